@@ -161,10 +161,14 @@ struct brickpi_channel_data {
  * @tx_buffer: Array to store the data to be transmitted.
  * @tx_buffer_tail: The index *in bits* of the current end of the tx_buffer.
  * @tx_mutex: Mutex to ensure only on tx request is handled at a time.
+ * @tx_size: The size of the message in tx_buffer, used for resending.
  * @rx_buffer: Array to store the received data.
- * @rx_buffer_head: The index *in bits* of the current position in the rx_buffer.
+ * @rx_msg: Copy of the last complete reply. Decoding is done from here so
+ *  that rx_buffer can already receive the next reply.
+ * @rx_buffer_head: The index *in bits* of the current position in rx_msg.
  * @rx_data_size: Size of the received data.
  * @rx_time: Timestamp when data was received.
+ * @rx_msg_time: Copy of rx_time for the reply in rx_msg.
  * @rx_completion: Completion to wait for received data.
  * @rx_data_work: Workqueue item for handling received data.
  * @poll_work: Work for polling.
@@ -179,11 +183,14 @@ struct brickpi_data {
 	unsigned num_channels;
 	u8 tx_buffer[BRICKPI_BUFFER_SIZE];
 	unsigned tx_buffer_tail;
+	unsigned tx_size;
 	struct mutex tx_mutex;
 	u8 rx_buffer[BRICKPI_BUFFER_SIZE];
+	u8 rx_msg[BRICKPI_BUFFER_SIZE];
 	unsigned rx_buffer_head;
 	unsigned rx_data_size;
 	ktime_t rx_time;
+	ktime_t rx_msg_time;
 	struct completion rx_completion;
 	struct work_struct rx_data_work;
 	struct work_struct poll_work;
@@ -60,10 +60,12 @@
 /*
  * This is just about as fast as we can go. Each poll is 2 messages -- 1 to
  * each channel. Each message takes about 1ms. This leaves 2ms open for sending
- * commands.
+ * commands. The messages are pipelined (see brickpi_poll_work()), so the
+ * reply from one channel is decoded while the other channel is busy.
  */
 #define BRICKPI_POLL_MS		4
 #define BRICKPI_SPEED_PERIOD	20
+#define BRICKPI_GET_VALUES_TIMEOUT	100
 
 /* tx_buffer offsets */
 #define BRICKPI_TX_ADDR		0
@@ -102,7 +104,7 @@ long brickpi_read_rx(struct brickpi_data *data, u8 size)
 	int i = 0;
 
 	while (i < size) {
-		if (test_bit(data->rx_buffer_head, (unsigned long *)data->rx_buffer))
+		if (test_bit(data->rx_buffer_head, (unsigned long *)data->rx_msg))
 			result |= 1 << i;
 		data->rx_buffer_head++;
 		i++;
@@ -111,12 +113,16 @@ long brickpi_read_rx(struct brickpi_data *data, u8 size)
 	return result;
 }
 
-int brickpi_send_message(struct brickpi_data *data, u8 addr,
-			 enum brickpi_message msg, unsigned timeout)
+/*
+ * Writes the message in tx_buffer to the tty without waiting for the reply.
+ * brickpi_wait_message() must be called before tx_buffer is modified again.
+ */
+static int brickpi_start_message(struct brickpi_data *data, u8 addr,
+				 enum brickpi_message msg)
 {
-	unsigned size, i, ret;
-	unsigned retries = 2;
+	unsigned size, i;
 	u8 checksum = 0;
+	int ret;
 
 	WARN_ON(!mutex_is_locked(&data->tx_mutex));
 	size = (data->tx_buffer_tail + 7) / 8;
@@ -127,17 +133,41 @@ int brickpi_send_message(struct brickpi_data *data, u8 addr,
 	for (i = 0; i < size; i++)
 		checksum += data->tx_buffer[i];
 	data->tx_buffer[BRICKPI_TX_CHECKSUM] = checksum;
-	while (retries--) {
+	data->tx_size = size;
+
+	data->rx_data_size = 0;
+	reinit_completion(&data->rx_completion);
+	set_bit(TTY_DO_WRITE_WAKEUP, &data->tty->flags);
+	ret = data->tty->ops->write(data->tty, data->tx_buffer, size);
+	if (ret < 0)
+		return ret;
+
+	return 0;
+}
+
+/*
+ * Waits for the reply to a message sent with brickpi_start_message(). The
+ * message is sent one more time if there is no reply. On success, the reply
+ * has been copied to rx_msg so that rx_buffer is free for the next reply.
+ */
+static int brickpi_wait_message(struct brickpi_data *data, unsigned timeout)
+{
+	unsigned retries = 1;
+	int ret;
+
+	for (;;) {
+		ret = wait_for_completion_timeout(&data->rx_completion,
+						  msecs_to_jiffies(timeout));
+		if (ret || !retries--)
+			break;
+
 		data->rx_data_size = 0;
 		reinit_completion(&data->rx_completion);
 		set_bit(TTY_DO_WRITE_WAKEUP, &data->tty->flags);
-		ret = data->tty->ops->write(data->tty, data->tx_buffer, size);
+		ret = data->tty->ops->write(data->tty, data->tx_buffer,
+					    data->tx_size);
 		if (ret < 0)
 			return ret;
-		ret = wait_for_completion_timeout(&data->rx_completion,
-						  msecs_to_jiffies(timeout));
-		if (ret)
-			break;
 	}
 	if (!ret)
 		return -ETIMEDOUT;
@@ -145,9 +175,24 @@ int brickpi_send_message(struct brickpi_data *data, u8 addr,
 	if (data->rx_buffer[BRICKPI_RX_MESSAGE_TYPE] != data->tx_buffer[BRICKPI_TX_MESSAGE_TYPE])
 		return -EPROTO;
 
+	memcpy(data->rx_msg, data->rx_buffer, BRICKPI_BUFFER_SIZE);
+	data->rx_msg_time = data->rx_time;
+
 	return 0;
 }
 
+int brickpi_send_message(struct brickpi_data *data, u8 addr,
+			 enum brickpi_message msg, unsigned timeout)
+{
+	int ret;
+
+	ret = brickpi_start_message(data, addr, msg);
+	if (ret < 0)
+		return ret;
+
+	return brickpi_wait_message(data, timeout);
+}
+
 int brickpi_set_sensors(struct brickpi_channel_data *ch_data)
 {
 	struct brickpi_data *data = ch_data->data;
@@ -196,17 +241,12 @@ int brickpi_set_sensors(struct brickpi_channel_data *ch_data)
 	return err;
 }
 
-int brickpi_get_values(struct brickpi_channel_data *ch_data)
+/* Sends the get values message for a channel. tx_mutex must be held. */
+static int brickpi_get_values_start(struct brickpi_channel_data *ch_data)
 {
 	struct brickpi_data *data = ch_data->data;
-	int i, j, err;
-	u8 port_size[NUM_BRICKPI_PORT];
+	int i, j;
 
-	mutex_lock(&data->tx_mutex);
-	if (data->closing) {
-		mutex_unlock(&data->tx_mutex);
-		return 0;
-	}
 	data->tx_buffer_tail = BRICKPI_TX_BUFFER_TAIL_INIT;
 	for (i = 0; i < NUM_BRICKPI_PORT; i++) {
 		brickpi_append_tx(data, 1, ch_data->out_port[i].motor_use_offset);
@@ -239,13 +279,20 @@ int brickpi_get_values(struct brickpi_channel_data *ch_data)
 			}
 		}
 	}
-	err = brickpi_send_message(data, ch_data->address,
-				   BRICK_PI_MESSAGE_GET_VALUES, 100);
-	if (err < 0) {
-		/* TODO: Set encoder offsets to 0 */
-		mutex_unlock(&data->tx_mutex);
-		return err;
-	}
+
+	return brickpi_start_message(data, ch_data->address,
+				     BRICK_PI_MESSAGE_GET_VALUES);
+}
+
+/*
+ * Decodes the reply to the get values message that is in rx_msg. tx_mutex
+ * must be held.
+ */
+static void brickpi_get_values_decode(struct brickpi_channel_data *ch_data)
+{
+	struct brickpi_data *data = ch_data->data;
+	int i, j;
+	u8 port_size[NUM_BRICKPI_PORT];
 
 	data->rx_buffer_head = BRICKPI_RX_BUFFER_HEAD_INIT;
 	port_size[BRICKPI_PORT_1] = brickpi_read_rx(data, 5);
@@ -265,7 +312,7 @@ int brickpi_get_values(struct brickpi_channel_data *ch_data)
 		if (bits & 1)
 			position *= -1;
 		port->motor_position = position;
-		tm_speed_update(&port->speed, position, data->rx_time);
+		tm_speed_update(&port->speed, position, data->rx_msg_time);
 		debug_pr("motor_position[%d]: %d\n", i, (int)position);
 		if (port->stop_at_target_position) {
 			if ((port->motor_reversed
@@ -393,9 +440,30 @@ int brickpi_get_values(struct brickpi_channel_data *ch_data)
 		}
 		lego_port_call_raw_data_func(&port->port);
 	}
+}
+
+int brickpi_get_values(struct brickpi_channel_data *ch_data)
+{
+	struct brickpi_data *data = ch_data->data;
+	int err;
+
+	mutex_lock(&data->tx_mutex);
+	if (data->closing) {
+		mutex_unlock(&data->tx_mutex);
+		return 0;
+	}
+	err = brickpi_get_values_start(ch_data);
+	if (err < 0)
+		goto out;
+	err = brickpi_wait_message(data, BRICKPI_GET_VALUES_TIMEOUT);
+	if (err < 0)
+		/* TODO: Set encoder offsets to 0 */
+		goto out;
+	brickpi_get_values_decode(ch_data);
+out:
 	mutex_unlock(&data->tx_mutex);
 
-	return 0;
+	return err;
 }
 
 static void brickpi_handle_rx_data(struct work_struct *work)
@@ -464,10 +532,19 @@ static void brickpi_update_motor(struct brickpi_out_port_data *port)
 	}
 }
 
+/*
+ * Polls all channels. The BrickPi replies do not include the address, and the
+ * channels share the same receive line, so only one request can be
+ * outstanding at a time. However, as soon as a reply is complete, the request
+ * for the next channel is sent and the reply is decoded while the next
+ * channel is processing the request. All motors are updated before any
+ * messages are sent so that the motor commands don't wait on sensor data.
+ */
 static void brickpi_poll_work(struct work_struct *work)
 {
 	struct brickpi_data *data = container_of(work, struct brickpi_data,
 						 poll_work);
+	struct brickpi_channel_data *prev = NULL;
 	int i, err;
 
 	if (data->closing)
@@ -478,12 +555,41 @@ static void brickpi_poll_work(struct work_struct *work)
 		if (ch_data->init_ok) {
 			brickpi_update_motor(&ch_data->out_port[BRICKPI_PORT_1]);
 			brickpi_update_motor(&ch_data->out_port[BRICKPI_PORT_2]);
-			err = brickpi_get_values(ch_data);
-			if (err < 0)
-				debug_pr("failed to get values for address %d. (%d)\n",
-				ch_data->address, err);
 		}
 	}
+
+	mutex_lock(&data->tx_mutex);
+	if (data->closing)
+		goto out;
+
+	for (i = 0; i < data->num_channels; i++) {
+		struct brickpi_channel_data *ch_data = &data->channel_data[i];
+
+		if (!ch_data->init_ok)
+			continue;
+
+		err = brickpi_get_values_start(ch_data);
+		if (err < 0) {
+			debug_pr("failed to get values for address %d. (%d)\n",
+				 ch_data->address, err);
+			continue;
+		}
+		if (prev)
+			brickpi_get_values_decode(prev);
+		prev = NULL;
+
+		err = brickpi_wait_message(data, BRICKPI_GET_VALUES_TIMEOUT);
+		if (err < 0) {
+			debug_pr("failed to get values for address %d. (%d)\n",
+				 ch_data->address, err);
+			continue;
+		}
+		prev = ch_data;
+	}
+	if (prev)
+		brickpi_get_values_decode(prev);
+out:
+	mutex_unlock(&data->tx_mutex);
 }
 
 static void brickpi_init_work(struct work_struct *work)
@@ -527,9 +633,9 @@ static void brickpi_init_work(struct work_struct *work)
 			return;
 		}
 		tm_speed_init(&out_port_1->speed, out_port_1->motor_position,
-			data->rx_time, BRICKPI_SPEED_PERIOD / BRICKPI_POLL_MS);
+			data->rx_msg_time, BRICKPI_SPEED_PERIOD / BRICKPI_POLL_MS);
 		tm_speed_init(&out_port_1->speed, out_port_1->motor_position,
-			data->rx_time, BRICKPI_SPEED_PERIOD / BRICKPI_POLL_MS);
+			data->rx_msg_time, BRICKPI_SPEED_PERIOD / BRICKPI_POLL_MS);
 		_brickpi_out_port_reset(out_port_1);
 		_brickpi_out_port_reset(out_port_2);
 		ch_data->fw_version = in_port_1->sensor_values[0];
@@ -19,6 +19,20 @@
 #ifndef _BRICKPI3_H_
 #define _BRICKPI3_H_
 
+#include <linux/i2c.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+
+#define BRICKPI3_MIN_ADDRESS		1
+/*
+ * Technically max address is 255, but we want a reasonable number to probe.
+ * Stacks larger than this are not practical because of power and SPI bus
+ * bandwidth anyway.
+ */
+#define BRICKPI3_MAX_ADDRESS		8
+#define NUM_BRICKPI3_ADDRESSES \
+	(BRICKPI3_MAX_ADDRESS - BRICKPI3_MIN_ADDRESS + 1)
+
 enum brickpi3_input_port {
 	BRICKPI3_PORT_IN1,
 	BRICKPI3_PORT_IN2,
@@ -141,11 +155,32 @@ enum brickpi3_i2c_flags {
 
 enum brickpi3_motor_status {
 	BRICKPI3_MOTOR_STATUS_LOW_VOLTAGE_FLOAT = 0x01,
+	BRICKPI3_MOTOR_STATUS_OVERLOADED	= 0x02,
+};
+
+#define BRICKPI3_MOTOR_STATUS_MSG_SIZE	8
+
+/**
+ * struct brickpi3_motor_sample - Status of one motor as reported by firmware
+ *
+ * @flags: Flags from enum brickpi3_motor_status.
+ * @power: The current duty cycle in percent or -128 for coast.
+ * @position: The encoder position in degrees.
+ * @speed: The speed in degrees per second as calculated by the firmware.
+ */
+struct brickpi3_motor_sample {
+	u8 flags;
+	s8 power;
+	s32 position;
+	s16 speed;
 };
 
 #define BRICKPI3_I2C_MAX_WRITE_SIZE	16
 #define BRICKPI3_I2C_MAX_READ_SIZE	14
 
+/* the largest message is GET_MANUFACTURER/GET_NAME: 4 byte header + 20 bytes */
+#define BRICKPI3_MAX_MSG_SIZE		24
+
 enum brickpi3_result {
 	BRICKPI3_RESULT_SUCCESS,
 	BRICKPI3_RESULT_SPI_ERROR,
@@ -172,12 +207,27 @@ enum brickpi3_out_port_mode {
 
 struct brickpi3;
 
+/**
+ * brickpi3_complete_t - Callback for asynchronous transfers
+ *
+ * @context: The context passed to brickpi3_transfer_async()
+ * @status: 0 on success or negative error code
+ * @rx_buf: The received data, only valid for the duration of the call
+ */
+typedef void (*brickpi3_complete_t)(void *context, int status,
+				    const u8 *rx_buf);
+
+int brickpi3_transfer_async(struct brickpi3 *bp, const u8 *tx_buf, size_t len,
+			    brickpi3_complete_t complete, void *context);
 int brickpi3_write_u8(struct brickpi3 *bp, u8 address,
 		      enum brickpi3_message msg, u8 value);
 int brickpi3_write_u8_u8(struct brickpi3 *bp, u8 address,
 			 enum brickpi3_message msg, u8 value1, u8 value2);
 int brickpi3_read_u16(struct brickpi3 *bp, u8 address,
 		      enum brickpi3_message msg, u16 *value);
+int brickpi3_read_u16_multi(struct brickpi3 *bp, u8 address,
+			    const enum brickpi3_message *msgs, u16 *values,
+			    int num);
 int brickpi3_write_u16(struct brickpi3 *bp, u8 address,
 		       enum brickpi3_message msg, u16 value);
 int brickpi3_write_u8_u16(struct brickpi3 *bp, u8 address,
@@ -209,6 +259,8 @@ int brickpi3_i2c_transact(struct brickpi3 *bp, u8 address,
 int brickpi3_set_motor_limits(struct brickpi3 *bp, u8 address,
 			      enum brickpi3_output_port, u8 duty_cycle_sp,
 			      u16 speed);
+int brickpi3_read_motor_samples(struct brickpi3 *bp, u8 address,
+				struct brickpi3_motor_sample *samples);
 
 static inline int brickpi3_set_sensor_type(struct brickpi3 *bp, u8 address,
 					   enum brickpi3_input_port port,
@@ -260,10 +312,32 @@ static inline int brickpi3_run_to_position(struct brickpi3 *bp, u8 address,
 				     BIT(port), position);
 }
 
-int devm_brickpi3_register_i2c(struct device *dev, struct brickpi3 *bp, u8 address);
+/**
+ * brickpi3_poll_phase - Get the initial delay for a periodic poller
+ *
+ * @slot: The index of the poller, e.g. based on the BrickPi3 address
+ * @num_slots: The total number of possible pollers of this kind
+ * @period_ms: The polling period
+ *
+ * When several BrickPi3s are stacked, pollers with the same period would all
+ * queue their messages at the same time. Starting each one with a different
+ * offset spreads the messages out evenly over the period instead.
+ */
+static inline ktime_t brickpi3_poll_phase(unsigned int slot,
+					  unsigned int num_slots,
+					  unsigned int period_ms)
+{
+	u64 ns = (u64)period_ms * NSEC_PER_MSEC;
+
+	return ns_to_ktime(ns + div_u64(ns * slot, num_slots));
+}
+
+int devm_brickpi3_register_i2c(struct device *dev, struct brickpi3 *bp,
+			       u8 address, struct i2c_adapter **adaps);
 int devm_brickpi3_register_iio(struct device *dev, struct brickpi3 *bp, u8 address);
 int devm_brickpi3_register_leds(struct device *dev, struct brickpi3 *bp, u8 address);
-int devm_brickpi3_register_in_ports(struct device *dev, struct brickpi3 *bp, u8 address);
+int devm_brickpi3_register_in_ports(struct device *dev, struct brickpi3 *bp,
+				    u8 address, struct i2c_adapter **adaps);
 int devm_brickpi3_register_out_ports(struct device *dev, struct brickpi3 *bp, u8 address);
 
 #endif /* _BRICKPI3_H_ */
@@ -83,16 +83,16 @@ static void brickpi3_i2c_release(struct device *dev, void *res)
 	i2c_del_adapter(&data->adap);
 }
 
-static int devm_brickpi3_i2c_register_one(struct device *dev,
-					  struct brickpi3 *bp, u8 address,
-					  enum brickpi3_input_port port)
+static struct i2c_adapter *
+devm_brickpi3_i2c_register_one(struct device *dev, struct brickpi3 *bp,
+			       u8 address, enum brickpi3_input_port port)
 {
 	struct brickpi3_i2c *data;
 	int ret;
 
 	data = devres_alloc(brickpi3_i2c_release, sizeof(*data), GFP_KERNEL);
 	if (!data)
-		return -ENOMEM;
+		return ERR_PTR(-ENOMEM);
 
 	data->bp = bp;
 	data->address = address;
@@ -104,27 +104,40 @@ static int devm_brickpi3_i2c_register_one(struct device *dev,
 	data->adap.timeout = HZ; /* 1 second */
 	data->adap.dev.parent = dev;
 	data->adap.nr = -1;
-	snprintf(data->adap.name, sizeof(data->adap.name), "brickpi3-i2c%d", port);
+	snprintf(data->adap.name, sizeof(data->adap.name), "brickpi3-i2c%d",
+		 (address - 1) * NUM_BRICKPI3_INPUT_PORTS + port);
 	data->adap.quirks = &brickpi3_i2c_quirks;
 
 	ret = i2c_add_numbered_adapter(&data->adap);
-	if (ret < 0)
-		return ret;
+	if (ret < 0) {
+		devres_free(data);
+		return ERR_PTR(ret);
+	}
 
 	devres_add(dev, data);
 
-	return 0;
+	return &data->adap;
 }
 
+/**
+ * devm_brickpi3_register_i2c - Register I2C adapters for each input port
+ *
+ * @dev: The BrickPi3 device
+ * @bp: The private driver data
+ * @address: The BrickPi3 address
+ * @adaps: Array of NUM_BRICKPI3_INPUT_PORTS elements to receive the adapters
+ *
+ * Returns 0 on success or negative error code.
+ */
 int devm_brickpi3_register_i2c(struct device *dev, struct brickpi3 *bp,
-			       u8 address)
+			       u8 address, struct i2c_adapter **adaps)
 {
-	int i, ret;
+	int i;
 
 	for (i = 0; i < NUM_BRICKPI3_INPUT_PORTS; i++) {
-		ret = devm_brickpi3_i2c_register_one(dev, bp, address, i);
-		if (ret < 0)
-			return ret;
+		adaps[i] = devm_brickpi3_i2c_register_one(dev, bp, address, i);
+		if (IS_ERR(adaps[i]))
+			return PTR_ERR(adaps[i]);
 	}
 
 	return 0;
@@ -26,19 +26,42 @@
  *
  * .. _Industrial I/O: http://lxr.free-electrons.com/source/drivers/staging/iio/Documentation/overview.txt?v=4.4
  *
+ * Buffered mode is also supported for continuous monitoring. All enabled
+ * voltages are read together each time the trigger fires and are pushed to
+ * the buffer along with a timestamp. The BrickPi3 does not provide a trigger
+ * of its own, so use a software trigger, e.g. an ``hrtimer`` trigger created
+ * in ``/sys/kernel/config/iio/triggers/hrtimer/``.
+ *
  * .. tip:: You can use the `Battery`_ driver for monitoring the battery
  *    instead of using this driver.
  */
 
+#include <linux/bitops.h>
 #include <linux/device.h>
+#include <linux/iio/buffer.h>
 #include <linux/iio/iio.h>
+#include <linux/iio/trigger_consumer.h>
+#include <linux/iio/triggered_buffer.h>
+#include <linux/interrupt.h>
 
 #include "brickpi3.h"
 
+#define BRICKPI3_IIO_NUM_VOLTAGES 4
+
+static const enum brickpi3_message
+brickpi3_iio_voltage_msgs[BRICKPI3_IIO_NUM_VOLTAGES] = {
+	BRICKPI3_MSG_GET_VOLTAGE_3V3,
+	BRICKPI3_MSG_GET_VOLTAGE_5V,
+	BRICKPI3_MSG_GET_VOLTAGE_9V,
+	BRICKPI3_MSG_GET_VOLTAGE_VCC,
+};
+
 struct brickpi3_iio {
 	struct iio_dev *iio;
 	struct brickpi3 *bp;
 	u8 address;
+	/* 4 voltages + padding + 64-bit timestamp */
+	u16 scan[BRICKPI3_IIO_NUM_VOLTAGES + 4] __aligned(8);
 };
 
 static int brickpi3_iio_read_raw(struct iio_dev *iio,
@@ -64,6 +87,32 @@ static int brickpi3_iio_read_raw(struct iio_dev *iio,
 	return -EINVAL;
 }
 
+static irqreturn_t brickpi3_iio_trigger_handler(int irq, void *p)
+{
+	struct iio_poll_func *pf = p;
+	struct iio_dev *iio = pf->indio_dev;
+	struct brickpi3_iio *data = iio_priv(iio);
+	u16 values[BRICKPI3_IIO_NUM_VOLTAGES];
+	int i, j = 0, ret;
+
+	ret = brickpi3_read_u16_multi(data->bp, data->address,
+				      brickpi3_iio_voltage_msgs, values,
+				      BRICKPI3_IIO_NUM_VOLTAGES);
+	if (ret < 0)
+		goto out;
+
+	for_each_set_bit(i, iio->active_scan_mask, BRICKPI3_IIO_NUM_VOLTAGES)
+		data->scan[j++] = values[i];
+
+	iio_push_to_buffers_with_timestamp(iio, data->scan,
+					   iio_get_time_ns(iio));
+
+out:
+	iio_trigger_notify_done(iio->trig);
+
+	return IRQ_HANDLED;
+}
+
 #define BRICKPI3_V_CHAN(index, name)				\
 {								\
 	.type = IIO_VOLTAGE,					\
@@ -117,6 +166,13 @@ int devm_brickpi3_register_iio(struct device *dev, struct brickpi3 *bp,
 	iio->num_channels = ARRAY_SIZE(brickpi3_iio_channels);
 	iio->info = &brickpi3_iio_info;
 
+	ret = devm_iio_triggered_buffer_setup(dev, iio, NULL,
+					      brickpi3_iio_trigger_handler, NULL);
+	if (ret) {
+		dev_err(dev, "Failed to setup triggered buffer.\n");
+		return ret;
+	}
+
 	ret = devm_iio_device_register(dev, iio);
 	if (ret) {
 		dev_err(dev, "Failed to register iio device.\n");
@@ -308,7 +308,12 @@ static int brickpi3_in_port_register_sensor(struct brickpi3_in_port *data,
 			return PTR_ERR(new_sensor);
 
 		data->sensor = new_sensor;
-		hrtimer_start(&data->poll_timer, ms_to_ktime(10), HRTIMER_MODE_REL);
+		hrtimer_start(&data->poll_timer,
+			brickpi3_poll_phase((data->address - 1) *
+					    NUM_BRICKPI3_INPUT_PORTS + data->index,
+					    NUM_BRICKPI3_ADDRESSES *
+					    NUM_BRICKPI3_INPUT_PORTS, 10),
+			HRTIMER_MODE_REL);
 	}
 
 	return 0;
@@ -501,7 +506,8 @@ static void brickpi3_ports_in_release(struct device *dev, void *res)
 static int devm_brickpi3_port_in_register_one(struct device *dev,
 					      struct brickpi3 *bp,
 					      u8 address,
-					      enum brickpi3_input_port port)
+					      enum brickpi3_input_port port,
+					      struct i2c_adapter *i2c_adap)
 {
 	struct brickpi3_in_port *data;
 	int ret;
@@ -518,22 +524,7 @@ static int devm_brickpi3_port_in_register_one(struct device *dev,
 	data->poll_timer.function = brickpi3_in_port_poll_timer_function;
 	data->i2c_pdata.in_port = &data->port;
 
-	/*
-	 * FIXME: there is no guarantee this is the correct adapter.
-	 * This works as long as the device tree specifies aliases for 3 I2C
-	 * adapters and there are no other dynamic I2C adapters.
-	 */
-	data->i2c_adap = i2c_get_adapter(port + 3);
-	if (!data->i2c_adap) {
-		dev_err(dev, "Could not get I2C adapter %d\n", port + 3);
-		return -ENXIO;
-	}
-	/*
-	 * This module also owns the i2c adapters, so we would cause a reference
-	 * cycle if we held on to the reference, which would prevent the module
-	 * from ever being unloaded.
-	 */
-	i2c_put_adapter(data->i2c_adap);
+	data->i2c_adap = i2c_adap;
 
 	data->port.name = brickpi3_in_port_type.name;
 	snprintf(data->port.address, LEGO_NAME_SIZE, "%s:S%d", dev_name(dev),
@@ -561,12 +552,13 @@ static int devm_brickpi3_port_in_register_one(struct device *dev,
 }
 
 int devm_brickpi3_register_in_ports(struct device *dev, struct brickpi3 *bp,
-				    u8 address)
+				    u8 address, struct i2c_adapter **adaps)
 {
 	int i, ret;
 
 	for (i = 0; i < NUM_BRICKPI3_INPUT_PORTS; i++) {
-		ret = devm_brickpi3_port_in_register_one(dev, bp, address, i);
+		ret = devm_brickpi3_port_in_register_one(dev, bp, address, i,
+							 adaps[i]);
 		if (ret < 0)
 			return ret;
 	}
@@ -21,13 +21,23 @@
  * EV3, except that they cannot automatically detect when a motor is connected.
  * By default, the ``lego-nxt-motor`` driver is loaded, so you don't need to
  * manually set the mode or device unless you want to use something else.
+ *
+ * When more than one BrickPi3 is stacked, the ports on the second BrickPi3
+ * continue with ``ME`` through ``MH`` and so on. Since there are only 26
+ * letters, the ports on the seventh BrickPi3 are named ``MY``, ``MZ``,
+ * ``MAA`` and ``MAB`` and the ports on the eighth BrickPi3 continue with
+ * ``MAC`` through ``MAF``.
  */
 
 #include <linux/bitops.h>
 #include <linux/device.h>
+#include <linux/hrtimer.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
 
 #include <dc_motor_class.h>
 #include <tacho_motor_class.h>
+#include <tacho_motor_helper.h>
 
 #include "brickpi3.h"
 #include "../ev3/legoev3_motor.h"
@@ -36,13 +46,48 @@
 #define BRICKPI3_MOTOR_BRAKE (0)
 #define BRICKPI3_MOTOR_COAST (-128)
 
+#define BRICKPI3_MOTOR_POLL_MS		10
+#define BRICKPI3_MOTOR_SPEED_PERIOD	100
+
+struct brickpi3_motor_sampler;
+
 struct brickpi3_out_port {
 	struct brickpi3 *bp;
+	struct brickpi3_motor_sampler *sampler;
 	struct lego_port_device port;
 	struct lego_device *motor;
+	struct tm_speed speed;
+	struct brickpi3_motor_sample sample;
+	unsigned generation;
 	enum brickpi3_output_port index;
 	s8 duty_cycle;
 	bool running;
+	bool holding;
+	u8 address;
+};
+
+/**
+ * struct brickpi3_motor_sampler - Periodically samples all motors on a BrickPi3
+ *
+ * @bp: The BrickPi3 device
+ * @ports: The output ports that share this BrickPi3 address
+ * @poll_work: Does the actual SPI transaction
+ * @poll_timer: Schedules @poll_work
+ * @lock: Protects the cached samples, speed helpers and generations in @ports
+ * @address: The BrickPi3 address
+ *
+ * Reading the position of a motor used to require a round trip on the SPI bus
+ * each time. Instead, the status of all four motors is read at a fixed
+ * interval and the tacho-motor ops are served from the cached values. This
+ * also gives us regular timestamps for calculating the speed, which is needed
+ * for ramping.
+ */
+struct brickpi3_motor_sampler {
+	struct brickpi3 *bp;
+	struct brickpi3_out_port *ports[NUM_BRICKPI3_OUTPUT_PORTS];
+	struct work_struct poll_work;
+	struct hrtimer poll_timer;
+	spinlock_t lock;
 	u8 address;
 };
 
@@ -160,7 +205,7 @@ static int brickpi3_out_port_set_command(void *context,
 					data->duty_cycle);
 }
 
-static unsigned brickpi3_out_port_get_duty_cycle(void *context)
+static unsigned brickpi3_out_port_dc_get_duty_cycle(void *context)
 {
 	struct brickpi3_out_port *data = context;
 
@@ -189,15 +234,90 @@ static struct dc_motor_ops brickpi3_out_port_dc_motor_ops = {
 	.get_command		= brickpi3_out_port_get_command,
 	.set_command		= brickpi3_out_port_set_command,
 	.set_duty_cycle		= brickpi3_out_port_set_duty_cycle,
-	.get_duty_cycle		= brickpi3_out_port_get_duty_cycle,
+	.get_duty_cycle		= brickpi3_out_port_dc_get_duty_cycle,
 };
 
+static void brickpi3_motor_sampler_poll_work(struct work_struct *work)
+{
+	struct brickpi3_motor_sampler *sampler =
+		container_of(work, struct brickpi3_motor_sampler, poll_work);
+	struct brickpi3_motor_sample samples[NUM_BRICKPI3_OUTPUT_PORTS];
+	unsigned generation[NUM_BRICKPI3_OUTPUT_PORTS];
+	unsigned long flags;
+	ktime_t now;
+	int i, ret;
+
+	/*
+	 * A sample that was read before the position was resynced must not be
+	 * applied after it, otherwise the speed would see a jump.
+	 */
+	spin_lock_irqsave(&sampler->lock, flags);
+	for (i = 0; i < NUM_BRICKPI3_OUTPUT_PORTS; i++)
+		generation[i] = sampler->ports[i]->generation;
+	spin_unlock_irqrestore(&sampler->lock, flags);
+
+	ret = brickpi3_read_motor_samples(sampler->bp, sampler->address,
+					  samples);
+	if (ret < 0)
+		return;
+
+	now = ktime_get();
+
+	spin_lock_irqsave(&sampler->lock, flags);
+	for (i = 0; i < NUM_BRICKPI3_OUTPUT_PORTS; i++) {
+		struct brickpi3_out_port *data = sampler->ports[i];
+
+		if (data->generation != generation[i])
+			continue;
+		data->sample = samples[i];
+		tm_speed_update(&data->speed, samples[i].position, now);
+	}
+	spin_unlock_irqrestore(&sampler->lock, flags);
+}
+
+static enum hrtimer_restart
+brickpi3_motor_sampler_poll_timer_function(struct hrtimer *timer)
+{
+	struct brickpi3_motor_sampler *sampler =
+		container_of(timer, struct brickpi3_motor_sampler, poll_timer);
+
+	hrtimer_forward_now(timer, ms_to_ktime(BRICKPI3_MOTOR_POLL_MS));
+	schedule_work(&sampler->poll_work);
+
+	return HRTIMER_RESTART;
+}
+
+/*
+ * Synchronously reads the current position and restarts the speed calculation.
+ * This is needed when the position jumps, i.e. when it is set by the user.
+ */
+static int brickpi3_out_port_resync_position(struct brickpi3_out_port *data)
+{
+	unsigned long flags;
+	int pos, ret;
+
+	ret = brickpi3_get_motor_encoder(data->bp, data->address, data->index,
+					 &pos);
+	if (ret < 0)
+		return ret;
+
+	spin_lock_irqsave(&data->sampler->lock, flags);
+	data->generation++;
+	data->sample.position = pos;
+	tm_speed_init(&data->speed, pos, ktime_get(),
+		      BRICKPI3_MOTOR_SPEED_PERIOD / BRICKPI3_MOTOR_POLL_MS);
+	spin_unlock_irqrestore(&data->sampler->lock, flags);
+
+	return 0;
+}
+
 static int brickpi3_out_port_get_position(void *context, int *position)
 {
 	struct brickpi3_out_port *data = context;
 
-	return brickpi3_get_motor_encoder(data->bp, data->address, data->index,
-					  position);
+	*position = READ_ONCE(data->sample.position);
+
+	return 0;
 }
 
 static int brickpi3_out_port_set_position(void *context, int position)
@@ -212,8 +332,31 @@ static int brickpi3_out_port_set_position(void *context, int position)
 
 	position += current_pos;
 
-	return brickpi3_set_motor_offset(data->bp, data->address, data->index,
-					 position);
+	ret = brickpi3_set_motor_offset(data->bp, data->address, data->index,
+					position);
+	if (ret < 0)
+		return ret;
+
+	return brickpi3_out_port_resync_position(data);
+}
+
+static int brickpi3_out_port_get_duty_cycle(void *context, int *duty_cycle)
+{
+	struct brickpi3_out_port *data = context;
+	s8 power = READ_ONCE(data->sample.power);
+
+	*duty_cycle = power == BRICKPI3_MOTOR_COAST ? 0 : power;
+
+	return 0;
+}
+
+static int brickpi3_out_port_get_speed(void *context, int *speed)
+{
+	struct brickpi3_out_port *data = context;
+
+	*speed = READ_ONCE(tm_speed_get(&data->speed));
+
+	return 0;
 }
 
 static int brickpi3_out_port_run_unregulated(void *context, int duty_cycle)
@@ -230,6 +373,7 @@ static int brickpi3_out_port_run_unregulated(void *context, int duty_cycle)
 		return ret;
 
 	data->running = true;
+	data->holding = false;
 
 	return 0;
 }
@@ -244,6 +388,7 @@ static int brickpi3_out_port_run_regulated(void *context, int speed)
 		return ret;
 
 	data->running = true;
+	data->holding = false;
 
 	return 0;
 }
@@ -264,6 +409,7 @@ static int brickpi3_out_port_run_to_pos(void *context, int pos, int speed,
 		return ret;
 
 	data->running = true;
+	data->holding = false;
 
 	return 0;
 }
@@ -275,8 +421,13 @@ static int brickpi3_out_port_get_state(void *context)
 
 	if (data->running)
 		state |= BIT(TM_STATE_RUNNING);
+	if (data->holding)
+		state |= BIT(TM_STATE_HOLDING);
+	if ((data->running || data->holding) &&
+	    (READ_ONCE(data->sample.flags) & BRICKPI3_MOTOR_STATUS_OVERLOADED))
+		state |= BIT(TM_STATE_OVERLOADED);
 
-	/* FIXME: how to get holding/overloaded/stalled states? */
+	/* FIXME: how to get stalled state? */
 
 	return state;
 }
@@ -311,6 +462,7 @@ static int brickpi3_out_port_stop(void *context, enum tm_stop_action stop_action
 		return ret;
 
 	data->running = false;
+	data->holding = stop_action == TM_STOP_ACTION_HOLD;
 
 	return 0;
 }
@@ -343,6 +495,8 @@ struct tacho_motor_ops brickpi3_out_port_tacho_motor_ops = {
 	.stop			= brickpi3_out_port_stop,
 	.reset			= brickpi3_out_port_reset,
 	.get_state		= brickpi3_out_port_get_state,
+	.get_duty_cycle		= brickpi3_out_port_get_duty_cycle,
+	.get_speed		= brickpi3_out_port_get_speed,
 	.get_stop_actions	= brickpi3_out_port_get_stop_actions,
 };
 
@@ -392,24 +546,34 @@ static void brickpi3_out_port_release(struct device *dev, void *res)
 }
 
 static int devm_brickpi3_out_port_register_one(struct device *dev,
-					       struct brickpi3 *bp,
-					       u8 address,
-					       enum brickpi3_output_port port)
+				struct brickpi3 *bp, u8 address,
+				enum brickpi3_output_port port,
+				struct brickpi3_motor_sampler *sampler)
 {
 	struct brickpi3_out_port *data;
-	int ret;
+	int index, ret;
 
 	data = devres_alloc(brickpi3_out_port_release, sizeof(*data), GFP_KERNEL);
 	if (!data)
 		return -ENOMEM;
 
 	data->bp = bp;
+	data->sampler = sampler;
 	data->address = address;
 	data->index = port;
+	tm_speed_init(&data->speed, 0, ktime_get(),
+		      BRICKPI3_MOTOR_SPEED_PERIOD / BRICKPI3_MOTOR_POLL_MS);
+	sampler->ports[port] = data;
 
 	data->port.name = brickpi3_out_port_type.name;
-	snprintf(data->port.address, LEGO_NAME_SIZE, "%s:M%c", dev_name(dev),
-		 (address - 1) * 4 + port + 'A');
+	index = (address - 1) * NUM_BRICKPI3_OUTPUT_PORTS + port;
+	if (index < 26)
+		snprintf(data->port.address, LEGO_NAME_SIZE, "%s:M%c",
+			 dev_name(dev), index + 'A');
+	else
+		/* past MZ, from the third port of the 7th BrickPi3 on */
+		snprintf(data->port.address, LEGO_NAME_SIZE, "%s:M%c%c",
+			 dev_name(dev), index / 26 - 1 + 'A', index % 26 + 'A');
 	data->port.num_modes = NUM_BRICKPI3_OUT_PORT_MODES;
 	data->port.supported_modes = LEGO_PORT_ALL_MODES;
 	data->port.mode_info = brickpi3_out_port_mode_info;
@@ -426,6 +590,12 @@ static int devm_brickpi3_out_port_register_one(struct device *dev,
 
 	devres_add(dev, data);
 
+	ret = brickpi3_out_port_resync_position(data);
+	if (ret < 0) {
+		dev_err(dev, "Failed to read motor position\n");
+		return ret;
+	}
+
 	ret = brickpi3_out_port_set_mode(data,
 					 BRICKPI3_OUT_PORT_MODE_TACHO_MOTOR);
 	if (ret < 0) {
@@ -436,17 +606,51 @@ static int devm_brickpi3_out_port_register_one(struct device *dev,
 	return 0;
 }
 
+static void brickpi3_motor_sampler_release(struct device *dev, void *res)
+{
+	struct brickpi3_motor_sampler *sampler = res;
+
+	hrtimer_cancel(&sampler->poll_timer);
+	cancel_work_sync(&sampler->poll_work);
+}
 
 int devm_brickpi3_register_out_ports(struct device *dev, struct brickpi3 *bp,
 				     u8 address)
 {
+	struct brickpi3_motor_sampler *sampler;
 	int i, ret;
 
+	sampler = devres_alloc(brickpi3_motor_sampler_release, sizeof(*sampler),
+			       GFP_KERNEL);
+	if (!sampler)
+		return -ENOMEM;
+
+	sampler->bp = bp;
+	sampler->address = address;
+	spin_lock_init(&sampler->lock);
+	INIT_WORK(&sampler->poll_work, brickpi3_motor_sampler_poll_work);
+	hrtimer_init(&sampler->poll_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	sampler->poll_timer.function = brickpi3_motor_sampler_poll_timer_function;
+
 	for (i = 0; i < NUM_BRICKPI3_OUTPUT_PORTS; i++) {
-		ret = devm_brickpi3_out_port_register_one (dev, bp, address, i);
-		if (ret < 0)
+		ret = devm_brickpi3_out_port_register_one(dev, bp, address, i,
+							  sampler);
+		if (ret < 0) {
+			devres_free(sampler);
 			return ret;
+		}
 	}
 
+	/*
+	 * Added after the ports so that it is released first, otherwise the
+	 * poll work could touch ports that have already been freed.
+	 */
+	devres_add(dev, sampler);
+	hrtimer_start(&sampler->poll_timer,
+		      brickpi3_poll_phase(address - BRICKPI3_MIN_ADDRESS,
+					  NUM_BRICKPI3_ADDRESSES,
+					  BRICKPI3_MOTOR_POLL_MS),
+		      HRTIMER_MODE_REL);
+
 	return 0;
 }
@@ -16,12 +16,19 @@
  * GNU General Public License for more details.
  */
 
+#include <linux/atomic.h>
+#include <linux/completion.h>
 #include <linux/delay.h>
+#include <linux/jiffies.h>
+#include <linux/kernel.h>
+#include <linux/list.h>
 #include <linux/module.h>
-#include <linux/mutex.h>
 #include <linux/of.h>
 #include <linux/spi/spi.h>
+#include <linux/spinlock.h>
 #include <linux/string.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
 
 #include "brickpi3.h"
 
@@ -29,21 +36,258 @@
 #define BRICKPI3_HEADER_SIZE		4
 #define BRICKPI3_ID_MSG_SIZE		16
 #define BRICKPI3_STRING_MSG_SIZE	20
-#define BRICKPI3_MIN_ADDRESS		1
-/* technically max address is 255, but we want a reasonable number to probe */
-#define BRICKPI3_MAX_ADDRESS		4
-#define BRICKPI3_MAX_MSG_SIZE (BRICKPI3_HEADER_SIZE + BRICKPI3_STRING_MSG_SIZE)
+
+/* number of preallocated request slots */
+#define BRICKPI3_NUM_REQUESTS		16
+/* max number of requests that are combined into one SPI message */
+#define BRICKPI3_MAX_BATCH		8
+
+/* polling parameters for reading back the result of I2C transactions */
+#define BRICKPI3_I2C_MIN_POLL_US	500
+#define BRICKPI3_I2C_MAX_POLL_US	4000
+#define BRICKPI3_I2C_TIMEOUT_MS		100
 
 #define BRICKPI3_READ_FAILED(b)	((b)[3] != 0xA5)
 
+/**
+ * struct brickpi3_request - One firmware message
+ *
+ * @node: For the free and pending lists
+ * @buf: Buffer for both transmit and receive data
+ * @len: Number of valid bytes in @buf
+ * @complete: Called when the transfer is done
+ * @context: Passed to @complete
+ */
+struct brickpi3_request {
+	struct list_head node;
+	u8 buf[BRICKPI3_MAX_MSG_SIZE];
+	size_t len;
+	brickpi3_complete_t complete;
+	void *context;
+};
+
+/**
+ * struct brickpi3 - The private driver data
+ *
+ * @spi: The SPI device
+ * @requests: Preallocated request slots
+ * @free_list: Requests that are not in use
+ * @pending_list: Requests waiting to be sent
+ * @free_wait: Wait queue for synchronous callers waiting for a free slot
+ * @lock: Protects the lists, @batch, @batch_len and @busy
+ * @msg: The SPI message currently in flight
+ * @xfers: One transfer for each request in @batch
+ * @batch: The requests that make up @msg
+ * @batch_len: Number of valid items in @batch and @xfers
+ * @busy: true when @msg has been submitted and is not complete yet
+ *
+ * All communication with the BrickPi3 goes through a queue. When the bus is
+ * idle, everything that is currently pending is sent in one SPI message using
+ * spi_async(). Each request gets its own transfer with chip select toggled in
+ * between, so the firmware still sees separate messages.
+ */
 struct brickpi3 {
 	struct spi_device *spi;
-	u8 buf[BRICKPI3_MAX_MSG_SIZE];
+	struct brickpi3_request requests[BRICKPI3_NUM_REQUESTS];
+	struct list_head free_list;
+	struct list_head pending_list;
+	wait_queue_head_t free_wait;
+	spinlock_t lock;
 	struct spi_message msg;
-	struct spi_transfer xfer;
-	struct mutex xfer_lock;
+	struct spi_transfer xfers[BRICKPI3_MAX_BATCH];
+	struct brickpi3_request *batch[BRICKPI3_MAX_BATCH];
+	int batch_len;
+	bool busy;
 };
 
+static struct brickpi3_request *brickpi3_get_request(struct brickpi3 *bp)
+{
+	struct brickpi3_request *req;
+	unsigned long flags;
+
+	spin_lock_irqsave(&bp->lock, flags);
+	req = list_first_entry_or_null(&bp->free_list, struct brickpi3_request,
+				       node);
+	if (req)
+		list_del(&req->node);
+	spin_unlock_irqrestore(&bp->lock, flags);
+
+	return req;
+}
+
+static void brickpi3_msg_complete(void *context);
+static void brickpi3_complete_batch(struct brickpi3 *bp, int status);
+
+/* must be called with bp->lock held, releases it */
+static void brickpi3_kick(struct brickpi3 *bp, unsigned long flags)
+{
+	struct brickpi3_request *req, *tmp;
+	int ret;
+
+	if (bp->busy || list_empty(&bp->pending_list)) {
+		spin_unlock_irqrestore(&bp->lock, flags);
+		return;
+	}
+
+	spi_message_init(&bp->msg);
+	bp->msg.complete = brickpi3_msg_complete;
+	bp->msg.context = bp;
+	bp->batch_len = 0;
+
+	list_for_each_entry_safe(req, tmp, &bp->pending_list, node) {
+		struct spi_transfer *xfer = &bp->xfers[bp->batch_len];
+
+		if (bp->batch_len == BRICKPI3_MAX_BATCH)
+			break;
+
+		list_del(&req->node);
+		memset(xfer, 0, sizeof(*xfer));
+		xfer->tx_buf = req->buf;
+		xfer->rx_buf = req->buf;
+		xfer->len = req->len;
+		xfer->cs_change = 1;
+		spi_message_add_tail(xfer, &bp->msg);
+		bp->batch[bp->batch_len++] = req;
+	}
+	/* cs_change on the last transfer would leave the chip selected */
+	bp->xfers[bp->batch_len - 1].cs_change = 0;
+
+	bp->busy = true;
+	spin_unlock_irqrestore(&bp->lock, flags);
+
+	ret = spi_async(bp->spi, &bp->msg);
+	if (ret < 0)
+		brickpi3_complete_batch(bp, ret);
+}
+
+static void brickpi3_complete_batch(struct brickpi3 *bp, int status)
+{
+	unsigned long flags;
+	int i;
+
+	/*
+	 * Nothing else touches the batch while busy is set, so the callbacks
+	 * can be called without holding the lock.
+	 */
+	for (i = 0; i < bp->batch_len; i++) {
+		struct brickpi3_request *req = bp->batch[i];
+
+		if (req->complete)
+			req->complete(req->context, status, req->buf);
+	}
+
+	spin_lock_irqsave(&bp->lock, flags);
+	for (i = 0; i < bp->batch_len; i++)
+		list_add_tail(&bp->batch[i]->node, &bp->free_list);
+	bp->batch_len = 0;
+	bp->busy = false;
+	wake_up(&bp->free_wait);
+	brickpi3_kick(bp, flags);
+}
+
+static void brickpi3_msg_complete(void *context)
+{
+	struct brickpi3 *bp = context;
+
+	brickpi3_complete_batch(bp, bp->msg.status);
+}
+
+static void brickpi3_queue_request(struct brickpi3 *bp,
+				   struct brickpi3_request *req)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&bp->lock, flags);
+	list_add_tail(&req->node, &bp->pending_list);
+	brickpi3_kick(bp, flags);
+}
+
+/**
+ * brickpi3_transfer_async - Queue a message to be sent to the BrickPi3
+ *
+ * @bp: The private driver data
+ * @tx_buf: The data to send, including the address and message header
+ * @len: The length of @tx_buf - must be <= BRICKPI3_MAX_MSG_SIZE
+ * @complete: Called when the transfer is complete (can be NULL)
+ * @context: Passed to @complete
+ *
+ * This does not sleep. @complete is called from the SPI controller completion
+ * context, so it must not sleep either. The rx_buf passed to @complete has the
+ * same length as @tx_buf and is only valid until @complete returns.
+ *
+ * Messages are sent in the order they are queued.
+ *
+ * Returns 0 on success, -EBUSY if all request slots are in use or other
+ * negative error code.
+ */
+int brickpi3_transfer_async(struct brickpi3 *bp, const u8 *tx_buf, size_t len,
+			    brickpi3_complete_t complete, void *context)
+{
+	struct brickpi3_request *req;
+
+	if (len > BRICKPI3_MAX_MSG_SIZE)
+		return -EINVAL;
+
+	req = brickpi3_get_request(bp);
+	if (!req)
+		return -EBUSY;
+
+	memcpy(req->buf, tx_buf, len);
+	req->len = len;
+	req->complete = complete;
+	req->context = context;
+
+	brickpi3_queue_request(bp, req);
+
+	return 0;
+}
+
+struct brickpi3_sync {
+	struct completion done;
+	u8 *buf;
+	size_t len;
+	int status;
+};
+
+static void brickpi3_sync_complete(void *context, int status, const u8 *rx_buf)
+{
+	struct brickpi3_sync *sync = context;
+
+	sync->status = status;
+	if (status == 0)
+		memcpy(sync->buf, rx_buf, sync->len);
+	complete(&sync->done);
+}
+
+/*
+ * Synchronous version of brickpi3_transfer_async(). The received data is
+ * written back to buf. This sleeps until a request slot is available.
+ */
+static int brickpi3_transfer(struct brickpi3 *bp, u8 *buf, size_t len)
+{
+	struct brickpi3_request *req;
+	struct brickpi3_sync sync;
+
+	if (len > BRICKPI3_MAX_MSG_SIZE)
+		return -EINVAL;
+
+	wait_event(bp->free_wait, (req = brickpi3_get_request(bp)));
+
+	init_completion(&sync.done);
+	sync.buf = buf;
+	sync.len = len;
+
+	memcpy(req->buf, buf, len);
+	req->len = len;
+	req->complete = brickpi3_sync_complete;
+	req->context = &sync;
+
+	brickpi3_queue_request(bp, req);
+	wait_for_completion(&sync.done);
+
+	return sync.status;
+}
+
 /**
  * brickpi3_write_u8 - Write message with one byte of data
  *
@@ -57,40 +301,26 @@ struct brickpi3 {
 int brickpi3_write_u8(struct brickpi3 *bp, u8 address, enum brickpi3_message msg,
 		      u8 value)
 {
-	int ret;
-
-	mutex_lock(&bp->xfer_lock);
+	u8 buf[3];
 
-	bp->buf[0] = address;
-	bp->buf[1] = msg;
-	bp->buf[2] = value;
-	bp->xfer.len = 3;
+	buf[0] = address;
+	buf[1] = msg;
+	buf[2] = value;
 
-	ret = spi_sync(bp->spi, &bp->msg);
-
-	mutex_unlock(&bp->xfer_lock);
-
-	return ret;
+	return brickpi3_transfer(bp, buf, 3);
 }
 
 int brickpi3_write_u8_u8(struct brickpi3 *bp, u8 address,
 			 enum brickpi3_message msg, u8 value1, u8 value2)
 {
-	int ret;
-
-	mutex_lock(&bp->xfer_lock);
+	u8 buf[4];
 
-	bp->buf[0] = address;
-	bp->buf[1] = msg;
-	bp->buf[2] = value1;
-	bp->buf[3] = value2;
-	bp->xfer.len = 4;
+	buf[0] = address;
+	buf[1] = msg;
+	buf[2] = value1;
+	buf[3] = value2;
 
-	ret = spi_sync(bp->spi, &bp->msg);
-
-	mutex_unlock(&bp->xfer_lock);
-
-	return ret;
+	return brickpi3_transfer(bp, buf, 4);
 }
 
 /**
@@ -106,33 +336,19 @@ int brickpi3_write_u8_u8(struct brickpi3 *bp, u8 address,
 int brickpi3_read_u16(struct brickpi3 *bp, u8 address, enum brickpi3_message msg,
 		      u16 *value)
 {
-	int ret = 0;
-
-	mutex_lock(&bp->xfer_lock);
-
-	bp->buf[0] = address;
-	bp->buf[1] = msg;
-	bp->buf[2] = 0;
-	bp->buf[3] = 0;
-	bp->buf[4] = 0;
-	bp->buf[5] = 0;
-	bp->xfer.len = 6;
+	u8 buf[6] = { address, msg };
+	int ret;
 
-	ret = spi_sync(bp->spi, &bp->msg);
+	ret = brickpi3_transfer(bp, buf, 6);
 	if (ret < 0)
-		goto out;
-
-	if (BRICKPI3_READ_FAILED(bp->buf)) {
-		ret = -EIO;
-		goto out;
-	}
+		return ret;
 
-	*value = (bp->buf[4] << 8) | bp->buf[5];
+	if (BRICKPI3_READ_FAILED(buf))
+		return -EIO;
 
-out:
-	mutex_unlock(&bp->xfer_lock);
+	*value = (buf[4] << 8) | buf[5];
 
-	return ret;
+	return 0;
 }
 
 /**
@@ -148,42 +364,28 @@ out:
 int brickpi3_write_u16(struct brickpi3 *bp, u8 address,
 		       enum brickpi3_message msg, u16 value)
 {
-	int ret;
-
-	mutex_lock(&bp->xfer_lock);
-
-	bp->buf[0] = address;
-	bp->buf[1] = msg;
-	bp->buf[2] = (value >> 8) & 0xff;
-	bp->buf[3] = value & 0xff;
-	bp->xfer.len = 4;
-
-	ret = spi_sync(bp->spi, &bp->msg);
+	u8 buf[4];
 
-	mutex_unlock(&bp->xfer_lock);
+	buf[0] = address;
+	buf[1] = msg;
+	buf[2] = (value >> 8) & 0xff;
+	buf[3] = value & 0xff;
 
-	return ret;
+	return brickpi3_transfer(bp, buf, 4);
 }
 
 int brickpi3_write_u8_u16(struct brickpi3 *bp, u8 address,
 			  enum brickpi3_message msg, u8 value1, u16 value2)
 {
-	int ret;
-
-	mutex_lock(&bp->xfer_lock);
-
-	bp->buf[0] = address;
-	bp->buf[1] = msg;
-	bp->buf[2] = value1;
-	bp->buf[3] = (value2 >> 8) & 0xff;
-	bp->buf[4] = value2 & 0xff;
-	bp->xfer.len = 5;
-
-	ret = spi_sync(bp->spi, &bp->msg);
+	u8 buf[5];
 
-	mutex_unlock(&bp->xfer_lock);
+	buf[0] = address;
+	buf[1] = msg;
+	buf[2] = value1;
+	buf[3] = (value2 >> 8) & 0xff;
+	buf[4] = value2 & 0xff;
 
-	return ret;
+	return brickpi3_transfer(bp, buf, 5);
 }
 
 /**
@@ -199,22 +401,15 @@ int brickpi3_write_u8_u16(struct brickpi3 *bp, u8 address,
 int brickpi3_write_u24(struct brickpi3 *bp, u8 address,
 		       enum brickpi3_message msg, u32 value)
 {
-	int ret;
-
-	mutex_lock(&bp->xfer_lock);
-
-	bp->buf[0] = address;
-	bp->buf[1] = msg;
-	bp->buf[2] = (value >> 16) & 0xff;
-	bp->buf[3] = (value >> 8) & 0xff;
-	bp->buf[4] = value & 0xff;
-	bp->xfer.len = 5;
+	u8 buf[5];
 
-	ret = spi_sync(bp->spi, &bp->msg);
+	buf[0] = address;
+	buf[1] = msg;
+	buf[2] = (value >> 16) & 0xff;
+	buf[3] = (value >> 8) & 0xff;
+	buf[4] = value & 0xff;
 
-	mutex_unlock(&bp->xfer_lock);
-
-	return ret;
+	return brickpi3_transfer(bp, buf, 5);
 }
 
 /**
@@ -230,36 +425,19 @@ int brickpi3_write_u24(struct brickpi3 *bp, u8 address,
 int brickpi3_read_u32(struct brickpi3 *bp, u8 address,
 		      enum brickpi3_message msg, u32 *value)
 {
-	int ret = 0;
-
-	mutex_lock(&bp->xfer_lock);
-
-	bp->buf[0] = address;
-	bp->buf[1] = msg;
-	bp->buf[2] = 0;
-	bp->buf[3] = 0;
-	bp->buf[4] = 0;
-	bp->buf[5] = 0;
-	bp->buf[6] = 0;
-	bp->buf[7] = 0;
-	bp->xfer.len = 8;
+	u8 buf[8] = { address, msg };
+	int ret;
 
-	ret = spi_sync(bp->spi, &bp->msg);
+	ret = brickpi3_transfer(bp, buf, 8);
 	if (ret < 0)
-		goto out;
-
-	if (BRICKPI3_READ_FAILED(bp->buf)) {
-		ret = -EIO;
-		goto out;
-	}
+		return ret;
 
-	*value = (bp->buf[4] << 24) | (bp->buf[5] << 16) |
-		 (bp->buf[6] << 8) | bp->buf[7];
+	if (BRICKPI3_READ_FAILED(buf))
+		return -EIO;
 
-out:
-	mutex_unlock(&bp->xfer_lock);
+	*value = (buf[4] << 24) | (buf[5] << 16) | (buf[6] << 8) | buf[7];
 
-	return ret;
+	return 0;
 }
 
 /**
@@ -275,46 +453,32 @@ out:
 int brickpi3_write_u32(struct brickpi3 *bp, u8 address,
 		       enum brickpi3_message msg, u32 value)
 {
-	int ret;
-
-	mutex_lock(&bp->xfer_lock);
+	u8 buf[6];
 
-	bp->buf[0] = address;
-	bp->buf[1] = msg;
-	bp->buf[2] = (value >> 24) & 0xff;
-	bp->buf[3] = (value >> 16) & 0xff;
-	bp->buf[4] = (value >> 8) & 0xff;
-	bp->buf[5] = value & 0xff;
-	bp->xfer.len = 6;
+	buf[0] = address;
+	buf[1] = msg;
+	buf[2] = (value >> 24) & 0xff;
+	buf[3] = (value >> 16) & 0xff;
+	buf[4] = (value >> 8) & 0xff;
+	buf[5] = value & 0xff;
 
-	ret = spi_sync(bp->spi, &bp->msg);
-
-	mutex_unlock(&bp->xfer_lock);
-
-	return ret;
+	return brickpi3_transfer(bp, buf, 6);
 }
 
 int brickpi3_write_u8_u32(struct brickpi3 *bp, u8 address,
 			  enum brickpi3_message msg, u8 value1, u32 value2)
 {
-	int ret;
-
-	mutex_lock(&bp->xfer_lock);
+	u8 buf[7];
 
-	bp->buf[0] = address;
-	bp->buf[1] = msg;
-	bp->buf[2] = value1;
-	bp->buf[3] = (value2 >> 24) & 0xff;
-	bp->buf[4] = (value2 >> 16) & 0xff;
-	bp->buf[5] = (value2 >> 8) & 0xff;
-	bp->buf[6] = value2 & 0xff;
-	bp->xfer.len = 7;
+	buf[0] = address;
+	buf[1] = msg;
+	buf[2] = value1;
+	buf[3] = (value2 >> 24) & 0xff;
+	buf[4] = (value2 >> 16) & 0xff;
+	buf[5] = (value2 >> 8) & 0xff;
+	buf[6] = value2 & 0xff;
 
-	ret = spi_sync(bp->spi, &bp->msg);
-
-	mutex_unlock(&bp->xfer_lock);
-
-	return ret;
+	return brickpi3_transfer(bp, buf, 7);
 }
 
 /**
@@ -331,51 +495,34 @@ int brickpi3_write_u8_u32(struct brickpi3 *bp, u8 address,
 int brickpi3_read_string(struct brickpi3 *bp, u8 address,
 			 enum brickpi3_message msg, char *value, size_t len)
 {
-	int ret = 0;
-
-	mutex_lock(&bp->xfer_lock);
+	u8 buf[BRICKPI3_MAX_MSG_SIZE] = { address, msg };
+	int ret;
 
-	bp->buf[0] = address;
-	bp->buf[1] = msg;
-	bp->buf[2] = 0;
-	bp->buf[3] = 0;
-	memset(&bp->buf[BRICKPI3_HEADER_SIZE], 0, len);
-	bp->xfer.len = BRICKPI3_HEADER_SIZE + len;
+	if (len > BRICKPI3_STRING_MSG_SIZE)
+		return -EINVAL;
 
-	ret = spi_sync(bp->spi, &bp->msg);
+	ret = brickpi3_transfer(bp, buf, BRICKPI3_HEADER_SIZE + len);
 	if (ret < 0)
-		goto out;
-
-	if (BRICKPI3_READ_FAILED(bp->buf)) {
-		ret = -EIO;
-		goto out;
-	}
+		return ret;
 
-	memcpy(value, &bp->buf[BRICKPI3_HEADER_SIZE], len);
+	if (BRICKPI3_READ_FAILED(buf))
+		return -EIO;
 
-out:
-	mutex_unlock(&bp->xfer_lock);
+	memcpy(value, &buf[BRICKPI3_HEADER_SIZE], len);
 
-	return ret;
+	return 0;
 }
 
 static int brickpi3_set_address(struct brickpi3 *bp, u8 address, u8 id[16])
 {
-	int ret;
-
-	mutex_lock(&bp->xfer_lock);
-
-	bp->buf[0] = 0;
-	bp->buf[1] = BRICKPI3_MSG_SET_ADDRESS;
-	bp->buf[2] = address;
-	strncpy(&bp->buf[3], id, 16);
-	bp->xfer.len = 19;
-
-	ret = spi_sync(bp->spi, &bp->msg);
+	u8 buf[19];
 
-	mutex_unlock(&bp->xfer_lock);
+	buf[0] = 0;
+	buf[1] = BRICKPI3_MSG_SET_ADDRESS;
+	buf[2] = address;
+	strncpy(&buf[3], id, 16);
 
-	return ret;
+	return brickpi3_transfer(bp, buf, 19);
 }
 
 /**
@@ -395,44 +542,28 @@ int brickpi3_read_sensor(struct brickpi3 *bp, u8 address,
 			 enum brickpi3_sensor_type type, char *value,
 			 size_t len)
 {
-	int ret = 0;
-
-	mutex_lock(&bp->xfer_lock);
+	u8 buf[BRICKPI3_MAX_MSG_SIZE] = { address, BRICKPI3_MSG_GET_SENSOR + port };
+	int ret;
 
-	bp->buf[0] = address;
-	bp->buf[1] = BRICKPI3_MSG_GET_SENSOR + port;
-	bp->buf[2] = 0;
-	bp->buf[3] = 0;
-	bp->buf[4] = 0;
-	bp->buf[5] = 0;
-	memset(&bp->buf[6], 0, len);
-	bp->xfer.len = 6 + len;
+	if (len > BRICKPI3_MAX_MSG_SIZE - 6)
+		return -EINVAL;
 
-	ret = spi_sync(bp->spi, &bp->msg);
+	ret = brickpi3_transfer(bp, buf, 6 + len);
 	if (ret < 0)
-		goto out;
-
-	if (BRICKPI3_READ_FAILED(bp->buf)) {
-		ret = -EIO;
-		goto out;
-	}
+		return ret;
 
-	if (bp->buf[4] != type) {
-		ret = -EIO;
-		goto out;
-	}
+	if (BRICKPI3_READ_FAILED(buf))
+		return -EIO;
 
-	if (bp->buf[5] != BRICKPI3_SENSOR_STATE_VALID_DATA) {
-		ret = -EIO;
-		goto out;
-	}
+	if (buf[4] != type)
+		return -EIO;
 
-	memcpy(value, &bp->buf[6], len);
+	if (buf[5] != BRICKPI3_SENSOR_STATE_VALID_DATA)
+		return -EIO;
 
-out:
-	mutex_unlock(&bp->xfer_lock);
+	memcpy(value, &buf[6], len);
 
-	return ret;
+	return 0;
 }
 
 /**
@@ -449,23 +580,16 @@ int brickpi3_set_sensor_custom(struct brickpi3 *bp, u8 address,
 			       enum brickpi3_input_port port,
 			       enum brickpi3_sensor_pin_flags flags)
 {
-	int ret = 0;
+	u8 buf[6];
 
-	mutex_lock(&bp->xfer_lock);
+	buf[0] = address;
+	buf[1] = BRICKPI3_MSG_SET_SENSOR_TYPE;
+	buf[2] = BIT(port);
+	buf[3] = BRICKPI3_SENSOR_TYPE_CUSTOM;
+	buf[4] = (flags >> 8) & 0xff;
+	buf[5] = flags & 0xff;
 
-	bp->buf[0] = address;
-	bp->buf[1] = BRICKPI3_MSG_SET_SENSOR_TYPE;
-	bp->buf[2] = BIT(port);
-	bp->buf[3] = BRICKPI3_SENSOR_TYPE_CUSTOM;
-	bp->buf[4] = (flags >> 8) & 0xff;
-	bp->buf[5] = flags & 0xff;
-	bp->xfer.len = 6;
-
-	ret = spi_sync(bp->spi, &bp->msg);
-
-	mutex_unlock(&bp->xfer_lock);
-
-	return ret;
+	return brickpi3_transfer(bp, buf, 6);
 }
 
 /**
@@ -484,24 +608,17 @@ int brickpi3_set_sensor_i2c(struct brickpi3 *bp, u8 address,
 			    enum brickpi3_i2c_flags flags,
 			    u8 speed)
 {
-	int ret = 0;
-
-	mutex_lock(&bp->xfer_lock);
-
-	bp->buf[0] = address;
-	bp->buf[1] = BRICKPI3_MSG_SET_SENSOR_TYPE;
-	bp->buf[2] = BIT(port);
-	bp->buf[3] = BRICKPI3_SENSOR_TYPE_I2C;
-	bp->buf[4] = flags;
-	bp->buf[5] = speed;
-	bp->xfer.len = 6;
+	u8 buf[6];
+
+	buf[0] = address;
+	buf[1] = BRICKPI3_MSG_SET_SENSOR_TYPE;
+	buf[2] = BIT(port);
+	buf[3] = BRICKPI3_SENSOR_TYPE_I2C;
+	buf[4] = flags;
+	buf[5] = speed;
 	/* TODO: handle extra params for (flags & BRICKPI3_I2C_SAME) */
 
-	ret = spi_sync(bp->spi, &bp->msg);
-
-	mutex_unlock(&bp->xfer_lock);
-
-	return ret;
+	return brickpi3_transfer(bp, buf, 6);
 }
 
 /**
@@ -516,152 +633,367 @@ int brickpi3_set_sensor_i2c(struct brickpi3 *bp, u8 address,
  * @read_buf: The buffer to store the read data
  * @read_size: The number of bytes to read (<= BRICKPI3_I2C_MAX_READ_SIZE)
  *
- * Returns 0 on success or negative error code.
+ * This sleeps while the BrickPi3 does the transaction, but does not prevent
+ * other messages from being sent to the BrickPi3 in the mean time.
+ *
+ * Returns 0 on success, -ETIMEDOUT if the read data did not become valid in
+ * time or other negative error code.
  */
 int brickpi3_i2c_transact(struct brickpi3 *bp, u8 address,
 			  enum brickpi3_input_port port, u8 i2c_addr,
 			  u8 *write_buf, u8 write_size,
 			  u8 *read_buf, u8 read_size)
 {
-	int ret = 0;
+	u8 buf[BRICKPI3_MAX_MSG_SIZE];
+	unsigned long timeout;
+	unsigned int delay_us;
+	int ret;
 
 	if (read_size > BRICKPI3_I2C_MAX_READ_SIZE)
 		return -EINVAL;
 	if (write_size > BRICKPI3_I2C_MAX_WRITE_SIZE)
 		return -EINVAL;
 
-	mutex_lock(&bp->xfer_lock);
-
 	/*
 	 * TODO: It might be better to error early if we know the port is not
 	 * already in I2C mode. For now, we will return -EBUSY when we try to
 	 * read back the response if the mode was not set.
 	 */
 
-	bp->buf[0] = address;
-	bp->buf[1] = BRICKPI3_MSG_I2C_TRANSACT + port;
-	bp->buf[2] = i2c_addr << 1;
-	bp->buf[3] = read_size;
-	bp->buf[4] = write_size;
-	memcpy(&bp->buf[5], write_buf, write_size);
-	bp->xfer.len = 5 + write_size;
+	buf[0] = address;
+	buf[1] = BRICKPI3_MSG_I2C_TRANSACT + port;
+	buf[2] = i2c_addr << 1;
+	buf[3] = read_size;
+	buf[4] = write_size;
+	memcpy(&buf[5], write_buf, write_size);
 
-	ret = spi_sync(bp->spi, &bp->msg);
+	ret = brickpi3_transfer(bp, buf, 5 + write_size);
 	if (ret < 0)
-		goto out;
+		return ret;
 
-	if (BRICKPI3_READ_FAILED(bp->buf)) {
-		ret = -EIO;
-		goto out;
-	}
+	if (BRICKPI3_READ_FAILED(buf))
+		return -EIO;
 
-	if (read_buf && read_size) {
-		/*
-		 * FIXME: msleep is never a good idea. Perhaps we could keep
-		 * polling until spi_sync() returns BRICKPI3_SENSOR_STATE_VALID_DATA
-		 * along with a timeout mechanism.
-		 *
-		 * For now, we are estimating one msec per byte (I2C operates
-		 * at 10kHz)
-		 */
-		msleep(write_size + read_size + 2);
-
-		bp->buf[0] = address;
-		bp->buf[1] = BRICKPI3_MSG_GET_SENSOR + port;
-		memset(&bp->buf[2], 0, 4 + read_size);
-		bp->xfer.len = 6 + read_size;
-
-		ret = spi_sync(bp->spi, &bp->msg);
-		if (ret < 0)
-			goto out;
+	if (!read_buf || !read_size)
+		return 0;
 
-		if (BRICKPI3_READ_FAILED(bp->buf)) {
-			ret = -EIO;
-			goto out;
-		}
-		if (bp->buf[4] != BRICKPI3_SENSOR_TYPE_I2C) {
-			ret = -EBUSY;
-			goto out;
-		}
-		if (bp->buf[5] != BRICKPI3_SENSOR_STATE_VALID_DATA) {
-			ret = -EIO;
-			goto out;
-		}
+	/*
+	 * The I2C bus on the BrickPi3 runs at about 10kHz, so the transaction
+	 * will take at least one msec per byte. There is no point in asking
+	 * for the data before then. After that, keep polling with backoff
+	 * until the firmware says the data is valid. The SPI bus is free for
+	 * other users in the mean time.
+	 */
+	timeout = jiffies + msecs_to_jiffies(BRICKPI3_I2C_TIMEOUT_MS);
+	delay_us = (write_size + read_size) * USEC_PER_MSEC;
+	usleep_range(delay_us, delay_us + delay_us / 4);
+	delay_us = BRICKPI3_I2C_MIN_POLL_US;
 
-		memcpy(read_buf, &bp->buf[6], read_size);
+	for (;;) {
+		buf[0] = address;
+		buf[1] = BRICKPI3_MSG_GET_SENSOR + port;
+		memset(&buf[2], 0, 4 + read_size);
+
+		ret = brickpi3_transfer(bp, buf, 6 + read_size);
+		if (ret < 0)
+			return ret;
+
+		if (BRICKPI3_READ_FAILED(buf))
+			return -EIO;
+		if (buf[4] != BRICKPI3_SENSOR_TYPE_I2C)
+			return -EBUSY;
+		if (buf[5] == BRICKPI3_SENSOR_STATE_VALID_DATA)
+			break;
+		if (buf[5] == BRICKPI3_SENSOR_STATE_I2C_ERROR)
+			return -EIO;
+		if (time_after(jiffies, timeout))
+			return -ETIMEDOUT;
+
+		usleep_range(delay_us, delay_us + delay_us / 4);
+		delay_us = min_t(unsigned int, delay_us * 2,
+				 BRICKPI3_I2C_MAX_POLL_US);
 	}
 
-out:
-	mutex_unlock(&bp->xfer_lock);
+	memcpy(read_buf, &buf[6], read_size);
 
-	return ret;
+	return 0;
 }
 
 int brickpi3_set_motor_limits(struct brickpi3 *bp, u8 address,
 			      enum brickpi3_output_port port,
 			      u8 duty_cycle_sp, u16 speed)
 {
-	int ret;
+	u8 buf[6];
 
-	mutex_lock(&bp->xfer_lock);
+	buf[0] = address;
+	buf[1] = BRICKPI3_MSG_SET_MOTOR_LIMITS;
+	buf[2] = BIT(port);
+	buf[3] = duty_cycle_sp;
+	buf[4] = (speed >> 8) & 0xff;
+	buf[5] = speed & 0xff;
 
-	bp->buf[0] = address;
-	bp->buf[1] = BRICKPI3_MSG_SET_MOTOR_LIMITS;
-	bp->buf[2] = BIT(port);
-	bp->buf[3] = duty_cycle_sp;
-	bp->buf[4] = (speed >> 8) & 0xff;
-	bp->buf[5] = speed & 0xff;
-	bp->xfer.len = 6;
+	return brickpi3_transfer(bp, buf, 6);
+}
 
-	ret = spi_sync(bp->spi, &bp->msg);
+/*
+ * Helpers for queuing several messages and waiting for all of them. Since they
+ * are queued back to back, they will usually end up in the same SPI message.
+ */
 
-	mutex_unlock(&bp->xfer_lock);
+struct brickpi3_batch {
+	struct completion done;
+	atomic_t remaining;
+	int status;
+};
 
-	return ret;
+static void brickpi3_batch_init(struct brickpi3_batch *batch, int count)
+{
+	init_completion(&batch->done);
+	atomic_set(&batch->remaining, count);
+	batch->status = 0;
 }
 
-static int brickpi3_detect(struct brickpi3 *bp, u8 address)
+static void brickpi3_batch_complete_one(struct brickpi3_batch *batch,
+					int status)
 {
-	struct device *dev = &bp->spi->dev;
-	char string[BRICKPI3_STRING_MSG_SIZE + 1];
-	u32 value;
+	if (status < 0)
+		batch->status = status;
+	if (atomic_dec_and_test(&batch->remaining))
+		complete(&batch->done);
+}
+
+static void brickpi3_batch_queue(struct brickpi3 *bp, const u8 *tx_buf,
+				 size_t len, brickpi3_complete_t complete,
+				 void *context)
+{
+	/* only fails with -EBUSY when there are no free slots */
+	wait_event(bp->free_wait,
+		   !brickpi3_transfer_async(bp, tx_buf, len, complete, context));
+}
+
+static int brickpi3_batch_wait(struct brickpi3_batch *batch)
+{
+	wait_for_completion(&batch->done);
+
+	return batch->status;
+}
+
+struct brickpi3_motor_sample_slot {
+	struct brickpi3_batch *batch;
+	struct brickpi3_motor_sample *sample;
+};
+
+static void brickpi3_motor_sample_complete(void *context, int status,
+					   const u8 *rx_buf)
+{
+	struct brickpi3_motor_sample_slot *slot = context;
+	struct brickpi3_motor_sample *sample = slot->sample;
+
+	if (status == 0 && BRICKPI3_READ_FAILED(rx_buf))
+		status = -EIO;
+
+	if (status == 0) {
+		sample->flags = rx_buf[4];
+		sample->power = rx_buf[5];
+		sample->position = (rx_buf[6] << 24) | (rx_buf[7] << 16) |
+				   (rx_buf[8] << 8) | rx_buf[9];
+		sample->speed = (rx_buf[10] << 8) | rx_buf[11];
+	}
+
+	brickpi3_batch_complete_one(slot->batch, status);
+}
+
+/**
+ * brickpi3_read_motor_samples - Read the status of all motors at once
+ *
+ * @bp: The private driver data
+ * @address: The BrickPi3 address
+ * @samples: Caller-allocated array of NUM_BRICKPI3_OUTPUT_PORTS elements to
+ *	hold the returned status
+ *
+ * The status of each motor is still a separate firmware message, but they are
+ * queued back to back so that they end up in a single SPI message.
+ *
+ * Returns 0 on success or negative error code.
+ */
+int brickpi3_read_motor_samples(struct brickpi3 *bp, u8 address,
+				struct brickpi3_motor_sample *samples)
+{
+	struct brickpi3_motor_sample_slot slots[NUM_BRICKPI3_OUTPUT_PORTS];
+	u8 buf[BRICKPI3_HEADER_SIZE + BRICKPI3_MOTOR_STATUS_MSG_SIZE] = { 0 };
+	struct brickpi3_batch batch;
+	int i;
+
+	brickpi3_batch_init(&batch, NUM_BRICKPI3_OUTPUT_PORTS);
+	buf[0] = address;
+
+	for (i = 0; i < NUM_BRICKPI3_OUTPUT_PORTS; i++) {
+		slots[i].batch = &batch;
+		slots[i].sample = &samples[i];
+		buf[1] = BRICKPI3_MSG_GET_MOTOR_STATUS + i;
+		brickpi3_batch_queue(bp, buf, sizeof(buf),
+				     brickpi3_motor_sample_complete, &slots[i]);
+	}
+
+	return brickpi3_batch_wait(&batch);
+}
+
+struct brickpi3_u16_slot {
+	struct brickpi3_batch *batch;
+	u16 *value;
+};
+
+static void brickpi3_read_u16_complete(void *context, int status,
+				       const u8 *rx_buf)
+{
+	struct brickpi3_u16_slot *slot = context;
+
+	if (status == 0 && BRICKPI3_READ_FAILED(rx_buf))
+		status = -EIO;
+
+	if (status == 0)
+		*slot->value = (rx_buf[4] << 8) | rx_buf[5];
+
+	brickpi3_batch_complete_one(slot->batch, status);
+}
+
+/**
+ * brickpi3_read_u16_multi - Read several messages with two bytes of data
+ *
+ * @bp: The private driver data
+ * @address: The BrickPi3 address
+ * @msgs: Array of commands to send
+ * @values: Caller-allocated array to hold the returned message data
+ * @num: The number of items in @msgs and @values (<= BRICKPI3_MAX_BATCH)
+ *
+ * Like brickpi3_read_u16(), but all of the messages are sent in one SPI
+ * message.
+ *
+ * Returns 0 on success or negative error code.
+ */
+int brickpi3_read_u16_multi(struct brickpi3 *bp, u8 address,
+			    const enum brickpi3_message *msgs, u16 *values,
+			    int num)
+{
+	struct brickpi3_u16_slot slots[BRICKPI3_MAX_BATCH];
+	struct brickpi3_batch batch;
+	u8 buf[6] = { address };
+	int i;
+
+	if (num > BRICKPI3_MAX_BATCH)
+		return -EINVAL;
+
+	brickpi3_batch_init(&batch, num);
+
+	for (i = 0; i < num; i++) {
+		slots[i].batch = &batch;
+		slots[i].value = &values[i];
+		buf[1] = msgs[i];
+		brickpi3_batch_queue(bp, buf, sizeof(buf),
+				     brickpi3_read_u16_complete, &slots[i]);
+	}
+
+	return brickpi3_batch_wait(&batch);
+}
+
+/**
+ * struct brickpi3_detect_work - Reads identifying information from a BrickPi3
+ *
+ * @work: Work item for detecting in parallel
+ * @bp: The private driver data
+ * @address: The BrickPi3 address
+ * @ret: 0 if all of the info was read successfully, otherwise error code
+ * @mfg: The manufacturer string
+ * @name: The board name string
+ * @hw_version: The hardware version
+ * @fw_version: The firmware version
+ * @id: The unique ID
+ */
+struct brickpi3_detect_work {
+	struct work_struct work;
+	struct brickpi3 *bp;
+	u8 address;
+	int ret;
+	char mfg[BRICKPI3_STRING_MSG_SIZE + 1];
+	char name[BRICKPI3_STRING_MSG_SIZE + 1];
+	u32 hw_version;
+	u32 fw_version;
+	u8 id[BRICKPI3_ID_MSG_SIZE];
+};
+
+static int brickpi3_read_info(struct brickpi3_detect_work *info)
+{
+	struct brickpi3 *bp = info->bp;
+	u8 address = info->address;
 	int ret;
 
 	/* ensure null terminator */
-	string[BRICKPI3_STRING_MSG_SIZE] = 0;
+	info->mfg[BRICKPI3_STRING_MSG_SIZE] = 0;
+	info->name[BRICKPI3_STRING_MSG_SIZE] = 0;
 
 	ret = brickpi3_read_string(bp, address, BRICKPI3_MSG_GET_MANUFACTURER,
-				   string, BRICKPI3_STRING_MSG_SIZE);
+				   info->mfg, BRICKPI3_STRING_MSG_SIZE);
 	if (ret < 0)
 		return ret;
 
-	dev_info(dev, "Address: %u\n", address);
-	dev_info(dev, "Mfg: %s\n", string);
-	if (strncmp(string, "Dexter Industries", BRICKPI3_STRING_MSG_SIZE) != 0)
-		return -EINVAL;
+	/* don't bother with the rest if nothing is there */
+	if (strncmp(info->mfg, "Dexter Industries", BRICKPI3_STRING_MSG_SIZE) != 0)
+		return 0;
 
 	ret = brickpi3_read_string(bp, address, BRICKPI3_MSG_GET_NAME,
-				   string, BRICKPI3_STRING_MSG_SIZE);
+				   info->name, BRICKPI3_STRING_MSG_SIZE);
 	if (ret < 0)
 		return ret;
 
-	dev_info(dev, "Board: %s\n", string);
-	if (strncmp(string, "BrickPi3", BRICKPI3_STRING_MSG_SIZE) != 0)
-		return -EINVAL;
-
 	ret = brickpi3_read_u32(bp, address, BRICKPI3_MSG_GET_HARDWARE_VERSION,
-				&value);
+				&info->hw_version);
 	if (ret < 0)
 		return ret;
 
-	dev_info(dev, "HW: %u.%u.%u\n", value / 1000000 % 1000000,
-		 value / 1000 % 1000, value % 1000);
-
 	ret = brickpi3_read_u32(bp, address, BRICKPI3_MSG_GET_FIRMWARE_VERSION,
-				&value);
+				&info->fw_version);
 	if (ret < 0)
 		return ret;
 
+	return brickpi3_read_string(bp, address, BRICKPI3_MSG_GET_ID,
+				    (char *)info->id,
+				    BRICKPI3_ID_MSG_SIZE);
+}
+
+static void brickpi3_detect_work(struct work_struct *work)
+{
+	struct brickpi3_detect_work *info =
+		container_of(work, struct brickpi3_detect_work, work);
+
+	info->ret = brickpi3_read_info(info);
+}
+
+/*
+ * Checks the info read by brickpi3_detect_work. This is done afterwards
+ * so that the log messages for each address are not mixed up.
+ */
+static int brickpi3_detect(struct brickpi3_detect_work *info)
+{
+	struct device *dev = &info->bp->spi->dev;
+	u32 value;
+
+	if (info->ret < 0)
+		return info->ret;
+
+	dev_info(dev, "Address: %u\n", info->address);
+	dev_info(dev, "Mfg: %s\n", info->mfg);
+	if (strncmp(info->mfg, "Dexter Industries", BRICKPI3_STRING_MSG_SIZE) != 0)
+		return -EINVAL;
+
+	dev_info(dev, "Board: %s\n", info->name);
+	if (strncmp(info->name, "BrickPi3", BRICKPI3_STRING_MSG_SIZE) != 0)
+		return -EINVAL;
+
+	value = info->hw_version;
+	dev_info(dev, "HW: %u.%u.%u\n", value / 1000000 % 1000000,
+		 value / 1000 % 1000, value % 1000);
+
+	value = info->fw_version;
 	dev_info(dev, "FW: %u.%u.%u\n", value / 1000000 % 1000000,
 		 value / 1000 % 1000, value % 1000);
 	if (value < BRICKPI3_REQUIRED_FIRMWARE_VERSION ||
@@ -671,17 +1003,13 @@ static int brickpi3_detect(struct brickpi3 *bp, u8 address)
 			BRICKPI3_REQUIRED_FIRMWARE_VERSION / 1000 % 1000);
 		return -EINVAL;
 	}
-	ret = brickpi3_read_string(bp, address, BRICKPI3_MSG_GET_ID, string,
-				   BRICKPI3_ID_MSG_SIZE);
-	if (ret < 0)
-		return ret;
 
 	dev_info(dev, "ID: %02X%02X%02X%02X%02X%02X%02X%02X"
 		 "%02X%02X%02X%02X%02X%02X%02X%02X\n",
-		 string[0], string[1], string[2], string[3],
-		 string[4], string[5], string[6], string[7],
-		 string[8], string[9], string[10], string[11],
-		 string[12], string[13], string[14], string[15]);
+		 info->id[0], info->id[1], info->id[2], info->id[3],
+		 info->id[4], info->id[5], info->id[6], info->id[7],
+		 info->id[8], info->id[9], info->id[10], info->id[11],
+		 info->id[12], info->id[13], info->id[14], info->id[15]);
 
 	return 0;
 }
@@ -725,6 +1053,7 @@ static void brickpi3_set_addresses(struct brickpi3 *bp) {
 
 static int brickpi3_probe(struct spi_device *spi)
 {
+	struct brickpi3_detect_work *detect;
 	struct device *dev = &spi->dev;
 	struct brickpi3 *bp;
 	int i, ret;
@@ -734,44 +1063,71 @@ static int brickpi3_probe(struct spi_device *spi)
 	if (!bp)
 		return -ENOMEM;
 
+	detect = devm_kcalloc(dev, NUM_BRICKPI3_ADDRESSES, sizeof(*detect),
+			      GFP_KERNEL);
+	if (!detect)
+		return -ENOMEM;
+
 	dev_set_drvdata(dev, bp);
 
 	bp->spi = spi;
-	bp->xfer.tx_buf = bp->buf;
-	bp->xfer.rx_buf = bp->buf;
-	spi_message_init_with_transfers(&bp->msg, &bp->xfer, 1);
-	mutex_init(&bp->xfer_lock);
+	INIT_LIST_HEAD(&bp->free_list);
+	INIT_LIST_HEAD(&bp->pending_list);
+	for (i = 0; i < BRICKPI3_NUM_REQUESTS; i++)
+		list_add_tail(&bp->requests[i].node, &bp->free_list);
+	init_waitqueue_head(&bp->free_wait);
+	spin_lock_init(&bp->lock);
 
 	brickpi3_set_addresses(bp);
 
-	for (i = BRICKPI3_MIN_ADDRESS; i <= BRICKPI3_MAX_ADDRESS; i++) {
-		ret = brickpi3_detect(bp, i);
+	/*
+	 * Detection takes several round trips for each address, so do all of
+	 * the addresses at the same time and let the message queue interleave
+	 * them.
+	 */
+	for (i = 0; i < NUM_BRICKPI3_ADDRESSES; i++) {
+		INIT_WORK(&detect[i].work, brickpi3_detect_work);
+		detect[i].bp = bp;
+		detect[i].address = BRICKPI3_MIN_ADDRESS + i;
+		queue_work(system_unbound_wq, &detect[i].work);
+	}
+	for (i = 0; i < NUM_BRICKPI3_ADDRESSES; i++)
+		flush_work(&detect[i].work);
+
+	for (i = 0; i < NUM_BRICKPI3_ADDRESSES; i++) {
+		struct i2c_adapter *i2c_adaps[NUM_BRICKPI3_INPUT_PORTS];
+		u8 address = detect[i].address;
+
+		ret = brickpi3_detect(&detect[i]);
 		if (ret < 0)
 			continue;
 
-		ret = devm_brickpi3_register_leds(dev, bp, i);
+		ret = devm_brickpi3_register_leds(dev, bp, address);
 		if (ret < 0)
 			return ret;
 
-		ret = devm_brickpi3_register_iio(dev, bp, i);
+		ret = devm_brickpi3_register_iio(dev, bp, address);
 		if (ret < 0)
 			return ret;
 
-		ret = devm_brickpi3_register_i2c(dev, bp, i);
+		ret = devm_brickpi3_register_i2c(dev, bp, address, i2c_adaps);
 		if (ret < 0)
 			return ret;
 
-		ret = devm_brickpi3_register_in_ports(dev, bp, i);
+		ret = devm_brickpi3_register_in_ports(dev, bp, address,
+						      i2c_adaps);
 		if (ret < 0)
 			return ret;
 
-		ret = devm_brickpi3_register_out_ports(dev, bp, i);
+		ret = devm_brickpi3_register_out_ports(dev, bp, address);
 		if (ret < 0)
 			return ret;
 
 		ok = true;
 	}
 
+	devm_kfree(dev, detect);
+
 	return ok ? 0 : -ENODEV;
 }
 
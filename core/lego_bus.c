@@ -20,10 +20,95 @@
 #include <linux/err.h>
 #include <linux/gpio.h>
 #include <linux/ioport.h>
+#include <linux/hashtable.h>
+#include <linux/jhash.h>
+#include <linux/rculist.h>
 
 #include <lego.h>
 #include <lego_port_class.h>
 
+/*
+ * Index of the id table entries of all registered drivers, hashed by device
+ * name. Matching a device against a driver is then a lookup in one bucket
+ * instead of a scan of the whole id table, which matters for drivers with
+ * large tables (nxt-analog, ev3-uart, nxt-i2c) since the driver core tries
+ * each device against each driver. The index is modified under
+ * lego_bus_id_mutex and read under RCU since lego_bus_match() can be called
+ * from within driver_register().
+ */
+#define LEGO_BUS_ID_HASH_BITS	8
+
+/**
+ * struct lego_bus_id_entry - entry in the lego bus id index
+ * @node: Node in lego_bus_id_hash.
+ * @hash: Hash of the device name.
+ * @drv: The driver that this entry belongs to.
+ * @id: The id table entry or NULL if the driver does not have an id table
+ *	and matches by driver name.
+ */
+struct lego_bus_id_entry {
+	struct hlist_node node;
+	u32 hash;
+	struct lego_device_driver *drv;
+	const struct lego_device_id *id;
+};
+
+static DEFINE_HASHTABLE(lego_bus_id_hash, LEGO_BUS_ID_HASH_BITS);
+static DEFINE_MUTEX(lego_bus_id_mutex);
+
+static u32 lego_bus_name_hash(const char *name)
+{
+	return jhash(name, strnlen(name, LEGO_NAME_SIZE), 0);
+}
+
+static int lego_bus_id_index_add(struct lego_device_driver *drv)
+{
+	const struct lego_device_id *id = drv->id_table;
+	struct lego_bus_id_entry *entries;
+	unsigned num = 1;
+	int i;
+
+	if (id) {
+		num = 0;
+		while (id[num].name[0])
+			num++;
+	}
+
+	entries = kcalloc(num, sizeof(*entries), GFP_KERNEL);
+	if (!entries)
+		return -ENOMEM;
+
+	mutex_lock(&lego_bus_id_mutex);
+	for (i = 0; i < num; i++) {
+		entries[i].drv = drv;
+		entries[i].id = id ? &id[i] : NULL;
+		entries[i].hash = lego_bus_name_hash(id ? id[i].name
+							: drv->driver.name);
+		hash_add_rcu(lego_bus_id_hash, &entries[i].node, entries[i].hash);
+	}
+	mutex_unlock(&lego_bus_id_mutex);
+
+	drv->id_entries = entries;
+	drv->num_id_entries = num;
+
+	return 0;
+}
+
+static void lego_bus_id_index_remove(struct lego_device_driver *drv)
+{
+	int i;
+
+	mutex_lock(&lego_bus_id_mutex);
+	for (i = 0; i < drv->num_id_entries; i++)
+		hash_del_rcu(&drv->id_entries[i].node);
+	mutex_unlock(&lego_bus_id_mutex);
+
+	synchronize_rcu();
+	kfree(drv->id_entries);
+	drv->id_entries = NULL;
+	drv->num_id_entries = 0;
+}
+
 static void lego_device_release (struct device *dev)
 {
 	struct lego_device *ldev = to_lego_device(dev);
@@ -59,6 +144,7 @@ struct lego_device *lego_device_register(const char *name,
 		return ERR_PTR(-ENOMEM);
 
 	strncpy(ldev->name, name, LEGO_NAME_SIZE);
+	ldev->name_hash = lego_bus_name_hash(ldev->name);
 	ldev->port = port;
 	snprintf(init_name, LEGO_NAME_SIZE, "%s:%s", ldev->port->address,
 		 ldev->name);
@@ -133,6 +219,8 @@ static void lego_device_driver_shutdown(struct device *dev)
 
 int lego_device_driver_register(struct lego_device_driver *drv)
 {
+	int err;
+
 	drv->driver.bus = &lego_bus_type;
 	if (drv->probe)
 		drv->driver.probe = lego_device_driver_probe;
@@ -141,13 +229,23 @@ int lego_device_driver_register(struct lego_device_driver *drv)
 	if (drv->shutdown)
 		drv->driver.shutdown = lego_device_driver_shutdown;
 
-	return driver_register(&drv->driver);
+	/* the index has to be ready before driver_register() matches devices */
+	err = lego_bus_id_index_add(drv);
+	if (err)
+		return err;
+
+	err = driver_register(&drv->driver);
+	if (err)
+		lego_bus_id_index_remove(drv);
+
+	return err;
 }
 EXPORT_SYMBOL_GPL(lego_device_driver_register);
 
 void lego_device_driver_unregister(struct lego_device_driver *drv)
 {
 	driver_unregister(&drv->driver);
+	lego_bus_id_index_remove(drv);
 }
 EXPORT_SYMBOL_GPL(lego_device_driver_unregister);
 
@@ -184,25 +282,31 @@ static int lego_bus_match(struct device *dev, struct device_driver *drv)
 {
 	struct lego_device *ldev = to_lego_device(dev);
 	struct lego_device_driver *ldrv = to_lego_device_driver(drv);
-	const struct lego_device_id *id = ldrv->id_table;
+	struct lego_bus_id_entry *entry;
+	int match = 0;
 
 	/* device type name must match driver name */
 	if (strcmp(ldev->dev.type->name, drv->name))
 		return 0;
 
-	/* match entry from id table if there is one */
-	if (id) {
-		while (id->name[0]) {
-			if (!strcmp(ldev->name, id->name)) {
-				ldev->entry_id = id;
-				return 1;
-			}
-			id++;
-		}
-		return 0;
+	/*
+	 * Match entry from id table if there is one, otherwise device name
+	 * must match driver name. Both are in the index.
+	 */
+	rcu_read_lock();
+	hash_for_each_possible_rcu(lego_bus_id_hash, entry, node,
+				   ldev->name_hash) {
+		if (entry->drv != ldrv || entry->hash != ldev->name_hash)
+			continue;
+		if (strcmp(ldev->name, entry->id ? entry->id->name : drv->name))
+			continue;
+		ldev->entry_id = entry->id;
+		match = 1;
+		break;
 	}
+	rcu_read_unlock();
 
-	return !strcmp(ldev->name, drv->name);
+	return match;
 }
 
 static int lego_bus_uevent(struct device *dev, struct kobj_uevent_env *env)
@@ -0,0 +1,214 @@
+/*
+ * LEGO device bus match benchmark
+ *
+ * Copyright (C) 2026 The ev3dev project
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+
+ * This program is distributed "as is" WITHOUT ANY WARRANTY of any
+ * kind, whether express or implied; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/**
+ * DOC: benchmark
+ *
+ * This module measures how long it takes to register and unregister devices
+ * on the lego bus. It registers one virtual port and one driver with a large
+ * id table, then registers ``num_devices`` devices that each match a different
+ * entry of the table. The names are taken from the end of the table, which is
+ * the worst case for a scan of the table. The results are printed to the kernel
+ * log and the module then refuses to load (``-EAGAIN``), so there is nothing
+ * to unload afterwards::
+ *
+ *     sudo dmesg -n 1
+ *     sudo modprobe lego_bus_bench num_ids=1024 num_devices=500
+ *     dmesg | grep lego_bus_bench
+ *
+ * Only exported lego bus functions are used, so the same module can be built
+ * against older kernels to compare the cost of matching. Every device also
+ * logs a message when it is added and removed, and that cost is included in
+ * the results. Use the same log level for every run being compared.
+ *
+ * .. flat-table:: Module parameters
+ *    :widths: 1 1 5
+ *    :header-rows: 1
+ *
+ *    * - Name
+ *      - Default
+ *      - Description
+ *
+ *    * - ``num_ids``
+ *      - 512
+ *      - Number of entries in the id table of the benchmark driver.
+ *
+ *    * - ``num_devices``
+ *      - 500
+ *      - Number of devices to register. Must not be more than ``num_ids``.
+ */
+
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/device.h>
+#include <linux/err.h>
+#include <linux/ktime.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+
+#include <lego.h>
+#include <lego_port_class.h>
+
+#define LEGO_BUS_BENCH_NAME	"lego-bus-bench"
+
+static unsigned num_ids = 512;
+module_param(num_ids, uint, 0444);
+MODULE_PARM_DESC(num_ids, "Number of entries in the id table.");
+
+static unsigned num_devices = 500;
+module_param(num_devices, uint, 0444);
+MODULE_PARM_DESC(num_devices, "Number of devices to register.");
+
+static const struct device_type lego_bus_bench_port_type = {
+	.name	= "lego-bus-bench-port",
+};
+
+static const struct device_type lego_bus_bench_device_type = {
+	.name	= LEGO_BUS_BENCH_NAME,
+};
+
+static unsigned lego_bus_bench_probed;
+
+static int lego_bus_bench_probe(struct lego_device *ldev)
+{
+	lego_bus_bench_probed++;
+
+	return 0;
+}
+
+static int lego_bus_bench_remove(struct lego_device *ldev)
+{
+	return 0;
+}
+
+static struct lego_device_driver lego_bus_bench_driver = {
+	.probe	= lego_bus_bench_probe,
+	.remove	= lego_bus_bench_remove,
+	.driver = {
+		.name	= LEGO_BUS_BENCH_NAME,
+		.owner	= THIS_MODULE,
+	},
+};
+
+static struct lego_port_device lego_bus_bench_port = {
+	.name		= LEGO_BUS_BENCH_NAME,
+	.address	= "bench",
+};
+
+static int lego_bus_bench_run(void)
+{
+	struct lego_device **ldevs;
+	char name[LEGO_NAME_SIZE + 1];
+	ktime_t start, registered, unregistered;
+	s64 reg_ns, unreg_ns;
+	unsigned i, count;
+	int err = 0;
+
+	ldevs = vzalloc(num_devices * sizeof(*ldevs));
+	if (!ldevs)
+		return -ENOMEM;
+
+	start = ktime_get();
+	for (count = 0; count < num_devices; count++) {
+		snprintf(name, sizeof(name), "bench-%u", num_ids - 1 - count);
+		ldevs[count] = lego_device_register(name,
+					&lego_bus_bench_device_type,
+					&lego_bus_bench_port, NULL, 0);
+		if (IS_ERR(ldevs[count])) {
+			err = PTR_ERR(ldevs[count]);
+			break;
+		}
+	}
+	registered = ktime_get();
+	for (i = 0; i < count; i++)
+		lego_device_unregister(ldevs[i]);
+	unregistered = ktime_get();
+
+	vfree(ldevs);
+
+	if (err) {
+		pr_err("Failed to register device %u (%d)\n", count, err);
+		return err;
+	}
+	if (lego_bus_bench_probed != num_devices) {
+		pr_err("Only %u of %u devices matched\n", lego_bus_bench_probed,
+		       num_devices);
+		return -EIO;
+	}
+
+	reg_ns = ktime_to_ns(ktime_sub(registered, start));
+	unreg_ns = ktime_to_ns(ktime_sub(unregistered, registered));
+	pr_info("%u ids, %u devices: register %lld ns/device, unregister %lld ns/device\n",
+		num_ids, num_devices, div_s64(reg_ns, num_devices),
+		div_s64(unreg_ns, num_devices));
+
+	return 0;
+}
+
+static int __init lego_bus_bench_init(void)
+{
+	struct lego_device_id *id_table;
+	struct device *parent;
+	unsigned i;
+	int err;
+
+	/* each device needs its own id so that the device names are unique */
+	if (!num_devices || num_devices > num_ids)
+		return -EINVAL;
+
+	/* the table is terminated by an empty entry */
+	id_table = vzalloc((num_ids + 1) * sizeof(*id_table));
+	if (!id_table)
+		return -ENOMEM;
+	for (i = 0; i < num_ids; i++) {
+		snprintf(id_table[i].name, sizeof(id_table[i].name), "bench-%u",
+			 i);
+		id_table[i].driver_data = i;
+	}
+	lego_bus_bench_driver.id_table = id_table;
+
+	parent = root_device_register(LEGO_BUS_BENCH_NAME);
+	if (IS_ERR(parent)) {
+		err = PTR_ERR(parent);
+		goto err_root_device_register;
+	}
+
+	err = lego_port_register(&lego_bus_bench_port,
+				 &lego_bus_bench_port_type, parent);
+	if (err)
+		goto err_lego_port_register;
+
+	err = lego_device_driver_register(&lego_bus_bench_driver);
+	if (err)
+		goto err_lego_device_driver_register;
+
+	err = lego_bus_bench_run();
+
+	lego_device_driver_unregister(&lego_bus_bench_driver);
+err_lego_device_driver_register:
+	lego_port_unregister(&lego_bus_bench_port);
+err_lego_port_register:
+	root_device_unregister(parent);
+err_root_device_register:
+	vfree(id_table);
+
+	/* there is nothing left to do, so don't stay loaded */
+	return err ? err : -EAGAIN;
+}
+module_init(lego_bus_bench_init);
+
+MODULE_DESCRIPTION("LEGO device bus match benchmark");
+MODULE_LICENSE("GPL");
@@ -0,0 +1,245 @@
+/*
+ * KUnit tests for the LEGO sensor and motor helpers
+ *
+ * Copyright (C) 2026 The ev3dev project
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+
+ * This program is distributed "as is" WITHOUT ANY WARRANTY of any
+ * kind, whether express or implied; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/**
+ * DOC: kunit tests
+ *
+ * This module tests the math helpers that drivers use on every sample:
+ * lego_sensor_ftoi(), lego_sensor_itof(), lego_sensor_default_scale(),
+ * tm_speed_update() and tm_pid_update(). They are pure functions of their
+ * arguments, so no hardware is needed. Run them with::
+ *
+ *     ./tools/testing/kunit/kunit.py run 'lego-*'
+ *
+ * or load the module and read the results from the kernel log. The
+ * lego_math_bench module measures how fast the same helpers are.
+ */
+
+#include <kunit/test.h>
+#include <linux/kernel.h>
+#include <linux/ktime.h>
+#include <linux/module.h>
+
+#include <dc_motor_class.h>
+#include <lego_sensor_class.h>
+#include <tacho_motor_helper.h>
+
+struct lego_kunit_ftoi_case {
+	u32 f;
+	u8 dp;
+	s32 i;
+};
+
+static const struct lego_kunit_ftoi_case lego_kunit_ftoi_cases[] = {
+	{ 0x00000000, 0, 0 },		/* 0.0 */
+	{ 0x80000000, 0, 0 },		/* -0.0 */
+	{ 0x00000001, 0, 0 },		/* denormal */
+	{ 0x00800000, 9, 0 },		/* smallest normal */
+	{ 0x3f800000, 0, 1 },		/* 1.0 */
+	{ 0x3f800000, 3, 1000 },
+	{ 0xbf800000, 0, -1 },		/* -1.0 */
+	{ 0x3ecccccd, 0, 0 },		/* 0.4 */
+	{ 0x3f000000, 0, 1 },		/* 0.5 rounds away from zero */
+	{ 0xbf000000, 0, -1 },		/* -0.5 */
+	{ 0x3fc00000, 0, 2 },		/* 1.5 */
+	{ 0xc0200000, 0, -3 },		/* -2.5 */
+	{ 0x3fa00000, 1, 13 },		/* 1.25 */
+	{ 0x40490fd0, 2, 314 },		/* 3.14159 */
+	{ 0x4e800000, 0, 1 << 30 },	/* 2^30 */
+	{ 0x4effffff, 0, 2147483520 },	/* largest float below 2^31 */
+	{ 0x4f000000, 0, INT_MAX },	/* 2^31 */
+	{ 0xcf000000, 0, INT_MIN },	/* -2^31 */
+	{ 0x501502f9, 0, INT_MAX },	/* 1e10 */
+	{ 0x3f800000, 10, INT_MAX },	/* 1.0 with too many decimals */
+	{ 0xbf800000, 10, INT_MIN },
+	{ 0x7f800000, 0, INT_MAX },	/* inf */
+	{ 0xff800000, 0, INT_MIN },	/* -inf */
+	{ 0x7fc00000, 0, INT_MAX },	/* NaN */
+};
+
+static void lego_kunit_ftoi(struct kunit *test)
+{
+	const struct lego_kunit_ftoi_case *c;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(lego_kunit_ftoi_cases); i++) {
+		c = &lego_kunit_ftoi_cases[i];
+		KUNIT_EXPECT_EQ_MSG(test, lego_sensor_ftoi(c->f, c->dp), c->i,
+				    "f = 0x%08x, dp = %u", c->f, c->dp);
+	}
+}
+
+static void lego_kunit_itof(struct kunit *test)
+{
+	KUNIT_EXPECT_EQ(test, lego_sensor_itof(0, 0), 0x00000000U);
+	KUNIT_EXPECT_EQ(test, lego_sensor_itof(0, 3), 0x00000000U);
+	KUNIT_EXPECT_EQ(test, lego_sensor_itof(1, 0), 0x3f800000U);
+	KUNIT_EXPECT_EQ(test, lego_sensor_itof(-1, 0), 0xbf800000U);
+	KUNIT_EXPECT_EQ(test, lego_sensor_itof(1000, 3), 0x3f800000U);
+	KUNIT_EXPECT_EQ(test, lego_sensor_itof(15, 1), 0x3fc00000U);
+	KUNIT_EXPECT_EQ(test, lego_sensor_itof(1 << 24, 0), 0x4b800000U);
+	/* the bits that don't fit are truncated */
+	KUNIT_EXPECT_EQ(test, lego_sensor_itof(INT_MAX, 0), 0x4effffffU);
+	KUNIT_EXPECT_EQ(test, lego_sensor_itof(INT_MIN, 0), 0xcf000000U);
+}
+
+static void lego_kunit_ftoi_itof_round_trip(struct kunit *test)
+{
+	s32 i;
+	u8 dp;
+
+	/* every integer with 24 bits or less is exact as a float */
+	for (i = -(1 << 24) + 1; i < 1 << 24; i += 9973)
+		KUNIT_ASSERT_EQ_MSG(test, lego_sensor_ftoi(
+				    lego_sensor_itof(i, 0), 0), i, "i = %d", i);
+
+	/* with decimal places, itof truncates, so keep away from 24 bits */
+	for (dp = 0; dp <= 3; dp++) {
+		for (i = -100000; i <= 100000; i++)
+			KUNIT_ASSERT_EQ_MSG(test, lego_sensor_ftoi(
+					    lego_sensor_itof(i, dp), dp), i,
+					    "i = %d, dp = %u", i, dp);
+	}
+}
+
+static void lego_kunit_default_scale(struct kunit *test)
+{
+	struct lego_sensor_mode_info *mode_info;
+	long int value;
+
+	mode_info = kunit_kzalloc(test, sizeof(*mode_info), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, mode_info);
+
+	mode_info->data_type = LEGO_SENSOR_DATA_U8;
+	mode_info->raw_max = 100;
+	mode_info->si_max = 1000;
+	mode_info->raw_data[1] = 50;
+	KUNIT_EXPECT_EQ(test, lego_sensor_default_scale(mode_info, 1, &value), 0);
+	KUNIT_EXPECT_EQ(test, value, 500L);
+
+	mode_info->data_type = LEGO_SENSOR_DATA_S16_BE;
+	mode_info->raw_min = mode_info->si_min = 0;
+	mode_info->raw_max = mode_info->si_max = 0;
+	mode_info->raw_data[0] = 0xff;
+	mode_info->raw_data[1] = 0xfe;
+	KUNIT_EXPECT_EQ(test, lego_sensor_default_scale(mode_info, 0, &value), 0);
+	KUNIT_EXPECT_EQ(test, value, -2L);
+
+	/* 1.5 */
+	mode_info->data_type = LEGO_SENSOR_DATA_FLOAT;
+	mode_info->decimals = 1;
+	*(u32 *)mode_info->raw_data = 0x3fc00000;
+	KUNIT_EXPECT_EQ(test, lego_sensor_default_scale(mode_info, 0, &value), 0);
+	KUNIT_EXPECT_EQ(test, value, 15L);
+
+	mode_info->data_type = NUM_LEGO_SENSOR_DATA_TYPE;
+	KUNIT_EXPECT_EQ(test, lego_sensor_default_scale(mode_info, 0, &value),
+			-ENXIO);
+}
+
+static struct kunit_case lego_kunit_sensor_cases[] = {
+	KUNIT_CASE(lego_kunit_ftoi),
+	KUNIT_CASE(lego_kunit_itof),
+	KUNIT_CASE(lego_kunit_ftoi_itof_round_trip),
+	KUNIT_CASE(lego_kunit_default_scale),
+	{ }
+};
+
+static struct kunit_suite lego_kunit_sensor_suite = {
+	.name = "lego-sensor",
+	.test_cases = lego_kunit_sensor_cases,
+};
+
+static void lego_kunit_speed_equal_time(struct kunit *test)
+{
+	struct tm_speed *spd;
+	ktime_t t = ktime_set(1, 0);
+
+	spd = kunit_kzalloc(test, sizeof(*spd), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, spd);
+
+	tm_speed_init(spd, 0, t, 1);
+
+	/* no time has passed since init, must not divide by zero */
+	tm_speed_update(spd, 100, t);
+	KUNIT_EXPECT_EQ(test, tm_speed_get(spd), 0);
+
+	/* 100 counts in 10 ms */
+	tm_speed_init(spd, 0, t, 1);
+	t = ktime_add_ms(t, 10);
+	tm_speed_update(spd, 100, t);
+	KUNIT_EXPECT_EQ(test, tm_speed_get(spd), 10000);
+	tm_speed_update(spd, 100, t);
+	KUNIT_EXPECT_EQ(test, tm_speed_get(spd), 10000);
+
+	/* compared to the first sample at t, the last speed is kept */
+	tm_speed_update(spd, 200, t);
+	KUNIT_EXPECT_EQ(test, tm_speed_get(spd), 10000);
+
+	/* same for a timestamp that goes backwards */
+	tm_speed_update(spd, 300, ktime_sub_ms(t, 1));
+	KUNIT_EXPECT_EQ(test, tm_speed_get(spd), 10000);
+}
+
+static void lego_kunit_pid_saturation(struct kunit *test)
+{
+	struct tm_pid pid;
+	int i;
+
+	/* duty cycle = error */
+	tm_pid_init(&pid, 10000, 0, 0);
+
+	pid.setpoint = 1000;
+	KUNIT_EXPECT_EQ(test, tm_pid_update(&pid, 0), DC_MOTOR_MAX_DUTY_CYCLE);
+	KUNIT_EXPECT_TRUE(test, tm_pid_is_overloaded(&pid));
+
+	pid.setpoint = -1000;
+	KUNIT_EXPECT_EQ(test, tm_pid_update(&pid, 0), -DC_MOTOR_MAX_DUTY_CYCLE);
+	KUNIT_EXPECT_TRUE(test, tm_pid_is_overloaded(&pid));
+
+	pid.setpoint = 50;
+	KUNIT_EXPECT_EQ(test, tm_pid_update(&pid, 0), 50);
+	KUNIT_EXPECT_FALSE(test, tm_pid_is_overloaded(&pid));
+
+	/* duty cycle = integral of error */
+	tm_pid_init(&pid, 0, 10000, 0);
+	pid.setpoint = 50;
+	for (i = 0; i < 100; i++)
+		KUNIT_EXPECT_LE(test, tm_pid_update(&pid, 0),
+				DC_MOTOR_MAX_DUTY_CYCLE);
+	KUNIT_EXPECT_TRUE(test, tm_pid_is_overloaded(&pid));
+
+	/* the integral must not wind up while saturated */
+	KUNIT_EXPECT_EQ(test, pid.integral, DC_MOTOR_MAX_DUTY_CYCLE);
+	pid.setpoint = 0;
+	KUNIT_EXPECT_EQ(test, tm_pid_update(&pid, 50), 50);
+	KUNIT_EXPECT_FALSE(test, tm_pid_is_overloaded(&pid));
+}
+
+static struct kunit_case lego_kunit_motor_cases[] = {
+	KUNIT_CASE(lego_kunit_speed_equal_time),
+	KUNIT_CASE(lego_kunit_pid_saturation),
+	{ }
+};
+
+static struct kunit_suite lego_kunit_motor_suite = {
+	.name = "lego-tacho-motor",
+	.test_cases = lego_kunit_motor_cases,
+};
+
+kunit_test_suites(&lego_kunit_sensor_suite, &lego_kunit_motor_suite);
+
+MODULE_DESCRIPTION("KUnit tests for the LEGO sensor and motor helpers");
+MODULE_LICENSE("GPL");
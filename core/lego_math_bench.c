@@ -0,0 +1,174 @@
+/*
+ * LEGO sensor and motor math benchmark
+ *
+ * Copyright (C) 2026 The ev3dev project
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+
+ * This program is distributed "as is" WITHOUT ANY WARRANTY of any
+ * kind, whether express or implied; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/**
+ * DOC: benchmark
+ *
+ * This module measures the math helpers that drivers call on every sample:
+ * lego_sensor_ftoi(), lego_sensor_itof(), lego_sensor_default_scale(),
+ * tm_speed_update() and tm_pid_update(). Each one is called ``iterations``
+ * times with varying inputs. The results are printed to the kernel log and
+ * the module then refuses to load (``-EAGAIN``), so there is nothing to unload
+ * afterwards::
+ *
+ *     sudo modprobe lego_math_bench iterations=100000
+ *     dmesg | grep lego_math_bench
+ *
+ * The time per call is measured with ktime_get(). The number of cycles per
+ * call is measured with get_cycles() and is only printed on architectures
+ * that have a cycle counter. Interrupts are not disabled, so run it on an idle
+ * system and compare the best of several runs. The lego_kunit_test module
+ * checks that the helpers are still correct.
+ *
+ * .. flat-table:: Module parameters
+ *    :widths: 1 1 5
+ *    :header-rows: 1
+ *
+ *    * - Name
+ *      - Default
+ *      - Description
+ *
+ *    * - ``iterations``
+ *      - 100000
+ *      - Number of calls of each helper.
+ */
+
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/kernel.h>
+#include <linux/ktime.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/timex.h>
+
+#include <lego_sensor_class.h>
+#include <tacho_motor_helper.h>
+
+static unsigned iterations = 100000;
+module_param(iterations, uint, 0444);
+MODULE_PARM_DESC(iterations, "Number of calls of each helper.");
+
+/* keeps the compiler from dropping the calls */
+static volatile long lego_math_bench_sink;
+
+struct lego_math_bench_ctx {
+	struct lego_sensor_mode_info mode_info;
+	struct tm_speed speed;
+	struct tm_pid pid;
+	ktime_t t;
+};
+
+static void lego_math_bench_ftoi(struct lego_math_bench_ctx *ctx, unsigned i)
+{
+	/* values from 1 to 4, both signs */
+	u32 f = 0x3f800000 + ((i & 0xffff) << 8) + ((i & 1) << 31);
+
+	lego_math_bench_sink += lego_sensor_ftoi(f, 2);
+}
+
+static void lego_math_bench_itof(struct lego_math_bench_ctx *ctx, unsigned i)
+{
+	lego_math_bench_sink += lego_sensor_itof((i & 0xfffff) - 0x80000, 2);
+}
+
+static void lego_math_bench_default_scale(struct lego_math_bench_ctx *ctx,
+					  unsigned i)
+{
+	long value;
+
+	ctx->mode_info.raw_data[0] = i;
+	ctx->mode_info.raw_data[1] = i >> 8;
+	lego_sensor_default_scale(&ctx->mode_info, 0, &value);
+	lego_math_bench_sink += value;
+}
+
+static void lego_math_bench_speed(struct lego_math_bench_ctx *ctx, unsigned i)
+{
+	/* a motor at about 1000 deg/s, sampled every 2 ms */
+	ctx->t = ktime_add_us(ctx->t, 2000);
+	tm_speed_update(&ctx->speed, i * 2, ctx->t);
+	lego_math_bench_sink += tm_speed_get(&ctx->speed);
+}
+
+static void lego_math_bench_pid(struct lego_math_bench_ctx *ctx, unsigned i)
+{
+	lego_math_bench_sink += tm_pid_update(&ctx->pid, i & 0x3ff);
+}
+
+static const struct {
+	const char *name;
+	void (*func)(struct lego_math_bench_ctx *ctx, unsigned i);
+} lego_math_bench_funcs[] = {
+	{ "lego_sensor_ftoi",		lego_math_bench_ftoi		},
+	{ "lego_sensor_itof",		lego_math_bench_itof		},
+	{ "lego_sensor_default_scale",	lego_math_bench_default_scale	},
+	{ "tm_speed_update",		lego_math_bench_speed		},
+	{ "tm_pid_update",		lego_math_bench_pid		},
+};
+
+static int __init lego_math_bench_init(void)
+{
+	struct lego_math_bench_ctx *ctx;
+	cycles_t start_cycles, cycles;
+	ktime_t start;
+	s64 ns;
+	unsigned i, j;
+
+	if (!iterations)
+		return -EINVAL;
+
+	/* tm_speed is too big for the stack */
+	ctx = kzalloc(sizeof(*ctx), GFP_KERNEL);
+	if (!ctx)
+		return -ENOMEM;
+
+	/* 16-bit raw values scaled to another range, like many UART sensors */
+	ctx->mode_info.data_type = LEGO_SENSOR_DATA_S16;
+	ctx->mode_info.raw_max = 1023;
+	ctx->mode_info.si_max = 1000;
+
+	for (j = 0; j < ARRAY_SIZE(lego_math_bench_funcs); j++) {
+		ctx->t = ktime_get();
+		tm_speed_init(&ctx->speed, 0, ctx->t, 25);
+		tm_pid_init(&ctx->pid, 1000, 60, 0);
+		ctx->pid.setpoint = 500;
+
+		start = ktime_get();
+		start_cycles = get_cycles();
+		for (i = 0; i < iterations; i++)
+			lego_math_bench_funcs[j].func(ctx, i);
+		cycles = get_cycles() - start_cycles;
+		ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+		if (cycles)
+			pr_info("%s: %lld ns/call, %llu cycles/call\n",
+				lego_math_bench_funcs[j].name,
+				div_s64(ns, iterations),
+				div_u64(cycles, iterations));
+		else
+			pr_info("%s: %lld ns/call\n",
+				lego_math_bench_funcs[j].name,
+				div_s64(ns, iterations));
+	}
+
+	kfree(ctx);
+
+	/* there is nothing left to do, so don't stay loaded */
+	return -EAGAIN;
+}
+module_init(lego_math_bench_init);
+
+MODULE_DESCRIPTION("LEGO sensor and motor math benchmark");
+MODULE_LICENSE("GPL");
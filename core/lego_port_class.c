@@ -97,14 +97,35 @@
  *
  * In addition to the usual ``add`` and ``remove`` events, the kernel ``change``
  * event is emitted when ``mode`` or ``status`` changes.
+ *
+ * Tracing
+ * -------
+ *
+ * The ``lego`` trace system has events for the hot paths of the LEGO drivers.
+ * ``lego_port_raw_data`` is emitted each time a port passes new raw data to a
+ * sensor and ``lego_port_detect`` each time the device detection of a port
+ * changes state (the state numbers are specific to the port driver).
+ * ``lego_port_probe`` has the time from detecting a device to having it
+ * registered, which can be long for I2C sensors that need to boot. Sensors
+ * add ``lego_sensor_mode`` and ``lego_sensor_raw_data`` and tacho motors add
+ * ``tacho_motor_command``, ``tacho_motor_ramp`` and ``tm_pid_update``. They
+ * can be enabled in ``/sys/kernel/debug/tracing/events/lego/``.
  */
 
 #include <linux/err.h>
 #include <linux/delay.h>
+#include <linux/ktime.h>
 #include <linux/module.h>
+#include <linux/workqueue.h>
 
 #include <lego_port_class.h>
 
+#define CREATE_TRACE_POINTS
+#include <trace/events/lego_port.h>
+
+EXPORT_TRACEPOINT_SYMBOL_GPL(lego_port_raw_data);
+EXPORT_TRACEPOINT_SYMBOL_GPL(lego_port_detect);
+
 static ssize_t mode_show(struct device *dev, struct device_attribute *attr,
 			 char *buf)
 {
@@ -263,6 +284,51 @@ void lego_port_unregister(struct lego_port_device *port)
 }
 EXPORT_SYMBOL_GPL(lego_port_unregister);
 
+/*
+ * Registering a device after it has been detected can sleep for quite a while
+ * (e.g. waiting for an I2C sensor to boot). Ports use this unbound workqueue
+ * for that so that each port is probed on its own worker and a slow device
+ * does not hold up the others or other users of the system workqueue.
+ */
+static struct workqueue_struct *lego_port_probe_wq;
+
+/**
+ * lego_port_queue_probe - queue work that registers a device on a port
+ * @port: The port.
+ * @work: Work that registers the device. It should call lego_port_probe_done()
+ *	when it is finished.
+ *
+ * Returns false if @work was already queued. Can be called from atomic
+ * context.
+ */
+bool lego_port_queue_probe(struct lego_port_device *port,
+			   struct work_struct *work)
+{
+	port->probe_start = ktime_get();
+
+	return queue_work(lego_port_probe_wq, work);
+}
+EXPORT_SYMBOL_GPL(lego_port_queue_probe);
+
+/**
+ * lego_port_probe_done - report that a queued probe has finished
+ * @port: The port.
+ *
+ * The time since lego_port_queue_probe() is reported with the
+ * ``lego_port_probe`` trace event.
+ * Does nothing if the device was registered without queuing it first.
+ */
+void lego_port_probe_done(struct lego_port_device *port)
+{
+	if (!ktime_to_ns(port->probe_start))
+		return;
+
+	trace_lego_port_probe(port,
+		ktime_us_delta(ktime_get(), port->probe_start));
+	port->probe_start = ktime_set(0, 0);
+}
+EXPORT_SYMBOL_GPL(lego_port_probe_done);
+
 static int lego_port_dev_uevent(struct device *dev, struct kobj_uevent_env *env)
 {
 	struct lego_port_device *lego_port = to_lego_port_device(dev);
@@ -299,13 +365,24 @@ EXPORT_SYMBOL_GPL(lego_port_class);
 
 static int __init lego_port_class_init(void)
 {
-	return class_register(&lego_port_class);
+	int err;
+
+	lego_port_probe_wq = alloc_workqueue("lego-port-probe", WQ_UNBOUND, 0);
+	if (!lego_port_probe_wq)
+		return -ENOMEM;
+
+	err = class_register(&lego_port_class);
+	if (err)
+		destroy_workqueue(lego_port_probe_wq);
+
+	return err;
 }
 module_init(lego_port_class_init);
 
 static void __exit lego_port_class_exit(void)
 {
 	class_unregister(&lego_port_class);
+	destroy_workqueue(lego_port_probe_wq);
 }
 module_exit(lego_port_class_exit);
 
@@ -118,6 +118,8 @@ struct legoev3_analog_callback_info {
  * @callbacks: Callback functions for each channel. Called when data is updated.
  * @callback_tasklet: Tasklet to perform callbacks for each channel.
  * @num_connected: Number of devices connected to the input and output ports.
+ * @fast_requests: Number of users that requested fast updates, e.g. input
+ *	ports that are in the middle of detecting a newly connected device.
  * @read_nxt_color: Indicates if we should be reading NXT color data for each
  *	input port.
  * @current_nxt_color_port: Indicate the currently selected port for reading NXT
@@ -147,6 +149,7 @@ struct legoev3_analog_device {
 	struct legoev3_analog_callback_info callbacks[ADS7957_NUM_CHANNELS];
 	struct tasklet_struct callback_tasklet;
 	u8 num_connected;
+	atomic_t fast_requests;
 	bool read_nxt_color[NUM_EV3_PORT_IN];
 	enum legoev3_input_port_id current_nxt_color_port;
 	enum nxt_color_read_state current_nxt_color_read_state;
@@ -223,7 +226,7 @@ static enum hrtimer_restart legoev3_analog_timer_callback(struct hrtimer *timer)
 						NUM_NXT_COLOR_READ_STATE - 1;
 	int ret;
 
-	if (!alg->num_connected)
+	if (!alg->num_connected && !atomic_read(&alg->fast_requests))
 		alg->next_update_ns = UPDATE_SLOW_NS;
 	else if (read_color)
 		alg->next_update_ns = UPDATE_COLOR_NS;
@@ -348,6 +351,24 @@ void legoev3_analog_register_in_cb(struct legoev3_analog_device *alg,
 }
 EXPORT_SYMBOL_GPL(legoev3_analog_register_in_cb);
 
+/**
+ * legoev3_analog_request_fast_update - Temporarily update all channels faster
+ * @alg: The analog device.
+ * @fast: True to request fast updates, false to release a previous request.
+ *
+ * Calls must be balanced. The ADC is polled at the fast rate as long as there
+ * is at least one outstanding request. Can be called from atomic context.
+ */
+void legoev3_analog_request_fast_update(struct legoev3_analog_device *alg,
+					bool fast)
+{
+	if (fast)
+		atomic_inc(&alg->fast_requests);
+	else
+		atomic_dec(&alg->fast_requests);
+}
+EXPORT_SYMBOL_GPL(legoev3_analog_request_fast_update);
+
 static ssize_t legoev3_analog_show_name(struct device *dev,
 					struct device_attribute *devattr,
 					char *buf)
@@ -542,6 +563,7 @@ static int legoev3_analog_probe(struct spi_device *spi)
 	}
 	alg->pdata = spi->dev.platform_data;
 
+	atomic_set(&alg->fast_requests, 0);
 	hrtimer_init(&alg->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
 	alg->timer.function = legoev3_analog_timer_callback;
 
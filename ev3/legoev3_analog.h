@@ -39,6 +39,8 @@ extern u16 legoev3_analog_batt_curr_value(struct legoev3_analog_device *);
 extern void legoev3_analog_register_in_cb(struct legoev3_analog_device *,
 					  enum legoev3_input_port_id,
 					  legoev3_analog_cb_func_t, void *);
+extern void legoev3_analog_request_fast_update(struct legoev3_analog_device *,
+					       bool);
 
 extern struct spi_driver legoev3_analog_driver;
 
@@ -20,7 +20,7 @@
 
 extern struct lego_port_device
 *ev3_input_port_register(struct ev3_input_port_platform_data *pdata,
-			 struct device *parent);
+			 const char *preset_device, struct device *parent);
 extern void ev3_input_port_unregister(struct lego_port_device *port);
 extern struct lego_port_device
 *ev3_output_port_register(struct ev3_output_port_platform_data *pdata,
@@ -56,6 +56,16 @@
  *      - Used to prevent the output port from being loaded. This leaves the
  *        pwm device and gpios used by the port free to be controlled directly
  *        or used by other drivers.
+ *
+ *    * - ``in_port_device``
+ *      - Comma separated list of the devices that are expected on input ports
+ *        1 to 4, e.g. ``,lego-ev3-touch,,ev3-uart-host``. The driver for an
+ *        expected device is loaded immediately instead of after automatic
+ *        detection (``nxt-i2c-host`` still waits for the device to be
+ *        identified). The port is still identified in the background. If a
+ *        different device (or no device) is found, the driver is removed and
+ *        automatic detection takes over. Leave an entry empty to only use
+ *        automatic detection on that port.
  */
 
 #include <linux/device.h>
@@ -87,6 +97,10 @@ static uint disable_out_port[NUM_EV3_PORT_OUT];
 static int num_disabled_out_port;
 module_param_array(disable_out_port, uint, &num_disabled_out_port, 0);
 MODULE_PARM_DESC(disable_out_port, "Disables specified output ports. (1,2,3,4)");
+static char *in_port_device[NUM_EV3_PORT_IN];
+static int num_in_port_device;
+module_param_array(in_port_device, charp, &num_in_port_device, 0);
+MODULE_PARM_DESC(in_port_device, "Devices expected on the input ports, e.g. \",lego-ev3-touch,,ev3-uart-host\"");
 
 int legoev3_register_input_ports(struct legoev3_ports_data *ports,
 				 struct ev3_input_port_platform_data data[],
@@ -112,7 +126,10 @@ int legoev3_register_input_ports(struct legoev3_ports_data *ports,
 			continue;
 		}
 		ports->in_ports[i] =
-			ev3_input_port_register(&data[i], &ports->pdev->dev);
+			ev3_input_port_register(&data[i],
+				data[i].id < num_in_port_device
+					? in_port_device[data[i].id] : NULL,
+				&ports->pdev->dev);
 		if (IS_ERR(ports->in_ports[i])) {
 			err = PTR_ERR(ports->in_ports[i]);
 			goto err_legoev3_port_register;
@@ -27,12 +27,16 @@
 #include <linux/workqueue.h>
 #include <linux/gpio.h>
 #include <linux/i2c.h>
+#include <linux/interrupt.h>
+#include <linux/irq.h>
+#include <linux/ktime.h>
 #include <linux/platform_device.h>
 #include <linux/platform_data/legoev3.h>
 
 #include <mach/mux.h>
 
 #include <lego.h>
+#include <lego_i2c.h>
 #include <lego_port_class.h>
 
 #include "legoev3_analog.h"
@@ -45,10 +49,32 @@
 #define I2C_CLASS_LEGO (1<<31)
 #endif
 
+/*
+ * The port is polled slowly while nothing is happening. When a pin changes,
+ * we poll fast (and ask legoev3-analog to update fast too) until the new
+ * state has been stable long enough to identify the device.
+ *
+ * Contact bounce while a plug is being inserted is what requires a long
+ * stable time. When we have interrupts on the digital pins, any bounce
+ * restarts the stable time, even if it is too short to be seen by polling,
+ * so a much shorter stable time is enough. Pin 1 is only sampled by the ADC,
+ * so for EV3 sensors the spread of the pin 1 voltage during the stable time
+ * must also be within the tolerance of the ID resistors.
+ */
 #define INPUT_PORT_POLL_NS	10000000	/* 10 msec */
-#define SETTLE_CNT		2		/* 20 msec */
-#define ADD_CNT			35		/* 350 msec */
-#define REMOVE_CNT		10		/* 100 msec */
+#define INPUT_PORT_FAST_POLL_NS	1000000		/* 1 msec */
+#define SETTLE_MS		20
+#define ADD_MS			350		/* without edge interrupts */
+#define ADD_FAST_MS		30		/* with edge interrupts */
+#define REMOVE_MS		100
+#define BURST_MS		100
+
+/*
+ * NXT I2C sensors NAK while their microcontroller is booting. Wait at most
+ * this long for one of them to answer before registering the I2C adapter.
+ */
+#define I2C_BOOT_MS		1000
+#define I2C_READY_POLL_MS	20
 
 #define PIN1_NEAR_5V		4900		/* 4.90V */
 #define PIN1_NEAR_PIN2		3100		/* 3.1V */
@@ -223,6 +249,15 @@ enum gpio_index {
 	NUM_GPIO
 };
 
+/* pins that have edge interrupts while no device is connected */
+static const enum gpio_index ev3_input_port_edge_pins[] = {
+	GPIO_PIN2,
+	GPIO_PIN5,
+	GPIO_PIN6,
+};
+
+#define NUM_EDGE_PIN ARRAY_SIZE(ev3_input_port_edge_pins)
+
 enum pin5_mux_mode {
 	PIN5_MUX_MODE_I2C,
 	PIN5_MUX_MODE_UART,
@@ -245,6 +280,8 @@ enum connection_state {
 	CON_STATE_HAVE_EV3,		/* Wait for pin 1 to float */
 	CON_STATE_HAVE_I2C,		/* Wait for pin 6 to float */
 	CON_STATE_HAVE_PIN5_ERR,	/* Wait for pin 5 to float */
+	CON_STATE_VERIFY_PRESET,	/* A preset device is registered, check
+						that it is what is connected */
 	NUM_CON_STATE
 };
 
@@ -449,11 +486,21 @@ static struct device_type ev3_input_port_type = {
  * @work: Worker for registering and unregistering sensors when they are
  *	connected and disconnected.
  * @timer: Polling timer to monitor the port.
- * @timer_loop_cnt: Used to measure time in the polling loop.
+ * @state_time: Time of the last change of @con_state or, depending on the
+ *	state, of the last change of the pins.
  * @con_state: The current state of the port.
  * @pin_state_flags: Used in the polling loop to track certain changes in the
  *	state of the port's pins.
  * @pin1_mv: Used in the polling loop to track changes in pin 1 voltage.
+ * @pin1_min: Minimum pin 1 voltage since @state_time.
+ * @pin1_max: Maximum pin 1 voltage since @state_time.
+ * @pin1_sum: Sum of the pin 1 samples since @state_time.
+ * @pin1_samples: Number of pin 1 samples since @state_time.
+ * @edge_irq: Interrupts for the pins in ev3_input_port_edge_pins.
+ * @have_edge_irqs: All of @edge_irq were successfully requested.
+ * @edge_irqs_enabled: @edge_irq are currently enabled.
+ * @pin_edge: Set by the interrupt handler when one of the pins changed.
+ * @burst: Fast polling is active.
  * @sensor_type: The type of sensor currently connected.
  * @sensor_type_id: The sensor type id for EV3 sensors or -1 for NXT sensors.
  * @sensor: The sensor connected to the port
@@ -470,10 +517,19 @@ struct ev3_input_port_data {
 	struct work_struct change_uevent_work;
 	struct work_struct work;
 	struct hrtimer timer;
-	unsigned timer_loop_cnt;
+	ktime_t state_time;
 	enum connection_state con_state;
 	unsigned pin_state_flags:NUM_PIN_STATE_FLAG;
 	unsigned pin1_mv;
+	unsigned pin1_min;
+	unsigned pin1_max;
+	unsigned pin1_sum;
+	unsigned pin1_samples;
+	int edge_irq[NUM_EDGE_PIN];
+	bool have_edge_irqs;
+	bool edge_irqs_enabled;
+	bool pin_edge;
+	bool burst;
 	enum sensor_type sensor_type;
 	enum sensor_type_id sensor_type_id;
 	struct lego_device *sensor;
@@ -612,6 +668,52 @@ void ev3_input_port_float(struct ev3_input_port_data *data)
 	gpio_direction_output(data->gpio[GPIO_BUF_ENA].gpio, 1); /* active low */
 }
 
+/* The addresses that are probed by the nxt-i2c-sensor driver */
+static const unsigned short ev3_input_port_i2c_addrs[] = {
+	LEGO_I2C_SENSOR_ADDRS
+};
+
+/*
+ * Automatic detection of I2C sensors only happens once, when the adapter is
+ * registered, so the sensor has to be ready by then. Instead of waiting for
+ * the worst case boot time, register the adapter without detection first and
+ * poll the usual addresses until something answers.
+ */
+static void ev3_input_port_wait_i2c_ready(struct ev3_input_port_data *data)
+{
+	unsigned long timeout = jiffies + msecs_to_jiffies(I2C_BOOT_MS);
+	union i2c_smbus_data smbus_data;
+	struct i2c_adapter *adap;
+	int i;
+
+	if (ev3_input_port_register_i2c(data, 0) < 0) {
+		msleep(I2C_BOOT_MS);
+		return;
+	}
+
+	adap = i2c_get_adapter(data->i2c_pdev_info.id);
+	if (!adap) {
+		ev3_input_port_unregister_i2c(data);
+		msleep(I2C_BOOT_MS);
+		return;
+	}
+
+	do {
+		for (i = 0; i < ARRAY_SIZE(ev3_input_port_i2c_addrs); i++) {
+			if (i2c_smbus_xfer(adap, ev3_input_port_i2c_addrs[i], 0,
+					   I2C_SMBUS_READ, 0, I2C_SMBUS_BYTE,
+					   &smbus_data) >= 0)
+				goto ready;
+		}
+		msleep(I2C_READY_POLL_MS);
+	} while (time_before(jiffies, timeout));
+
+	dev_dbg(&data->port.dev, "No answer from I2C sensor.\n");
+ready:
+	i2c_put_adapter(adap);
+	ev3_input_port_unregister_i2c(data);
+}
+
 void ev3_input_port_register_sensor(struct work_struct *work)
 {
 	struct ev3_input_port_data *data =
@@ -638,8 +740,7 @@ void ev3_input_port_register_sensor(struct work_struct *work)
 			ev3_input_port_ev3_analog_cb, data);
 		break;
 	case SENSOR_NXT_I2C:
-		/* Give the sensor time to boot */
-		msleep(1000);
+		ev3_input_port_wait_i2c_ready(data);
 		ev3_input_port_register_i2c(data, I2C_CLASS_LEGO);
 		/*
 		 * I2C sensors are handled by the i2c stack, so we are just
@@ -664,6 +765,7 @@ void ev3_input_port_register_sensor(struct work_struct *work)
 		ev3_input_port_sensor_table[data->sensor_type_id],
 		&ev3_input_port_sensor_types[data->sensor_type],
 		&data->port, NULL, 0);
+	lego_port_probe_done(&data->port);
 	if (IS_ERR(new_sensor)) {
 		dev_err(&data->port.dev,
 			"Could not register sensor on port %s. (%ld)\n",
@@ -697,113 +799,310 @@ void ev3_input_port_change_uevent_work(struct work_struct *work)
 	kobject_uevent(&data->port.dev.kobj, KOBJ_CHANGE);
 }
 
+static irqreturn_t ev3_input_port_edge_irq(int irq, void *dev_id)
+{
+	struct ev3_input_port_data *data = dev_id;
+
+	WRITE_ONCE(data->pin_edge, true);
+
+	return IRQ_HANDLED;
+}
+
+static void ev3_input_port_enable_edge_irqs(struct ev3_input_port_data *data,
+					    bool enable)
+{
+	int i;
+
+	if (!data->have_edge_irqs || data->edge_irqs_enabled == enable)
+		return;
+
+	for (i = 0; i < NUM_EDGE_PIN; i++) {
+		if (enable)
+			enable_irq(data->edge_irq[i]);
+		else
+			disable_irq_nosync(data->edge_irq[i]);
+	}
+	data->edge_irqs_enabled = enable;
+	data->pin_edge = false;
+}
+
+static void ev3_input_port_set_burst(struct ev3_input_port_data *data,
+				     bool burst)
+{
+	if (data->burst == burst)
+		return;
+
+	data->burst = burst;
+	legoev3_analog_request_fast_update(data->analog, burst);
+}
+
+static unsigned ev3_input_port_elapsed_ms(struct ev3_input_port_data *data,
+					  ktime_t now)
+{
+	return ktime_to_ms(ktime_sub(now, data->state_time));
+}
+
+static void ev3_input_port_restart_window(struct ev3_input_port_data *data,
+					  ktime_t now)
+{
+	data->state_time = now;
+	data->pin1_min = UINT_MAX;
+	data->pin1_max = 0;
+	data->pin1_sum = 0;
+	data->pin1_samples = 0;
+}
+
+/*
+ * Samples the pins for the identification window. Returns true once they
+ * have been steady long enough, with @con_state, @sensor_type and
+ * @sensor_type_id set to what was found. @sensor_type is SENSOR_NONE when
+ * @con_state is CON_STATE_TEST_NXT_TOUCH.
+ *
+ * When verifying a preset, its driver may already be driving some of the
+ * pins. @preset says which device that is, so that those pins can be read
+ * as that device would leave them.
+ */
+static bool ev3_input_port_identify(struct ev3_input_port_data *data,
+				    ktime_t now, bool edge, unsigned add_ms,
+				    enum sensor_type_id preset,
+				    enum connection_state *con_state,
+				    enum sensor_type *sensor_type,
+				    enum sensor_type_id *sensor_type_id)
+{
+	unsigned new_pin_state_flags = 0;
+	unsigned new_pin1_mv;
+
+	new_pin1_mv = legoev3_analog_in_pin1_value(data->analog, data->id);
+	if (!gpio_get_value(data->gpio[GPIO_PIN2].gpio))
+		new_pin_state_flags |= BIT(PIN_STATE_FLAG_PIN2_LOW);
+	if (new_pin1_mv < PIN1_NEAR_5V)
+		new_pin_state_flags |= BIT(PIN_STATE_FLAG_PIN1_LOADED);
+	if (!gpio_get_value(data->gpio[GPIO_PIN5].gpio))
+		new_pin_state_flags |= BIT(PIN_STATE_FLAG_PIN5_LOW);
+	if (gpio_get_value(data->gpio[GPIO_PIN6].gpio))
+		new_pin_state_flags |= BIT(PIN_STATE_FLAG_PIN6_HIGH);
+
+	switch (preset) {
+	case SENSOR_TYPE_ID_NXT_LIGHT:
+	case SENSOR_TYPE_ID_NXT_ANALOG:
+		/* pin 5 is set by the driver for each mode */
+		new_pin_state_flags &= ~BIT(PIN_STATE_FLAG_PIN5_LOW);
+		if (new_pin_state_flags & BIT(PIN_STATE_FLAG_PIN2_LOW))
+			new_pin_state_flags |= BIT(PIN_STATE_FLAG_PIN5_LOW);
+		break;
+	case SENSOR_TYPE_ID_EV3_UART:
+		/* pins 5 and 6 are the uart */
+		new_pin_state_flags &= ~(BIT(PIN_STATE_FLAG_PIN5_LOW)
+					 | BIT(PIN_STATE_FLAG_PIN6_HIGH));
+		break;
+	default:
+		break;
+	}
+
+	if (edge || new_pin_state_flags != data->pin_state_flags) {
+		ev3_input_port_restart_window(data, now);
+		ev3_input_port_set_burst(data, true);
+	} else if (new_pin_state_flags) {
+		data->pin1_min = min(data->pin1_min, new_pin1_mv);
+		data->pin1_max = max(data->pin1_max, new_pin1_mv);
+		data->pin1_sum += new_pin1_mv;
+		data->pin1_samples++;
+	}
+	data->pin_state_flags = new_pin_state_flags;
+	/*
+	 * EV3 sensors are identified by the pin 1 voltage alone, so it
+	 * has to be steady, not just the digital pins.
+	 */
+	if (!(new_pin_state_flags & BIT(PIN_STATE_FLAG_PIN2_LOW))
+	    && data->pin1_samples
+	    && data->pin1_max - data->pin1_min > PIN1_ID_VAR)
+		ev3_input_port_restart_window(data, now);
+	if (!new_pin_state_flags || !data->pin1_samples
+	    || ev3_input_port_elapsed_ms(data, now) < add_ms
+	    || work_busy(&data->work))
+		return false;
+
+	/* use the average for identification */
+	new_pin1_mv = data->pin1_sum / data->pin1_samples;
+	*sensor_type_id = SENSOR_TYPE_ID_UNKNOWN;
+	if (new_pin_state_flags & BIT(PIN_STATE_FLAG_PIN2_LOW)) {
+		*con_state = CON_STATE_HAVE_NXT;
+		if ((~new_pin_state_flags & BIT(PIN_STATE_FLAG_PIN5_LOW))
+		    && (new_pin_state_flags & BIT(PIN_STATE_FLAG_PIN6_HIGH))) {
+			if (new_pin1_mv < PIN1_NEAR_GND) {
+				*sensor_type = SENSOR_NXT_COLOR;
+				*sensor_type_id = SENSOR_TYPE_ID_NXT_COLOR;
+			} else {
+				*sensor_type = SENSOR_NXT_I2C;
+				*sensor_type_id = SENSOR_TYPE_ID_NXT_I2C;
+			}
+		} else if (new_pin_state_flags & BIT(PIN_STATE_FLAG_PIN5_LOW)) {
+			*sensor_type = SENSOR_NXT_ANALOG;
+			if (new_pin_state_flags & BIT(PIN_STATE_FLAG_PIN6_HIGH))
+				*sensor_type_id = SENSOR_TYPE_ID_NXT_ANALOG;
+			else
+				*sensor_type_id = SENSOR_TYPE_ID_NXT_LIGHT;
+		} else if (new_pin1_mv < PIN1_NEAR_GND) {
+			*sensor_type = SENSOR_NXT_COLOR;
+			*sensor_type_id = SENSOR_TYPE_ID_NXT_COLOR;
+		} else if (new_pin1_mv > PIN1_NEAR_5V) {
+			*sensor_type = SENSOR_NXT_ANALOG;
+			*sensor_type_id = SENSOR_TYPE_ID_NXT_TOUCH;
+		} else if (new_pin1_mv > PIN1_TOUCH_LOW
+			 && new_pin1_mv < PIN1_TOUCH_HIGH) {
+			*con_state = CON_STATE_TEST_NXT_TOUCH;
+			*sensor_type = SENSOR_NONE;
+			data->pin1_mv = new_pin1_mv;
+		} else {
+			*sensor_type = SENSOR_NXT_ANALOG;
+			*sensor_type_id = SENSOR_TYPE_ID_NXT_ANALOG;
+		}
+	} else if (new_pin_state_flags & BIT(PIN_STATE_FLAG_PIN1_LOADED)) {
+		*con_state = CON_STATE_HAVE_EV3;
+		if (new_pin1_mv > PIN1_NEAR_PIN2) {
+			*sensor_type = SENSOR_ERR;
+		} else if (new_pin1_mv < PIN1_NEAR_GND) {
+			*sensor_type = SENSOR_EV3_UART;
+			*sensor_type_id = SENSOR_TYPE_ID_EV3_UART;
+		} else {
+			*sensor_type = SENSOR_EV3_ANALOG;
+			*sensor_type_id = to_ev3_analog_sensor_type_id(new_pin1_mv);
+			if (*sensor_type_id == SENSOR_TYPE_ID_UNKNOWN)
+				*sensor_type = SENSOR_ERR;
+		}
+	} else if (new_pin_state_flags & BIT(PIN_STATE_FLAG_PIN6_HIGH)) {
+		*con_state = CON_STATE_HAVE_I2C;
+		*sensor_type = SENSOR_NXT_I2C;
+		*sensor_type_id = SENSOR_TYPE_ID_NXT_I2C;
+	} else {
+		*con_state = CON_STATE_HAVE_PIN5_ERR;
+		*sensor_type = SENSOR_ERR;
+	}
+
+	return true;
+}
+
+/*
+ * Only what can be told apart while the preset driver is loaded is compared.
+ * NXT touch and generic analog sensors look the same once pin 5 is driven.
+ */
+static bool ev3_input_port_preset_matches(struct ev3_input_port_data *data,
+					  enum sensor_type sensor_type,
+					  enum sensor_type_id sensor_type_id)
+{
+	if (sensor_type != data->sensor_type)
+		return false;
+
+	switch (sensor_type) {
+	case SENSOR_NXT_ANALOG:
+		return data->sensor_type_id != SENSOR_TYPE_ID_NXT_LIGHT
+			|| sensor_type_id == SENSOR_TYPE_ID_NXT_LIGHT;
+	case SENSOR_EV3_ANALOG:
+		return sensor_type_id == data->sensor_type_id;
+	default:
+		return true;
+	}
+}
+
+static void ev3_input_port_drop_preset(struct ev3_input_port_data *data)
+{
+	if (data->sensor) {
+		INIT_WORK(&data->work, ev3_input_port_unregister_sensor);
+		schedule_work(&data->work);
+	}
+	data->con_state = CON_STATE_INIT;
+}
+
 static enum hrtimer_restart ev3_input_port_timer_callback(struct hrtimer *timer)
 {
 	struct ev3_input_port_data *data =
 			container_of(timer, struct ev3_input_port_data, timer);
 	enum sensor_type prev_sensor_type = data->sensor_type;
-	unsigned new_pin_state_flags = 0;
+	enum connection_state prev_con_state = data->con_state;
+	enum connection_state con_state;
+	enum sensor_type sensor_type;
+	enum sensor_type_id sensor_type_id;
 	unsigned new_pin1_mv = 0;
-
-	hrtimer_forward_now(timer, ktime_set(0, INPUT_PORT_POLL_NS));
-	data->timer_loop_cnt++;
+	unsigned add_ms = data->have_edge_irqs ? ADD_FAST_MS : ADD_MS;
+	ktime_t now = ktime_get();
+	bool edge = xchg(&data->pin_edge, false);
 
 	switch(data->con_state) {
 	case CON_STATE_INIT:
 		if (!data->sensor) {
 			ev3_input_port_float(data);
-			data->timer_loop_cnt = 0;
+			data->state_time = now;
 			data->sensor_type = SENSOR_NONE;
 			data->sensor_type_id = SENSOR_TYPE_ID_UNKNOWN;
 			data->con_state = CON_STATE_INIT_SETTLE;
 		}
 		break;
 	case CON_STATE_INIT_SETTLE:
-		if (data->timer_loop_cnt >= SETTLE_CNT) {
-			data->timer_loop_cnt = 0;
+		if (ev3_input_port_elapsed_ms(data, now) >= SETTLE_MS) {
+			ev3_input_port_restart_window(data, now);
+			data->pin_state_flags = 0;
 			data->con_state = CON_STATE_NO_DEV;
+			ev3_input_port_enable_edge_irqs(data, true);
 		}
 		break;
 	case CON_STATE_NO_DEV:
-		new_pin1_mv = legoev3_analog_in_pin1_value(data->analog, data->id);
-		if (!gpio_get_value(data->gpio[GPIO_PIN2].gpio))
-			new_pin_state_flags |= BIT(PIN_STATE_FLAG_PIN2_LOW);
-		if (new_pin1_mv < PIN1_NEAR_5V)
-			new_pin_state_flags |= BIT(PIN_STATE_FLAG_PIN1_LOADED);
-		if (!gpio_get_value(data->gpio[GPIO_PIN5].gpio))
-			new_pin_state_flags |= BIT(PIN_STATE_FLAG_PIN5_LOW);
-		if (gpio_get_value(data->gpio[GPIO_PIN6].gpio))
-			new_pin_state_flags |= BIT(PIN_STATE_FLAG_PIN6_HIGH);
-		if (new_pin_state_flags != data->pin_state_flags)
-			data->timer_loop_cnt = 0;
-		else if (new_pin_state_flags && data->timer_loop_cnt >= ADD_CNT
-			 && !work_busy(&data->work))
+		if (ev3_input_port_identify(data, now, edge, add_ms,
+					    SENSOR_TYPE_ID_UNKNOWN,
+					    &data->con_state, &data->sensor_type,
+					    &data->sensor_type_id))
 		{
-			if (new_pin_state_flags & BIT(PIN_STATE_FLAG_PIN2_LOW)) {
-				data->con_state = CON_STATE_HAVE_NXT;
-				if ((~new_pin_state_flags & BIT(PIN_STATE_FLAG_PIN5_LOW))
-				    && (new_pin_state_flags & BIT(PIN_STATE_FLAG_PIN6_HIGH))) {
-					if (new_pin1_mv < PIN1_NEAR_GND) {
-						data->sensor_type = SENSOR_NXT_COLOR;
-						data->sensor_type_id = SENSOR_TYPE_ID_NXT_COLOR;
-					} else {
-						data->sensor_type = SENSOR_NXT_I2C;
-						data->sensor_type_id = SENSOR_TYPE_ID_NXT_I2C;
-					}
-				} else if (new_pin_state_flags & BIT(PIN_STATE_FLAG_PIN5_LOW)) {
-					data->sensor_type = SENSOR_NXT_ANALOG;
-					if (new_pin_state_flags & BIT(PIN_STATE_FLAG_PIN6_HIGH))
-						data->sensor_type_id = SENSOR_TYPE_ID_NXT_ANALOG;
-					else
-						data->sensor_type_id = SENSOR_TYPE_ID_NXT_LIGHT;
-				} else if (new_pin1_mv < PIN1_NEAR_GND) {
-					data->sensor_type = SENSOR_NXT_COLOR;
-					data->sensor_type_id = SENSOR_TYPE_ID_NXT_COLOR;
-				} else if (new_pin1_mv > PIN1_NEAR_5V) {
-					data->sensor_type = SENSOR_NXT_ANALOG;
-					data->sensor_type_id = SENSOR_TYPE_ID_NXT_TOUCH;
-				} else if (new_pin1_mv > PIN1_TOUCH_LOW
-					 && new_pin1_mv < PIN1_TOUCH_HIGH) {
-					data->con_state = CON_STATE_TEST_NXT_TOUCH;
-					data->timer_loop_cnt = 0;
-					data->pin1_mv = new_pin1_mv;
-				} else {
-					data->sensor_type = SENSOR_NXT_ANALOG;
-					data->sensor_type_id = SENSOR_TYPE_ID_NXT_ANALOG;
-				}
-			} else if (new_pin_state_flags & BIT(PIN_STATE_FLAG_PIN1_LOADED)) {
-				data->con_state = CON_STATE_HAVE_EV3;
-				if (new_pin1_mv > PIN1_NEAR_PIN2) {
-					data->sensor_type = SENSOR_ERR;
-				} else if (new_pin1_mv < PIN1_NEAR_GND) {
-					data->sensor_type = SENSOR_EV3_UART;
-					data->sensor_type_id = SENSOR_TYPE_ID_EV3_UART;
-				} else {
-					data->sensor_type = SENSOR_EV3_ANALOG;
-					data->sensor_type_id = to_ev3_analog_sensor_type_id(new_pin1_mv);
-					if (data->sensor_type_id == SENSOR_TYPE_ID_UNKNOWN)
-						data->sensor_type = SENSOR_ERR;
+			data->state_time = now;
+			ev3_input_port_enable_edge_irqs(data, false);
+			if (data->sensor_type != SENSOR_NONE
+			    && data->sensor_type != SENSOR_ERR) {
+				INIT_WORK(&data->work, ev3_input_port_register_sensor);
+				lego_port_queue_probe(&data->port, &data->work);
+			}
+		}
+		break;
+	case CON_STATE_VERIFY_PRESET:
+		if (ev3_input_port_identify(data, now, false, ADD_MS,
+					    data->sensor_type_id, &con_state,
+					    &sensor_type, &sensor_type_id))
+		{
+			if (con_state == CON_STATE_TEST_NXT_TOUCH) {
+				con_state = CON_STATE_HAVE_NXT;
+				sensor_type = SENSOR_NXT_ANALOG;
+				sensor_type_id = SENSOR_TYPE_ID_NXT_TOUCH;
+			}
+			if (ev3_input_port_preset_matches(data, sensor_type,
+							  sensor_type_id))
+			{
+				data->con_state = con_state;
+				data->state_time = now;
+				/* i2c needs pins 5 and 6, so it waits until now */
+				if (data->sensor_type == SENSOR_NXT_I2C) {
+					INIT_WORK(&data->work,
+						  ev3_input_port_register_sensor);
+					lego_port_queue_probe(&data->port,
+							      &data->work);
 				}
-			} else if (new_pin_state_flags & BIT(PIN_STATE_FLAG_PIN6_HIGH)) {
-				data->con_state = CON_STATE_HAVE_I2C;
-				data->sensor_type = SENSOR_NXT_I2C;
-				data->sensor_type_id = SENSOR_TYPE_ID_NXT_I2C;
 			} else {
-				data->con_state = CON_STATE_HAVE_PIN5_ERR;
-				data->sensor_type = SENSOR_ERR;
-				data->sensor_type_id = SENSOR_TYPE_ID_UNKNOWN;
-			}
-			data->timer_loop_cnt = 0;
-			if (data->sensor_type != SENSOR_ERR) {
-				INIT_WORK(&data->work, ev3_input_port_register_sensor);
-				schedule_work(&data->work);
+				dev_info(&data->port.dev,
+					 "Found %s instead of preset device '%s'.\n",
+					 ev3_input_port_state_names[sensor_type],
+					 ev3_input_port_sensor_table[data->sensor_type_id]);
+				ev3_input_port_drop_preset(data);
 			}
+		} else if (!data->pin_state_flags
+			   && ev3_input_port_elapsed_ms(data, now) >= REMOVE_MS
+			   && !work_busy(&data->work))
+		{
+			dev_info(&data->port.dev,
+				 "Preset device '%s' is not connected.\n",
+				 ev3_input_port_sensor_table[data->sensor_type_id]);
+			ev3_input_port_drop_preset(data);
 		}
-		data->pin_state_flags = new_pin_state_flags;
 		break;
 	case CON_STATE_TEST_NXT_TOUCH:
-		if (data->timer_loop_cnt >= SETTLE_CNT) {
+		if (ev3_input_port_elapsed_ms(data, now) >= SETTLE_MS) {
 			data->con_state = CON_STATE_HAVE_NXT;
+			data->state_time = now;
 			data->sensor_type = SENSOR_NXT_ANALOG;
 			new_pin1_mv = legoev3_analog_in_pin1_value(data->analog, data->id);
 			if (new_pin1_mv > (data->pin1_mv - PIN1_TOUCH_VAR) &&
@@ -811,24 +1110,30 @@ static enum hrtimer_restart ev3_input_port_timer_callback(struct hrtimer *timer)
 				data->sensor_type_id = SENSOR_TYPE_ID_NXT_TOUCH;
 			else
 				data->sensor_type_id = SENSOR_TYPE_ID_NXT_ANALOG;
+			INIT_WORK(&data->work, ev3_input_port_register_sensor);
+			lego_port_queue_probe(&data->port, &data->work);
 		}
 		break;
 	case CON_STATE_HAVE_NXT:
 		if (!gpio_get_value(data->gpio[GPIO_PIN2].gpio))
-			data->timer_loop_cnt = 0;
+			data->state_time = now;
 		break;
 	case CON_STATE_HAVE_EV3:
 		new_pin1_mv = legoev3_analog_in_pin1_value(data->analog, data->id);
-		if (new_pin1_mv < PIN1_NEAR_5V)
-			data->timer_loop_cnt = 0;
+		/* an EV3 analog sensor with a different ID counts as removed */
+		if (new_pin1_mv < PIN1_NEAR_5V
+		    && (data->sensor_type != SENSOR_EV3_ANALOG
+			|| to_ev3_analog_sensor_type_id(new_pin1_mv)
+			   == data->sensor_type_id))
+			data->state_time = now;
 		break;
 	case CON_STATE_HAVE_I2C:
 		if (gpio_get_value(data->gpio[GPIO_PIN6].gpio))
-			data->timer_loop_cnt = 0;
+			data->state_time = now;
 		break;
 	case CON_STATE_HAVE_PIN5_ERR:
 		if (!gpio_get_value(data->gpio[GPIO_PIN5].gpio))
-			data->timer_loop_cnt = 0;
+			data->state_time = now;
 		break;
 	default:
 		data->con_state = CON_STATE_INIT;
@@ -842,7 +1147,9 @@ static enum hrtimer_restart ev3_input_port_timer_callback(struct hrtimer *timer)
 		schedule_work(&data->change_uevent_work);
 
 	if (data->sensor_type != SENSOR_NONE
-	    && data->timer_loop_cnt >= REMOVE_CNT && !work_busy(&data->work))
+	    && data->con_state != CON_STATE_VERIFY_PRESET
+	    && ev3_input_port_elapsed_ms(data, now) >= REMOVE_MS
+	    && !work_busy(&data->work))
 	{
 		if (data->sensor) {
 			INIT_WORK(&data->work, ev3_input_port_unregister_sensor);
@@ -851,9 +1158,80 @@ static enum hrtimer_restart ev3_input_port_timer_callback(struct hrtimer *timer)
 		data->con_state = CON_STATE_INIT;
 	}
 
+	/*
+	 * Keep polling fast while identifying a device and for a while after
+	 * the pins went back to idle in case something is still wiggling.
+	 */
+	if (data->con_state != CON_STATE_TEST_NXT_TOUCH
+	    && ((data->con_state != CON_STATE_NO_DEV
+		 && data->con_state != CON_STATE_VERIFY_PRESET)
+		|| (!data->pin_state_flags
+		    && ev3_input_port_elapsed_ms(data, now) >= BURST_MS)))
+		ev3_input_port_set_burst(data, false);
+
+	hrtimer_forward_now(timer, ktime_set(0, data->burst ?
+			INPUT_PORT_FAST_POLL_NS : INPUT_PORT_POLL_NS));
+
+	if (prev_con_state != data->con_state)
+		trace_lego_port_detect(&data->port, prev_con_state,
+				       data->con_state);
+
 	return HRTIMER_RESTART;
 }
 
+/*
+ * Registers the given device right away, as if it had just been detected.
+ * The polling loop still runs the identification window in the background
+ * and compares the result with the preset. If another device (or nothing) is
+ * connected, the preset device is unregistered and normal detection takes
+ * over. NXT I2C is only registered once it has been confirmed, because the
+ * i2c bus needs pins 5 and 6.
+ */
+static void ev3_input_port_preset(struct ev3_input_port_data *data,
+				  const char *device_name)
+{
+	enum sensor_type_id id;
+
+	for (id = 0; id < SENSOR_TYPE_ID_UNKNOWN; id++) {
+		if (!strcmp(ev3_input_port_sensor_table[id], device_name))
+			break;
+	}
+
+	switch (id) {
+	case SENSOR_TYPE_ID_NXT_TOUCH:
+	case SENSOR_TYPE_ID_NXT_LIGHT:
+	case SENSOR_TYPE_ID_NXT_ANALOG:
+		data->sensor_type = SENSOR_NXT_ANALOG;
+		break;
+	case SENSOR_TYPE_ID_NXT_COLOR:
+		data->sensor_type = SENSOR_NXT_COLOR;
+		break;
+	case SENSOR_TYPE_ID_NXT_I2C:
+		data->sensor_type = SENSOR_NXT_I2C;
+		break;
+	case SENSOR_TYPE_ID_EV3_UART:
+		data->sensor_type = SENSOR_EV3_UART;
+		break;
+	case SENSOR_TYPE_ID_UNKNOWN:
+		dev_warn(&data->port.dev, "Unknown preset device '%s'.\n",
+			 device_name);
+		return;
+	default:
+		data->sensor_type = SENSOR_EV3_ANALOG;
+		break;
+	}
+
+	ev3_input_port_float(data);
+	data->sensor_type_id = id;
+	data->con_state = CON_STATE_VERIFY_PRESET;
+	ev3_input_port_restart_window(data, ktime_get());
+	data->pin_state_flags = 0;
+	if (data->sensor_type != SENSOR_NXT_I2C) {
+		INIT_WORK(&data->work, ev3_input_port_register_sensor);
+		lego_port_queue_probe(&data->port, &data->work);
+	}
+}
+
 /* TODO: This should be hwmon maybe? Dynamic attributes cause problems */
 
 static ssize_t pin1_mv_show(struct device *dev, struct device_attribute *attr,
@@ -926,6 +1304,8 @@ static int ev3_input_port_set_mode(void *context, u8 mode)
 	 */
 
 	hrtimer_cancel(&data->timer);
+	ev3_input_port_enable_edge_irqs(data, false);
+	ev3_input_port_set_burst(data, false);
 	cancel_work_sync(&data->work);
 
 	if (data->port.mode == EV3_INPUT_PORT_MODE_OTHER_I2C) {
@@ -1030,10 +1410,10 @@ static const char *ev3_input_port_get_status(void *context)
 
 struct lego_port_device
 *ev3_input_port_register(struct ev3_input_port_platform_data *pdata,
-			 struct device *parent)
+			 const char *preset_device, struct device *parent)
 {
 	struct ev3_input_port_data *data;
-	int err;
+	int i, irq, err;
 
 	if (WARN(!pdata, "Platform data is required."))
 		return ERR_PTR(-EINVAL);
@@ -1110,10 +1490,37 @@ struct lego_port_device
 
 	INIT_WORK(&data->change_uevent_work, ev3_input_port_change_uevent_work);
 	INIT_WORK(&data->work, NULL);
+
+	/*
+	 * Edge interrupts are optional, we just need a longer stable time to
+	 * detect devices without them.
+	 */
+	for (i = 0; i < NUM_EDGE_PIN; i++) {
+		irq = gpio_to_irq(data->gpio[ev3_input_port_edge_pins[i]].gpio);
+		if (irq < 0)
+			break;
+		irq_set_status_flags(irq, IRQ_NOAUTOEN);
+		err = request_irq(irq, ev3_input_port_edge_irq,
+				  IRQF_TRIGGER_RISING | IRQF_TRIGGER_FALLING,
+				  dev_name(&data->port.dev), data);
+		if (err < 0)
+			break;
+		data->edge_irq[i] = irq;
+	}
+	if (i < NUM_EDGE_PIN) {
+		dev_warn(&data->port.dev, "Edge interrupts not available.\n");
+		while (i--)
+			free_irq(data->edge_irq[i], data);
+	} else {
+		data->have_edge_irqs = true;
+	}
+
 	hrtimer_init(&data->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
 	data->timer.function = ev3_input_port_timer_callback;
 
 	data->con_state = CON_STATE_INIT;
+	if (preset_device && *preset_device)
+		ev3_input_port_preset(data, preset_device);
 	hrtimer_start(&data->timer, ktime_set(0, INPUT_PORT_POLL_NS),
 		      HRTIMER_MODE_REL);
 
@@ -1132,6 +1539,7 @@ err_request_legoev3_analog:
 void ev3_input_port_unregister(struct lego_port_device *port)
 {
 	struct ev3_input_port_data *data;
+	int i;
 
 	/* port can be null if disabled via module parameter */
 	if (!port)
@@ -1140,6 +1548,12 @@ void ev3_input_port_unregister(struct lego_port_device *port)
 	data =container_of(port, struct ev3_input_port_data, port);
 
 	hrtimer_cancel(&data->timer);
+	ev3_input_port_enable_edge_irqs(data, false);
+	ev3_input_port_set_burst(data, false);
+	if (data->have_edge_irqs) {
+		for (i = 0; i < NUM_EDGE_PIN; i++)
+			free_irq(data->edge_irq[i], data);
+	}
 	cancel_work_sync(&data->change_uevent_work);
 	cancel_work_sync(&data->work);
 	if (port->mode == EV3_INPUT_PORT_MODE_OTHER_UART)
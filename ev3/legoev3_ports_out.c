@@ -395,6 +395,7 @@ void ev3_output_port_register_motor(struct work_struct *work)
 	motor = lego_device_register(driver_name,
 		&ev3_motor_device_types[data->motor_type],
 		&data->out_port, &pdata, sizeof(struct ev3_motor_platform_data));
+	lego_port_probe_done(&data->out_port);
 	if (IS_ERR(motor)) {
 		dev_err(&data->out_port.dev,
 			"Could not register motor on port %s.\n",
@@ -422,6 +423,7 @@ static enum hrtimer_restart ev3_output_port_timer_callback(struct hrtimer *timer
 	struct ev3_output_port_data *data =
 			container_of(timer, struct ev3_output_port_data, timer);
 	enum motor_type prev_motor_type = data->motor_type;
+	enum connection_state prev_con_state = data->con_state;
 	unsigned new_pin_state_flags = 0;
 	unsigned new_pin5_mv = 0;
 
@@ -567,7 +569,7 @@ static enum hrtimer_restart ev3_output_port_timer_callback(struct hrtimer *timer
 		data->timer_loop_cnt = 0;
 		if (data->motor_type != MOTOR_ERR && !work_busy(&data->work)) {
 			INIT_WORK(&data->work, ev3_output_port_register_motor);
-			schedule_work(&data->work);
+			lego_port_queue_probe(&data->out_port, &data->work);
 			data->con_state = CON_STATE_WAITING_FOR_DISCONNECT;
 		}
 		break;
@@ -596,6 +598,10 @@ static enum hrtimer_restart ev3_output_port_timer_callback(struct hrtimer *timer
 	if (prev_motor_type != data->motor_type)
 		schedule_work(&data->change_uevent_work);
 
+	if (prev_con_state != data->con_state)
+		trace_lego_port_detect(&data->out_port, prev_con_state,
+				       data->con_state);
+
 	return HRTIMER_RESTART;
 }
 
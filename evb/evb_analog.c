@@ -18,6 +18,11 @@
  * This framework consists of a timer loop to poll the analog/digital converter
  * and functions to access the data that is recorded.
  *
+ * All enabled channels are scanned every 10 msec. by default. The period can
+ * be set with the ``ev3dev,scan-period-ms`` device tree property or at runtime
+ * with the IIO ``sampling_frequency`` attribute (1 to 1000 Hz). The most
+ * recent scan can also be captured with an IIO triggered buffer.
+ *
  * Acknowledgments:
  *
  * This file is based on:
@@ -32,16 +37,23 @@
  * -----------------------------------------------------------------------------
  */
 
+#include <linux/bitops.h>
 #include <linux/device.h>
 #include <linux/err.h>
 #include <linux/hrtimer.h>
+#include <linux/iio/buffer.h>
+#include <linux/iio/iio.h>
+#include <linux/iio/trigger_consumer.h>
+#include <linux/iio/triggered_buffer.h>
 #include <linux/init.h>
 #include <linux/interrupt.h>
 #include <linux/module.h>
 #include <linux/of.h>
 #include <linux/slab.h>
 #include <linux/spi/spi.h>
+#include <linux/spinlock.h>
 #include <linux/types.h>
+#include <linux/wait.h>
 
 #include "evb_analog.h"
 
@@ -61,6 +73,8 @@
 #define ADS7957_MODE_AUTO1	0x2
 #define ADS7957_PROG_ENA	0x1
 #define ADS7957_RANGE_5V	0x1
+/* The data received in a frame is for the channel sent two frames earlier */
+#define ADS7957_PIPELINE_DEPTH	2
 
 #define ADS7957_COMMAND_MANUAL(channel) \
 	((ADS7957_MODE_MANUAL	<< 12) |	\
@@ -73,6 +87,11 @@
 	 (ADS7957_PROG_ENA	<< 11) |	\
 	 (ADS7957_RANGE_5V	<< 6))
 
+#define EVB_ANALOG_MAX_FRAMES	(ADS7957_NUM_CHANNELS + ADS7957_PIPELINE_DEPTH)
+#define EVB_ANALOG_DEFAULT_PERIOD_MS	10
+#define EVB_ANALOG_MIN_PERIOD_MS	1
+#define EVB_ANALOG_MAX_PERIOD_MS	1000
+
 /**
  * struct evb_analog_channel_data - Per channel data.
  *
@@ -88,82 +107,106 @@ struct evb_analog_channel_data {
  * struct evb_analog_data - TI ADS7957 analog/digital converter
  * @name: Name of this device.
  * @spi: SPI device that communicates the the ADC chip.
- * @timer: Timer used to poll the ADC.
- * @callback_tasklet: Tasklet to perform callbacks for each channel.
- * @tx_buf: Transmit buffer.
- * @rx_buf: Receive buffer.
- * @transfer: SPI transfer.
- * @msg: SPI message that reads only one channel of the ADC.
+ * @iio: The IIO device for buffered access.
+ * @timer: Timer used to start each scan.
+ * @callback_tasklet: Tasklet to decode a scan and perform callbacks for each
+ *	channel.
+ * @tx_buf: Transmit buffer, one command per frame.
+ * @rx_buf: Receive buffer, one result per frame.
+ * @transfers: SPI transfers, one per frame.
+ * @msg: SPI message that scans all enabled channels.
+ * @num_frames: The number of transfers in @msg.
  * @ch_data: Channel specific data for each channel.
  * @raw_data: Buffer to hold the raw (unscaled) input from the ADC for each
- *	channel.
- * @tx_channel: The currently active transmit channel or CHANNEL_NONE.
- * @rx_channel: The currently active receive channel or CHANNEL_NONE.
+ *	channel from the most recent scan.
+ * @scan: Buffer for pushing data to the IIO buffer.
+ * @scan_time: Timestamp of the most recent scan.
+ * @scan_start: Timestamp of the scan that is in progress.
+ * @lock: Protects @ch_data, @raw_data and @scan_time.
+ * @idle_wait: Wait queue for waiting for @msg_busy to be cleared.
+ * @enabled_channels: Bitmask of the channels that are scanned.
+ * @period_ms: The scan period in milliseconds.
+ * @overruns: The number of periods skipped because the previous scan was
+ *	not finished yet.
+ * @msg_busy: A scan is in progress.
+ * @stopping: Flag to prevent starting new scans when removing the driver.
+ *
+ * The timer starts a scan every @period_ms by sending one SPI message
+ * containing one frame for each enabled channel, plus two extra frames to
+ * flush the ADC pipeline. This way the whole scan happens in one spi_async()
+ * call instead of one timer tick per channel.
  */
 struct evb_analog_data {
 	const char			*name;
 	struct spi_device		*spi;
+	struct iio_dev			*iio;
 	struct				hrtimer timer;
 	struct tasklet_struct		callback_tasklet;
-	u16				tx_buf[1];
-	u16				rx_buf[1];
-	struct spi_transfer		transfer;
+	u16				tx_buf[EVB_ANALOG_MAX_FRAMES];
+	u16				rx_buf[EVB_ANALOG_MAX_FRAMES];
+	struct spi_transfer		transfers[EVB_ANALOG_MAX_FRAMES];
 	struct spi_message		msg;
+	unsigned			num_frames;
 	struct evb_analog_channel_data	ch_data[ADS7957_NUM_CHANNELS];
 	u16				raw_data[ADS7957_NUM_CHANNELS];
+	/* channels + padding + 64-bit timestamp */
+	u16				scan[ADS7957_NUM_CHANNELS + 4] __aligned(8);
+	s64				scan_time;
+	s64				scan_start;
+	spinlock_t			lock;
+	wait_queue_head_t		idle_wait;
 	unsigned			enabled_channels;
 #define ENABLED_CHANNEL_MASK ((1 << ADS7957_NUM_CHANNELS) - 1)
-	u8				next_channel;
+	unsigned			period_ms;
+	unsigned			overruns;
 	bool				msg_busy;
-#define CHANNEL_NONE (-1)
+	bool				stopping;
 };
 
-static inline void evb_analog_next_channel(struct evb_analog_data *data)
-{
-	if (unlikely(!(data->enabled_channels & ENABLED_CHANNEL_MASK)))
-		return;
-
-	do {
-		data->next_channel++;
-		if (data->next_channel >= ADS7957_NUM_CHANNELS)
-			data->next_channel = 0;
-	} while (!(BIT(data->next_channel) & data->enabled_channels));
-}
-
 static void evb_analog_tasklet_func(unsigned long _data)
 {
 	struct evb_analog_data *data = (void *)_data;
-	struct evb_analog_channel_data *ch_data;
-	u16 val, channel;
-printk("%s\n", __func__);
-	/* The data received is for the channel sent two messages ago */
-	channel = data->rx_buf[0] >> 12;
-	if (channel >= ADS7957_NUM_CHANNELS)
-		return;
+	struct evb_analog_channel_data ch_data[ADS7957_NUM_CHANNELS];
+	unsigned long updated = 0;
+	unsigned long flags;
+	int i, channel;
 
-	val = (data->rx_buf[0] >> (12 - ADS7957_RESOLUTION))
-	      & ADS7957_VALUE_MASK;
-	data->raw_data[channel] = val;
-printk("received ch %u: %u\n", channel, val);
-	ch_data = &data->ch_data[channel];
-	if (ch_data->callback)
-		ch_data->callback(ch_data->context);
+	if (data->msg.status) {
+		dev_err_ratelimited(&data->spi->dev, "%s: spi async fail %d\n",
+				    __func__, data->msg.status);
+		goto out;
+	}
+
+	spin_lock_irqsave(&data->lock, flags);
+	for (i = ADS7957_PIPELINE_DEPTH; i < data->num_frames; i++) {
+		u16 rx = data->rx_buf[i];
+
+		channel = rx >> 12;
+		if (channel >= ADS7957_NUM_CHANNELS)
+			continue;
 
-	data->msg_busy = false;
+		data->raw_data[channel] = (rx >> (12 - ADS7957_RESOLUTION))
+					  & ADS7957_VALUE_MASK;
+		updated |= BIT(channel);
+	}
+	data->scan_time = data->scan_start;
+	memcpy(ch_data, data->ch_data, sizeof(ch_data));
+	spin_unlock_irqrestore(&data->lock, flags);
+
+	for_each_set_bit(channel, &updated, ADS7957_NUM_CHANNELS) {
+		if (ch_data[channel].callback)
+			ch_data[channel].callback(ch_data[channel].context);
+	}
+
+out:
+	WRITE_ONCE(data->msg_busy, false);
+	wake_up(&data->idle_wait);
 }
 
 static void evb_analog_msg_complete(void *context)
 {
 	struct evb_analog_data *data = context;
 
-	if (data->msg.status) {
-		dev_err(&data->spi->dev, "%s: spi async fail %d\n", __func__,
-			data->msg.status);
-		hrtimer_cancel(&data->timer);
-
-		return;
-	}
-
 	tasklet_schedule(&data->callback_tasklet);
 }
 
@@ -174,27 +217,67 @@ static enum hrtimer_restart evb_analog_timer_callback(struct hrtimer *timer)
 	struct spi_device *spi = data->spi;
 	int ret;
 
-	hrtimer_forward_now(timer, ktime_set(1, 10000000)); /* 10 ms */
+	if (unlikely(data->stopping))
+		return HRTIMER_NORESTART;
+
+	hrtimer_forward_now(timer, ms_to_ktime(READ_ONCE(data->period_ms)));
 
 	/* If we are still processing the data from last time... */
-	if (data->msg_busy)
+	if (READ_ONCE(data->msg_busy)) {
+		data->overruns++;
 		return HRTIMER_RESTART;
+	}
 
-	printk("requesting ch %u\n", data->next_channel);
-	data->tx_buf[0] = ADS7957_COMMAND_MANUAL(data->next_channel);
+	data->msg_busy = true;
+	data->scan_start = iio_get_time_ns(data->iio);
 	ret = spi_async(spi, &data->msg);
 	if (ret < 0) {
 		dev_err(&spi->dev, "%s: spi async fail %d\n", __func__, ret);
+		data->msg_busy = false;
+		wake_up(&data->idle_wait);
 
 		return HRTIMER_NORESTART;
 	}
 
-	data->msg_busy = true;
-	evb_analog_next_channel(data);
-
 	return HRTIMER_RESTART;
 }
 
+/*
+ * Builds the scan message. Each frame needs its own chip select pulse, so
+ * every transfer except the last one has cs_change set. The last frames just
+ * repeat the last command to flush the results out of the ADC pipeline.
+ */
+static void evb_analog_init_scan(struct evb_analog_data *data)
+{
+	int i, n = 0, channel = 0;
+
+	spi_message_init(&data->msg);
+
+	for_each_set_bit(i, (unsigned long *)&data->enabled_channels,
+			 ADS7957_NUM_CHANNELS) {
+		channel = i;
+		data->tx_buf[n++] = ADS7957_COMMAND_MANUAL(channel);
+	}
+	for (i = 0; i < ADS7957_PIPELINE_DEPTH; i++)
+		data->tx_buf[n++] = ADS7957_COMMAND_MANUAL(channel);
+
+	for (i = 0; i < n; i++) {
+		struct spi_transfer *xfer = &data->transfers[i];
+
+		memset(xfer, 0, sizeof(*xfer));
+		xfer->tx_buf = &data->tx_buf[i];
+		xfer->rx_buf = &data->rx_buf[i];
+		xfer->bits_per_word = 16;
+		xfer->len = 2;
+		xfer->cs_change = i < n - 1;
+		spi_message_add_tail(xfer, &data->msg);
+	}
+	data->num_frames = n;
+
+	data->msg.complete = evb_analog_msg_complete;
+	data->msg.context = data;
+}
+
 int evb_analog_get_value_for_ch(struct evb_analog_data *data, u8 ch, u16 *val)
 {
 	int new_val;
@@ -205,7 +288,7 @@ int evb_analog_get_value_for_ch(struct evb_analog_data *data, u8 ch, u16 *val)
 			 __func__, ch, ADS7957_NUM_CHANNELS);
 		return -EINVAL;
 	}
-	new_val = data->raw_data[ch];
+	new_val = READ_ONCE(data->raw_data[ch]);
 	*val = new_val * ADS7957_LSB_UV / 1000;
 
 	return 0;
@@ -217,6 +300,8 @@ void evb_analog_register_cb_for_ch(struct evb_analog_data *data,
 				   evb_analog_cb_func_t function,
 				   void *context)
 {
+	unsigned long flags;
+
 	if (channel >= ADS7957_NUM_CHANNELS) {
 		dev_crit(&data->spi->dev,
 			 "%s: channel id %d >= available channels (%d)\n",
@@ -224,11 +309,130 @@ void evb_analog_register_cb_for_ch(struct evb_analog_data *data,
 		return;
 	}
 
+	spin_lock_irqsave(&data->lock, flags);
 	data->ch_data[channel].callback = function;
 	data->ch_data[channel].context = context;
+	spin_unlock_irqrestore(&data->lock, flags);
 }
 EXPORT_SYMBOL_GPL(evb_analog_register_cb_for_ch);
 
+static int evb_analog_read_raw(struct iio_dev *iio,
+			       struct iio_chan_spec const *chan,
+			       int *val, int *val2, long mask)
+{
+	struct evb_analog_data *data = iio_priv(iio);
+
+	switch (mask) {
+	case IIO_CHAN_INFO_RAW:
+		if (!(data->enabled_channels & BIT(chan->channel)))
+			return -EINVAL;
+		*val = READ_ONCE(data->raw_data[chan->channel]);
+		return IIO_VAL_INT;
+	case IIO_CHAN_INFO_SCALE:
+		/* millivolts */
+		*val = 2 * ADS7957_REF_UV / 1000;
+		*val2 = ADS7957_VALUE_MASK;
+		return IIO_VAL_FRACTIONAL;
+	case IIO_CHAN_INFO_SAMP_FREQ:
+		*val = 1000;
+		*val2 = READ_ONCE(data->period_ms);
+		return IIO_VAL_FRACTIONAL;
+	}
+
+	return -EINVAL;
+}
+
+static int evb_analog_write_raw(struct iio_dev *iio,
+				struct iio_chan_spec const *chan,
+				int val, int val2, long mask)
+{
+	struct evb_analog_data *data = iio_priv(iio);
+
+	switch (mask) {
+	case IIO_CHAN_INFO_SAMP_FREQ:
+		if (val <= 0)
+			return -EINVAL;
+		WRITE_ONCE(data->period_ms,
+			   clamp_t(unsigned, 1000 / val,
+				   EVB_ANALOG_MIN_PERIOD_MS,
+				   EVB_ANALOG_MAX_PERIOD_MS));
+		return 0;
+	}
+
+	return -EINVAL;
+}
+
+/*
+ * The trigger handler does not talk to the ADC. It pushes the most recent
+ * scan, which is at most one scan period old, so any trigger can be used
+ * without adding SPI traffic.
+ */
+static irqreturn_t evb_analog_trigger_handler(int irq, void *p)
+{
+	struct iio_poll_func *pf = p;
+	struct iio_dev *iio = pf->indio_dev;
+	struct evb_analog_data *data = iio_priv(iio);
+	unsigned long flags;
+	s64 time;
+	int i, j = 0;
+
+	spin_lock_irqsave(&data->lock, flags);
+	for_each_set_bit(i, iio->active_scan_mask, ADS7957_NUM_CHANNELS)
+		data->scan[j++] = data->raw_data[i];
+	time = data->scan_time;
+	spin_unlock_irqrestore(&data->lock, flags);
+
+	iio_push_to_buffers_with_timestamp(iio, data->scan, time);
+
+	iio_trigger_notify_done(iio->trig);
+
+	return IRQ_HANDLED;
+}
+
+#define EVB_ANALOG_V_CHAN(index)				\
+{								\
+	.type = IIO_VOLTAGE,					\
+	.indexed = 1,						\
+	.channel = index,					\
+	.info_mask_separate = BIT(IIO_CHAN_INFO_RAW),		\
+	.info_mask_shared_by_type = BIT(IIO_CHAN_INFO_SCALE),	\
+	.info_mask_shared_by_all = BIT(IIO_CHAN_INFO_SAMP_FREQ),\
+	.datasheet_name = "CH"__stringify(index),		\
+	.scan_index = index,					\
+	.scan_type = {						\
+		.sign = 'u',					\
+		.realbits = ADS7957_RESOLUTION,			\
+		.storagebits = 16,				\
+		.endianness = IIO_CPU,				\
+	},							\
+}
+
+static const struct iio_chan_spec evb_analog_channels[] = {
+	EVB_ANALOG_V_CHAN(0),
+	EVB_ANALOG_V_CHAN(1),
+	EVB_ANALOG_V_CHAN(2),
+	EVB_ANALOG_V_CHAN(3),
+	EVB_ANALOG_V_CHAN(4),
+	EVB_ANALOG_V_CHAN(5),
+	EVB_ANALOG_V_CHAN(6),
+	EVB_ANALOG_V_CHAN(7),
+	EVB_ANALOG_V_CHAN(8),
+	EVB_ANALOG_V_CHAN(9),
+	EVB_ANALOG_V_CHAN(10),
+	EVB_ANALOG_V_CHAN(11),
+	EVB_ANALOG_V_CHAN(12),
+	EVB_ANALOG_V_CHAN(13),
+	EVB_ANALOG_V_CHAN(14),
+	EVB_ANALOG_V_CHAN(15),
+	IIO_CHAN_SOFT_TIMESTAMP(16),
+};
+
+static const struct iio_info evb_analog_iio_info = {
+	.driver_module = THIS_MODULE,
+	.read_raw = &evb_analog_read_raw,
+	.write_raw = &evb_analog_write_raw,
+};
+
 static void evb_analog_parse_dt(struct evb_analog_data *data)
 {
 	struct device_node *node = data->spi->dev.of_node;
@@ -247,33 +451,37 @@ static void evb_analog_parse_dt(struct evb_analog_data *data)
 		}
 		data->enabled_channels |= BIT(value);
 	}
+
+	if (!of_property_read_u32(node, "ev3dev,scan-period-ms", &value))
+		data->period_ms = clamp_t(unsigned, value,
+					  EVB_ANALOG_MIN_PERIOD_MS,
+					  EVB_ANALOG_MAX_PERIOD_MS);
 }
 
 static int evb_analog_probe(struct spi_device *spi)
 {
 	struct evb_analog_data *data;
+	struct iio_dev *iio;
+	int ret;
 
-	data = devm_kzalloc(&spi->dev, sizeof(*data), GFP_KERNEL);
-	if (!data)
+	iio = devm_iio_device_alloc(&spi->dev, sizeof(*data));
+	if (!iio)
 		return -ENOMEM;
 
+	data = iio_priv(iio);
 	spi_set_drvdata(spi, data);
 	data->spi = spi;
+	data->iio = iio;
+	data->period_ms = EVB_ANALOG_DEFAULT_PERIOD_MS;
+	spin_lock_init(&data->lock);
+	init_waitqueue_head(&data->idle_wait);
 	evb_analog_parse_dt(data);
 
 	/* If it wasn't set in device tree */
 	if (!data->enabled_channels)
 		data->enabled_channels = ENABLED_CHANNEL_MASK;
-	/* move to first enabled channel */
-	data->next_channel = ADS7957_NUM_CHANNELS - 1;
-	evb_analog_next_channel(data);
 
-	spi_message_init(&data->msg);
-	data->transfer.tx_buf = &data->tx_buf;
-	data->transfer.rx_buf = &data->rx_buf;
-	data->transfer.bits_per_word = 16;
-	data->transfer.len = 2;
-	spi_message_add_tail(&data->transfer, &data->msg);
+	evb_analog_init_scan(data);
 
 	tasklet_init(&data->callback_tasklet, evb_analog_tasklet_func,
 		     (unsigned long)data);
@@ -281,22 +489,32 @@ static int evb_analog_probe(struct spi_device *spi)
 	hrtimer_init(&data->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
 	data->timer.function = evb_analog_timer_callback;
 
-	/*
-	 * Run two messages so that we actually have valid rx data in the
-	 * first message initiated by the timer callback.
-	 */
-	data->tx_buf[0] = ADS7957_COMMAND_MANUAL(data->next_channel);
-	spi_sync(spi, &data->msg);
-	evb_analog_next_channel(data);
-	data->tx_buf[0] = ADS7957_COMMAND_MANUAL(data->next_channel);
-	spi_sync(spi, &data->msg);
-	evb_analog_next_channel(data);
-
-	data->msg.complete = evb_analog_msg_complete;
-	data->msg.context = data;
+	iio->name = DRVNAME;
+	iio->dev.parent = &spi->dev;
+	iio->modes = INDIO_DIRECT_MODE;
+	iio->channels = evb_analog_channels;
+	iio->num_channels = ARRAY_SIZE(evb_analog_channels);
+	iio->info = &evb_analog_iio_info;
+
+	ret = devm_iio_triggered_buffer_setup(&spi->dev, iio, NULL,
+					      evb_analog_trigger_handler, NULL);
+	if (ret) {
+		dev_err(&spi->dev, "Failed to setup triggered buffer.\n");
+		return ret;
+	}
 
 	hrtimer_start(&data->timer, ktime_set(0, 0), HRTIMER_MODE_REL);
 
+	ret = iio_device_register(iio);
+	if (ret) {
+		dev_err(&spi->dev, "Failed to register iio device.\n");
+		data->stopping = true;
+		hrtimer_cancel(&data->timer);
+		wait_event(data->idle_wait, !READ_ONCE(data->msg_busy));
+		tasklet_kill(&data->callback_tasklet);
+		return ret;
+	}
+
 	return 0;
 }
 
@@ -304,7 +522,10 @@ static int evb_analog_remove(struct spi_device *spi)
 {
 	struct evb_analog_data *data = spi_get_drvdata(spi);
 
+	iio_device_unregister(data->iio);
+	data->stopping = true;
 	hrtimer_cancel(&data->timer);
+	wait_event(data->idle_wait, !READ_ONCE(data->msg_busy));
 	tasklet_kill(&data->callback_tasklet);
 	spi_set_drvdata(data->spi, NULL);
 
@@ -656,6 +656,7 @@ void evb_input_port_register_sensor(struct work_struct *work)
 		evb_input_port_sensor_table[data->sensor_type_id],
 		&evb_input_port_sensor_types[data->sensor_type],
 		&data->port, NULL, 0);
+	lego_port_probe_done(&data->port);
 	if (IS_ERR(new_sensor)) {
 		dev_err(&data->port.dev,
 			"Could not register sensor on port %s. (%ld)\n",
@@ -694,6 +695,7 @@ static enum hrtimer_restart evb_input_port_timer_callback(struct hrtimer *timer)
 	struct evb_input_port_data *data =
 			container_of(timer, struct evb_input_port_data, timer);
 	enum sensor_type prev_sensor_type = data->sensor_type;
+	enum connection_state prev_con_state = data->con_state;
 	unsigned new_pin_state_flags = 0;
 	unsigned new_pin1_mv = 0;
 
@@ -829,7 +831,7 @@ static enum hrtimer_restart evb_input_port_timer_callback(struct hrtimer *timer)
 			data->timer_loop_cnt = 0;
 			if (data->sensor_type != SENSOR_ERR) {
 				INIT_WORK(&data->work, evb_input_port_register_sensor);
-				schedule_work(&data->work);
+				lego_port_queue_probe(&data->port, &data->work);
 			}
 		}
 		data->pin_state_flags = new_pin_state_flags;
@@ -886,6 +888,10 @@ static enum hrtimer_restart evb_input_port_timer_callback(struct hrtimer *timer)
 		data->con_state = CON_STATE_INIT;
 	}
 
+	if (prev_con_state != data->con_state)
+		trace_lego_port_detect(&data->port, prev_con_state,
+				       data->con_state);
+
 	return HRTIMER_RESTART;
 }
 
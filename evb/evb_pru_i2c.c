@@ -43,8 +43,13 @@
 #include <linux/completion.h>
 #include <linux/i2c.h>
 #include <linux/kernel.h>
+#include <linux/list.h>
 #include <linux/module.h>
 #include <linux/rpmsg.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+
+#include <lego_i2c.h>
 
 /*
  * We need to use fixed adapter numbers so that the input port driver can
@@ -53,6 +58,9 @@
  */
 #define EVB_PRU_I2C_ADAPTER_NR_OFFSET 3
 
+/* Number of transfers that can be queued on each adapter */
+#define EVB_PRU_I2C_QUEUE_LEN	4
+
 /*
  * Everything between here and "END PRU DATA STRUCTS" must exactly match the PRU
  * firmware. These structs are used to pass info to and from the PRU.
@@ -80,62 +88,249 @@ struct evb_pru_i2c_msg_data {
 
 /* END PRU DATA STRUCTS */
 
-/* private driver data */
+/**
+ * struct evb_pru_i2c_xfer - a queued transfer
+ *
+ * @node: For adding to the free or pending list.
+ * @msg_data: The message that is sent to the PRU. This is filled in when the
+ *            transfer is submitted, so sending it does not need any copying
+ *            other than what rpmsg does.
+ * @msgs: The caller's messages. Read data is copied straight from the reply
+ *        into these buffers.
+ * @num: The number of messages in @msgs.
+ * @complete: Called when the transfer is done.
+ * @context: Passed to @complete.
+ */
+struct evb_pru_i2c_xfer {
+	struct list_head node;
+	struct evb_pru_i2c_msg_data msg_data;
+	struct i2c_msg *msgs;
+	int num;
+	lego_i2c_complete_t complete;
+	void *context;
+};
+
+/**
+ * struct evb_pru_i2c_algo_data - private driver data
+ *
+ * @rpdev: The rpmsg channel for this port.
+ * @adap: The I2C adapter for this port.
+ * @xfers: Pre-allocated transfers.
+ * @free_list: Transfers that are not in use.
+ * @pending_list: Transfers waiting to be sent to the PRU.
+ * @active: The transfer that is currently being handled by the PRU, if any.
+ * @deadline: Time in jiffies when @active times out.
+ * @lock: Protects the lists, @active and @deadline.
+ * @send_work: Sends the next pending transfer.
+ * @timeout_work: Cancels @active if the PRU does not reply in time.
+ * @idle_msg: Message used to put the PRU back in idle state after a timeout.
+ * @removing: Flag to fail new transfers when the driver is being removed.
+ *
+ * The PRU firmware handles one transfer per port at a time and its replies
+ * do not identify the transfer, so the queue is fed to the PRU in order and
+ * each reply belongs to @active. The next transfer is sent as soon as the
+ * reply for the previous one comes in, so the PRU never waits for a caller
+ * to be scheduled.
+ */
 struct evb_pru_i2c_algo_data {
 	struct rpmsg_channel *rpdev;
 	struct i2c_adapter *adap;
-	struct completion done;
-	u8 buf[MESSAGE_LIMIT][MAX_BUF_SIZE];
-	int xfer_result;
-	int rx_count;
+	struct evb_pru_i2c_xfer xfers[EVB_PRU_I2C_QUEUE_LEN];
+	struct list_head free_list;
+	struct list_head pending_list;
+	struct evb_pru_i2c_xfer *active;
+	unsigned long deadline;
+	spinlock_t lock;
+	struct work_struct send_work;
+	struct delayed_work timeout_work;
+	struct evb_pru_i2c_msg_data idle_msg;
+	bool removing;
 };
 
-/**
- * evb_pru_i2c_master_xfer - i2c algo master_xfer callback
+/*
+ * Returns the transfer to the free list and calls its completion. Must be
+ * called without holding the lock.
  */
-static int evb_pru_i2c_master_xfer(struct i2c_adapter *i2c_adap,
-				   struct i2c_msg *msgs, int num)
+static void evb_pru_i2c_finish(struct evb_pru_i2c_algo_data *adata,
+			       struct evb_pru_i2c_xfer *xfer, int result)
 {
-	struct evb_pru_i2c_algo_data *adata = i2c_adap->algo_data;
-	struct evb_pru_i2c_msg_data msg_data;
-	int i, ret;
+	lego_i2c_complete_t complete = xfer->complete;
+	void *context = xfer->context;
+	unsigned long flags;
 
-	reinit_completion(&adata->done);
+	spin_lock_irqsave(&adata->lock, flags);
+	list_add_tail(&xfer->node, &adata->free_list);
+	spin_unlock_irqrestore(&adata->lock, flags);
+
+	complete(context, result);
+}
+
+static void evb_pru_i2c_send_work(struct work_struct *work)
+{
+	struct evb_pru_i2c_algo_data *adata =
+		container_of(work, struct evb_pru_i2c_algo_data, send_work);
+	struct evb_pru_i2c_xfer *xfer;
+	unsigned long flags;
+	int ret;
+
+	spin_lock_irqsave(&adata->lock, flags);
+	if (adata->active || list_empty(&adata->pending_list)) {
+		spin_unlock_irqrestore(&adata->lock, flags);
+		return;
+	}
+	xfer = list_first_entry(&adata->pending_list, struct evb_pru_i2c_xfer,
+				node);
+	list_del(&xfer->node);
+	adata->active = xfer;
+	adata->deadline = jiffies + adata->adap->timeout;
+	spin_unlock_irqrestore(&adata->lock, flags);
+
+	/*
+	 * The timeout has to be running before the message is sent, otherwise
+	 * the reply could race with arming it.
+	 */
+	mod_delayed_work(system_wq, &adata->timeout_work, adata->adap->timeout);
+
+	ret = rpmsg_trysend(adata->rpdev, &xfer->msg_data,
+			    sizeof(xfer->msg_data));
+	if (ret < 0) {
+		spin_lock_irqsave(&adata->lock, flags);
+		if (adata->active != xfer) {
+			/* the timeout already took care of it */
+			spin_unlock_irqrestore(&adata->lock, flags);
+			return;
+		}
+		adata->active = NULL;
+		spin_unlock_irqrestore(&adata->lock, flags);
+
+		cancel_delayed_work(&adata->timeout_work);
+		evb_pru_i2c_finish(adata, xfer, ret == -ENOMEM ? -EAGAIN : ret);
+		schedule_work(&adata->send_work);
+	}
+}
+
+static void evb_pru_i2c_timeout_work(struct work_struct *work)
+{
+	struct evb_pru_i2c_algo_data *adata = container_of(to_delayed_work(work),
+				struct evb_pru_i2c_algo_data, timeout_work);
+	struct evb_pru_i2c_xfer *xfer;
+	unsigned long flags;
+
+	spin_lock_irqsave(&adata->lock, flags);
+	xfer = adata->active;
+	if (xfer && time_before(jiffies, adata->deadline)) {
+		/* this was the timeout for a transfer that already finished */
+		mod_delayed_work(system_wq, &adata->timeout_work,
+				 adata->deadline - jiffies);
+		spin_unlock_irqrestore(&adata->lock, flags);
+		return;
+	}
+	adata->active = NULL;
+	spin_unlock_irqrestore(&adata->lock, flags);
+
+	if (!xfer)
+		return;
+
+	/* sending num_msgs == 0 puts the port in idle state */
+	rpmsg_send(adata->rpdev, &adata->idle_msg, sizeof(adata->idle_msg));
+
+	evb_pru_i2c_finish(adata, xfer, -ETIMEDOUT);
+	schedule_work(&adata->send_work);
+}
+
+/*
+ * Queues an I2C transfer without waiting for it. This is the submit op of
+ * struct lego_i2c_quirks, see there for the details.
+ */
+static int evb_pru_i2c_submit(struct i2c_adapter *adap, struct i2c_msg *msgs,
+		       int num, lego_i2c_complete_t complete, void *context)
+{
+	struct evb_pru_i2c_algo_data *adata = adap->algo_data;
+	struct evb_pru_i2c_xfer *xfer;
+	unsigned long flags;
+	int i;
 
 	if (num > MESSAGE_LIMIT)
 		return -EINVAL;
-
-	/* serialize the i2c msgs for sending to the PRU */
-	msg_data.num_msgs = num;
 	for (i = 0; i < num; i++) {
 		if (msgs[i].len > MAX_BUF_SIZE)
 			return -EINVAL;
-		memcpy(&msg_data.msgs[i], &msgs[i], sizeof(struct i2c_msg));
-		memcpy(&msg_data.msgs[i].buf, msgs[i].buf, msgs[i].len);
 	}
 
-	ret = rpmsg_trysend(adata->rpdev, &msg_data, sizeof(msg_data));
-	if (ret == -ENOMEM)
-		return -EAGAIN;
-	if (ret < 0)
-		return ret;
-
-	ret = wait_for_completion_timeout(&adata->done, i2c_adap->timeout);
-	if (!ret) {
-		/* sending num_msgs == 0 puts the port in idle state */
-		msg_data.num_msgs = 0;
-		rpmsg_send(adata->rpdev, &msg_data, sizeof(msg_data));
-
-		return -ETIMEDOUT;
+	spin_lock_irqsave(&adata->lock, flags);
+	if (adata->removing) {
+		spin_unlock_irqrestore(&adata->lock, flags);
+		return -ESHUTDOWN;
 	}
+	xfer = list_first_entry_or_null(&adata->free_list,
+					struct evb_pru_i2c_xfer, node);
+	if (xfer)
+		list_del(&xfer->node);
+	spin_unlock_irqrestore(&adata->lock, flags);
 
-	/* copy back updated buffers for read messages */
+	if (!xfer)
+		return -EBUSY;
+
+	/* serialize the i2c msgs for sending to the PRU */
+	xfer->msg_data.num_msgs = num;
 	for (i = 0; i < num; i++) {
-		if (msgs[i].flags & I2C_M_RD)
-			memcpy(msgs[i].buf, adata->buf[i], msgs[i].len);
+		struct pru_i2c_msg *pru_msg = &xfer->msg_data.msgs[i];
+
+		pru_msg->addr = msgs[i].addr;
+		pru_msg->flags = msgs[i].flags;
+		pru_msg->len = msgs[i].len;
+		if (!(msgs[i].flags & I2C_M_RD))
+			memcpy(pru_msg->buf, msgs[i].buf, msgs[i].len);
 	}
+	xfer->msgs = msgs;
+	xfer->num = num;
+	xfer->complete = complete;
+	xfer->context = context;
+
+	spin_lock_irqsave(&adata->lock, flags);
+	list_add_tail(&xfer->node, &adata->pending_list);
+	spin_unlock_irqrestore(&adata->lock, flags);
+
+	schedule_work(&adata->send_work);
+
+	return 0;
+}
+
+struct evb_pru_i2c_sync {
+	struct completion done;
+	int result;
+};
+
+static void evb_pru_i2c_sync_complete(void *context, int result)
+{
+	struct evb_pru_i2c_sync *sync = context;
+
+	sync->result = result;
+	complete(&sync->done);
+}
+
+/**
+ * evb_pru_i2c_master_xfer - i2c algo master_xfer callback
+ */
+static int evb_pru_i2c_master_xfer(struct i2c_adapter *i2c_adap,
+				   struct i2c_msg *msgs, int num)
+{
+	struct evb_pru_i2c_sync sync;
+	int ret;
+
+	init_completion(&sync.done);
+
+	ret = evb_pru_i2c_submit(i2c_adap, msgs, num, evb_pru_i2c_sync_complete,
+				 &sync);
+	if (ret == -EBUSY)
+		return -EAGAIN;
+	if (ret < 0)
+		return ret;
+
+	/* the timeout is handled by the queue, so this always completes */
+	wait_for_completion(&sync.done);
 
-	return adata->xfer_result;
+	return sync.result;
 }
 
 /**
@@ -154,13 +349,16 @@ const struct i2c_algorithm evb_pru_i2c_algo = {
 };
 EXPORT_SYMBOL_GPL(evb_pru_i2c_algo);
 
-static const struct i2c_adapter_quirks evb_pru_i2c_quirks = {
-	.flags			= I2C_AQ_NO_CLK_STRETCH,
-	.max_num_msgs		= MESSAGE_LIMIT,
-	.max_write_len		= MAX_BUF_SIZE,
-	.max_read_len		= MAX_BUF_SIZE,
-	.max_comb_1st_msg_len	= MAX_BUF_SIZE,
-	.max_comb_2nd_msg_len	= MAX_BUF_SIZE,
+static const struct lego_i2c_quirks evb_pru_i2c_quirks = {
+	.quirks = {
+		.flags			= I2C_AQ_NO_CLK_STRETCH | I2C_AQ_LEGO_ASYNC,
+		.max_num_msgs		= MESSAGE_LIMIT,
+		.max_write_len		= MAX_BUF_SIZE,
+		.max_read_len		= MAX_BUF_SIZE,
+		.max_comb_1st_msg_len	= MAX_BUF_SIZE,
+		.max_comb_2nd_msg_len	= MAX_BUF_SIZE,
+	},
+	.submit = evb_pru_i2c_submit,
 };
 
 /**
@@ -171,27 +369,41 @@ static void evb_pru_i2c_cb(struct rpmsg_channel *rpdev, void *data, int len,
 {
 	struct evb_pru_i2c_algo_data *adata = dev_get_drvdata(&rpdev->dev);
 	struct evb_pru_i2c_msg_data *msg_data = data;
+	struct evb_pru_i2c_xfer *xfer;
+	unsigned long flags;
 	int i;
 
 	/* If len is wrong, we probably have bad firmware - just ignore it */
 	if (len != sizeof(*msg_data))
 		return;
 
-	adata->xfer_result = msg_data->xfer_result;
+	spin_lock_irqsave(&adata->lock, flags);
+	xfer = adata->active;
+	adata->active = NULL;
+	spin_unlock_irqrestore(&adata->lock, flags);
+
+	/* late reply to a transfer that already timed out */
+	if (!xfer)
+		return;
+
+	cancel_delayed_work(&adata->timeout_work);
+
 	/* copy updated buffers for read messages */
-	for (i = 0; i < msg_data->num_msgs; i++) {
-		if (msg_data->msgs[i].flags & I2C_M_RD)
-			memcpy(adata->buf[i], msg_data->msgs[i].buf,
-			       msg_data->msgs[i].len);
+	for (i = 0; i < xfer->num && i < msg_data->num_msgs; i++) {
+		if (xfer->msgs[i].flags & I2C_M_RD)
+			memcpy(xfer->msgs[i].buf, msg_data->msgs[i].buf,
+			       min(xfer->msgs[i].len, msg_data->msgs[i].len));
 	}
-	complete(&adata->done);
+
+	evb_pru_i2c_finish(adata, xfer, msg_data->xfer_result);
+	schedule_work(&adata->send_work);
 }
 
 static int evb_pru_i2c_probe(struct rpmsg_channel *rpdev)
 {
 	struct evb_pru_i2c_algo_data *adata;
 	struct i2c_adapter *adap;
-	int ret;
+	int i, ret;
 
 	adata = devm_kzalloc(&rpdev->dev, sizeof(*adata), GFP_KERNEL);
 	if (!adata)
@@ -208,11 +420,17 @@ static int evb_pru_i2c_probe(struct rpmsg_channel *rpdev)
 	adap->dev.parent = &rpdev->dev;
 	adap->nr = EVB_PRU_I2C_ADAPTER_NR_OFFSET + rpdev->dst;
 	snprintf(adap->name, sizeof(adap->name), "evb-pru-i2c%d", rpdev->dst);
-	adap->quirks = &evb_pru_i2c_quirks;
+	adap->quirks = &evb_pru_i2c_quirks.quirks;
 
 	adata->rpdev = rpdev;
 	adata->adap = adap;
-	init_completion(&adata->done);
+	INIT_LIST_HEAD(&adata->free_list);
+	INIT_LIST_HEAD(&adata->pending_list);
+	for (i = 0; i < EVB_PRU_I2C_QUEUE_LEN; i++)
+		list_add_tail(&adata->xfers[i].node, &adata->free_list);
+	spin_lock_init(&adata->lock);
+	INIT_WORK(&adata->send_work, evb_pru_i2c_send_work);
+	INIT_DELAYED_WORK(&adata->timeout_work, evb_pru_i2c_timeout_work);
 
 	dev_set_drvdata(&rpdev->dev, adata);
 
@@ -228,8 +446,30 @@ static int evb_pru_i2c_probe(struct rpmsg_channel *rpdev)
 static void evb_pru_i2c_remove(struct rpmsg_channel *rpdev)
 {
 	struct evb_pru_i2c_algo_data *adata = dev_get_drvdata(&rpdev->dev);
+	struct evb_pru_i2c_xfer *xfer, *tmp;
+	unsigned long flags;
+	LIST_HEAD(list);
+
+	spin_lock_irqsave(&adata->lock, flags);
+	adata->removing = true;
+	spin_unlock_irqrestore(&adata->lock, flags);
 
 	i2c_del_adapter(adata->adap);
+	cancel_work_sync(&adata->send_work);
+	cancel_delayed_work_sync(&adata->timeout_work);
+
+	/* fail anything that asynchronous users left behind */
+	spin_lock_irqsave(&adata->lock, flags);
+	if (adata->active)
+		list_add_tail(&adata->active->node, &list);
+	adata->active = NULL;
+	list_splice_tail_init(&adata->pending_list, &list);
+	spin_unlock_irqrestore(&adata->lock, flags);
+
+	list_for_each_entry_safe(xfer, tmp, &list, node) {
+		list_del(&xfer->node);
+		evb_pru_i2c_finish(adata, xfer, -ESHUTDOWN);
+	}
 
 	dev_info(&rpdev->dev, "Removed i2c adapter %s\n", adata->adap->name);
 }
@@ -35,14 +35,29 @@
  * group for this).
  *
  * .. _ALSA: https://en.wikipedia.org/wiki/Advanced_Linux_Sound_Architecture
+ *
+ * By default, PCM playback updates the PWM duty cycle from an hrtimer once
+ * per sample. If the device tree node has a ``pcm`` DMA channel, the samples
+ * are converted to PWM compare values one period at a time and a cyclic DMA
+ * transfer writes them to the compare register instead. This needs these
+ * properties:
+ *
+ * - ``ev3dev,pcm-dma-reg``: physical address of the 16-bit compare register.
+ * - ``ev3dev,pcm-dma-period``: the PWM period in compare register counts.
+ * - ``ev3dev,pcm-dma-rate``: the rate at which the DMA requests are paced,
+ *   which becomes the only supported sample rate.
  */
 
+#include <linux/dma-mapping.h>
+#include <linux/dmaengine.h>
 #include <linux/gpio/consumer.h>
 #include <linux/hrtimer.h>
 #include <linux/init.h>
 #include <linux/input.h>
 #include <linux/interrupt.h>
+#include <linux/math64.h>
 #include <linux/module.h>
+#include <linux/of.h>
 #include <linux/platform_device.h>
 #include <linux/pm_runtime.h>
 #include <linux/pwm.h>
@@ -62,6 +77,7 @@
 #define MAX_VOLUME	256
 #define OFF_DELAY	msecs_to_jiffies(5000)
 #define PCM_PWM_PERIOD	(NSEC_PER_SEC / 64000)
+#define PCM_DUTY_SHIFT	16
 
 /*--- module parameters ---*/
 
@@ -81,12 +97,20 @@ struct evb_sound {
 	struct delayed_work	 disable_work;
 	struct hrtimer		 pcm_timer;
 	struct tasklet_struct	 pcm_period_tasklet;
+	struct snd_pcm_substream *pcm_substream;
 	unsigned int		 tone_frequency;
 	unsigned int		 tone_volume;
 	ktime_t			 pcm_timer_period;
-	size_t			 pcm_playback_ptr;
-	unsigned int		 pcm_callback_count;
+	snd_pcm_uframes_t	 pcm_playback_frame;
+	snd_pcm_uframes_t	 pcm_callback_count;
+	unsigned int		 pcm_period;
 	unsigned int		 pcm_volume;
+	u16			*pcm_duty_buf;
+	struct dma_chan		*pcm_dma;
+	unsigned int		 pcm_dma_period_counts;
+	unsigned int		 pcm_dma_rate;
+	dma_addr_t		 pcm_dma_buf_addr;
+	bool			 pcm_dma_running;
 	bool			 requested_enabled;
 	bool			 is_enabled;
 };
@@ -125,6 +149,11 @@ static void evb_sound_disable_work(struct work_struct *work)
 	gpiod_set_value(chip->ena_gpio, 0);
 }
 
+static inline bool evb_sound_pcm_is_running(struct evb_sound *chip)
+{
+	return hrtimer_is_queued(&chip->pcm_timer) || chip->pcm_dma_running;
+}
+
 /*--- tone/beep mode ---*/
 
 static int evb_sound_apply_tone_volume(struct evb_sound *chip)
@@ -147,7 +176,7 @@ static int evb_sound_do_tone(struct evb_sound *chip, int hz)
 	int err;
 
 	/* check if PCM playback is active */
-	if (hrtimer_is_queued(&chip->pcm_timer))
+	if (evb_sound_pcm_is_running(chip))
 		return -EBUSY;
 
 	if (hz <= 0) {
@@ -243,10 +272,87 @@ static struct snd_pcm_hardware evb_sound_playback_hw = {
 	.buffer_bytes_max  = BUFFER_SIZE,
 	.period_bytes_min  = 4096,
 	.period_bytes_max  = BUFFER_SIZE,
-	.periods_min       = 1,
+	/* see evb_sound_period_done() */
+	.periods_min       = 3,
 	.periods_max       = 1024,
 };
 
+/*
+ * PCM samples are converted to PWM duty cycles one period at a time instead
+ * of in the interrupt handler. The application can still write to a period
+ * after it has been converted, so evb_sound_pcm_ack() converts the periods
+ * that have not finished playing again each time it writes. The volume and
+ * PWM period are combined into a single fixed-point multiplier, so there are
+ * no divisions per sample:
+ *
+ *   duty = offset + ((sample * mult) >> PCM_DUTY_SHIFT)
+ *
+ * The result is in the same units as @period, i.e. nanoseconds for the timer
+ * backend and compare register counts for the DMA backend.
+ */
+static void evb_sound_convert_period(struct evb_sound *chip,
+				     struct snd_pcm_runtime *runtime,
+				     unsigned int period, unsigned int pwm_period)
+{
+	size_t offset = period * runtime->period_size;
+	s16 *src = (s16 *)runtime->dma_area + offset;
+	u16 *dst = chip->pcm_duty_buf + offset;
+	s32 mult, duty_offset;
+	int i;
+
+	mult = div_u64((u64)chip->pcm_volume * pwm_period << PCM_DUTY_SHIFT,
+		       MAX_VOLUME * USHRT_MAX);
+	duty_offset = pwm_period * SHRT_MAX / USHRT_MAX;
+
+	for (i = 0; i < runtime->period_size; i++)
+		dst[i] = duty_offset + (s32)(((s64)src[i] * mult) >> PCM_DUTY_SHIFT);
+}
+
+static inline unsigned int evb_sound_pwm_period(struct evb_sound *chip)
+{
+	return chip->pcm_dma ? chip->pcm_dma_period_counts : chip->pwm->period;
+}
+
+/*
+ * Called when a period is done playing. The next period has already been
+ * converted, so we convert the one after that. This gives the conversion a
+ * whole period of slack. It also means that the period being converted must
+ * have been released to the application one period ago, so that it has had
+ * time to refill it. That is only true with at least 3 periods. With 2, it
+ * would be the period that just finished and with 1, the one now playing.
+ *
+ * The stream lock keeps evb_sound_pcm_ack() from converting at the same time.
+ */
+static void evb_sound_period_done(struct evb_sound *chip,
+				  struct snd_pcm_substream *substream)
+{
+	struct snd_pcm_runtime *runtime = substream->runtime;
+	unsigned long flags;
+
+	snd_pcm_stream_lock_irqsave(substream, flags);
+
+	/*
+	 * FIXME: Setting the buffer data to 0 because there is a tendency to
+	 * replay part of a sample at the end of playback. If we can figure out
+	 * how to detect the end of playback, we wouldn't need to do this. The
+	 * timer backend does it per sample because its pointer is per sample,
+	 * so the application may already have refilled the period.
+	 */
+	if (chip->pcm_dma)
+		memset(runtime->dma_area + frames_to_bytes(runtime,
+				chip->pcm_period * runtime->period_size),
+		       0, frames_to_bytes(runtime, runtime->period_size));
+
+	chip->pcm_period = (chip->pcm_period + 1) % runtime->periods;
+	evb_sound_convert_period(chip, runtime,
+				 (chip->pcm_period + 1) % runtime->periods,
+				 evb_sound_pwm_period(chip));
+
+	snd_pcm_stream_unlock_irqrestore(substream, flags);
+
+	snd_pcm_period_elapsed(substream);
+}
+
 /*
  * Call snd_pcm_period_elapsed in a tasklet
  * This avoids spinlock messes and long-running irq contexts
@@ -255,54 +361,89 @@ static void evb_sound_period_elapsed_tasklet(unsigned long data)
 {
 	struct snd_pcm_substream *substream = (void *)data;
 
-	snd_pcm_period_elapsed(substream);
+	evb_sound_period_done(snd_pcm_substream_chip(substream), substream);
 }
 
 static enum hrtimer_restart evb_sound_pcm_timer_callback(struct hrtimer *timer)
 {
 	struct evb_sound *chip = container_of(timer, struct evb_sound, pcm_timer);
-	struct snd_pcm_substream *substream = (void *)chip->pcm_period_tasklet.data;
-	struct snd_pcm_runtime *runtime = substream->runtime;
+	struct snd_pcm_runtime *runtime = chip->pcm_substream->runtime;
 	struct pwm_device *pwm = chip->pwm;
-	long duty;
-	size_t period_size;
 
 	hrtimer_forward_now(&chip->pcm_timer, chip->pcm_timer_period);
 
+	pwm_config(pwm, chip->pcm_duty_buf[chip->pcm_playback_frame],
+		   pwm->period);
+	/* see evb_sound_period_done() */
+	((s16 *)runtime->dma_area)[chip->pcm_playback_frame] = 0;
+
+	if (++chip->pcm_playback_frame >= runtime->buffer_size)
+		chip->pcm_playback_frame = 0;
+
 	/*
 	 * Take care of notifying alsa every when we are done playing back
 	 * a period.
 	 */
-	period_size = snd_pcm_lib_period_bytes(substream);
-	chip->pcm_callback_count += 1;
-	if (chip->pcm_callback_count >= period_size) {
-		chip->pcm_callback_count %= period_size;
+	if (++chip->pcm_callback_count >= runtime->period_size) {
+		chip->pcm_callback_count = 0;
 		tasklet_schedule(&chip->pcm_period_tasklet);
 	}
 
-	duty = *(short *)(runtime->dma_area + chip->pcm_playback_ptr);
-	/* do volume scaling while value is signed */
-	duty *= chip->pcm_volume;
-	duty /= MAX_VOLUME;
-	/* then convert to unsigned and scale to pwm period */
-	duty += SHRT_MAX;
-	duty *= pwm->period;
-	duty /= USHRT_MAX;
+	return HRTIMER_RESTART;
+}
 
-	/*
-	 * FIXME: Setting the buffer data to 0 here because there is a tendency
-	 * to replay part of a sample at the end of playback. If we can figure
-	 * out how to detect the end of playback, we wouldn't need to do this.
-	 */
-	*(short *)(runtime->dma_area + chip->pcm_playback_ptr) = 0;
+static void evb_sound_dma_callback(void *param)
+{
+	struct snd_pcm_substream *substream = param;
 
-	pwm_config(pwm, duty, pwm->period);
+	evb_sound_period_done(snd_pcm_substream_chip(substream), substream);
+}
 
-	chip->pcm_playback_ptr += frames_to_bytes(runtime, 1);
-	if (chip->pcm_playback_ptr >= snd_pcm_lib_buffer_bytes(substream))
-		chip->pcm_playback_ptr = 0;
+/* Converts the first periods before playback starts */
+static void evb_sound_pcm_convert_start(struct evb_sound *chip,
+					struct snd_pcm_runtime *runtime)
+{
+	chip->pcm_period = 0;
+	evb_sound_convert_period(chip, runtime, 0, evb_sound_pwm_period(chip));
+	evb_sound_convert_period(chip, runtime, 1, evb_sound_pwm_period(chip));
+}
 
-	return HRTIMER_RESTART;
+static int evb_sound_dma_start(struct evb_sound *chip,
+			       struct snd_pcm_substream *substream)
+{
+	struct snd_pcm_runtime *runtime = substream->runtime;
+	struct dma_async_tx_descriptor *desc;
+	dma_cookie_t cookie;
+
+	evb_sound_pcm_convert_start(chip, runtime);
+
+	desc = dmaengine_prep_dma_cyclic(chip->pcm_dma, chip->pcm_dma_buf_addr,
+			runtime->buffer_size * sizeof(u16),
+			runtime->period_size * sizeof(u16),
+			DMA_MEM_TO_DEV, DMA_PREP_INTERRUPT);
+	if (!desc)
+		return -ENOMEM;
+
+	desc->callback = evb_sound_dma_callback;
+	desc->callback_param = substream;
+
+	cookie = dmaengine_submit(desc);
+	if (dma_submit_error(cookie))
+		return -EIO;
+
+	chip->pcm_dma_running = true;
+	dma_async_issue_pending(chip->pcm_dma);
+
+	return 0;
+}
+
+static void evb_sound_dma_stop(struct evb_sound *chip)
+{
+	if (!chip->pcm_dma_running)
+		return;
+
+	dmaengine_terminate_all(chip->pcm_dma);
+	chip->pcm_dma_running = false;
 }
 
 static int evb_sound_pcm_playback_open(struct snd_pcm_substream *substream)
@@ -317,6 +458,12 @@ static int evb_sound_pcm_playback_open(struct snd_pcm_substream *substream)
 		return err;
 
 	runtime->hw = evb_sound_playback_hw;
+	if (chip->pcm_dma) {
+		/* the DMA requests are paced by hardware at a fixed rate */
+		runtime->hw.rate_min = chip->pcm_dma_rate;
+		runtime->hw.rate_max = chip->pcm_dma_rate;
+	}
+	chip->pcm_substream = substream;
 	tasklet_init(&chip->pcm_period_tasklet, evb_sound_period_elapsed_tasklet,
 		     (unsigned long)substream);
 
@@ -329,7 +476,11 @@ static int evb_sound_pcm_playback_close(struct snd_pcm_substream *substream)
 
 	/* Should already be stopped, but just in case... */
 	hrtimer_cancel(&chip->pcm_timer);
+	if (chip->pcm_dma)
+		dmaengine_terminate_all(chip->pcm_dma);
+	chip->pcm_dma_running = false;
 	tasklet_kill(&chip->pcm_period_tasklet);
+	chip->pcm_substream = NULL;
 
 	return 0;
 }
@@ -350,8 +501,9 @@ static int evb_sound_pcm_prepare(struct snd_pcm_substream *substream)
 {
 	struct evb_sound *chip = snd_pcm_substream_chip(substream);
 
-	chip->pcm_playback_ptr = 0;
+	chip->pcm_playback_frame = 0;
 	chip->pcm_callback_count = 0;
+	chip->pcm_period = 0;
 
 	return 0;
 }
@@ -359,12 +511,22 @@ static int evb_sound_pcm_prepare(struct snd_pcm_substream *substream)
 static int evb_sound_pcm_trigger(struct snd_pcm_substream *substream, int cmd)
 {
 	struct evb_sound *chip = snd_pcm_substream_chip(substream);
+	int err;
 
 	switch (cmd) {
 	case SNDRV_PCM_TRIGGER_START:
-		if (chip->tone_frequency || hrtimer_is_queued(&chip->pcm_timer))
+		if (chip->tone_frequency || evb_sound_pcm_is_running(chip))
 			return -EBUSY;
 		evb_sound_enable(chip);
+		if (chip->pcm_dma) {
+			err = evb_sound_dma_start(chip, substream);
+			if (err < 0) {
+				evb_sound_disable(chip);
+				return err;
+			}
+			break;
+		}
+		evb_sound_pcm_convert_start(chip, substream->runtime);
 		chip->pcm_timer_period = ktime_set(0,
 				NSEC_PER_SEC / substream->runtime->rate);
 		hrtimer_start(&chip->pcm_timer, chip->pcm_timer_period,
@@ -373,6 +535,7 @@ static int evb_sound_pcm_trigger(struct snd_pcm_substream *substream, int cmd)
 	case SNDRV_PCM_TRIGGER_STOP:
 		evb_sound_disable(chip);
 		hrtimer_cancel(&chip->pcm_timer);
+		evb_sound_dma_stop(chip);
 		break;
 	default:
 		return -EINVAL;
@@ -386,7 +549,31 @@ evb_sound_pcm_pointer(struct snd_pcm_substream *substream)
 {
 	struct evb_sound *chip = snd_pcm_substream_chip(substream);
 
-	return bytes_to_frames(substream->runtime, chip->pcm_playback_ptr);
+	if (chip->pcm_dma)
+		return chip->pcm_period * substream->runtime->period_size;
+
+	return chip->pcm_playback_frame;
+}
+
+/*
+ * Called with the stream lock held when the application has written samples.
+ * The period that is playing and the next one have already been converted, so
+ * convert them again in case the samples are in one of them. Samples that have
+ * already been played are converted too, but they are not played again before
+ * their period is converted in evb_sound_period_done().
+ */
+static int evb_sound_pcm_ack(struct snd_pcm_substream *substream)
+{
+	struct evb_sound *chip = snd_pcm_substream_chip(substream);
+	struct snd_pcm_runtime *runtime = substream->runtime;
+
+	evb_sound_convert_period(chip, runtime, chip->pcm_period,
+				 evb_sound_pwm_period(chip));
+	evb_sound_convert_period(chip, runtime,
+				 (chip->pcm_period + 1) % runtime->periods,
+				 evb_sound_pwm_period(chip));
+
+	return 0;
 }
 
 static struct snd_pcm_ops evb_sound_playback_ops = {
@@ -398,6 +585,7 @@ static struct snd_pcm_ops evb_sound_playback_ops = {
 	.prepare	= evb_sound_pcm_prepare,
 	.trigger	= evb_sound_pcm_trigger,
 	.pointer	= evb_sound_pcm_pointer,
+	.ack		= evb_sound_pcm_ack,
 };
 
 static int evb_sound_new_pcm(struct evb_sound *chip)
@@ -492,12 +680,10 @@ static int evb_sound_pcm_volume_control_put(struct snd_kcontrol *kcontrol,
 	if (newValue > MAX_VOLUME)
 		newValue = MAX_VOLUME;
 
-	if (chip->tone_volume != newValue) {
+	if (chip->pcm_volume != newValue) {
+		/* applied when the next period is converted */
 		chip->pcm_volume = newValue;
 
-		/* if tone playback is running, apply volume */
-		/* FIXME: */
-
 		changed = 1;
 	}
 
@@ -526,11 +712,90 @@ static struct snd_kcontrol_new pcm_volume_control = {
 
 /*--- platform sound device ---*/
 
+/*
+ * The DMA backend is optional. If there is no DMA channel in the device tree,
+ * we just use the hrtimer.
+ */
+static int evb_sound_dma_init(struct evb_sound *chip, struct device *dev)
+{
+	struct device_node *np = dev->of_node;
+	struct dma_slave_config config = { };
+	struct dma_chan *chan;
+	u32 reg, counts, rate;
+	int err;
+
+	if (!np || !of_find_property(np, "dmas", NULL))
+		return 0;
+
+	if (of_property_read_u32(np, "ev3dev,pcm-dma-reg", &reg) ||
+	    of_property_read_u32(np, "ev3dev,pcm-dma-period", &counts) ||
+	    of_property_read_u32(np, "ev3dev,pcm-dma-rate", &rate)) {
+		dev_warn(dev, "Missing DMA properties, using timer for PCM\n");
+		return 0;
+	}
+
+	chan = dma_request_slave_channel_reason(dev, "pcm");
+	if (IS_ERR(chan))
+		return PTR_ERR(chan);
+
+	config.direction = DMA_MEM_TO_DEV;
+	config.dst_addr = reg;
+	config.dst_addr_width = DMA_SLAVE_BUSWIDTH_2_BYTES;
+	config.dst_maxburst = 1;
+	err = dmaengine_slave_config(chan, &config);
+	if (err < 0)
+		goto err_release_channel;
+
+	/* one 16-bit compare value per 16-bit sample */
+	chip->pcm_duty_buf = dma_alloc_coherent(chan->device->dev, BUFFER_SIZE,
+						&chip->pcm_dma_buf_addr,
+						GFP_KERNEL);
+	if (!chip->pcm_duty_buf) {
+		err = -ENOMEM;
+		goto err_release_channel;
+	}
+
+	chip->pcm_dma = chan;
+	chip->pcm_dma_period_counts = counts;
+	chip->pcm_dma_rate = rate;
+
+	return 0;
+
+err_release_channel:
+	dma_release_channel(chan);
+
+	return err;
+}
+
+static void evb_sound_duty_buf_free(struct evb_sound *chip)
+{
+	if (!chip->pcm_dma) {
+		kfree(chip->pcm_duty_buf);
+		chip->pcm_duty_buf = NULL;
+		return;
+	}
+
+	dma_free_coherent(chip->pcm_dma->device->dev, BUFFER_SIZE,
+			  chip->pcm_duty_buf, chip->pcm_dma_buf_addr);
+	dma_release_channel(chip->pcm_dma);
+	chip->pcm_dma = NULL;
+	chip->pcm_duty_buf = NULL;
+}
+
+static int evb_sound_dev_free(struct snd_device *device)
+{
+	evb_sound_duty_buf_free(device->device_data);
+
+	return 0;
+}
+
 static int evb_sound_create(struct snd_card *card, struct pwm_device *pwm,
 			    struct gpio_desc *gpio)
 {
 	struct evb_sound *chip  = card->private_data;
-	static struct snd_device_ops ops = { };
+	static struct snd_device_ops ops = {
+		.dev_free = evb_sound_dev_free,
+	};
 	int err;
 
 	chip->card = card;
@@ -540,10 +805,24 @@ static int evb_sound_create(struct snd_card *card, struct pwm_device *pwm,
 	hrtimer_init(&chip->pcm_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
 	chip->pcm_timer.function = &evb_sound_pcm_timer_callback;
 
-	err = snd_device_new(card, SNDRV_DEV_LOWLEVEL, chip, &ops);
+	err = evb_sound_dma_init(chip, card->dev);
 	if (err < 0)
 		return err;
 
+	/* the timer backend stores duty cycles in ns, which fits in a u16 */
+	BUILD_BUG_ON(PCM_PWM_PERIOD > USHRT_MAX);
+	if (!chip->pcm_dma) {
+		chip->pcm_duty_buf = kmalloc(BUFFER_SIZE, GFP_KERNEL);
+		if (!chip->pcm_duty_buf)
+			return -ENOMEM;
+	}
+
+	err = snd_device_new(card, SNDRV_DEV_LOWLEVEL, chip, &ops);
+	if (err < 0) {
+		evb_sound_duty_buf_free(chip);
+		return err;
+	}
+
 	err = evb_sound_new_pcm(chip);
 	if (err < 0)
 		return err;
@@ -32,9 +32,18 @@ struct lego_device_id {
 		.driver_data = _id,	\
 	}
 
+/**
+ * struct lego_device
+ * @dev: The device.
+ * @name: The name of the device. Used to match a driver.
+ * @name_hash: Hash of @name, used to look up matching id table entries.
+ * @port: The port the device is attached to.
+ * @entry_id: The matching id table entry of the driver.
+ */
 struct lego_device {
 	struct device dev;
 	char name[LEGO_NAME_SIZE + 1];
+	u32 name_hash;
 	struct lego_port_device *port;
 	const struct lego_device_id *entry_id;
 };
@@ -51,12 +60,27 @@ extern struct lego_device *lego_device_register(const char *name,
 						size_t platform_data_size);
 extern void lego_device_unregister(struct lego_device *ldev);
 
+struct lego_bus_id_entry;
+
+/**
+ * struct lego_device_driver
+ * @probe: Called when a matching device is added.
+ * @remove: Called when the device is removed.
+ * @shutdown: Called at shutdown.
+ * @driver: The driver.
+ * @id_table: Names of the devices this driver can handle (optional). If
+ *	omitted, the device name must match the driver name.
+ * @id_entries: Private. Entries of the lego bus id index for this driver.
+ * @num_id_entries: Private. Number of items in @id_entries.
+ */
 struct lego_device_driver {
 	int (*probe)(struct lego_device *ldev);
 	int (*remove)(struct lego_device *ldev);
 	void (*shutdown)(struct lego_device *ldev);
 	struct device_driver driver;
 	const struct lego_device_id *id_table;
+	struct lego_bus_id_entry *id_entries;
+	unsigned num_id_entries;
 };
 
 static inline struct lego_device_driver
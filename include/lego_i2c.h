@@ -0,0 +1,80 @@
+/*
+ * Helpers for I2C adapters on LEGO ports
+ *
+ * Copyright (C) 2026 The ev3dev project
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+
+ * This program is distributed "as is" WITHOUT ANY WARRANTY of any
+ * kind, whether express or implied; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef __LEGO_I2C_H
+#define __LEGO_I2C_H
+
+#include <linux/bitops.h>
+#include <linux/i2c.h>
+#include <linux/kernel.h>
+
+/*
+ * Adapters can offer transfers that don't wait for the result by embedding
+ * their quirks in struct lego_i2c_quirks and setting this flag. Sensor drivers
+ * find it at runtime, so they don't have to link to the adapter driver.
+ */
+#define I2C_AQ_LEGO_ASYNC	BIT(31)
+
+/*
+ * The addresses that the nxt-i2c-sensor driver probes. Ports that poll for a
+ * sensor before it is detected use the same list.
+ */
+#define LEGO_I2C_SENSOR_ADDRS	0x01, 0x02, 0x03, 0x08, 0x0a, 0x0c, 0x11, 0x18, \
+				0x4c, 0x50, 0x51, 0x52, 0x58
+
+/**
+ * lego_i2c_complete_t - completion callback for asynchronous transfers
+ *
+ * @context: The context that was passed to submit.
+ * @result: The number of messages transferred or a negative error code.
+ *
+ * This can be called from atomic context.
+ */
+typedef void (*lego_i2c_complete_t)(void *context, int result);
+
+/**
+ * struct lego_i2c_quirks - quirks of an adapter with asynchronous transfers
+ *
+ * @quirks: The usual quirks. The flags must include I2C_AQ_LEGO_ASYNC.
+ * @submit: Queues a transfer without waiting for it. This does not sleep and
+ *	does not take the adapter lock, so it is up to the caller to not mix
+ *	it with other users of the same I2C device. The buffers of read
+ *	messages must remain valid until @complete is called. Returns 0 if the
+ *	transfer was queued, -EBUSY if the queue is full or another negative
+ *	error code. @complete is only called if 0 is returned.
+ */
+struct lego_i2c_quirks {
+	struct i2c_adapter_quirks quirks;
+	int (*submit)(struct i2c_adapter *adap, struct i2c_msg *msgs, int num,
+		      lego_i2c_complete_t complete, void *context);
+};
+
+/**
+ * lego_i2c_get_quirks - get the asynchronous transfer ops of an adapter
+ *
+ * @adap: The adapter.
+ *
+ * Returns NULL if @adap does not support asynchronous transfers.
+ */
+static inline const struct lego_i2c_quirks *
+lego_i2c_get_quirks(struct i2c_adapter *adap)
+{
+	if (!adap->quirks || !(adap->quirks->flags & I2C_AQ_LEGO_ASYNC))
+		return NULL;
+
+	return container_of(adap->quirks, struct lego_i2c_quirks, quirks);
+}
+
+#endif /* __LEGO_I2C_H */
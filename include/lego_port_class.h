@@ -17,10 +17,14 @@
 #define _LEGO_PORT_CLASS_H_
 
 #include <linux/device.h>
+#include <linux/ktime.h>
 #include <linux/types.h>
+#include <linux/workqueue.h>
 
 #include <lego.h>
 
+#include <trace/events/lego_port.h>
+
 /**
  * Used by sensor drivers to get notified when a port has new raw data available.
  */
@@ -87,6 +91,7 @@ struct lego_port_ev3_uart_ops {
  * @notify_raw_data_func: Registered by sensor drivers to be notified of new
  * 	raw data.
  * @notify_raw_data_context: Send to notify_raw_data_func as parameter.
+ * @probe_start: Time the last probe was queued, used for tracing.
  */
 struct lego_port_device {
 	const char *name;
@@ -114,6 +119,7 @@ struct lego_port_device {
 	unsigned raw_data_size;
 	lego_port_notify_raw_data_func_t notify_raw_data_func;
 	void *notify_raw_data_context;
+	ktime_t probe_start;
 };
 
 #define to_lego_port_device(_dev) container_of(_dev, struct lego_port_device, dev)
@@ -122,6 +128,9 @@ extern int lego_port_register(struct lego_port_device *lego_port,
 			      const struct device_type *type,
 			      struct device *parent);
 extern void lego_port_unregister(struct lego_port_device *lego_port);
+extern bool lego_port_queue_probe(struct lego_port_device *lego_port,
+				  struct work_struct *work);
+extern void lego_port_probe_done(struct lego_port_device *lego_port);
 
 static inline void
 lego_port_set_raw_data_ptr_and_func(struct lego_port_device *port,
@@ -138,6 +147,7 @@ lego_port_set_raw_data_ptr_and_func(struct lego_port_device *port,
 static inline void
 lego_port_call_raw_data_func(struct lego_port_device *port)
 {
+	trace_lego_port_raw_data(port);
 	if (port->notify_raw_data_func)
 		port->notify_raw_data_func(port->notify_raw_data_context);
 }
@@ -0,0 +1,106 @@
+/*
+ * Tracepoints for LEGO ports
+ *
+ * Copyright (C) 2016 David Lechner <david@lechnology.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+
+ * This program is distributed "as is" WITHOUT ANY WARRANTY of any
+ * kind, whether express or implied; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM lego
+
+#if !defined(_TRACE_LEGO_PORT_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _TRACE_LEGO_PORT_H
+
+#include <linux/tracepoint.h>
+
+struct lego_port_device;
+
+/*
+ * Emitted when a port hands new raw data to the sensor driver that is
+ * attached to it.
+ */
+TRACE_EVENT(lego_port_raw_data,
+
+	TP_PROTO(const struct lego_port_device *port),
+
+	TP_ARGS(port),
+
+	TP_STRUCT__entry(
+		__string(address, port->address)
+		__field(unsigned, size)
+	),
+
+	TP_fast_assign(
+		__assign_str(address, port->address);
+		__entry->size = port->raw_data_size;
+	),
+
+	TP_printk("address=%s size=%u", __get_str(address), __entry->size)
+);
+
+/*
+ * Emitted when the device detection state machine of a port changes state.
+ * The meaning of the states is private to each port driver.
+ */
+TRACE_EVENT(lego_port_detect,
+
+	TP_PROTO(const struct lego_port_device *port, int old_state,
+		 int new_state),
+
+	TP_ARGS(port, old_state, new_state),
+
+	TP_STRUCT__entry(
+		__string(address, port->address)
+		__field(int, old_state)
+		__field(int, new_state)
+	),
+
+	TP_fast_assign(
+		__assign_str(address, port->address);
+		__entry->old_state = old_state;
+		__entry->new_state = new_state;
+	),
+
+	TP_printk("address=%s state=%d->%d", __get_str(address),
+		  __entry->old_state, __entry->new_state)
+);
+
+/*
+ * Emitted by lego_port_probe_done() when a probe that was queued with
+ * lego_port_queue_probe() has finished.
+ */
+TRACE_EVENT(lego_port_probe,
+
+	TP_PROTO(const struct lego_port_device *port, s64 duration_us),
+
+	TP_ARGS(port, duration_us),
+
+	TP_STRUCT__entry(
+		__string(address, port->address)
+		__field(s64, duration_us)
+	),
+
+	TP_fast_assign(
+		__assign_str(address, port->address);
+		__entry->duration_us = duration_us;
+	),
+
+	TP_printk("address=%s duration=%lldus", __get_str(address),
+		  __entry->duration_us)
+);
+
+#endif /* _TRACE_LEGO_PORT_H */
+
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE lego_port
+
+/* This part must be outside protection */
+#include <trace/define_trace.h>
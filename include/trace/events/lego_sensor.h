@@ -0,0 +1,89 @@
+/*
+ * Tracepoints for LEGO sensors
+ *
+ * Copyright (C) 2016 David Lechner <david@lechnology.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+
+ * This program is distributed "as is" WITHOUT ANY WARRANTY of any
+ * kind, whether express or implied; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM lego
+
+#if !defined(_TRACE_LEGO_SENSOR_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _TRACE_LEGO_SENSOR_H
+
+#include <linux/tracepoint.h>
+
+struct lego_sensor_device;
+
+/*
+ * Emitted when the sensor mode changes, either because it was written to the
+ * mode attribute or because the sensor reported a new mode by itself.
+ */
+TRACE_EVENT(lego_sensor_mode,
+
+	TP_PROTO(const struct lego_sensor_device *sensor, u8 old_mode,
+		 u8 new_mode),
+
+	TP_ARGS(sensor, old_mode, new_mode),
+
+	TP_STRUCT__entry(
+		__string(name, sensor->name)
+		__string(address, sensor->address)
+		__field(u8, old_mode)
+		__field(u8, new_mode)
+	),
+
+	TP_fast_assign(
+		__assign_str(name, sensor->name);
+		__assign_str(address, sensor->address);
+		__entry->old_mode = old_mode;
+		__entry->new_mode = new_mode;
+	),
+
+	TP_printk("name=%s address=%s mode=%u->%u", __get_str(name),
+		  __get_str(address), __entry->old_mode, __entry->new_mode)
+);
+
+/*
+ * Emitted when a sensor driver has stored new data in the raw_data of the
+ * given mode.
+ */
+TRACE_EVENT(lego_sensor_raw_data,
+
+	TP_PROTO(const struct lego_sensor_device *sensor, u8 mode, int size),
+
+	TP_ARGS(sensor, mode, size),
+
+	TP_STRUCT__entry(
+		__string(name, sensor->name)
+		__string(address, sensor->address)
+		__field(u8, mode)
+		__field(int, size)
+	),
+
+	TP_fast_assign(
+		__assign_str(name, sensor->name);
+		__assign_str(address, sensor->address);
+		__entry->mode = mode;
+		__entry->size = size;
+	),
+
+	TP_printk("name=%s address=%s mode=%u size=%d", __get_str(name),
+		  __get_str(address), __entry->mode, __entry->size)
+);
+
+#endif /* _TRACE_LEGO_SENSOR_H */
+
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE lego_sensor
+
+/* This part must be outside protection */
+#include <trace/define_trace.h>
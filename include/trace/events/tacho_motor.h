@@ -0,0 +1,149 @@
+/*
+ * Tracepoints for tacho motors
+ *
+ * Copyright (C) 2016 David Lechner <david@lechnology.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+
+ * This program is distributed "as is" WITHOUT ANY WARRANTY of any
+ * kind, whether express or implied; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM lego
+
+#if !defined(_TRACE_TACHO_MOTOR_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _TRACE_TACHO_MOTOR_H
+
+#include <linux/tracepoint.h>
+
+struct tacho_motor_device;
+struct tacho_motor_params;
+struct tm_pid;
+
+TRACE_DEFINE_ENUM(TM_COMMAND_RUN_FOREVER);
+TRACE_DEFINE_ENUM(TM_COMMAND_RUN_TO_ABS_POS);
+TRACE_DEFINE_ENUM(TM_COMMAND_RUN_TO_REL_POS);
+TRACE_DEFINE_ENUM(TM_COMMAND_RUN_TIMED);
+TRACE_DEFINE_ENUM(TM_COMMAND_RUN_DIRECT);
+TRACE_DEFINE_ENUM(TM_COMMAND_STOP);
+TRACE_DEFINE_ENUM(TM_COMMAND_RESET);
+
+#define show_tm_command(cmd)						\
+	__print_symbolic(cmd,						\
+			 { TM_COMMAND_RUN_FOREVER,	"run-forever" },	\
+			 { TM_COMMAND_RUN_TO_ABS_POS,	"run-to-abs-pos" },	\
+			 { TM_COMMAND_RUN_TO_REL_POS,	"run-to-rel-pos" },	\
+			 { TM_COMMAND_RUN_TIMED,	"run-timed" },		\
+			 { TM_COMMAND_RUN_DIRECT,	"run-direct" },		\
+			 { TM_COMMAND_STOP,		"stop" },		\
+			 { TM_COMMAND_RESET,		"reset" })
+
+/* Emitted when a command has been sent to the motor controller. */
+TRACE_EVENT(tacho_motor_command,
+
+	TP_PROTO(const struct tacho_motor_device *tm, int command,
+		 const struct tacho_motor_params *params, int err),
+
+	TP_ARGS(tm, command, params, err),
+
+	TP_STRUCT__entry(
+		__string(driver_name, tm->driver_name)
+		__string(address, tm->address)
+		__field(int, command)
+		__field(int, duty_cycle_sp)
+		__field(int, speed_sp)
+		__field(int, position_sp)
+		__field(int, err)
+	),
+
+	TP_fast_assign(
+		__assign_str(driver_name, tm->driver_name);
+		__assign_str(address, tm->address);
+		__entry->command = command;
+		__entry->duty_cycle_sp = params->duty_cycle_sp;
+		__entry->speed_sp = params->speed_sp;
+		__entry->position_sp = params->position_sp;
+		__entry->err = err;
+	),
+
+	TP_printk("driver=%s address=%s command=%s duty_cycle_sp=%d speed_sp=%d position_sp=%d err=%d",
+		  __get_str(driver_name), __get_str(address),
+		  show_tm_command(__entry->command), __entry->duty_cycle_sp,
+		  __entry->speed_sp, __entry->position_sp, __entry->err)
+);
+
+/* Emitted each time the ramp work sets a new intermediate speed. */
+TRACE_EVENT(tacho_motor_ramp,
+
+	TP_PROTO(const struct tacho_motor_device *tm),
+
+	TP_ARGS(tm),
+
+	TP_STRUCT__entry(
+		__string(address, tm->address)
+		__field(int, speed)
+		__field(int, end_speed)
+		__field(unsigned long, remaining)
+	),
+
+	TP_fast_assign(
+		__assign_str(address, tm->address);
+		__entry->speed = tm->ramp_last_speed;
+		__entry->end_speed = tm->ramp_end_speed;
+		__entry->remaining = time_is_after_jiffies(tm->ramp_end_time) ?
+				     tm->ramp_end_time - jiffies : 0;
+	),
+
+	TP_printk("address=%s speed=%d end_speed=%d remaining_ms=%u",
+		  __get_str(address), __entry->speed, __entry->end_speed,
+		  jiffies_to_msecs(__entry->remaining))
+);
+
+/*
+ * Emitted by tm_pid_update(). The pid pointer is the only thing that ties
+ * the event to a motor since the PID does not know which motor it belongs to.
+ */
+TRACE_EVENT(tm_pid_update,
+
+	TP_PROTO(const struct tm_pid *pid, int value, int error, int output),
+
+	TP_ARGS(pid, value, error, output),
+
+	TP_STRUCT__entry(
+		__field(const void *, pid)
+		__field(int, setpoint)
+		__field(int, value)
+		__field(int, error)
+		__field(int, integral)
+		__field(int, output)
+		__field(bool, overloaded)
+	),
+
+	TP_fast_assign(
+		__entry->pid = pid;
+		__entry->setpoint = pid->setpoint;
+		__entry->value = value;
+		__entry->error = error;
+		__entry->integral = pid->integral;
+		__entry->output = output;
+		__entry->overloaded = pid->overloaded;
+	),
+
+	TP_printk("pid=%p setpoint=%d value=%d error=%d integral=%d output=%d%s",
+		  __entry->pid, __entry->setpoint, __entry->value,
+		  __entry->error, __entry->integral, __entry->output,
+		  __entry->overloaded ? " overloaded" : "")
+);
+
+#endif /* _TRACE_TACHO_MOTOR_H */
+
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE tacho_motor
+
+/* This part must be outside protection */
+#include <trace/define_trace.h>
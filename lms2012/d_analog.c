@@ -19,10 +19,14 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
  */
 
+#include <linux/bitops.h>
 #include <linux/debugfs.h>
 #include <linux/device.h>
+#include <linux/err.h>
 #include <linux/fs.h>
 #include <linux/hrtimer.h>
+#include <linux/iio/consumer.h>
+#include <linux/iio/iio.h>
 #include <linux/init.h>
 #include <linux/kernel.h>
 #include <linux/miscdevice.h>
@@ -35,6 +39,7 @@
 #include <linux/uaccess.h>
 
 #include "lms2012.h"
+#include "lms2012_snapshot.h"
 
 /* Input port stuff */
 
@@ -102,10 +107,70 @@ static ktime_t Device1Time;
 
 static u8 TestMode = 0;
 
-static ANALOG AnalogDefault;
+static bool bridge;
+module_param(bridge, bool, 0444);
+MODULE_PARM_DESC(bridge, "Fill lms_analog from the iio ADC device instead of using the ports directly");
 
-static ANALOG *pAnalog = &AnalogDefault;
+/* The values in ANALOG that change on every scan */
+typedef struct {
+	DATA16 InPin1[INPUTS];
+	DATA16 InPin6[INPUTS];
+	DATA16 OutPin5[OUTPUTS];
+	DATA16 BatteryTemp;
+	DATA16 MotorCurrent;
+	DATA16 BatteryCurrent;
+	DATA16 Cell123456;
+	DATA16 OutPin5Low[OUTPUTS];
+	DATA8  InDcm[INPUTS];
+	DATA8  InConn[INPUTS];
+	DATA8  OutDcm[OUTPUTS];
+	DATA8  OutConn[OUTPUTS];
+} ANALOGVALUES;
+
+typedef struct {
+	SNAPSHOTHEADER Hdr;
+	ANALOGVALUES Buf[2];
+} ANALOGSNAPSHOT;
+
+/* Layout of the lms_analog shared memory, old readers only know Analog */
+typedef struct {
+	ANALOG Analog;
+	ANALOGSNAPSHOT Snapshot;
+} ANALOGSHM;
+
+static ANALOGSHM AnalogDefault;
+
+static ANALOG *pAnalog = &AnalogDefault.Analog;
 static u16 *pInputs = (u16*)&AnalogDefault;
+static ANALOGSNAPSHOT *pAnalogSnapshot = &AnalogDefault.Snapshot;
+
+/*
+ * Copies the values of a complete scan to the snapshot area so that readers
+ * can get all of them from the same scan
+ */
+static void PublishAnalog(void)
+{
+	ANALOGVALUES *pValues;
+
+	LMS2012_SNAPSHOT_BEGIN(pAnalogSnapshot);
+	pValues = LMS2012_SNAPSHOT_NEXT(pAnalogSnapshot);
+
+	memcpy(pValues->InPin1, pAnalog->InPin1, sizeof(pValues->InPin1));
+	memcpy(pValues->InPin6, pAnalog->InPin6, sizeof(pValues->InPin6));
+	memcpy(pValues->OutPin5, pAnalog->OutPin5, sizeof(pValues->OutPin5));
+	pValues->BatteryTemp = pAnalog->BatteryTemp;
+	pValues->MotorCurrent = pAnalog->MotorCurrent;
+	pValues->BatteryCurrent = pAnalog->BatteryCurrent;
+	pValues->Cell123456 = pAnalog->Cell123456;
+	memcpy(pValues->OutPin5Low, pAnalog->OutPin5Low,
+	       sizeof(pValues->OutPin5Low));
+	memcpy(pValues->InDcm, pAnalog->InDcm, sizeof(pValues->InDcm));
+	memcpy(pValues->InConn, pAnalog->InConn, sizeof(pValues->InConn));
+	memcpy(pValues->OutDcm, pAnalog->OutDcm, sizeof(pValues->OutDcm));
+	memcpy(pValues->OutConn, pAnalog->OutConn, sizeof(pValues->OutConn));
+
+	LMS2012_SNAPSHOT_PUBLISH(pAnalogSnapshot);
+}
 
 static u8 Device3State = 0;
 
@@ -371,6 +436,8 @@ static enum hrtimer_restart Device1TimerInterrupt1(struct hrtimer *pTimer)
 			pAnalog->Updated[Port] = 1;
 		}
 		NxtcolorLatchedCmd[InputPoint2] = NxtcolorCmd[InputPoint2];
+
+		PublishAnalog();
 	}
 
 	return HRTIMER_RESTART;
@@ -713,8 +780,10 @@ static int Device1Init(void)
 	for (i = 0; i < NPAGES * PAGE_SIZE; i += PAGE_SIZE) {
 		SetPageReserved(virt_to_page(((unsigned long)pTmp) + i));
 	}
-	pAnalog = (ANALOG*)pTmp;
-	memset(pAnalog, 0, sizeof(ANALOG));
+	memset(pTmp, 0, sizeof(ANALOGSHM));
+	pAnalog = &((ANALOGSHM *)pTmp)->Analog;
+	pAnalogSnapshot = &((ANALOGSHM *)pTmp)->Snapshot;
+	LMS2012_SNAPSHOT_INIT(pAnalogSnapshot);
 	pInputs = pTmp;
 
 	for (Port = 0;Port < INPUTS;Port++) {
@@ -726,13 +795,15 @@ static int Device1Init(void)
 		pAnalog->OutConn[Port] = 0;
 	}
 
-	SpiReset();
-	SpiUpdate(0x400F);
-	SpiUpdate(0x400F);
-	SpiUpdate(0x400F);
-	SpiUpdate(0x400F);
-	SpiUpdate(0x400F);
-	SpiUpdate(0x400F);
+	if (!bridge) {
+		SpiReset();
+		SpiUpdate(0x400F);
+		SpiUpdate(0x400F);
+		SpiUpdate(0x400F);
+		SpiUpdate(0x400F);
+		SpiUpdate(0x400F);
+		SpiUpdate(0x400F);
+	}
 
 	ret = misc_register(&Device1);
 	if (ret < 0) {
@@ -745,6 +816,10 @@ static int Device1Init(void)
 		return ret;
 	}
 
+	// in bridge mode, the values come from BridgeBufferCb() instead
+	if (bridge)
+		return 0;
+
 	// setup analog update timer interrupt
 
 	Time1[0] = ktime_set(0, 200000);
@@ -772,15 +847,18 @@ static void Device1Exit(void)
 	u16   *pTmp;
 	int     i;
 
-	hrtimer_cancel(&Device1Timer);
+	if (!bridge)
+		hrtimer_cancel(&Device1Timer);
 
 	misc_deregister(&Device1);
 
-	SpiReset();
+	if (!bridge)
+		SpiReset();
 
 	pTmp    = pInputs;
 	pInputs = (u16*)&AnalogDefault;
-	pAnalog = &AnalogDefault;
+	pAnalog = &AnalogDefault.Analog;
+	pAnalogSnapshot = &AnalogDefault.Snapshot;
 
 	for (i = 0; i < NPAGES * PAGE_SIZE; i+= PAGE_SIZE) {
 		ClearPageReserved(virt_to_page(((unsigned long)pTmp) + i));
@@ -1729,6 +1807,152 @@ static void Device3Exit(void)
 		InputPortFloat(Tmp);
 }
 
+// BRIDGE *********************************************************************
+
+/*
+ * Bridge mode
+ *
+ * The input ports are left to the ev3dev drivers and the ADC values in the
+ * shared memory, including the battery values, are filled from the same iio
+ * device that they use instead of from our own SPI scan. The ADC channels must
+ * be listed in the io-channels property of the lms2012 compat node.
+ *
+ * The values come from the buffer of the iio device, so a trigger must be
+ * selected in its current_trigger attribute before the module is loaded,
+ * e.g. an hrtimer trigger at the scan rate of the ADC.
+ *
+ * /dev/lms_dcm is not created in this mode, so InDcm, InConn, OutDcm and
+ * OutConn are not set.
+ */
+
+typedef struct {
+	u8 Index;
+	u8 Shift;
+	u16 Mask;
+	s8 Scale;
+	enum iio_endian Endianness;
+} BRIDGECHANNEL;
+
+static struct iio_cb_buffer *BridgeBuffer;
+static BRIDGECHANNEL BridgeChannel[INPUTADC];
+
+static int BridgeBufferCb(const void *Data, void *Private)
+{
+	const u16 *pRaw = Data;
+	BRIDGECHANNEL *pChan;
+	u16 Value;
+	int i;
+
+	for (i = 0; i < INPUTADC; i++) {
+		pChan = &BridgeChannel[i];
+		Value = pRaw[pChan->Index];
+		if (pChan->Endianness == IIO_BE)
+			Value = be16_to_cpu((__force __be16)Value);
+		else if (pChan->Endianness == IIO_LE)
+			Value = le16_to_cpu((__force __le16)Value);
+		Value = (Value >> pChan->Shift) & pChan->Mask;
+		// the rest of lms2012 expects 12-bit ADC counts
+		if (pChan->Scale > 0)
+			Value <<= pChan->Scale;
+		else
+			Value >>= -pChan->Scale;
+		pInputs[i] = Value;
+	}
+	for (i = 0; i < INPUTS; i++)
+		pAnalog->Updated[i] = 1;
+
+	PublishAnalog();
+
+	return 0;
+}
+
+static int BridgeInit(void)
+{
+	struct iio_channel *pChans;
+	const struct iio_chan_spec *pSpec;
+	struct iio_dev *pIio;
+	u32 Channel;
+	int i, j, ret;
+
+	BridgeBuffer = iio_channel_get_all_cb(Device1Lms2012CompatDev,
+					      BridgeBufferCb, NULL);
+	if (IS_ERR(BridgeBuffer))
+		return PTR_ERR(BridgeBuffer);
+
+	pIio = iio_channel_cb_get_iio_dev(BridgeBuffer);
+	if (!pIio->trig) {
+		dev_err(Device1Lms2012CompatDev,
+			"%s has no trigger, set its current_trigger first\n",
+			pIio->name);
+		ret = -EINVAL;
+		goto err_release_cb;
+	}
+
+	/*
+	 * The buffer has the values in the order of the scan index, not in the
+	 * order of io-channels, so count the lower ones. This only works if
+	 * all values have the same size.
+	 */
+	pChans = iio_channel_cb_get_channels(BridgeBuffer);
+	for (j = 0; pChans[j].channel; j++) {
+		pSpec = pChans[j].channel;
+		if (pSpec->scan_type.storagebits != 16
+		    || pSpec->scan_type.sign != 'u'
+		    || !pSpec->scan_type.realbits
+		    || pSpec->scan_type.shift + pSpec->scan_type.realbits > 16) {
+			dev_err(Device1Lms2012CompatDev,
+				"Channel %d of %s is not unsigned 16-bit\n",
+				pSpec->channel, pIio->name);
+			ret = -EINVAL;
+			goto err_release_cb;
+		}
+	}
+	for (i = 0; i < INPUTADC; i++) {
+		Channel = Device1Lms2012Compat->adc_map[i];
+		pSpec = NULL;
+		for (j = 0; pChans[j].channel; j++) {
+			if (pChans[j].channel->channel == Channel)
+				pSpec = pChans[j].channel;
+		}
+		if (!pSpec) {
+			dev_err(Device1Lms2012CompatDev,
+				"No io-channel for adc channel %u\n", Channel);
+			ret = -EINVAL;
+			goto err_release_cb;
+		}
+
+		BridgeChannel[i].Index = 0;
+		for (j = 0; pChans[j].channel; j++) {
+			if (pChans[j].channel->scan_index < pSpec->scan_index)
+				BridgeChannel[i].Index++;
+		}
+		BridgeChannel[i].Shift = pSpec->scan_type.shift;
+		BridgeChannel[i].Mask = GENMASK(pSpec->scan_type.realbits - 1, 0);
+		BridgeChannel[i].Scale = 12 - pSpec->scan_type.realbits;
+		BridgeChannel[i].Endianness = pSpec->scan_type.endianness;
+	}
+
+	ret = iio_channel_start_all_cb(BridgeBuffer);
+	if (ret < 0) {
+		dev_err(Device1Lms2012CompatDev,
+			"Failed to start iio callbacks\n");
+		goto err_release_cb;
+	}
+
+	return 0;
+
+err_release_cb:
+	iio_channel_release_all_cb(BridgeBuffer);
+
+	return ret;
+}
+
+static void BridgeExit(void)
+{
+	iio_channel_stop_all_cb(BridgeBuffer);
+	iio_channel_release_all_cb(BridgeBuffer);
+}
+
 // MODULE *********************************************************************
 
 static int d_analog_probe(struct platform_device *pdev)
@@ -1738,6 +1962,19 @@ static int d_analog_probe(struct platform_device *pdev)
 	ret = Device1Init();
 	if (ret < 0)
 		return ret;
+
+	if (bridge) {
+		ret = BridgeInit();
+		if (ret < 0) {
+			Device1Exit();
+			return ret;
+		}
+
+		pr_info("d_analog registered in bridge mode\n");
+
+		return 0;
+	}
+
 	ret = Device3Init();
 	if (ret < 0) {
 		Device1Exit();
@@ -1751,6 +1988,15 @@ static int d_analog_probe(struct platform_device *pdev)
 
 static int d_analog_remove(struct platform_device *pdev)
 {
+	if (bridge) {
+		BridgeExit();
+		Device1Exit();
+
+		pr_info("d_analog removed\n");
+
+		return 0;
+	}
+
 	Device3Exit();
 	Device1Exit();
 
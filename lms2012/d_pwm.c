@@ -30,14 +30,19 @@
 #include <linux/miscdevice.h>
 #include <linux/mm.h>
 #include <linux/module.h>
+#include <linux/mutex.h>
 #include <linux/platform_device.h>
 #include <linux/rcupdate.h>
 #include <linux/sched.h>
 #include <linux/signal.h>
 #include <linux/slab.h>
 #include <linux/uaccess.h>
+#include <linux/workqueue.h>
+
+#include <tacho_motor_class.h>
 
 #include "lms2012.h"
+#include "lms2012_snapshot.h"
 
 #define MODULE_NAME		"pwm_module"
 #define DEVICE1_NAME		PWM_DEVICE
@@ -159,6 +164,17 @@ typedef struct {
 	SLONG TachoSensor;
 } MOTORDATA;
 
+typedef struct {
+	SNAPSHOTHEADER Hdr;
+	MOTORDATA Buf[2][OUTPUTS];
+} MOTORSNAPSHOT;
+
+/* Layout of the lms_motor shared memory, old readers only know Motor */
+typedef struct {
+	MOTORDATA Motor[OUTPUTS];
+	MOTORSNAPSHOT Snapshot;
+} MOTORSHM;
+
 typedef struct {
 	DATA8   Cmd;
 	DATA8   Nos;
@@ -248,24 +264,27 @@ typedef struct {
 	UBYTE ArrayPtrOld;
 } TACHOSAMPLES;
 
-static irqreturn_t IntA (int irq, void * dev);
-static irqreturn_t IntB (int irq, void * dev);
-static irqreturn_t IntC (int irq, void * dev);
-static irqreturn_t IntD (int irq, void * dev);
+/*
+ *  Per port data for the tacho interrupt. The pins are looked up once at
+ *  init so that the interrupt handler does not have to go through
+ *  lms2012-compat on every edge.
+ */
+typedef struct {
+	UBYTE No;
+	int Irq;
+	struct gpio_desc *IntPin;
+	struct gpio_desc *DirPin;
+} TACHOIRQ;
+
+static TACHOIRQ TachoIrq[OUTPUTS];
+
+static irqreturn_t IntTacho(int irq, void *dev);
+static void SetTachoIrq(UBYTE Port);
 
 static UBYTE dCalculateSpeed(UBYTE No, SBYTE *pSpeed);
-static void SetGpioRisingIrq(UBYTE Port, UBYTE PinNo, irqreturn_t (*IntFuncPtr)(int, void *));
 static void GetSyncDurationCnt(SLONG *pCount0, SLONG *pCount1);
 static void CheckforEndOfSync(void);
 
-#define OutputReadDir(port, pin) \
-	gpiod_get_value(Device1Lms2012Compat->out_pins[port]->desc[pin])
-
-#define READDirA OutputReadDir(0, OUTPUT_PORT_PIN5R)
-#define READDirB OutputReadDir(1, OUTPUT_PORT_PIN5R)
-#define READDirC OutputReadDir(2, OUTPUT_PORT_PIN5R)
-#define READDirD OutputReadDir(3, OUTPUT_PORT_PIN5R)
-
 static struct device *Device1Lms2012CompatDev;
 static struct lms2012_compat *Device1Lms2012Compat;
 
@@ -288,8 +307,9 @@ static TACHOSAMPLES    TachoSamples[OUTPUTS];
 static UBYTE           ReadyStatus = 0;
 static UBYTE           TestStatus  = 0;
 
-static MOTORDATA       MotorData[OUTPUTS];
-static MOTORDATA       *pMotor = MotorData;
+static MOTORSHM        MotorData;
+static MOTORDATA       *pMotor = MotorData.Motor;
+static MOTORSNAPSHOT   *pMotorSnapshot = &MotorData.Snapshot;
 
 static ktime_t         TimeOutSpeed0[OUTPUTS];
 static UBYTE           MinRegEnabled[OUTPUTS];
@@ -392,11 +412,6 @@ static inline void SETAvgTachoCount(u8 Port, u8 Speed)
 #define OutputLow(port, pin) \
 	gpiod_direction_output(Device1Lms2012Compat->out_pins[port]->desc[pin], 0)
 
-#define READIntA OutputRead(0, OUTPUT_PORT_PIN6)
-#define READIntB OutputRead(1, OUTPUT_PORT_PIN6)
-#define READIntC OutputRead(2, OUTPUT_PORT_PIN6)
-#define READIntD OutputRead(3, OUTPUT_PORT_PIN6)
-
 static void CheckSpeedPowerLimits(SBYTE *pCheckVal)
 {
 	if (MAX_SPEED < *pCheckVal) {
@@ -997,6 +1012,18 @@ static void TestAndFloatSyncedMotors(UBYTE MotorBitField, UBYTE SyncCmd)
 	}
 }
 
+/*
+ *  Copies the shared memory to the snapshot area so that readers can get all
+ *  values from the same update
+ */
+static void PublishMotorData(void)
+{
+	LMS2012_SNAPSHOT_BEGIN(pMotorSnapshot);
+	memcpy(LMS2012_SNAPSHOT_NEXT(pMotorSnapshot), pMotor,
+	       sizeof(MOTORDATA) * OUTPUTS);
+	LMS2012_SNAPSHOT_PUBLISH(pMotorSnapshot);
+}
+
 /*
  *  Motor timer interrupt function
  *
@@ -1473,6 +1500,8 @@ static enum hrtimer_restart Device1TimerInterrupt1(struct hrtimer *pTimer)
 		}
 	}
 
+	PublishMotorData();
+
 	return HRTIMER_RESTART;
 }
 
@@ -2289,10 +2318,9 @@ static int Device1Init(void)
 	SyncMNos[1] = UNUSED_SYNC_MOTOR;
 
 	// Setup interrupt for the tacho int pins
-	SetGpioRisingIrq(0, OUTPUT_PORT_PIN6, IntA);
-	SetGpioRisingIrq(1, OUTPUT_PORT_PIN6, IntB);
-	SetGpioRisingIrq(2, OUTPUT_PORT_PIN6, IntC);
-	SetGpioRisingIrq(3, OUTPUT_PORT_PIN6, IntD);
+	for (Tmp = 0; Tmp < OUTPUTS; Tmp++) {
+		SetTachoIrq(Tmp);
+	}
 
 	ret = misc_register(&Device1);
 
@@ -2306,28 +2334,36 @@ static void Device1Exit(void)
 	misc_deregister(&Device1);
 	hrtimer_cancel(&Device1Timer);
 	for (i = 0; i < OUTPUTS; i++) {
+		if (TachoIrq[i].Irq > 0) {
+			free_irq(TachoIrq[i].Irq, &TachoIrq[i]);
+		}
 		SetCoast(i);
 		pwm_disable(Device1Lms2012Compat->out_pwms[i]);
 	}
 	put_device(Device1Lms2012CompatDev);
 }
 
-static void SetGpioRisingIrq(UBYTE Port, UBYTE PinNo, irqreturn_t (*IntFuncPtr)(int, void *))
+static void SetTachoIrq(UBYTE Port)
 {
-	UWORD Status;
-	int irq;
+	TACHOIRQ *pIrq = &TachoIrq[Port];
+	int Status;
 
-	irq = gpiod_to_irq(Device1Lms2012Compat->out_pins[Port]->desc[PinNo]);
+	pIrq->No     = Port;
+	pIrq->IntPin = Device1Lms2012Compat->out_pins[Port]->desc[OUTPUT_PORT_PIN6];
+	pIrq->DirPin = Device1Lms2012Compat->out_pins[Port]->desc[OUTPUT_PORT_PIN5R];
+	pIrq->Irq    = gpiod_to_irq(pIrq->IntPin);
 
-	Status = request_irq(irq, IntFuncPtr, 0, "PWM_DEVICE", NULL);
+	Status = request_irq(pIrq->Irq, IntTacho,
+			     IRQF_TRIGGER_RISING | IRQF_TRIGGER_FALLING,
+			     "PWM_DEVICE", pIrq);
 	if (Status < 0) {
-		printk("error %d requesting GPIO IRQ %d\n", Status, PinNo);
+		printk("error %d requesting tacho IRQ for port %d\n", Status, Port);
+		pIrq->Irq = 0;
 	}
-	irq_set_irq_type(irq, IRQ_TYPE_EDGE_RISING | IRQ_TYPE_EDGE_FALLING);
 }
 
 /*
- *  Tacho A interrupt function
+ *  Tacho interrupt function, shared by all ports
  *
  *  Tacho count is incremented or decremented on both positive
  *  and negative edges of the OUTPUT_PORT_PIN6 signal.
@@ -2335,311 +2371,53 @@ static void SetGpioRisingIrq(UBYTE Port, UBYTE PinNo, irqreturn_t (*IntFuncPtr)(
  *  For each positive and negative edge of the OUTPUT_PORT_PIN6 tacho signal
  *  a timer is sampled. this is used to calculate the speed later on.
  *
+ *  Above speed 35 the direction can't change between two edges, so the pins
+ *  are only read below that. Below that, the motor runs forward when
+ *  OUTPUT_PORT_PIN6 and OUTPUT_PORT_PIN5R have the same level.
+ *
  *  DirChgPtr is implemented for ensuring that there is enough
  *  samples in the same direction to calculate a speed.
  */
-static irqreturn_t IntA (int irq, void * dev)
+static irqreturn_t IntTacho(int irq, void *dev)
 {
+	TACHOIRQ *pIrq = dev;
+	MOTOR *pM = &Motor[pIrq->No];
+	TACHOSAMPLES *pSamples = &TachoSamples[pIrq->No];
+	UBYTE MaxDirChg = SamplesPerSpeed[pIrq->No][SAMPLES_ABOVE_SPEED_75];
 	UBYTE TmpPtr;
-	ULONG IntAState;
-	ULONG DirAState;
-	ktime_t Timer;
-
-	// Sample all necessary items as fast as possible
-	IntAState = READIntA;
-	DirAState = READDirA;
-	Timer     = ktime_get();
-
-	TmpPtr = (TachoSamples[0].ArrayPtr + 1) & (NO_OF_TACHO_SAMPLES-1);
-	TachoSamples[0].TachoArray[TmpPtr] = Timer;
-	TachoSamples[0].ArrayPtr           = TmpPtr;
-
-	if ((35 < Motor[0].Speed) || (-35 > Motor[0].Speed)) {
-		if (FORWARD == Motor[0].Direction) {
-			(Motor[0].IrqTacho)++;
-		} else {
-			(Motor[0].IrqTacho)--;
-		}
-		if (Motor[0].DirChgPtr < SamplesPerSpeed[0][SAMPLES_ABOVE_SPEED_75]) {
-			Motor[0].DirChgPtr++;
-		}
-	} else {
-		if (IntAState) {
-			if (DirAState) {
-				if (FORWARD == Motor[0].Direction) {
-					if (Motor[0].DirChgPtr < SamplesPerSpeed[0][SAMPLES_ABOVE_SPEED_75]) {
-						Motor[0].DirChgPtr++;
-					}
-				} else {
-					Motor[0].DirChgPtr = 0;
-				}
-				(Motor[0].IrqTacho)++;
-				Motor[0].Direction = FORWARD;
-			} else {
-				if (BACKWARD == Motor[0].Direction) {
-					TachoSamples[0].TachoArray[TmpPtr] = Timer;
-					TachoSamples[0].ArrayPtr = TmpPtr;
-					if (Motor[0].DirChgPtr < SamplesPerSpeed[0][SAMPLES_ABOVE_SPEED_75]) {
-						Motor[0].DirChgPtr++;
-					}
-				} else {
-					Motor[0].DirChgPtr = 0;
-				}
-				(Motor[0].IrqTacho)--;
-				Motor[0].Direction = BACKWARD;
-			}
-		} else {
-			if (DirAState) {
-				if (BACKWARD == Motor[0].Direction) {
-					if (Motor[0].DirChgPtr < SamplesPerSpeed[0][SAMPLES_ABOVE_SPEED_75]) {
-						Motor[0].DirChgPtr++;
-					}
-				} else {
-					Motor[0].DirChgPtr = 0;
-				}
-				(Motor[0].IrqTacho)--;
-				Motor[0].Direction = BACKWARD;
-			} else {
-				if (FORWARD == Motor[0].Direction) {
-					if (Motor[0].DirChgPtr < SamplesPerSpeed[0][SAMPLES_ABOVE_SPEED_75]) {
-						Motor[0].DirChgPtr++;
-					}
-				} else {
-					Motor[0].DirChgPtr = 0;
-				}
-				(Motor[0].IrqTacho)++;
-				Motor[0].Direction = FORWARD;
-			}
-		}
-	}
-
-	return IRQ_HANDLED;
-}
-
-static irqreturn_t IntB (int irq, void * dev)
-{
-	UBYTE TmpPtr;
-	ULONG IntBState;
-	ULONG DirBState;
+	UBYTE Direction;
 	ktime_t Timer;
 
-	// Sample all necessary items as fast as possible
-	IntBState = READIntB;
-	DirBState = READDirB;
-	Timer     = ktime_get();
-
-	TmpPtr = (TachoSamples[1].ArrayPtr + 1) & (NO_OF_TACHO_SAMPLES-1);
-	TachoSamples[1].TachoArray[TmpPtr] = Timer;
-	TachoSamples[1].ArrayPtr           = TmpPtr;
-
-	if ((35 < Motor[1].Speed) || (-35 > Motor[1].Speed)) {
-		if (FORWARD == Motor[1].Direction) {
-			(Motor[1].IrqTacho)++;
-		} else {
-			(Motor[1].IrqTacho)--;
-		}
-
-		if (Motor[1].DirChgPtr < SamplesPerSpeed[1][SAMPLES_ABOVE_SPEED_75]) {
-			Motor[1].DirChgPtr++;
-		}
+	if ((35 < pM->Speed) || (-35 > pM->Speed)) {
+		Direction = pM->Direction;
+		Timer     = ktime_get();
 	} else {
-		if (IntBState) {
-			if (DirBState) {
-				if (FORWARD == Motor[1].Direction) {
-					if (Motor[1].DirChgPtr < SamplesPerSpeed[1][SAMPLES_ABOVE_SPEED_75]) {
-						Motor[1].DirChgPtr++;
-					}
-				} else {
-					Motor[1].DirChgPtr = 0;
-				}
-				(Motor[1].IrqTacho)++;
-				Motor[1].Direction = FORWARD;
-			} else {
-				if (BACKWARD == Motor[1].Direction) {
-					if (Motor[1].DirChgPtr < SamplesPerSpeed[1][SAMPLES_ABOVE_SPEED_75]) {
-						Motor[1].DirChgPtr++;
-					}
-				} else {
-					Motor[1].DirChgPtr = 0;
-				}
-				(Motor[1].IrqTacho)--;
-				Motor[1].Direction = BACKWARD;
-			}
+		// Sample all necessary items as fast as possible
+		if (!gpiod_get_value(pIrq->IntPin) == !gpiod_get_value(pIrq->DirPin)) {
+			Direction = FORWARD;
 		} else {
-			if (DirBState) {
-				if (BACKWARD == Motor[1].Direction) {
-					if (Motor[1].DirChgPtr < SamplesPerSpeed[1][SAMPLES_ABOVE_SPEED_75]) {
-						Motor[1].DirChgPtr++;
-					}
-				} else {
-					Motor[1].DirChgPtr = 0;
-				}
-				(Motor[1].IrqTacho)--;
-				Motor[1].Direction = BACKWARD;
-			} else {
-				if (FORWARD == Motor[1].Direction) {
-					if (Motor[1].DirChgPtr < SamplesPerSpeed[1][SAMPLES_ABOVE_SPEED_75]) {
-						Motor[1].DirChgPtr++;
-					}
-				} else {
-					Motor[1].DirChgPtr = 0;
-				}
-				(Motor[1].IrqTacho)++;
-				Motor[1].Direction = FORWARD;
-			}
+			Direction = BACKWARD;
 		}
+		Timer = ktime_get();
 	}
 
-	return IRQ_HANDLED;
-}
-
-static irqreturn_t IntC (int irq, void * dev)
-{
-	UBYTE TmpPtr;
-	ULONG IntCState;
-	ULONG DirCState;
-	ktime_t Timer;
-
-	// Sample all necessary items as fast as possible
-	IntCState = READIntC;
-	DirCState = READDirC;
-	Timer     = ktime_get();
-
-	TmpPtr = (TachoSamples[2].ArrayPtr + 1) & (NO_OF_TACHO_SAMPLES-1);
-	TachoSamples[2].TachoArray[TmpPtr] = Timer;
-	TachoSamples[2].ArrayPtr           = TmpPtr;
+	TmpPtr = (pSamples->ArrayPtr + 1) & (NO_OF_TACHO_SAMPLES - 1);
+	pSamples->TachoArray[TmpPtr] = Timer;
+	pSamples->ArrayPtr           = TmpPtr;
 
-	if ((35 < Motor[2].Speed) || (-35 > Motor[2].Speed)) {
-		if (FORWARD == Motor[2].Direction) {
-			(Motor[2].IrqTacho)++;
-		} else {
-			(Motor[2].IrqTacho)--;
-		}
-		if (Motor[2].DirChgPtr < SamplesPerSpeed[2][SAMPLES_ABOVE_SPEED_75]) {
-			Motor[2].DirChgPtr++;
+	if (Direction == pM->Direction) {
+		if (pM->DirChgPtr < MaxDirChg) {
+			pM->DirChgPtr++;
 		}
 	} else {
-		if (IntCState) {
-			if (DirCState) {
-				if (FORWARD == Motor[2].Direction) {
-					if (Motor[2].DirChgPtr < SamplesPerSpeed[2][SAMPLES_ABOVE_SPEED_75]) {
-						Motor[2].DirChgPtr++;
-					}
-				} else {
-					Motor[2].DirChgPtr = 0;
-				}
-				(Motor[2].IrqTacho)++;
-				Motor[2].Direction = FORWARD;
-			} else {
-				if (BACKWARD == Motor[2].Direction) {
-					if (Motor[2].DirChgPtr < SamplesPerSpeed[2][SAMPLES_ABOVE_SPEED_75]) {
-						Motor[2].DirChgPtr++;
-					}
-				} else {
-					Motor[2].DirChgPtr = 0;
-				}
-				(Motor[2].IrqTacho)--;
-				Motor[2].Direction = BACKWARD;
-			}
-		} else {
-			if (DirCState) {
-				if (BACKWARD == Motor[2].Direction) {
-					if (Motor[2].DirChgPtr < SamplesPerSpeed[2][SAMPLES_ABOVE_SPEED_75]) {
-						Motor[2].DirChgPtr++;
-					}
-				} else {
-					Motor[2].DirChgPtr = 0;
-				}
-				(Motor[2].IrqTacho)--;
-				Motor[2].Direction = BACKWARD;
-			} else {
-				if (FORWARD == Motor[2].Direction) {
-					if (Motor[2].DirChgPtr < SamplesPerSpeed[2][SAMPLES_ABOVE_SPEED_75]) {
-						Motor[2].DirChgPtr++;
-					}
-				} else {
-					Motor[2].DirChgPtr = 0;
-				}
-				(Motor[2].IrqTacho)++;
-				Motor[2].Direction = FORWARD;
-			}
-		}
+		pM->DirChgPtr = 0;
 	}
+	pM->Direction = Direction;
 
-	return IRQ_HANDLED;
-}
-
-static irqreturn_t IntD (int irq, void * dev)
-{
-	UBYTE TmpPtr;
-	ULONG IntDState;
-	ULONG DirDState;
-	ktime_t Timer;
-
-	// Sample all necessary items as fast as possible
-	IntDState = READIntD;
-	DirDState = READDirD;
-	Timer     = ktime_get();
-
-	TmpPtr = (TachoSamples[3].ArrayPtr + 1) & (NO_OF_TACHO_SAMPLES-1);
-	TachoSamples[3].TachoArray[TmpPtr] = Timer;
-	TachoSamples[3].ArrayPtr           = TmpPtr;
-
-	if ((35 < Motor[3].Speed) || (-35 > Motor[3].Speed)) {
-		if (FORWARD == Motor[3].Direction) {
-			(Motor[3].IrqTacho)++;
-		} else {
-			(Motor[3].IrqTacho)--;
-		}
-		if (Motor[3].DirChgPtr < SamplesPerSpeed[3][SAMPLES_ABOVE_SPEED_75]) {
-			Motor[3].DirChgPtr++;
-		}
+	if (FORWARD == Direction) {
+		(pM->IrqTacho)++;
 	} else {
-		if (IntDState) {
-			if (DirDState) {
-				if (FORWARD == Motor[3].Direction) {
-					if (Motor[3].DirChgPtr < SamplesPerSpeed[3][SAMPLES_ABOVE_SPEED_75]) {
-						Motor[3].DirChgPtr++;
-					}
-				} else {
-					Motor[3].DirChgPtr = 0;
-				}
-				(Motor[3].IrqTacho)++;
-				Motor[3].Direction = FORWARD;
-			} else {
-				if (BACKWARD == Motor[3].Direction) {
-					if (Motor[3].DirChgPtr < SamplesPerSpeed[3][SAMPLES_ABOVE_SPEED_75]) {
-						Motor[3].DirChgPtr++;
-					}
-				} else {
-					Motor[3].DirChgPtr = 0;
-				}
-				(Motor[3].IrqTacho)--;
-				Motor[3].Direction = BACKWARD;
-			}
-		} else {
-			if (DirDState) {
-				if (BACKWARD == Motor[3].Direction) {
-					if (Motor[3].DirChgPtr < SamplesPerSpeed[3][SAMPLES_ABOVE_SPEED_75]) {
-						Motor[3].DirChgPtr++;
-					}
-				} else {
-					Motor[3].DirChgPtr = 0;
-				}
-				(Motor[3].IrqTacho)--;
-				Motor[3].Direction = BACKWARD;
-			} else {
-				if (FORWARD == Motor[3].Direction) {
-					if (Motor[3].DirChgPtr < SamplesPerSpeed[3][SAMPLES_ABOVE_SPEED_75]) {
-						Motor[3].DirChgPtr++;
-					}
-				} else {
-					Motor[3].DirChgPtr = 0;
-				}
-				(Motor[3].IrqTacho)++;
-				Motor[3].Direction = FORWARD;
-			}
-		}
+		(pM->IrqTacho)--;
 	}
 
 	return IRQ_HANDLED;
@@ -2776,8 +2554,10 @@ static int Device2Init(void)
 	for (i = 0; i < NPAGES * PAGE_SIZE; i += PAGE_SIZE) {
 		SetPageReserved(virt_to_page(((unsigned long)pTmp) + i));
 	}
-	pMotor = pTmp;
-	memset(pMotor, 0, sizeof(MotorData));
+	memset(pTmp, 0, sizeof(MOTORSHM));
+	pMotor = ((MOTORSHM *)pTmp)->Motor;
+	pMotorSnapshot = &((MOTORSHM *)pTmp)->Snapshot;
+	LMS2012_SNAPSHOT_INIT(pMotorSnapshot);
 
 	ret = misc_register(&Device2);
 	if (ret < 0) {
@@ -2796,7 +2576,8 @@ static void Device2Exit(void)
 	misc_deregister(&Device2);
 
 	pTmp   = pMotor;
-	pMotor = MotorData;
+	pMotor = MotorData.Motor;
+	pMotorSnapshot = &MotorData.Snapshot;
 	// free shared memory
 	for (i = 0; i < NPAGES * PAGE_SIZE; i+= PAGE_SIZE) {
 		ClearPageReserved(virt_to_page(((unsigned long)pTmp) + i));
@@ -2805,10 +2586,162 @@ static void Device2Exit(void)
 	kfree(kmalloc_ptr);
 }
 
+/*
+ * Bridge mode
+ *
+ * The output ports are left to the ev3dev motor drivers and the shared
+ * memory is filled from the tacho-motor class devices on outA to outD instead
+ * of from our own tacho interrupts. This way the real-time work is only done
+ * once and lms2012 programs can still read MotorData without a syscall.
+ * /dev/lms_pwm is not created in this mode, so motors must be controlled
+ * through the tacho-motor class.
+ */
+
+static bool bridge;
+module_param(bridge, bool, 0444);
+MODULE_PARM_DESC(bridge, "Fill lms_motor from the tacho-motor class instead of using the output ports directly");
+
+static struct tacho_motor_device *BridgeMotor[OUTPUTS];
+static DEFINE_MUTEX(BridgeLock);
+static struct hrtimer BridgeTimer;
+static struct work_struct BridgeWork;
+static bool BridgeStopping;
+
+static int BridgePort(struct device *dev)
+{
+	struct tacho_motor_device *tm =
+		container_of(dev, struct tacho_motor_device, dev);
+
+	if (strncmp(tm->address, "out", 3) || tm->address[4] != '\0')
+		return -1;
+	if (tm->address[3] < 'A' || tm->address[3] >= 'A' + OUTPUTS)
+		return -1;
+
+	return tm->address[3] - 'A';
+}
+
+static int BridgeAddDev(struct device *dev, struct class_interface *intf)
+{
+	int Port = BridgePort(dev);
+
+	if (Port < 0)
+		return 0;
+
+	mutex_lock(&BridgeLock);
+	BridgeMotor[Port] = container_of(dev, struct tacho_motor_device, dev);
+	mutex_unlock(&BridgeLock);
+
+	return 0;
+}
+
+static void BridgeRemoveDev(struct device *dev, struct class_interface *intf)
+{
+	int Port = BridgePort(dev);
+
+	if (Port < 0)
+		return;
+
+	mutex_lock(&BridgeLock);
+	if (BridgeMotor[Port] && &BridgeMotor[Port]->dev == dev)
+		BridgeMotor[Port] = NULL;
+	mutex_unlock(&BridgeLock);
+}
+
+static struct class_interface BridgeInterface = {
+	.class		= &tacho_motor_class,
+	.add_dev	= BridgeAddDev,
+	.remove_dev	= BridgeRemoveDev,
+};
+
+static void BridgeWorkFunc(struct work_struct *work)
+{
+	struct tacho_motor_device *tm;
+	int Port, Position, Speed;
+
+	for (Port = 0; Port < OUTPUTS; Port++) {
+		Position = 0;
+		Speed = 0;
+
+		mutex_lock(&BridgeLock);
+		tm = BridgeMotor[Port];
+		if (tm) {
+			tm->ops->get_position(tm->context, &Position);
+			/* speed is scaled to the motor's max_speed */
+			if (tm->ops->get_speed && tm->info
+			    && tm->info->max_speed > 0) {
+				tm->ops->get_speed(tm->context, &Speed);
+				Speed = Speed * MAX_SPEED / tm->info->max_speed;
+				Speed = clamp(Speed, -MAX_SPEED, MAX_SPEED);
+			}
+		}
+		mutex_unlock(&BridgeLock);
+
+		pMotor[Port].TachoCounts = Position;
+		pMotor[Port].TachoSensor = Position;
+		pMotor[Port].Speed = Speed;
+	}
+
+	PublishMotorData();
+}
+
+static enum hrtimer_restart BridgeTimerFunc(struct hrtimer *pTimer)
+{
+	if (BridgeStopping)
+		return HRTIMER_NORESTART;
+
+	hrtimer_forward_now(pTimer, ms_to_ktime(SOFT_TIMER_MS));
+	schedule_work(&BridgeWork);
+
+	return HRTIMER_RESTART;
+}
+
+static int BridgeInit(void)
+{
+	int ret;
+
+	INIT_WORK(&BridgeWork, BridgeWorkFunc);
+	hrtimer_init(&BridgeTimer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	BridgeTimer.function = BridgeTimerFunc;
+
+	/* this calls BridgeAddDev() for motors that already exist */
+	ret = class_interface_register(&BridgeInterface);
+	if (ret < 0)
+		return ret;
+
+	BridgeStopping = false;
+	hrtimer_start(&BridgeTimer, ms_to_ktime(SOFT_TIMER_MS), HRTIMER_MODE_REL);
+
+	return 0;
+}
+
+static void BridgeExit(void)
+{
+	BridgeStopping = true;
+	hrtimer_cancel(&BridgeTimer);
+	cancel_work_sync(&BridgeWork);
+	class_interface_unregister(&BridgeInterface);
+}
+
 static int d_pwm_probe(struct platform_device *pdev)
 {
 	int ret;
 
+	if (bridge) {
+		ret = Device2Init();
+		if (ret < 0)
+			return ret;
+
+		ret = BridgeInit();
+		if (ret < 0) {
+			Device2Exit();
+			return ret;
+		}
+
+		pr_info("d_pwm registered in bridge mode\n");
+
+		return 0;
+	}
+
 	ret = Device1Init();
 	if (ret < 0)
 		return ret;
@@ -2832,6 +2765,15 @@ static int d_pwm_probe(struct platform_device *pdev)
 
 static int d_pwm_remove(struct platform_device *pdev)
 {
+	if (bridge) {
+		BridgeExit();
+		Device2Exit();
+
+		pr_info("d_pwm removed\n");
+
+		return 0;
+	}
+
 	Device2Exit();
 	Device1Exit();
 
@@ -0,0 +1,77 @@
+/*
+ * lms2012 compatibility - consistent snapshots of shared memory
+ *
+ * Copyright (C) 2016 David Lechner <david@lechnology.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+
+ * This program is distributed "as is" WITHOUT ANY WARRANTY of any
+ * kind, whether express or implied; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * The lms2012 shared memory areas are updated in place by timers, so a reader
+ * can see some fields from one update and some from the next. To fix this
+ * without breaking old readers, a snapshot area is appended after the legacy
+ * data. It has a header and two copies of the data.
+ *
+ * Seq is incremented once before and once after each update, so it is odd
+ * while the writer is busy. The writer only fills the copy that readers are
+ * not using, Buf[((Seq >> 1) + 1) & 1], and the second increment makes it the
+ * current one, Buf[(Seq >> 1) & 1].
+ *
+ * Readers check Magic and Version and then do:
+ *
+ *     do {
+ *         seq = Seq;
+ *         read barrier;
+ *         copy Buf[(seq >> 1) & 1];
+ *         read barrier;
+ *     } while (Seq != seq);
+ *
+ * The copy being read is not touched by the update that is in progress, so
+ * a reader does not have to wait for it, but any change of Seq means that
+ * the copy may have been overwritten, so the reader must try again.
+ */
+
+#ifndef _LMS2012_SNAPSHOT_H_
+#define _LMS2012_SNAPSHOT_H_
+
+#include <linux/compiler.h>
+#include <asm/barrier.h>
+
+#define LMS2012_SNAPSHOT_MAGIC		0x50414e53	/* "SNAP" */
+#define LMS2012_SNAPSHOT_VERSION	2
+
+typedef struct {
+	ULONG Magic;
+	ULONG Version;
+	ULONG Seq;
+} SNAPSHOTHEADER;
+
+#define LMS2012_SNAPSHOT_INIT(s) do {				\
+	(s)->Hdr.Magic = LMS2012_SNAPSHOT_MAGIC;		\
+	(s)->Hdr.Version = LMS2012_SNAPSHOT_VERSION;		\
+	(s)->Hdr.Seq = 0;					\
+} while (0)
+
+/* Starts an update. There must only be one writer. */
+#define LMS2012_SNAPSHOT_BEGIN(s) do {				\
+	WRITE_ONCE((s)->Hdr.Seq, (s)->Hdr.Seq + 1);		\
+	smp_wmb();						\
+} while (0)
+
+/* The copy that the writer may fill between BEGIN and PUBLISH. */
+#define LMS2012_SNAPSHOT_NEXT(s)	(&(s)->Buf[(((s)->Hdr.Seq >> 1) + 1) & 1])
+
+/* Ends the update and makes the copy from LMS2012_SNAPSHOT_NEXT() current. */
+#define LMS2012_SNAPSHOT_PUBLISH(s) do {			\
+	smp_wmb();						\
+	WRITE_ONCE((s)->Hdr.Seq, (s)->Hdr.Seq + 1);		\
+} while (0)
+
+#endif /* _LMS2012_SNAPSHOT_H_ */
@@ -258,6 +258,9 @@
 
 #include "ev3_motor.h"
 
+#define CREATE_TRACE_POINTS
+#include <trace/events/tacho_motor.h>
+
 #define RAMP_PERIOD	msecs_to_jiffies(100)
 
 struct tacho_motor_value_names {
@@ -412,6 +415,8 @@ static int tm_do_one_ramp_step(struct tacho_motor_device *tm,
 	if (err)
 		return err;
 
+	trace_tacho_motor_ramp(tm);
+
 	/*
 	 * Measure how long it took since the last call to ramp_work and
 	 * schedule the next ramp as close to RAMP_PERIOD as we can get
@@ -738,6 +743,7 @@ static int tm_send_command(struct tacho_motor_device *tm,
 
 	if (ramp)
 		err = tacho_motor_class_start_motor_ramp(tm, &new_params);
+	trace_tacho_motor_command(tm, cmd, &new_params, err);
 	if (err < 0)
 		return err;
 
@@ -17,6 +17,7 @@
 
 #include <dc_motor_class.h>
 #include <tacho_motor_helper.h>
+#include <trace/events/tacho_motor.h>
 
 /*
  * Speed helper:
@@ -41,7 +42,9 @@ void tm_speed_update(struct tm_speed *spd, int pos, ktime_t t)
 	spd->tail++;
 	spd->tail &= BUFFER_SIZE - 1;
 
-	spd->speed = div64_s64(ds, ktime_to_us(dt));
+	/* keep the last speed if the timestamps did not change */
+	if (ktime_to_us(dt) > 0)
+		spd->speed = div64_s64(ds, ktime_to_us(dt));
 
 	spd->head++;
 	spd->head &= BUFFER_SIZE - 1;
@@ -112,6 +115,8 @@ int tm_pid_update(struct tm_pid *pid, int value)
 	duty_cycle = min(duty_cycle, DC_MOTOR_MAX_DUTY_CYCLE);
 	duty_cycle = max(duty_cycle, -DC_MOTOR_MAX_DUTY_CYCLE);
 
+	trace_tm_pid_update(pid, value, error, duty_cycle);
+
 	return duty_cycle;
 }
 EXPORT_SYMBOL_GPL(tm_pid_update);
@@ -17,10 +17,18 @@
 #define _PISTORMS_H_
 
 #include <linux/i2c.h>
+#include <linux/ktime.h>
 #include <lego.h>
 
 #define PISTORMS_NAME_SIZE	30
 
+/* Size of the register image used by the bank poller */
+#define PS_POLL_NUM_REGS	256
+/* Period of the bank poller, used for sampling the motors */
+#define PS_POLL_MS		10
+/* Period for polling input ports, must be a multiple of PS_POLL_MS */
+#define PS_IN_PORT_POLL_MS	1000
+
 /**
  * struct pistorms_data - represents a single bank on a PiStorms
  *
@@ -30,6 +38,7 @@
  * @leds_data: Pointer to the private data used by the led driver.
  * @in_port_data: Pointer to the private data used by the input port driver.
  * @out_port_data: Pointer to the private data used by the output port driver.
+ * @poll_data: Pointer to the private data used by the bank poller.
  */
 struct pistorms_data {
 	char			name[PISTORMS_NAME_SIZE];
@@ -39,6 +48,7 @@ struct pistorms_data {
 	void			*leds_data;
 	void			*in_port_data;
 	void			*out_port_data;
+	void			*poll_data;
 };
 
 extern int pistorms_battery_register(struct pistorms_data *data);
@@ -51,6 +61,20 @@ extern int pistorms_in_ports_register(struct pistorms_data *data);
 extern void pistorms_in_ports_unregister(struct pistorms_data *data);
 extern int pistorms_out_ports_register(struct pistorms_data *data);
 extern void pistorms_out_ports_unregister(struct pistorms_data *data);
+extern int pistorms_poll_register(struct pistorms_data *data);
+extern void pistorms_poll_unregister(struct pistorms_data *data);
+extern void pistorms_poll_trigger(struct pistorms_data *data);
+extern void pistorms_poll_sync(struct pistorms_data *data);
+
+extern void pistorms_in_ports_get_poll_window(struct pistorms_data *data,
+					      unsigned *first, unsigned *last);
+extern void pistorms_in_ports_poll(struct pistorms_data *data, const u8 *regs,
+				   unsigned first, unsigned last);
+extern void pistorms_out_ports_get_poll_window(struct pistorms_data *data,
+					       unsigned *first, unsigned *last);
+extern void pistorms_out_ports_poll(struct pistorms_data *data, const u8 *regs,
+				    unsigned first, unsigned last,
+				    ktime_t time);
 
 extern const struct device_type pistorms_in_port_type;
 
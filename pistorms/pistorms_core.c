@@ -92,6 +92,9 @@ static int pistorms_probe(struct i2c_client *client,
 	ret = pistorms_leds_register(data);
 	if (ret < 0)
 		goto err_pistorms_leds_register;
+	ret = pistorms_poll_register(data);
+	if (ret < 0)
+		goto err_pistorms_poll_register;
 	ret = pistorms_in_ports_register(data);
 	if (ret < 0)
 		goto err_pistorms_in_ports_register;
@@ -106,6 +109,8 @@ static int pistorms_probe(struct i2c_client *client,
 err_pistorms_out_ports_register:
 	pistorms_in_ports_unregister(data);
 err_pistorms_in_ports_register:
+	pistorms_poll_unregister(data);
+err_pistorms_poll_register:
 	pistorms_leds_unregister(data);
 err_pistorms_leds_register:
 	pistorms_input_unregister(data);
@@ -123,6 +128,7 @@ static int pistorms_remove(struct i2c_client *client)
 	struct pistorms_data *data = i2c_get_clientdata(client);
 	pistorms_out_ports_unregister(data);
 	pistorms_in_ports_unregister(data);
+	pistorms_poll_unregister(data);
 	pistorms_leds_unregister(data);
 	pistorms_input_unregister(data);
 	pistorms_battery_unregister(data);
@@ -0,0 +1,221 @@
+/*
+ * Bank poller for mindsensors.com PiStorms
+ *
+ * Copyright (c) 2015-2016 David Lechner <david@lechnology.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+/*
+ * Each bank of the PiStorms is a single I2C client and all of the values that
+ * change on their own (motor encoders and status, input port data) live in
+ * one contiguous register window. Instead of each port polling its own
+ * registers, the bank poller asks each user for the registers it currently
+ * needs, reads the union of them with a single block read and then hands the
+ * register image back to the users. This keeps the number of I2C transactions
+ * per period at one and samples all ports of a bank at the same time.
+ */
+
+#include <linux/hrtimer.h>
+#include <linux/i2c.h>
+#include <linux/slab.h>
+#include <linux/workqueue.h>
+
+#include "pistorms.h"
+
+/**
+ * struct pistorms_poll_data - bank-wide poller
+ *
+ * @data: The bank this poller belongs to.
+ * @poll_work: Work that does the I2C read and distributes the data.
+ * @poll_timer: Timer that schedules @poll_work.
+ * @count: Number of periods since the input ports were last polled.
+ * @in_ports_pending: Poll the input ports at the next period even if they
+ *                    are not due yet.
+ * @stopping: Flag to prevent the timer from restarting when unregistering.
+ * @regs: Image of the bank's registers, indexed by register address. Only
+ *        the window that was requested by the users is valid after a poll.
+ */
+struct pistorms_poll_data {
+	struct pistorms_data *data;
+	struct work_struct poll_work;
+	struct hrtimer poll_timer;
+	unsigned count;
+	bool in_ports_pending;
+	bool stopping;
+	u8 regs[PS_POLL_NUM_REGS];
+};
+
+static int pistorms_poll_read(struct i2c_client *client, u8 reg, u8 *buf,
+			      int len)
+{
+	struct i2c_msg msgs[2];
+	int ret;
+
+	/*
+	 * The window can be larger than an SMBus block, so use a plain I2C
+	 * write/read transfer when the adapter can do it and fall back to
+	 * multiple SMBus block reads otherwise.
+	 */
+	if (!i2c_check_functionality(client->adapter, I2C_FUNC_I2C)) {
+		while (len > 0) {
+			int size = min(len, I2C_SMBUS_BLOCK_MAX);
+
+			ret = i2c_smbus_read_i2c_block_data(client, reg, size,
+							    buf);
+			if (ret < 0)
+				return ret;
+			if (ret != size)
+				return -EIO;
+
+			reg += size;
+			buf += size;
+			len -= size;
+		}
+
+		return 0;
+	}
+
+	msgs[0].addr = client->addr;
+	msgs[0].flags = 0;
+	msgs[0].len = 1;
+	msgs[0].buf = &reg;
+
+	msgs[1].addr = client->addr;
+	msgs[1].flags = I2C_M_RD;
+	msgs[1].len = len;
+	msgs[1].buf = buf;
+
+	ret = i2c_transfer(client->adapter, msgs, ARRAY_SIZE(msgs));
+	if (ret < 0)
+		return ret;
+	if (ret != ARRAY_SIZE(msgs))
+		return -EIO;
+
+	return 0;
+}
+
+static void pistorms_poll_work(struct work_struct *work)
+{
+	struct pistorms_poll_data *poll =
+		container_of(work, struct pistorms_poll_data, poll_work);
+	struct pistorms_data *data = poll->data;
+	unsigned first = PS_POLL_NUM_REGS;
+	unsigned last = 0;
+	bool in_ports;
+	ktime_t time;
+	int ret;
+
+	/*
+	 * The motors are sampled every period for the speed calculation. The
+	 * input ports don't need to be polled that often, so their registers
+	 * are only added to the window when they are due.
+	 */
+	in_ports = xchg(&poll->in_ports_pending, false);
+	if (++poll->count >= PS_IN_PORT_POLL_MS / PS_POLL_MS) {
+		poll->count = 0;
+		in_ports = true;
+	}
+
+	pistorms_out_ports_get_poll_window(data, &first, &last);
+	if (in_ports)
+		pistorms_in_ports_get_poll_window(data, &first, &last);
+	if (first >= last)
+		return;
+
+	ret = pistorms_poll_read(data->client, first, &poll->regs[first],
+				 last - first);
+	time = ktime_get();
+	if (ret < 0) {
+		dev_warn_ratelimited(&data->client->dev,
+				     "Failed to poll registers (%d)\n", ret);
+		return;
+	}
+
+	pistorms_out_ports_poll(data, poll->regs, first, last, time);
+	if (in_ports)
+		pistorms_in_ports_poll(data, poll->regs, first, last);
+}
+
+static enum hrtimer_restart pistorms_poll_timer_function(struct hrtimer *timer)
+{
+	struct pistorms_poll_data *poll =
+		container_of(timer, struct pistorms_poll_data, poll_timer);
+
+	if (unlikely(poll->stopping))
+		return HRTIMER_NORESTART;
+
+	hrtimer_forward_now(timer, ms_to_ktime(PS_POLL_MS));
+
+	schedule_work(&poll->poll_work);
+
+	return HRTIMER_RESTART;
+}
+
+/**
+ * pistorms_poll_trigger - poll the bank now instead of at the next period
+ *
+ * @data: The bank.
+ *
+ * Used when a new user is added so that it does not have to wait up to a
+ * whole period for its first data.
+ */
+void pistorms_poll_trigger(struct pistorms_data *data)
+{
+	struct pistorms_poll_data *poll = data->poll_data;
+
+	WRITE_ONCE(poll->in_ports_pending, true);
+	schedule_work(&poll->poll_work);
+}
+
+/**
+ * pistorms_poll_sync - wait for any poll that is in progress to finish
+ *
+ * @data: The bank.
+ *
+ * Users must stop reporting a poll window and then call this before they
+ * free anything that the poller delivers data to.
+ */
+void pistorms_poll_sync(struct pistorms_data *data)
+{
+	struct pistorms_poll_data *poll = data->poll_data;
+
+	flush_work(&poll->poll_work);
+}
+
+int pistorms_poll_register(struct pistorms_data *data)
+{
+	struct pistorms_poll_data *poll;
+
+	poll = kzalloc(sizeof(struct pistorms_poll_data), GFP_KERNEL);
+	if (!poll)
+		return -ENOMEM;
+
+	poll->data = data;
+	INIT_WORK(&poll->poll_work, pistorms_poll_work);
+	hrtimer_init(&poll->poll_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	poll->poll_timer.function = pistorms_poll_timer_function;
+
+	data->poll_data = poll;
+
+	hrtimer_start(&poll->poll_timer, ms_to_ktime(PS_POLL_MS),
+		      HRTIMER_MODE_REL);
+
+	return 0;
+}
+
+void pistorms_poll_unregister(struct pistorms_data *data)
+{
+	struct pistorms_poll_data *poll = data->poll_data;
+
+	if (!poll)
+		return;
+
+	poll->stopping = true;
+	hrtimer_cancel(&poll->poll_timer);
+	cancel_work_sync(&poll->poll_work);
+	data->poll_data = NULL;
+	kfree(poll);
+}
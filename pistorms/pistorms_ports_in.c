@@ -24,10 +24,8 @@
  * instead of each port having its own.
  */
 
-#include <linux/hrtimer.h>
 #include <linux/i2c.h>
 #include <linux/slab.h>
-#include <linux/workqueue.h>
 
 #include "pistorms.h"
 #include "../sensors/ev3_analog_sensor.h"
@@ -35,8 +33,6 @@
 #include "../sensors/nxt_analog_sensor.h"
 #include "../sensors/nxt_i2c_sensor.h"
 
-#define PS_DEFAULT_POLL_MS		1000
-
 #define PS_SENSOR_PORT_1_REG		0x6F
 #define PS_SENSOR_PORT_2_REG		0xA3
 #define NUM_PS_PORT			2
@@ -85,17 +81,15 @@ enum pistorms_sensor_type {
 
 struct pistorms_in_port_data {
 	struct lego_port_device port;
-	struct work_struct poll_work;
-	struct hrtimer poll_timer;
+	struct pistorms_data *data;
 	struct nxt_i2c_sensor_platform_data i2c_platform_data;
 	struct lego_device *sensor;
 	struct i2c_client *i2c_sensor;
 	struct i2c_client *client;
 	enum pistorms_sensor_type sensor_type;
-	int poll_ms;
 	u8 i2c_reg;
 	u8 i2c_sensor_addr;
-	bool stopping;
+	bool polling;
 };
 
 const struct device_type pistorms_in_port_type = {
@@ -224,87 +218,125 @@ static const struct lego_port_mode_info pistorms_in_port_mode_info[NUM_PS_IN_POR
 	},
 };
 
-static void pistorms_poll_work(struct work_struct *work)
+static bool pistorms_in_port_poll_window(struct pistorms_in_port_data *in_port,
+					 unsigned *reg, unsigned *size)
 {
-	struct pistorms_in_port_data *in_port =
-		container_of(work, struct pistorms_in_port_data, poll_work);
-	u8 *raw_data = in_port->port.raw_data;
-	int ret;
-
-	if (!raw_data)
-		return;
+	if (!READ_ONCE(in_port->polling) || !in_port->port.raw_data)
+		return false;
 
 	switch (in_port->port.mode) {
 	case PS_IN_PORT_MODE_NXT_ANALOG:
-		ret = i2c_smbus_read_word_data(in_port->client,
-				in_port->i2c_reg + PS_NXT_ANALOG_VALUE_OFFSET);
-		if (ret < 0)
-			return;
-		*(u32 *)raw_data = ret * 5000 / 1024;
+		*reg = in_port->i2c_reg + PS_NXT_ANALOG_VALUE_OFFSET;
+		*size = 2;
 		break;
 	case PS_IN_PORT_MODE_EV3_ANALOG:
 		/* for now, only supports the LEGO EV3 Touch sensor */
-		ret = i2c_smbus_read_byte_data(in_port->client,
-				in_port->i2c_reg + PS_EV3_TOUCH_VALUE_OFFSET);
-		if (ret < 0)
-			return;
-		*(u32 *)raw_data = ret;
+		*reg = in_port->i2c_reg + PS_EV3_TOUCH_VALUE_OFFSET;
+		*size = 1;
 		break;
 	case PS_IN_PORT_MODE_EV3_UART:
-#if 0
 		/*
-		 * TODO: Could use the id returned to make sure it matches the
+		 * TODO: Could read the id too to make sure it matches the
 		 * currently registered sensor and change sensors if it is not.
-		 * uart_status[PS_EV3_UART_STATUS_INDEX(READY)] does not seem
-		 * to do anything useful. The PiStorms seems to remember
-		 * uart_status[PS_EV3_UART_STATUS_INDEX(MODE)] as well, so we
-		 * don't need to worry about it changing.
+		 * The PiStorms seems to remember the mode, so we don't need to
+		 * worry about it changing.
 		 */
-		u8 uart_status[PS_EV3_UART_STATUS_SIZE];
-
-		ret = i2c_smbus_read_i2c_block_data(in_port->client,
-				in_port->i2c_reg + PS_EV3_UART_READY_OFFSET,
-				PS_EV3_UART_STATUS_SIZE, uart_status);
-		if (ret < 0)
-			return;
-#endif
-		ret = i2c_smbus_read_i2c_block_data(in_port->client,
-				in_port->i2c_reg + PS_EV3_UART_DATA_OFFSET,
-				in_port->port.raw_data_size, raw_data);
-		if (ret < 0)
-			return;
+		*reg = in_port->i2c_reg + PS_EV3_UART_DATA_OFFSET;
+		*size = min_t(unsigned, in_port->port.raw_data_size,
+			      PS_EV3_UART_DATA_SIZE);
 		break;
+	default:
+		return false;
 	}
 
-	lego_port_call_raw_data_func(&in_port->port);
+	return true;
 }
 
-enum hrtimer_restart pistorms_poll_timer_function(struct hrtimer *timer)
+/**
+ * pistorms_in_ports_get_poll_window - get the registers needed by input ports
+ *
+ * @data: The bank.
+ * @first: Lowered to the first register needed, if any.
+ * @last: Raised to one past the last register needed, if any.
+ *
+ * Called by the bank poller before each read.
+ */
+void pistorms_in_ports_get_poll_window(struct pistorms_data *data,
+				       unsigned *first, unsigned *last)
 {
-	struct pistorms_in_port_data *in_port =
-		container_of(timer, struct pistorms_in_port_data, poll_timer);
+	struct pistorms_in_port_data *ports = READ_ONCE(data->in_port_data);
+	unsigned reg, size;
+	int i;
+
+	if (!ports)
+		return;
+
+	for (i = 0; i < NUM_PS_PORT; i++) {
+		if (!pistorms_in_port_poll_window(&ports[i], &reg, &size))
+			continue;
+		*first = min(*first, reg);
+		*last = max(*last, reg + size);
+	}
+}
 
-	if (unlikely(!in_port->poll_ms || in_port->stopping))
-		return HRTIMER_NORESTART;
+/**
+ * pistorms_in_ports_poll - distribute polled registers to the input ports
+ *
+ * @data: The bank.
+ * @regs: The register image, indexed by register address.
+ * @first: The first register that was read.
+ * @last: One past the last register that was read.
+ *
+ * Ports whose registers are not inside of the window that was read (e.g. a
+ * sensor was added while the read was in progress) are skipped until the
+ * next poll.
+ */
+void pistorms_in_ports_poll(struct pistorms_data *data, const u8 *regs,
+			    unsigned first, unsigned last)
+{
+	struct pistorms_in_port_data *ports = READ_ONCE(data->in_port_data);
+	unsigned reg, size;
+	int i;
 
-	hrtimer_forward_now(timer, ms_to_ktime(in_port->poll_ms));
+	if (!ports)
+		return;
 
-	schedule_work(&in_port->poll_work);
+	for (i = 0; i < NUM_PS_PORT; i++) {
+		struct pistorms_in_port_data *in_port = &ports[i];
+		u8 *raw_data = in_port->port.raw_data;
+
+		if (!pistorms_in_port_poll_window(in_port, &reg, &size))
+			continue;
+		if (reg < first || reg + size > last)
+			continue;
+
+		switch (in_port->port.mode) {
+		case PS_IN_PORT_MODE_NXT_ANALOG:
+			*(u32 *)raw_data = (regs[reg] | regs[reg + 1] << 8)
+					   * 5000 / 1024;
+			break;
+		case PS_IN_PORT_MODE_EV3_ANALOG:
+			*(u32 *)raw_data = regs[reg];
+			break;
+		case PS_IN_PORT_MODE_EV3_UART:
+			memcpy(raw_data, &regs[reg], size);
+			break;
+		}
 
-	return HRTIMER_RESTART;
+		lego_port_call_raw_data_func(&in_port->port);
+	}
 }
 
 static void pistorms_in_port_start_polling(struct pistorms_in_port_data *in_port)
 {
-	hrtimer_start(&in_port->poll_timer, ktime_set(0, 0), HRTIMER_MODE_REL);
+	WRITE_ONCE(in_port->polling, true);
+	pistorms_poll_trigger(in_port->data);
 }
 
 static void pistorms_in_port_stop_polling(struct pistorms_in_port_data *in_port)
 {
-	in_port->stopping = true;
-	hrtimer_cancel(&in_port->poll_timer);
-	cancel_work_sync(&in_port->poll_work);
-	in_port->stopping = false;
+	WRITE_ONCE(in_port->polling, false);
+	pistorms_poll_sync(in_port->data);
 }
 
 static inline int pistorms_set_sensor_type(struct pistorms_in_port_data *in_port)
@@ -346,10 +378,7 @@ int pistorms_in_port_register_sensor(struct pistorms_in_port_data *in_port,
 		return PTR_ERR(new_sensor);
 
 	in_port->sensor = new_sensor;
-	if (in_port->poll_ms)
-		pistorms_in_port_start_polling(in_port);
-	else
-		schedule_work(&in_port->poll_work);
+	pistorms_in_port_start_polling(in_port);
 
 	return 0;
 }
@@ -563,14 +592,11 @@ int pistorms_in_ports_register(struct pistorms_data *data)
 	for (i = 0; i < NUM_PS_PORT; i++) {
 		struct pistorms_in_port_data *in_port = &ports[i];
 
+		in_port->data = data;
 		in_port->client = data->client;
 		in_port->sensor_type = PS_SENSOR_TYPE_NONE;
-		in_port->poll_ms = PS_DEFAULT_POLL_MS;
 		in_port->i2c_reg = (i == 0) ? PS_SENSOR_PORT_1_REG
 					    : PS_SENSOR_PORT_2_REG;
-		INIT_WORK(&in_port->poll_work, pistorms_poll_work);
-		hrtimer_init(&in_port->poll_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
-		in_port->poll_timer.function = pistorms_poll_timer_function;
 
 		in_port->i2c_platform_data.in_port = &in_port->port;
 
@@ -616,6 +642,7 @@ void pistorms_in_ports_unregister(struct pistorms_data *data)
 		lego_port_unregister(&in_port->port);
 	}
 
-	data->in_port_data = NULL;
+	WRITE_ONCE(data->in_port_data, NULL);
+	pistorms_poll_sync(data);
 	kfree(ports);
 }
@@ -20,6 +20,10 @@
  * EV3, motors cannot be automatically detected when attached. By default,
  * the ports are configured with the NXT motor driver, which will work for
  * most cases.
+ *
+ * The PiStorms does not report the motor speed, so the position and state of
+ * both motors on a bank are sampled every 10 msec. and the speed is calculated
+ * from these samples. This also means that ramping is supported.
  */
 
 #include "pistorms.h"
@@ -57,6 +61,63 @@ static const struct lego_port_mode_info pistorms_out_port_mode_info[NUM_PISTORMS
 };
 #endif
 
+/**
+ * pistorms_out_ports_get_poll_window - get the registers needed by the motors
+ *
+ * @data: The bank.
+ * @first: Lowered to the first register needed.
+ * @last: Raised to one past the last register needed.
+ *
+ * The encoder, status and tasks registers of both motors are always sampled
+ * so that the speed can be calculated. This is called before the registers
+ * are read, so it also records which speed calculation the sample belongs to.
+ */
+void pistorms_out_ports_get_poll_window(struct pistorms_data *data,
+					unsigned *first, unsigned *last)
+{
+	struct ms_nxtmmx_data *mmx = READ_ONCE(data->out_port_data);
+	unsigned long flags;
+	int i;
+
+	if (!mmx)
+		return;
+
+	for (i = 0; i < 2; i++) {
+		spin_lock_irqsave(&mmx[i].lock, flags);
+		mmx[i].poll_generation = mmx[i].generation;
+		spin_unlock_irqrestore(&mmx[i].lock, flags);
+	}
+
+	*first = min_t(unsigned, *first, READ_MOTOR_FIRST_REG);
+	*last = max_t(unsigned, *last, READ_MOTOR_FIRST_REG + READ_MOTOR_SIZE);
+}
+
+/**
+ * pistorms_out_ports_poll - update the cached motor values
+ *
+ * @data: The bank.
+ * @regs: The register image, indexed by register address.
+ * @first: The first register that was read.
+ * @last: One past the last register that was read.
+ * @time: Timestamp of when the registers were read.
+ */
+void pistorms_out_ports_poll(struct pistorms_data *data, const u8 *regs,
+			     unsigned first, unsigned last, ktime_t time)
+{
+	struct ms_nxtmmx_data *mmx = READ_ONCE(data->out_port_data);
+	int i;
+
+	if (!mmx)
+		return;
+	if (first > READ_MOTOR_FIRST_REG ||
+	    last < READ_MOTOR_FIRST_REG + READ_MOTOR_SIZE)
+		return;
+
+	for (i = 0; i < 2; i++)
+		ms_nxtmmx_update_sample(&mmx[i], &regs[READ_MOTOR_FIRST_REG],
+					time, false);
+}
+
 int pistorms_out_ports_register(struct pistorms_data *data)
 {
 	struct ms_nxtmmx_data *mmx;
@@ -66,8 +127,6 @@ int pistorms_out_ports_register(struct pistorms_data *data)
 	if (!mmx)
 		return -ENOMEM;
 
-	data->out_port_data = mmx;
-
 	for (i = 0; i < 2; i++) {
 		snprintf(mmx[i].address, LEGO_NAME_SIZE, "%sM%d",
 			 data->name, i + 1);
@@ -81,12 +140,14 @@ int pistorms_out_ports_register(struct pistorms_data *data)
 	if (err)
 		goto err_register_out_port1;
 
+	/* this lets the bank poller start sampling the motors */
+	WRITE_ONCE(data->out_port_data, mmx);
+
 	return 0;
 
 err_register_out_port1:
 	ms_nxtmmx_unregister_out_port(&mmx[0]);
 err_register_out_port0:
-	data->out_port_data = NULL;
 	kfree(mmx);
 
 	return err;
@@ -96,8 +157,9 @@ void pistorms_out_ports_unregister(struct pistorms_data *data)
 {
 	struct ms_nxtmmx_data *mmx = data->out_port_data;
 
+	WRITE_ONCE(data->out_port_data, NULL);
+	pistorms_poll_sync(data);
 	ms_nxtmmx_unregister_out_port(&mmx[1]);
 	ms_nxtmmx_unregister_out_port(&mmx[0]);
-	data->out_port_data = NULL;
 	kfree(mmx);
 }
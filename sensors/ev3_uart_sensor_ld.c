@@ -53,6 +53,7 @@
 #include <lego.h>
 #include <lego_port_class.h>
 #include <lego_sensor_class.h>
+#include <trace/events/lego_sensor.h>
 
 #include "ev3_uart_sensor.h"
 
@@ -876,6 +877,9 @@ static void ev3_uart_handle_rx_data(struct work_struct *work)
 			}
 			if (mode != port->sensor.mode) {
 				if (mode == port->new_mode) {
+					trace_lego_sensor_mode(&port->sensor,
+							       port->sensor.mode,
+							       mode);
 					port->sensor.mode = mode;
 					kobject_uevent(&port->sensor.dev.kobj,
 						       KOBJ_CHANGE);
@@ -888,6 +892,7 @@ static void ev3_uart_handle_rx_data(struct work_struct *work)
 			    && mode == port->new_mode)
 				complete(&port->set_mode_completion);
 			memcpy(port->mode_info[mode].raw_data, message + 1, msg_size - 2);
+			trace_lego_sensor_raw_data(&port->sensor, mode, msg_size - 2);
 			port->data_rec = 1;
 			if (port->num_data_err)
 				port->num_data_err--;
@@ -170,6 +170,12 @@
 
 #include <lego_sensor_class.h>
 
+#define CREATE_TRACE_POINTS
+#include <trace/events/lego_sensor.h>
+
+EXPORT_TRACEPOINT_SYMBOL_GPL(lego_sensor_mode);
+EXPORT_TRACEPOINT_SYMBOL_GPL(lego_sensor_raw_data);
+
 size_t lego_sensor_data_size[NUM_LEGO_SENSOR_DATA_TYPE] = {
 	[LEGO_SENSOR_DATA_S8]		= 1,
 	[LEGO_SENSOR_DATA_U8]		= 1,
@@ -191,13 +197,15 @@ EXPORT_SYMBOL_GPL(lego_sensor_data_size);
  * lego_sensor_ftoi - convert 32-bit IEEE 754 float to fixed point integer
  * @f: The floating point number.
  * @dp: The number of decimal places in the fixed-point integer.
+ *
+ * The result is rounded to the nearest integer. Values that do not fit in
+ * an s32 are clamped to INT_MIN or INT_MAX.
  */
 s32 lego_sensor_ftoi(u32 f, u8 dp)
 {
 	s32 s = (f & 0x80000000) ? -1 : 1;
 	u8 e = (f & 0x7F800000) >> 23;
 	u64 i = f & 0x007FFFFF;
-	u64 m;
 
 	/* handle special cases for zero, +/- infinity and NaN */
 	if (!e)
@@ -209,14 +217,21 @@ s32 lego_sensor_ftoi(u32 f, u8 dp)
 	while (dp--)
 		i *= 10;
 	if (e < 150) {
-		div64_u64_rem(i, 1 << (150 - e), &m);
-		i += m >> 1;
+		/* round to nearest, anything this small rounds to zero */
+		if (150 - e > 63)
+			return 0;
+		i += 1ULL << (149 - e);
 		i >>= 150 - e;
 	} else {
+		/* i is at least 2^23, so shifting by 8 is already too big */
+		if (e - 150 >= 8)
+			return s == 1 ? INT_MAX : INT_MIN;
 		i <<= e - 150;
 	}
+	if (i > INT_MAX)
+		return s == 1 ? INT_MAX : INT_MIN;
 
-	return s * i;
+	return s * (s32)i;
 }
 EXPORT_SYMBOL_GPL(lego_sensor_ftoi);
 
@@ -229,7 +244,7 @@ u32 lego_sensor_itof(s32 i, u8 dp)
 {
 	s32 s = i < 0 ? -1 : 1;
 	u8 e = 127;
-	u64 f = i * s;
+	u64 f = i < 0 ? -(s64)i : i;
 
 	/* special case for zero */
 	if (i == 0)
@@ -307,6 +322,7 @@ static ssize_t mode_store(struct device *dev, struct device_attribute *attr,
 			if (err)
 				return err;
 			if (sensor->mode != i) {
+				trace_lego_sensor_mode(sensor, sensor->mode, i);
 				sensor->mode = i;
 				kobject_uevent(&dev->kobj, KOBJ_CHANGE);
 			}
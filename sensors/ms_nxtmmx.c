@@ -28,6 +28,13 @@
 #include <lego.h>
 #include <tacho_motor_class.h>
 
+#ifdef PISTORMS_NXTMMX
+#include <linux/spinlock.h>
+#include <asm/unaligned.h>
+
+#include <tacho_motor_helper.h>
+#endif
+
 #define COMMAND_REG		0x41
 
 #define WRITE_SIZE		8
@@ -59,6 +66,13 @@
 #define SPEED_PID_KI_REG	0x66
 #define SPEED_PID_KD_REG	0x68
 
+/* encoder, status and tasks registers of both motors */
+#define READ_MOTOR_FIRST_REG	READ_ENCODER_POS_REG(0)
+#define READ_MOTOR_SIZE		(READ_TASKS_REG(2) - READ_MOTOR_FIRST_REG)
+#define READ_MOTOR_OFFSET(reg)	((reg) - READ_MOTOR_FIRST_REG)
+
+#define SPEED_PERIOD_MS		100
+
 #else
 
 #define READ_ENCODER_POS_REG(idx)	(0x62 + ENCODER_SIZE * (idx))
@@ -119,6 +133,28 @@ struct ms_nxtmmx_data {
 	struct lego_device *motor;
 	int index;
 	unsigned holding:1;
+#ifdef PISTORMS_NXTMMX
+	/*
+	 * On PiStorms, the encoder, status and tasks registers are sampled
+	 * periodically by the bank poller and the tacho-motor ops are served
+	 * from these cached values. The samples are also used to calculate the
+	 * speed, which the PiStorms does not report. @lock protects the cached
+	 * values and @speed.
+	 *
+	 * @generation is incremented each time the speed calculation is
+	 * restarted or the registers are read after a command. The poller
+	 * saves it in @poll_generation before it reads the registers so that a
+	 * sample that was read before the encoder was reset or before the
+	 * command was sent is not applied afterwards.
+	 */
+	spinlock_t lock;
+	struct tm_speed speed;
+	int position;
+	u8 status;
+	u8 tasks;
+	unsigned generation;
+	unsigned poll_generation;
+#endif
 };
 
 const struct device_type ms_nxtmmx_out_port_type = {
@@ -183,6 +219,104 @@ static inline int ms_nxtmmx_scale_speed(int speed)
 	return scaled;
 }
 
+#ifdef PISTORMS_NXTMMX
+
+/*
+ * Updates the cached values from a register image of the motor window. If
+ * @resync is true, the speed calculation is restarted, which is needed when
+ * the position jumps, i.e. when the encoder is reset. Samples from the poller
+ * that were read before the last restart are dropped.
+ */
+static void ms_nxtmmx_update_sample(struct ms_nxtmmx_data *mmx,
+				    const u8 *regs, ktime_t time, bool resync)
+{
+	unsigned long flags;
+	int pos;
+
+	pos = get_unaligned_le32(
+		&regs[READ_MOTOR_OFFSET(READ_ENCODER_POS_REG(mmx->index))]);
+	/* Motor rotation on PiStorms is backwards from standard rotation */
+	pos *= -1;
+
+	spin_lock_irqsave(&mmx->lock, flags);
+	if (!resync && mmx->poll_generation != mmx->generation) {
+		spin_unlock_irqrestore(&mmx->lock, flags);
+		return;
+	}
+	mmx->position = pos;
+	mmx->status = regs[READ_MOTOR_OFFSET(READ_STATUS_REG(mmx->index))];
+	mmx->tasks = regs[READ_MOTOR_OFFSET(READ_TASKS_REG(mmx->index))];
+	if (resync) {
+		mmx->generation++;
+		tm_speed_init(&mmx->speed, pos, time,
+			      SPEED_PERIOD_MS / PS_POLL_MS);
+	} else
+		tm_speed_update(&mmx->speed, pos, time);
+	spin_unlock_irqrestore(&mmx->lock, flags);
+}
+
+/* Synchronously reads the motor registers instead of waiting for the poller */
+static int ms_nxtmmx_resync(struct ms_nxtmmx_data *mmx)
+{
+	u8 regs[READ_MOTOR_SIZE];
+	int ret;
+
+	ret = i2c_smbus_read_i2c_block_data(mmx->i2c_client,
+			READ_MOTOR_FIRST_REG, READ_MOTOR_SIZE, regs);
+	if (ret < 0)
+		return ret;
+
+	ms_nxtmmx_update_sample(mmx, regs, ktime_get(), true);
+
+	return 0;
+}
+
+/*
+ * Synchronously reads the status and tasks registers after a command so that
+ * get_state does not return the state from before the command until the next
+ * poll.
+ */
+static int ms_nxtmmx_refresh(struct ms_nxtmmx_data *mmx)
+{
+	u8 regs[READ_MOTOR_SIZE];
+	unsigned long flags;
+	int ret;
+
+	ret = i2c_smbus_read_i2c_block_data(mmx->i2c_client,
+			READ_MOTOR_FIRST_REG, READ_MOTOR_SIZE, regs);
+	if (ret < 0)
+		return ret;
+
+	spin_lock_irqsave(&mmx->lock, flags);
+	mmx->status = regs[READ_MOTOR_OFFSET(READ_STATUS_REG(mmx->index))];
+	mmx->tasks = regs[READ_MOTOR_OFFSET(READ_TASKS_REG(mmx->index))];
+	/* drop a sample that the poller read before the command */
+	mmx->generation++;
+	spin_unlock_irqrestore(&mmx->lock, flags);
+
+	return 0;
+}
+
+static int ms_nxtmmx_get_position(void *context, int *position)
+{
+	struct ms_nxtmmx_data *mmx = context;
+
+	*position = READ_ONCE(mmx->position);
+
+	return 0;
+}
+
+static int ms_nxtmmx_get_speed(void *context, int *speed)
+{
+	struct ms_nxtmmx_data *mmx = context;
+
+	*speed = READ_ONCE(tm_speed_get(&mmx->speed));
+
+	return 0;
+}
+
+#else
+
 static int ms_nxtmmx_get_position(void *context, int *position)
 {
 	struct ms_nxtmmx_data *mmx = context;
@@ -195,14 +329,12 @@ static int ms_nxtmmx_get_position(void *context, int *position)
 		return err;
 
 	*position = le32_to_cpup((__le32 *)bytes);
-#ifdef PISTORMS_NXTMMX
-	/* Motor rotation on PiStorms is backwards from standard rotation */
-	*position *= -1;
-#endif
 
 	return 0;
 }
 
+#endif
+
 static int ms_nxtmmx_set_position(void *context, int position)
 {
 	struct ms_nxtmmx_data *mmx = context;
@@ -227,6 +359,12 @@ static int ms_nxtmmx_set_position(void *context, int position)
 	if (ret < 0)
 		return ret;
 
+#ifdef PISTORMS_NXTMMX
+	ret = ms_nxtmmx_resync(mmx);
+	if (ret < 0)
+		return ret;
+#endif
+
 	return 0;
 }
 
@@ -236,9 +374,13 @@ static int ms_nxtmmx_get_state(void *context)
 	int ret;
 	unsigned state = 0;
 
+#ifdef PISTORMS_NXTMMX
+	ret = READ_ONCE(mmx->status);
+#else
 	ret = i2c_smbus_read_byte_data(mmx->i2c_client, READ_STATUS_REG(mmx->index));
 	if (ret < 0)
 		return ret;
+#endif
 
 	if (ret & STATUS_FLAG_POWERED)
 		state |= BIT(TM_STATE_RUNNING);
@@ -251,9 +393,13 @@ static int ms_nxtmmx_get_state(void *context)
 	 * then we are still running, otherwise we are holding.
 	 */
 	if ((ret & STATUS_FLAG_POWERED) && (mmx->holding)) {
+#ifdef PISTORMS_NXTMMX
+		ret = READ_ONCE(mmx->tasks);
+#else
 		ret = i2c_smbus_read_byte_data(mmx->i2c_client, READ_TASKS_REG(mmx->index));
 		if (ret < 0)
 			return ret;
+#endif
 		if (!ret)
 			state |= BIT(TM_STATE_HOLDING);
 	}
@@ -285,6 +431,12 @@ static int ms_nxtmmx_run_regulated(void *context, int speed)
 
 	mmx->holding = false;
 
+#ifdef PISTORMS_NXTMMX
+	err = ms_nxtmmx_refresh(mmx);
+	if (err < 0)
+		return err;
+#endif
+
 	return 0;
 }
 
@@ -323,6 +475,12 @@ static int ms_nxtmmx_run_to_pos(void *context, int pos, int speed,
 
 	mmx->holding = false;
 
+#ifdef PISTORMS_NXTMMX
+	err = ms_nxtmmx_refresh(mmx);
+	if (err < 0)
+		return err;
+#endif
+
 	return 0;
 }
 
@@ -368,6 +526,12 @@ static int ms_nxtmmx_stop(void *context, enum tm_stop_action action)
 		mmx->holding = true;
 	}
 
+#ifdef PISTORMS_NXTMMX
+	err = ms_nxtmmx_refresh(mmx);
+	if (err < 0)
+		return err;
+#endif
+
 	return 0;
 }
 
@@ -388,6 +552,12 @@ static int ms_nxtmmx_reset(void *context)
 
 	mmx->holding = false;
 
+#ifdef PISTORMS_NXTMMX
+	err = ms_nxtmmx_resync(mmx);
+	if (err < 0)
+		return err;
+#endif
+
 	return 0;
 }
 
@@ -545,6 +715,9 @@ struct tacho_motor_ops ms_nxtmmx_tacho_motor_ops = {
 	.get_position		= ms_nxtmmx_get_position,
 	.set_position		= ms_nxtmmx_set_position,
 	.get_state		= ms_nxtmmx_get_state,
+#ifdef PISTORMS_NXTMMX
+	.get_speed		= ms_nxtmmx_get_speed,
+#endif
 	.run_regulated		= ms_nxtmmx_run_regulated,
 	.run_to_pos		= ms_nxtmmx_run_to_pos,
 	.stop			= ms_nxtmmx_stop,
@@ -619,6 +792,13 @@ int ms_nxtmmx_register_out_port(struct ms_nxtmmx_data *mmx)
 	port->tacho_motor_ops = &ms_nxtmmx_tacho_motor_ops;
 	port->context = mmx;
 
+#ifdef PISTORMS_NXTMMX
+	spin_lock_init(&mmx->lock);
+	err = ms_nxtmmx_resync(mmx);
+	if (err)
+		return err;
+#endif
+
 	err = lego_port_register(port, &ms_nxtmmx_out_port_type, &mmx->i2c_client->dev);
 	if (err)
 		return err;
@@ -17,8 +17,11 @@
 #define NXT_I2C_SENSOR_H_
 
 #include <linux/hrtimer.h>
+#include <linux/i2c.h>
+#include <linux/wait.h>
 
 #include <lego.h>
+#include <lego_i2c.h>
 #include <lego_port_class.h>
 #include <lego_sensor_class.h>
 
@@ -241,6 +244,18 @@ struct nxt_i2c_sensor_data {
 	struct work_struct poll_work;
 	enum nxt_i2c_sensor_type type;
 	unsigned poll_ms;
+	/*
+	 * If the adapter has asynchronous transfers (e.g. the PRU on EVB), the
+	 * poll timer submits the read with @async_quirks directly instead of
+	 * scheduling poll_work. Bit 0 of @async_busy is set while a read is in
+	 * flight and @async_wait is woken up when it is cleared.
+	 */
+	const struct lego_i2c_quirks *async_quirks;
+	unsigned long async_busy;
+	wait_queue_head_t async_wait;
+	struct i2c_msg async_msgs[2];
+	u8 async_reg;
+	u8 async_mode;
 };
 
 #endif /* NXT_I2C_SENSOR_H_ */
@@ -47,6 +47,7 @@
 #include <linux/workqueue.h>
 
 #include <lego_sensor_class.h>
+#include <trace/events/lego_sensor.h>
 
 #include "nxt_i2c_sensor.h"
 
@@ -68,6 +69,62 @@ MODULE_PARM_DESC(allow_autodetect, "Allow NXT I2C sensors to be automatically de
 
 void nxt_i2c_sensor_poll_work(struct work_struct *work);
 
+static void nxt_i2c_sensor_poll_complete(void *context, int result)
+{
+	struct nxt_i2c_sensor_data *data = context;
+
+	trace_lego_sensor_raw_data(&data->sensor, data->async_mode,
+				   result < 0 ? result : data->async_msgs[1].len);
+	clear_bit_unlock(0, &data->async_busy);
+	wake_up(&data->async_wait);
+}
+
+/*
+ * Submits the poll read without waiting for it. This is called from the poll
+ * timer. Returns false if the read has to be done by poll_work instead.
+ */
+static bool nxt_i2c_sensor_poll_async(struct nxt_i2c_sensor_data *data)
+{
+	struct i2c_client *client = data->client;
+	u8 mode = data->sensor.mode;
+	struct lego_sensor_mode_info *mode_info = &data->sensor.mode_info[mode];
+	int ret;
+
+	if (!data->async_quirks || (data->info->ops && data->info->ops->poll_cb))
+		return false;
+
+	/* the previous read is still in flight, so skip this period */
+	if (test_and_set_bit_lock(0, &data->async_busy))
+		return true;
+
+	data->async_mode = mode;
+	data->async_reg = data->info->i2c_mode_info[mode].read_data_reg;
+	data->async_msgs[0].addr = client->addr;
+	data->async_msgs[0].flags = client->flags & I2C_M_TEN;
+	data->async_msgs[0].len = 1;
+	data->async_msgs[0].buf = &data->async_reg;
+	data->async_msgs[1].addr = client->addr;
+	data->async_msgs[1].flags = (client->flags & I2C_M_TEN) | I2C_M_RD;
+	data->async_msgs[1].len = lego_sensor_get_raw_data_size(mode_info);
+	data->async_msgs[1].buf = mode_info->raw_data;
+
+	ret = data->async_quirks->submit(client->adapter, data->async_msgs, 2,
+					 nxt_i2c_sensor_poll_complete, data);
+	if (ret < 0) {
+		clear_bit_unlock(0, &data->async_busy);
+		wake_up(&data->async_wait);
+	}
+
+	return true;
+}
+
+/* Waits for a read submitted by nxt_i2c_sensor_poll_async() to finish. */
+static void nxt_i2c_sensor_poll_async_sync(struct nxt_i2c_sensor_data *data)
+{
+	if (data->async_quirks)
+		wait_event(data->async_wait, !test_bit(0, &data->async_busy));
+}
+
 static int nxt_i2c_sensor_set_mode(void *context, u8 mode)
 {
 	struct nxt_i2c_sensor_data *sensor = context;
@@ -80,6 +137,7 @@ static int nxt_i2c_sensor_set_mode(void *context, u8 mode)
 	}
 
 	hrtimer_cancel(&sensor->poll_timer);
+	nxt_i2c_sensor_poll_async_sync(sensor);
 
 	if (sensor->info->i2c_mode_info[mode].set_mode_reg) {
 		err = i2c_smbus_write_byte_data(sensor->client,
@@ -185,7 +243,8 @@ enum hrtimer_restart nxt_i2c_sensor_poll_timer(struct hrtimer *timer)
 		container_of(timer, struct nxt_i2c_sensor_data, poll_timer);
 
 	hrtimer_forward_now(timer, ms_to_ktime(data->poll_ms));
-	schedule_work(&data->poll_work);
+	if (!nxt_i2c_sensor_poll_async(data))
+		schedule_work(&data->poll_work);
 
 	return HRTIMER_RESTART;
 }
@@ -198,14 +257,19 @@ void nxt_i2c_sensor_poll_work(struct work_struct *work)
 		&data->info->i2c_mode_info[data->sensor.mode];
 	struct lego_sensor_mode_info *mode_info =
 			&data->sensor.mode_info[data->sensor.mode];
+	int ret;
 
-	if (data->info->ops && data->info->ops->poll_cb)
+	if (data->info->ops && data->info->ops->poll_cb) {
 		data->info->ops->poll_cb(data);
-	else
-		i2c_smbus_read_i2c_block_data(data->client,
+		ret = lego_sensor_get_raw_data_size(mode_info);
+	} else {
+		ret = i2c_smbus_read_i2c_block_data(data->client,
 			i2c_mode_info->read_data_reg,
 			lego_sensor_get_raw_data_size(mode_info),
 			mode_info->raw_data);
+	}
+
+	trace_lego_sensor_raw_data(&data->sensor, data->sensor.mode, ret);
 }
 
 static int nxt_i2c_sensor_probe(struct i2c_client *client,
@@ -288,6 +352,8 @@ static int nxt_i2c_sensor_probe(struct i2c_client *client,
 	hrtimer_init(&data->poll_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
 	data->poll_timer.function = nxt_i2c_sensor_poll_timer;
 	data->poll_ms = default_poll_ms;
+	data->async_quirks = lego_i2c_get_quirks(client->adapter);
+	init_waitqueue_head(&data->async_wait);
 	i2c_set_clientdata(client, data);
 
 	if (data->info->ops && data->info->ops->probe_cb) {
@@ -330,6 +396,7 @@ static int nxt_i2c_sensor_remove(struct i2c_client *client)
 	data->poll_ms = 0;
 	hrtimer_cancel(&data->poll_timer);
 	cancel_work_sync(&data->poll_work);
+	nxt_i2c_sensor_poll_async_sync(data);
 	if (data->in_port && data->in_port->nxt_i2c_ops)
 		data->in_port->nxt_i2c_ops->set_pin1_gpio(data->in_port->context,
 							  LEGO_PORT_GPIO_FLOAT);
@@ -486,8 +553,7 @@ struct i2c_driver nxt_i2c_sensor_driver = {
 	.remove		= nxt_i2c_sensor_remove,
 	.class		= I2C_CLASS_LEGO,
 	.detect		= nxt_i2c_sensor_detect,
-	.address_list	= I2C_ADDRS(0x01, 0x02, 0x03, 0x08, 0x0a, 0x0c, 0x11, 0x18,
-				    0x4c, 0x50, 0x51, 0x52, 0x58),
+	.address_list	= I2C_ADDRS(LEGO_I2C_SENSOR_ADDRS),
 };
 module_i2c_driver(nxt_i2c_sensor_driver);
 EXPORT_SYMBOL_GPL(nxt_i2c_sensor_driver);
@@ -0,0 +1,181 @@
+/*
+ * User-defined LEGO devices - Character device helpers
+ *
+ * Copyright (C) 2016 David Lechner <david@lechnology.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+
+ * This program is distributed "as is" WITHOUT ANY WARRANTY of any
+ * kind, whether express or implied; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * The user-defined device classes give each device a character device that
+ * the userspace driver keeps open. The device can be unregistered through
+ * configfs at any time, so the per-device data has to stay around until the
+ * last file is closed. These helpers handle the minor numbers and that
+ * lifetime, the drivers only embed struct user_lego_chrdev and provide the
+ * file operations.
+ */
+
+#include <linux/device.h>
+#include <linux/module.h>
+
+#include "user_lego_chrdev.h"
+
+/**
+ * user_lego_chrdev_region_init - allocates device numbers for a class
+ * @region: The region to initialize.
+ * @name: Name of the region.
+ * @max_minors: Maximum number of devices.
+ */
+int user_lego_chrdev_region_init(struct user_lego_chrdev_region *region,
+				 const char *name, unsigned max_minors)
+{
+	int err;
+
+	err = alloc_chrdev_region(&region->devt, 0, max_minors, name);
+	if (err)
+		return err;
+
+	region->name = name;
+	region->max_minors = max_minors;
+	idr_init(&region->minors);
+	mutex_init(&region->lock);
+
+	return 0;
+}
+EXPORT_SYMBOL_GPL(user_lego_chrdev_region_init);
+
+/**
+ * user_lego_chrdev_region_exit - frees the device numbers of a class
+ * @region: The region. All of its devices must have been deleted.
+ */
+void user_lego_chrdev_region_exit(struct user_lego_chrdev_region *region)
+{
+	unregister_chrdev_region(region->devt, region->max_minors);
+	idr_destroy(&region->minors);
+}
+EXPORT_SYMBOL_GPL(user_lego_chrdev_region_exit);
+
+/**
+ * user_lego_chrdev_add - adds a character device
+ * @region: The region to take the device number from.
+ * @chrdev: The character device, embedded in the driver data.
+ * @fops: The file operations. ``fops->owner`` also owns the cdev.
+ * @release: Called to free the driver data after user_lego_chrdev_del()
+ *	once the last file is closed. It is not called if this fails.
+ *
+ * The device number is in ``chrdev->cdev->dev`` afterwards.
+ */
+int user_lego_chrdev_add(struct user_lego_chrdev_region *region,
+			 struct user_lego_chrdev *chrdev,
+			 const struct file_operations *fops,
+			 void (*release)(struct user_lego_chrdev *chrdev))
+{
+	int err;
+
+	kref_init(&chrdev->kref);
+	chrdev->release = release;
+
+	mutex_lock(&region->lock);
+	chrdev->minor = idr_alloc(&region->minors, chrdev, 0,
+				  region->max_minors, GFP_KERNEL);
+	mutex_unlock(&region->lock);
+	if (chrdev->minor < 0)
+		return chrdev->minor;
+
+	chrdev->cdev = cdev_alloc();
+	if (!chrdev->cdev) {
+		err = -ENOMEM;
+		goto err_cdev_alloc;
+	}
+	chrdev->cdev->owner = fops->owner;
+	chrdev->cdev->ops = fops;
+
+	err = cdev_add(chrdev->cdev,
+		       MKDEV(MAJOR(region->devt), chrdev->minor), 1);
+	if (err)
+		goto err_cdev_add;
+
+	return 0;
+
+err_cdev_add:
+	kobject_put(&chrdev->cdev->kobj);
+err_cdev_alloc:
+	mutex_lock(&region->lock);
+	idr_remove(&region->minors, chrdev->minor);
+	mutex_unlock(&region->lock);
+
+	return err;
+}
+EXPORT_SYMBOL_GPL(user_lego_chrdev_add);
+
+/**
+ * user_lego_chrdev_del - deletes a character device
+ * @region: The region that the device number was taken from.
+ * @chrdev: The character device.
+ *
+ * The device can't be opened anymore afterwards, but files that are already
+ * open keep working. The caller drops its own reference with
+ * user_lego_chrdev_put() once it has told those files that the device is gone.
+ */
+void user_lego_chrdev_del(struct user_lego_chrdev_region *region,
+			  struct user_lego_chrdev *chrdev)
+{
+	mutex_lock(&region->lock);
+	idr_remove(&region->minors, chrdev->minor);
+	mutex_unlock(&region->lock);
+
+	cdev_del(chrdev->cdev);
+}
+EXPORT_SYMBOL_GPL(user_lego_chrdev_del);
+
+/**
+ * user_lego_chrdev_get - gets a reference to the device of an inode
+ * @region: The region of the class.
+ * @inode: The inode that is being opened.
+ *
+ * Returns NULL if the device has already been deleted.
+ */
+struct user_lego_chrdev *
+user_lego_chrdev_get(struct user_lego_chrdev_region *region,
+		     struct inode *inode)
+{
+	struct user_lego_chrdev *chrdev;
+
+	mutex_lock(&region->lock);
+	chrdev = idr_find(&region->minors, iminor(inode));
+	if (chrdev)
+		kref_get(&chrdev->kref);
+	mutex_unlock(&region->lock);
+
+	return chrdev;
+}
+EXPORT_SYMBOL_GPL(user_lego_chrdev_get);
+
+static void user_lego_chrdev_release(struct kref *kref)
+{
+	struct user_lego_chrdev *chrdev =
+		container_of(kref, struct user_lego_chrdev, kref);
+
+	chrdev->release(chrdev);
+}
+
+/**
+ * user_lego_chrdev_put - drops a reference
+ * @chrdev: The character device.
+ */
+void user_lego_chrdev_put(struct user_lego_chrdev *chrdev)
+{
+	kref_put(&chrdev->kref, user_lego_chrdev_release);
+}
+EXPORT_SYMBOL_GPL(user_lego_chrdev_put);
+
+MODULE_DESCRIPTION("Character device helpers for user-defined LEGO devices");
+MODULE_AUTHOR("David Lechner <david@lechnology.com>");
+MODULE_LICENSE("GPL");
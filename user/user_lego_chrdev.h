@@ -0,0 +1,73 @@
+/*
+ * User-defined LEGO devices - Character device helpers
+ *
+ * Copyright (C) 2016 David Lechner <david@lechnology.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+
+ * This program is distributed "as is" WITHOUT ANY WARRANTY of any
+ * kind, whether express or implied; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef __USER_LEGO_CHRDEV_H
+#define __USER_LEGO_CHRDEV_H
+
+#include <linux/cdev.h>
+#include <linux/fs.h>
+#include <linux/idr.h>
+#include <linux/kref.h>
+#include <linux/mutex.h>
+#include <linux/types.h>
+
+/**
+ * struct user_lego_chrdev_region - device numbers of a user device class
+ * @name: Name of the region.
+ * @max_minors: Number of minors in the region.
+ * @devt: First device number of the region.
+ * @minors: Maps minor numbers to struct user_lego_chrdev.
+ * @lock: Protects @minors.
+ */
+struct user_lego_chrdev_region {
+	const char *name;
+	unsigned max_minors;
+	dev_t devt;
+	struct idr minors;
+	struct mutex lock;
+};
+
+/**
+ * struct user_lego_chrdev - character device of a user device
+ * @cdev: The character device. It is allocated separately because it can
+ *	outlive this struct while a file that was opened through it is being
+ *	released.
+ * @minor: The minor number of @cdev.
+ * @kref: Keeps the containing struct around while the device is open after
+ *	unregistering.
+ * @release: Frees the containing struct when the last reference is dropped.
+ */
+struct user_lego_chrdev {
+	struct cdev *cdev;
+	int minor;
+	struct kref kref;
+	void (*release)(struct user_lego_chrdev *chrdev);
+};
+
+extern int user_lego_chrdev_region_init(struct user_lego_chrdev_region *region,
+					const char *name, unsigned max_minors);
+extern void user_lego_chrdev_region_exit(struct user_lego_chrdev_region *region);
+extern int user_lego_chrdev_add(struct user_lego_chrdev_region *region,
+				struct user_lego_chrdev *chrdev,
+				const struct file_operations *fops,
+				void (*release)(struct user_lego_chrdev *chrdev));
+extern void user_lego_chrdev_del(struct user_lego_chrdev_region *region,
+				 struct user_lego_chrdev *chrdev);
+extern struct user_lego_chrdev *
+user_lego_chrdev_get(struct user_lego_chrdev_region *region,
+		     struct inode *inode);
+extern void user_lego_chrdev_put(struct user_lego_chrdev *chrdev);
+
+#endif /* __USER_LEGO_CHRDEV_H */
@@ -19,8 +19,8 @@
  * DOC: userspace
  *
  * This driver provides a `configfs`_ interface for creating user-defined devices
- * that use the various ev3dev drivers. Currently, only ports, sensors and LEDs
- * are implemented. Motors could be added in the future.
+ * that use the various ev3dev drivers. Currently, ports, sensors, LEDs and tacho
+ * motors are implemented.
  *
  * .. _configfs: https://www.kernel.org/doc/Documentation/filesystems/configfs/configfs.txt
  *
@@ -74,6 +74,18 @@
  *   just as any other sensor. The ``user-lego-sensor`` device is used to feed
  *   data into the sensor. See the `user-lego-sensor-class`_ docs for more info.
  *
+ * - Tacho motors work the same way. Create one in ``motors``, set
+ *   ``driver_name``, ``count_per_rot`` and ``max_speed`` and link it to
+ *   ``live``::
+ *
+ *       mkdir motors/m1
+ *       ln -s motors/m1 live
+ *
+ *   This creates a device in ``/sys/class/user-tacho-motor/`` for the
+ *   userspace motor controller and one in ``/sys/class/tacho-motor/`` that is
+ *   used just as any other motor. See the `user-tacho-motor-class`_ docs for
+ *   more info.
+ *
  * - To remove the sensor and port, perform the operations in reverse::
  *
  *       rm link/s1
@@ -89,15 +101,19 @@
 #include <lego.h>
 #include <lego_port_class.h>
 #include <lego_sensor_class.h>
+#include <tacho_motor_class.h>
 
+#include "../motors/ev3_motor.h"
 #include "user_lego_sensor.h"
 #include "user_led.h"
+#include "user_tacho_motor.h"
 
 #define LEGO_USER_DEVICE_NAME "lego_user_device"
 
 enum group_index {
 	GROUP_INDEX_SENSORS,
 	GROUP_INDEX_LEDS,
+	GROUP_INDEX_MOTORS,
 	GROUP_INDEX_LIVE,
 	NUM_GROUP_INDEX
 };
@@ -107,8 +123,9 @@ struct port_info {
 	/* default groups */
 	struct config_group sensors_group;
 	struct config_group uleds_group;
+	struct config_group motors_group;
 	struct config_group live_group;
-	/* future default groups may include modes, motors and leds */
+	/* future default groups may include modes */
 	struct config_group *default_groups[NUM_GROUP_INDEX];
 	struct lego_port_device port;
 	struct lego_port_mode_info mode0;
@@ -136,6 +153,17 @@ struct uled_info {
 	bool live;
 };
 
+struct motor_info {
+	char driver_name[LEGO_NAME_SIZE];
+	char address[LEGO_NAME_SIZE];
+	struct port_info *port_info;
+	struct config_group group;
+	struct user_tacho_motor_device motor;
+	struct ev3_motor_info info;
+	struct mutex lock;
+	bool live;
+};
+
 struct device *lego_user_cfs_parent;
 
 static inline struct sensor_info *to_sensor_info(struct config_item *item)
@@ -555,6 +583,177 @@ static struct config_item_type uleds_group_type = {
 	.ct_owner	= THIS_MODULE,
 };
 
+/* User tacho motors */
+
+static inline struct motor_info *to_motor_info(struct config_item *item)
+{
+	return container_of(to_config_group(item), struct motor_info, group);
+}
+
+static void motor_info_release(struct config_item *item)
+{
+	struct motor_info *info = to_motor_info(item);
+
+	kfree(info);
+}
+
+static struct configfs_item_operations motor_info_ops = {
+	.release		= motor_info_release,
+};
+
+static ssize_t
+motor_info_driver_name_show(struct config_item *item, char *page)
+{
+	struct motor_info *info = to_motor_info(item);
+
+	return sprintf(page, "%s\n", info->driver_name);
+}
+
+static ssize_t
+motor_info_driver_name_store(struct config_item *item, const char *page,
+			     size_t len)
+{
+	struct motor_info *info = to_motor_info(item);
+	char *value;
+
+	if (info->live)
+		return -EBUSY;
+
+	if (len > LEGO_NAME_SIZE)
+		return -EINVAL;
+
+	value = kstrndup(page, len, GFP_KERNEL);
+	if (!value)
+		return -ENOMEM;
+
+	snprintf(info->driver_name, len, "%s", strim(value));
+	kfree(value);
+
+	return len;
+}
+
+static ssize_t
+motor_info_count_per_rot_show(struct config_item *item, char *page)
+{
+	struct motor_info *info = to_motor_info(item);
+
+	return sprintf(page, "%d\n", info->info.count_per_rot);
+}
+
+static ssize_t
+motor_info_count_per_rot_store(struct config_item *item, const char *page,
+			       size_t len)
+{
+	struct motor_info *info = to_motor_info(item);
+	int value;
+
+	if (info->live)
+		return -EBUSY;
+
+	if (kstrtoint(page, 10, &value) || value <= 0)
+		return -EINVAL;
+
+	info->info.count_per_rot = value;
+
+	return len;
+}
+
+static ssize_t
+motor_info_max_speed_show(struct config_item *item, char *page)
+{
+	struct motor_info *info = to_motor_info(item);
+
+	return sprintf(page, "%d\n", info->info.max_speed);
+}
+
+static ssize_t
+motor_info_max_speed_store(struct config_item *item, const char *page,
+			   size_t len)
+{
+	struct motor_info *info = to_motor_info(item);
+	int value;
+
+	if (info->live)
+		return -EBUSY;
+
+	if (kstrtoint(page, 10, &value) || value <= 0)
+		return -EINVAL;
+
+	info->info.max_speed = value;
+
+	return len;
+}
+
+CONFIGFS_ATTR(motor_info_, driver_name);
+CONFIGFS_ATTR(motor_info_, count_per_rot);
+CONFIGFS_ATTR(motor_info_, max_speed);
+
+static struct configfs_attribute *motor_info_attrs[] = {
+	&motor_info_attr_driver_name,
+	&motor_info_attr_count_per_rot,
+	&motor_info_attr_max_speed,
+	NULL
+};
+
+static struct config_item_type motor_info_type = {
+	.ct_item_ops	= &motor_info_ops,
+	.ct_attrs	= motor_info_attrs,
+	.ct_owner	= THIS_MODULE,
+};
+
+static struct config_group
+*motor_make(struct config_group *group, const char *name)
+{
+	struct port_info *port_info =
+			container_of(group, struct port_info, motors_group);
+	struct motor_info *info;
+
+	info = kzalloc(sizeof(*info), GFP_KERNEL);
+	if (!info)
+		return ERR_PTR(-ENOMEM);
+
+	snprintf(info->driver_name, LEGO_NAME_SIZE, LEGO_USER_DEVICE_NAME);
+	snprintf(info->address, LEGO_NAME_SIZE, "%s:%s",
+		 port_info->port.address, name);
+	info->port_info = port_info;
+	info->motor.tm.driver_name = info->driver_name;
+	info->motor.tm.address = info->address;
+	info->motor.tm.info = &info->info;
+
+	/* only rotational motors for now */
+	info->info.name = info->driver_name;
+	info->info.motion_type = TM_MOTION_ROTATION;
+	info->info.count_per_rot = 360;
+	info->info.max_speed = 1000;
+	mutex_init(&info->lock);
+
+	config_group_init_type_name(&info->group, name, &motor_info_type);
+	return &info->group;
+}
+
+static void motor_drop(struct config_group *group, struct config_item *item)
+{
+	struct motor_info *info = to_motor_info(item);
+
+	mutex_lock(&info->lock);
+	if (info->live)
+		user_tacho_motor_unregister(&info->motor);
+	info->live = false;
+	mutex_unlock(&info->lock);
+
+	config_item_put(item);
+}
+
+static struct configfs_group_operations motors_group_ops = {
+	.make_group	= &motor_make,
+	.drop_item	= &motor_drop,
+};
+
+static struct config_item_type motors_group_type = {
+	.ct_group_ops	= &motors_group_ops,
+	.ct_owner	= THIS_MODULE,
+};
+
 /* Ports */
 
 static int live_allow_link(struct config_item *src, struct config_item *target)
@@ -593,6 +792,22 @@ static int live_allow_link(struct config_item *src, struct config_item *target)
 				info->live = true;
 		}
 		mutex_unlock(&info->lock);
+	} else if (target->ci_type == &motor_info_type) {
+		struct motor_info *info = to_motor_info(target);
+
+		mutex_lock(&info->lock);
+		if (info->live) {
+			ret = -EBUSY;
+		} else {
+			/* zero out the devices since the motor struct can be reused */
+			memset(&info->motor.dev, 0, sizeof(struct device));
+			memset(&info->motor.tm.dev, 0, sizeof(struct device));
+			ret = user_tacho_motor_register(&info->motor,
+						&info->port_info->port.dev);
+			if (ret == 0)
+				info->live = true;
+		}
+		mutex_unlock(&info->lock);
 	}
 
 	return ret;
@@ -606,6 +821,12 @@ static int live_drop_link(struct config_item *src, struct config_item *target)
 		user_lego_sensor_unregister(&info->sensor);
 		info->live = false;
 		mutex_unlock(&info->lock);
+	} else if (target->ci_type == &motor_info_type) {
+		struct motor_info *info = to_motor_info(target);
+		mutex_lock(&info->lock);
+		user_tacho_motor_unregister(&info->motor);
+		info->live = false;
+		mutex_unlock(&info->lock);
 	}
 
 	return 0;
@@ -684,12 +905,15 @@ static struct config_group
 	info->group.default_groups = info->default_groups;
 	info->default_groups[GROUP_INDEX_SENSORS] = &info->sensors_group;
 	info->default_groups[GROUP_INDEX_LEDS] = &info->uleds_group;
+	info->default_groups[GROUP_INDEX_MOTORS] = &info->motors_group;
 	info->default_groups[GROUP_INDEX_LIVE] = &info->live_group;
 	config_group_init_type_name(&info->group, name, &port_info_type);
 	config_group_init_type_name(&info->sensors_group, "sensors",
 				    &sensors_group_type);
 	config_group_init_type_name(&info->uleds_group, "leds",
 				    &uleds_group_type);
+	config_group_init_type_name(&info->motors_group, "motors",
+				    &motors_group_type);
 	config_group_init_type_name(&info->live_group, "live", &live_group_type);
 
 	return &info->group;
@@ -54,15 +54,48 @@
  *      - Writing stores the value which can be read using the ``text_value``
  *        attribute in the corresponding `lego-sensor` class device.
  *        It is currently limited to 512 bytes in length.
+ *
+ * Character device
+ * ----------------
+ *
+ * Drivers that update a sensor often (e.g. a vision daemon) can use
+ * ``/dev/user-lego-sensor/sensor<N>`` instead of ``bin_data``. Writing to it
+ * takes any number of ``struct user_lego_sensor_sample`` (a 64-bit
+ * ``CLOCK_MONOTONIC`` timestamp in nanoseconds, or 0 for "now", followed by
+ * 32 bytes of raw data) in a single call. The samples are published in
+ * order, as if they had come from hardware. Samples with a timestamp older
+ * than the last published sample are dropped.
+ *
+ * To avoid the copy, the device can also be mmap'd. This maps a
+ * ``struct user_lego_sensor_ring``: userspace fills the slot at ``head``,
+ * advances ``head`` and then calls the ``USER_LEGO_SENSOR_IOC_COMMIT`` ioctl,
+ * which publishes all slots up to ``head`` and advances ``tail``. The ioctl
+ * returns the number of samples consumed.
+ *
+ * Pollers of the ``bin_data`` attribute of the ``lego-sensor`` class device
+ * are woken once per write or commit.
  */
 
 #include <linux/device.h>
+#include <linux/fs.h>
 #include <linux/module.h>
+#include <linux/mm.h>
+#include <linux/mutex.h>
+#include <linux/slab.h>
+#include <linux/uaccess.h>
+#include <linux/vmalloc.h>
 
+#include "user_lego_chrdev.h"
 #include "user_lego_sensor.h"
 
 #define USER_LEGO_SENSOR_NAME "user-lego-sensor"
 
+#define USER_LEGO_SENSOR_MAX_MINORS	64
+#define USER_LEGO_SENSOR_RING_BYTES	(4 * PAGE_SIZE)
+#define USER_LEGO_SENSOR_RING_SLOTS \
+	((USER_LEGO_SENSOR_RING_BYTES - sizeof(struct user_lego_sensor_ring)) \
+	 / sizeof(struct user_lego_sensor_sample))
+
 #define to_user_lego_sensor_device(_dev) \
 	container_of(_dev, struct user_lego_sensor_device, dev)
 
@@ -136,6 +169,268 @@ static const struct attribute_group *user_lego_sensor_class_groups[] = {
 	NULL
 };
 
+/**
+ * struct user_lego_sensor_chrdev - character device for a user sensor
+ * @common: The character device.
+ * @lock: Protects the fields below.
+ * @sensor: The sensor or NULL if it is not registered.
+ * @ring: The mmap'd sample ring or NULL if it has not been mapped yet.
+ * @ring_tail: Kernel copy of the ring tail, userspace can't change it.
+ * @timestamp: Timestamp of the last published sample.
+ */
+struct user_lego_sensor_chrdev {
+	struct user_lego_chrdev common;
+	struct mutex lock;
+	struct user_lego_sensor_device *sensor;
+	struct user_lego_sensor_ring *ring;
+	u32 ring_tail;
+	ktime_t timestamp;
+};
+
+static struct user_lego_chrdev_region user_lego_sensor_chrdevs;
+
+static void user_lego_sensor_chrdev_free(struct user_lego_chrdev *common)
+{
+	struct user_lego_sensor_chrdev *chrdev =
+		container_of(common, struct user_lego_sensor_chrdev, common);
+
+	vfree(chrdev->ring);
+	kfree(chrdev);
+}
+
+/*
+ * Copies a sample to the raw data of the current mode, the same thing that
+ * hardware drivers do when they receive new data. Must be called with
+ * chrdev->lock held. Returns true if the sample was published.
+ */
+static bool user_lego_sensor_publish(struct user_lego_sensor_chrdev *chrdev,
+				     const struct user_lego_sensor_sample *sample)
+{
+	struct lego_sensor_device *sensor = &chrdev->sensor->sensor;
+	ktime_t timestamp;
+
+	if (sample->timestamp_ns)
+		timestamp = ns_to_ktime(sample->timestamp_ns);
+	else
+		timestamp = ktime_get();
+
+	if (ktime_before(timestamp, chrdev->timestamp))
+		return false;
+	chrdev->timestamp = timestamp;
+
+	memcpy(sensor->mode_info[sensor->mode].raw_data, sample->data,
+	       LEGO_SENSOR_RAW_DATA_SIZE);
+
+	return true;
+}
+
+static void user_lego_sensor_notify(struct user_lego_sensor_chrdev *chrdev)
+{
+	sysfs_notify(&chrdev->sensor->sensor.dev.kobj, NULL, "bin_data");
+}
+
+static int user_lego_sensor_open(struct inode *inode, struct file *file)
+{
+	struct user_lego_chrdev *common;
+
+	common = user_lego_chrdev_get(&user_lego_sensor_chrdevs, inode);
+	if (!common)
+		return -ENODEV;
+
+	file->private_data =
+		container_of(common, struct user_lego_sensor_chrdev, common);
+
+	return nonseekable_open(inode, file);
+}
+
+static int user_lego_sensor_release_file(struct inode *inode,
+					 struct file *file)
+{
+	struct user_lego_sensor_chrdev *chrdev = file->private_data;
+
+	user_lego_chrdev_put(&chrdev->common);
+
+	return 0;
+}
+
+static ssize_t user_lego_sensor_write(struct file *file,
+				      const char __user *buf, size_t count,
+				      loff_t *ppos)
+{
+	struct user_lego_sensor_chrdev *chrdev = file->private_data;
+	struct user_lego_sensor_sample sample;
+	bool published = false;
+	size_t done = 0;
+	int err = 0;
+
+	if (count % sizeof(sample))
+		return -EINVAL;
+
+	mutex_lock(&chrdev->lock);
+
+	if (!chrdev->sensor) {
+		err = -ENODEV;
+		goto out;
+	}
+
+	for (done = 0; done < count; done += sizeof(sample)) {
+		if (copy_from_user(&sample, buf + done, sizeof(sample))) {
+			err = -EFAULT;
+			break;
+		}
+		published |= user_lego_sensor_publish(chrdev, &sample);
+	}
+
+	if (published)
+		user_lego_sensor_notify(chrdev);
+
+out:
+	mutex_unlock(&chrdev->lock);
+
+	return done ? done : err;
+}
+
+static int user_lego_sensor_ring_commit(struct user_lego_sensor_chrdev *chrdev)
+{
+	struct user_lego_sensor_ring *ring;
+	struct user_lego_sensor_sample sample;
+	bool published = false;
+	u32 head, tail;
+	int count = 0;
+
+	mutex_lock(&chrdev->lock);
+
+	ring = chrdev->ring;
+	if (!chrdev->sensor) {
+		count = -ENODEV;
+		goto out;
+	}
+	if (!ring) {
+		count = -ENXIO;
+		goto out;
+	}
+
+	head = smp_load_acquire(&ring->head);
+	if (head >= USER_LEGO_SENSOR_RING_SLOTS) {
+		count = -EINVAL;
+		goto out;
+	}
+
+	for (tail = chrdev->ring_tail; tail != head;
+	     tail = (tail + 1) % USER_LEGO_SENSOR_RING_SLOTS) {
+		/* userspace can change the slot while we look at it */
+		memcpy(&sample, &ring->samples[tail], sizeof(sample));
+		published |= user_lego_sensor_publish(chrdev, &sample);
+		count++;
+	}
+
+	chrdev->ring_tail = tail;
+	smp_store_release(&ring->tail, tail);
+
+	if (published)
+		user_lego_sensor_notify(chrdev);
+
+out:
+	mutex_unlock(&chrdev->lock);
+
+	return count;
+}
+
+static long user_lego_sensor_ioctl(struct file *file, unsigned int cmd,
+				   unsigned long arg)
+{
+	struct user_lego_sensor_chrdev *chrdev = file->private_data;
+
+	switch (cmd) {
+	case USER_LEGO_SENSOR_IOC_COMMIT:
+		return user_lego_sensor_ring_commit(chrdev);
+	}
+
+	return -ENOTTY;
+}
+
+static int user_lego_sensor_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct user_lego_sensor_chrdev *chrdev = file->private_data;
+	struct user_lego_sensor_ring *ring;
+	int err;
+
+	if (vma->vm_pgoff
+	    || vma->vm_end - vma->vm_start > USER_LEGO_SENSOR_RING_BYTES)
+		return -EINVAL;
+
+	mutex_lock(&chrdev->lock);
+
+	if (!chrdev->ring) {
+		ring = vmalloc_user(USER_LEGO_SENSOR_RING_BYTES);
+		if (!ring) {
+			err = -ENOMEM;
+			goto out;
+		}
+		ring->size = USER_LEGO_SENSOR_RING_SLOTS;
+		ring->sample_size = sizeof(struct user_lego_sensor_sample);
+		chrdev->ring = ring;
+		chrdev->ring_tail = 0;
+	}
+
+	err = remap_vmalloc_range(vma, chrdev->ring, 0);
+
+out:
+	mutex_unlock(&chrdev->lock);
+
+	return err;
+}
+
+static const struct file_operations user_lego_sensor_fops = {
+	.owner		= THIS_MODULE,
+	.open		= user_lego_sensor_open,
+	.release	= user_lego_sensor_release_file,
+	.write		= user_lego_sensor_write,
+	.unlocked_ioctl	= user_lego_sensor_ioctl,
+	.mmap		= user_lego_sensor_mmap,
+	.llseek		= no_llseek,
+};
+
+static int user_lego_sensor_chrdev_create(struct user_lego_sensor_device *sensor)
+{
+	struct user_lego_sensor_chrdev *chrdev;
+	int err;
+
+	chrdev = kzalloc(sizeof(*chrdev), GFP_KERNEL);
+	if (!chrdev)
+		return -ENOMEM;
+
+	mutex_init(&chrdev->lock);
+
+	err = user_lego_chrdev_add(&user_lego_sensor_chrdevs, &chrdev->common,
+				   &user_lego_sensor_fops,
+				   user_lego_sensor_chrdev_free);
+	if (err) {
+		kfree(chrdev);
+		return err;
+	}
+
+	sensor->dev.devt = chrdev->common.cdev->dev;
+	sensor->chrdev = chrdev;
+
+	return 0;
+}
+
+static void user_lego_sensor_chrdev_destroy(struct user_lego_sensor_device *sensor)
+{
+	struct user_lego_sensor_chrdev *chrdev = sensor->chrdev;
+
+	user_lego_chrdev_del(&user_lego_sensor_chrdevs, &chrdev->common);
+
+	/* files that are still open will get -ENODEV from now on */
+	mutex_lock(&chrdev->lock);
+	chrdev->sensor = NULL;
+	mutex_unlock(&chrdev->lock);
+
+	sensor->chrdev = NULL;
+	user_lego_chrdev_put(&chrdev->common);
+}
+
 const char *user_lego_sensor_get_text_value(void *context) {
 	struct user_lego_sensor_device *sensor = context;
 
@@ -161,14 +456,20 @@ int user_lego_sensor_register(struct user_lego_sensor_device *sensor,
 	if (WARN_ON(!parent))
 		return -EINVAL;
 
+	err = user_lego_sensor_chrdev_create(sensor);
+	if (err)
+		return err;
+
 	sensor->dev.release = user_lego_sensor_release;
 	sensor->dev.parent = parent;
 	sensor->dev.class = &user_lego_sensor_class;
 	dev_set_name(&sensor->dev, "sensor%d", user_lego_sensor_class_id++);
 
 	err = device_register(&sensor->dev);
-	if (err)
+	if (err) {
+		user_lego_sensor_chrdev_destroy(sensor);
 		return err;
+	}
 
 	dev_info(&sensor->dev, "Registered '%s' on '%s'.\n", sensor->sensor.name,
 		 sensor->sensor.address);
@@ -182,15 +483,22 @@ int user_lego_sensor_register(struct user_lego_sensor_device *sensor,
 			"Failed to register lego-sensor class device. %d\n",
 			err);
 		device_unregister(&sensor->dev);
+		user_lego_sensor_chrdev_destroy(sensor);
 		return err;
 	}
 
+	/* the sensor can't take samples until its class device exists */
+	mutex_lock(&sensor->chrdev->lock);
+	sensor->chrdev->sensor = sensor;
+	mutex_unlock(&sensor->chrdev->lock);
+
 	return 0;
 }
 EXPORT_SYMBOL_GPL(user_lego_sensor_register);
 
 void user_lego_sensor_unregister(struct user_lego_sensor_device *sensor)
 {
+	user_lego_sensor_chrdev_destroy(sensor);
 	unregister_lego_sensor(&sensor->sensor);
 	dev_info(&sensor->dev, "Unregistered '%s' on '%s'.\n", sensor->sensor.name,
 		 sensor->sensor.address);
@@ -237,9 +545,18 @@ static int __init user_lego_sensor_class_init(void)
 {
 	int err;
 
+	err = user_lego_chrdev_region_init(&user_lego_sensor_chrdevs,
+					   USER_LEGO_SENSOR_NAME,
+					   USER_LEGO_SENSOR_MAX_MINORS);
+	if (err) {
+		pr_err("unable to allocate " USER_LEGO_SENSOR_NAME " device numbers\n");
+		return err;
+	}
+
 	err = class_register(&user_lego_sensor_class);
 	if (err) {
 		pr_err("unable to register " USER_LEGO_SENSOR_NAME " device class\n");
+		user_lego_chrdev_region_exit(&user_lego_sensor_chrdevs);
 		return err;
 	}
 
@@ -250,6 +567,7 @@ module_init(user_lego_sensor_class_init);
 static void __exit user_lego_sensor_class_exit(void)
 {
 	class_unregister(&user_lego_sensor_class);
+	user_lego_chrdev_region_exit(&user_lego_sensor_chrdevs);
 }
 module_exit(user_lego_sensor_class_exit);
 
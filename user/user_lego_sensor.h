@@ -13,15 +13,54 @@
  * GNU General Public License for more details.
  */
 
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
 #include <lego.h>
 #include <lego_sensor_class.h>
 
 #define USER_LEGO_SENSOR_TEXT_VALUE_SIZE 512
 
+/**
+ * struct user_lego_sensor_sample - sample written to the character device
+ * @timestamp_ns: CLOCK_MONOTONIC time of the sample or 0 for "now". Samples
+ *                that are older than the last published sample are dropped.
+ * @data: The new raw data for the current mode.
+ */
+struct user_lego_sensor_sample {
+	__u64 timestamp_ns;
+	__u8 data[LEGO_SENSOR_RAW_DATA_SIZE];
+};
+
+/**
+ * struct user_lego_sensor_ring - header of the mmap'd sample ring
+ * @head: Index of the next slot that userspace will fill.
+ * @tail: Index of the next slot that the kernel will consume.
+ * @size: Number of slots in @samples.
+ * @sample_size: Size of each slot in bytes.
+ * @samples: The slots.
+ *
+ * Userspace owns @head and the kernel owns @tail. The ring is full when
+ * (@head + 1) % @size == @tail.
+ */
+struct user_lego_sensor_ring {
+	__u32 head;
+	__u32 tail;
+	__u32 size;
+	__u32 sample_size;
+	struct user_lego_sensor_sample samples[];
+};
+
+/* Publishes the samples that were added to the mmap'd ring. */
+#define USER_LEGO_SENSOR_IOC_COMMIT	_IO('L', 0x01)
+
+struct user_lego_sensor_chrdev;
+
 struct user_lego_sensor_device {
 	struct lego_sensor_device sensor;
 	struct device dev;
 	char text_value[USER_LEGO_SENSOR_TEXT_VALUE_SIZE+1];
+	struct user_lego_sensor_chrdev *chrdev;
 };
 
 extern int user_lego_sensor_register(struct user_lego_sensor_device *sensor,
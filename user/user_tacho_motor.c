@@ -0,0 +1,639 @@
+/*
+ * User-defined LEGO devices - Tacho motor driver
+ *
+ * Copyright (C) 2016 David Lechner <david@lechnology.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+
+ * This program is distributed "as is" WITHOUT ANY WARRANTY of any
+ * kind, whether express or implied; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/**
+ * DOC: userspace
+ *
+ * The ``user-tacho-motor`` class provides an interface for implementing
+ * user-defined tacho motors in userspace. The motor controller is a userspace
+ * program and the motor shows up in the ``tacho-motor`` class like any other
+ * motor.
+ *
+ * Motors can be found at ``/sys/class/user-tacho-motor/motor<N>``, where
+ * ``<N>`` is incremented each time a motor is loaded. The ``address``
+ * attribute matches the ``address`` of the corresponding ``tacho-motor``
+ * class device.
+ *
+ * Character device
+ * ----------------
+ *
+ * The controller opens ``/dev/user-tacho-motor/motor<N>``. Commands are not
+ * accepted by the ``tacho-motor`` class device unless the controller has it
+ * open.
+ *
+ * - ``read()`` returns one or more ``struct user_tacho_motor_command``. It
+ *   blocks until there is a command unless the file was opened with
+ *   ``O_NONBLOCK``. ``poll()`` can be used to wait for commands.
+ *
+ * - ``mmap()`` maps a ``struct user_tacho_motor_state``. The controller
+ *   updates the position, speed, duty cycle and state flags there and the
+ *   ``tacho-motor`` class reads them directly, so reading ``position`` or
+ *   ``speed`` does not need a round trip to the controller.
+ *
+ * - ``write()`` of a ``struct user_tacho_motor_state`` updates the shared
+ *   state for controllers that don't use ``mmap()``.
+ *
+ * - After changing the state flags in the shared page, the controller calls
+ *   the ``USER_TACHO_MOTOR_IOC_NOTIFY_STATE`` ioctl so that pollers of the
+ *   ``state`` attribute are woken. When a run-to-pos command starts ramping
+ *   down, it calls ``USER_TACHO_MOTOR_IOC_NOTIFY_RAMP_DOWN``. Writing the
+ *   state does the former automatically.
+ */
+
+#include <linux/device.h>
+#include <linux/fs.h>
+#include <linux/kfifo.h>
+#include <linux/mm.h>
+#include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/poll.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/uaccess.h>
+#include <linux/vmalloc.h>
+#include <linux/wait.h>
+
+#include "user_lego_chrdev.h"
+#include "user_tacho_motor.h"
+
+#define USER_TACHO_MOTOR_NAME "user-tacho-motor"
+
+#define USER_TACHO_MOTOR_MAX_MINORS	64
+#define USER_TACHO_MOTOR_NUM_COMMANDS	32
+
+#define to_user_tacho_motor_device(_dev) \
+	container_of(_dev, struct user_tacho_motor_device, dev)
+
+/**
+ * struct user_tacho_motor_chrdev - character device for a user motor
+ * @common: The character device.
+ * @open_count: Number of open files. Commands fail if there are none.
+ * @state: Page shared with the controller.
+ * @commands: Commands that have not been read by the controller yet.
+ * @commands_lock: Serializes writers of @commands.
+ * @read_lock: Serializes readers of @commands.
+ * @wait: Wait queue for readers of @commands.
+ * @lock: Protects @motor.
+ * @motor: The motor or NULL if it is not registered.
+ */
+struct user_tacho_motor_chrdev {
+	struct user_lego_chrdev common;
+	atomic_t open_count;
+	struct user_tacho_motor_state *state;
+	DECLARE_KFIFO(commands, struct user_tacho_motor_command,
+		      USER_TACHO_MOTOR_NUM_COMMANDS);
+	spinlock_t commands_lock;
+	struct mutex read_lock;
+	wait_queue_head_t wait;
+	struct mutex lock;
+	struct user_tacho_motor_device *motor;
+};
+
+static struct user_lego_chrdev_region user_tacho_motor_chrdevs;
+
+static void user_tacho_motor_chrdev_free(struct user_lego_chrdev *common)
+{
+	struct user_tacho_motor_chrdev *chrdev =
+		container_of(common, struct user_tacho_motor_chrdev, common);
+
+	vfree(chrdev->state);
+	kfree(chrdev);
+}
+
+/* tacho-motor class ops */
+
+static int user_tacho_motor_send(void *context,
+				 const struct user_tacho_motor_command *cmd)
+{
+	struct user_tacho_motor_device *motor = context;
+	struct user_tacho_motor_chrdev *chrdev = motor->chrdev;
+
+	if (!atomic_read(&chrdev->open_count))
+		return -ENOTCONN;
+
+	if (!kfifo_in_spinlocked(&chrdev->commands, cmd, 1,
+				 &chrdev->commands_lock))
+		return -EBUSY;
+
+	wake_up_interruptible(&chrdev->wait);
+
+	return 0;
+}
+
+static int user_tacho_motor_get_position(void *context, int *position)
+{
+	struct user_tacho_motor_device *motor = context;
+
+	*position = READ_ONCE(motor->chrdev->state->position);
+
+	return 0;
+}
+
+static int user_tacho_motor_set_position(void *context, int position)
+{
+	struct user_tacho_motor_device *motor = context;
+	struct user_tacho_motor_command cmd = {
+		.type		= USER_TM_CMD_SET_POSITION,
+		.position	= position,
+	};
+	int err;
+
+	err = user_tacho_motor_send(context, &cmd);
+	if (err < 0)
+		return err;
+
+	/* so that reading position right away returns the new value */
+	WRITE_ONCE(motor->chrdev->state->position, position);
+
+	return 0;
+}
+
+static int user_tacho_motor_get_state(void *context)
+{
+	struct user_tacho_motor_device *motor = context;
+
+	return READ_ONCE(motor->chrdev->state->state)
+		& (BIT(NUM_TM_STATE) - 1) & ~BIT(TM_STATE_RAMPING);
+}
+
+static int user_tacho_motor_get_duty_cycle(void *context, int *duty_cycle)
+{
+	struct user_tacho_motor_device *motor = context;
+
+	*duty_cycle = READ_ONCE(motor->chrdev->state->duty_cycle);
+
+	return 0;
+}
+
+static int user_tacho_motor_get_speed(void *context, int *speed)
+{
+	struct user_tacho_motor_device *motor = context;
+
+	*speed = READ_ONCE(motor->chrdev->state->speed);
+
+	return 0;
+}
+
+static int user_tacho_motor_run_unregulated(void *context, int duty_cycle)
+{
+	struct user_tacho_motor_command cmd = {
+		.type		= USER_TM_CMD_RUN_UNREGULATED,
+		.duty_cycle	= duty_cycle,
+	};
+
+	return user_tacho_motor_send(context, &cmd);
+}
+
+static int user_tacho_motor_run_regulated(void *context, int speed)
+{
+	struct user_tacho_motor_command cmd = {
+		.type		= USER_TM_CMD_RUN_REGULATED,
+		.speed		= speed,
+	};
+
+	return user_tacho_motor_send(context, &cmd);
+}
+
+static int user_tacho_motor_run_to_pos(void *context, int pos, int speed,
+				       enum tm_stop_action action)
+{
+	struct user_tacho_motor_command cmd = {
+		.type		= USER_TM_CMD_RUN_TO_POS,
+		.position	= pos,
+		.speed		= speed,
+		.stop_action	= action,
+	};
+
+	return user_tacho_motor_send(context, &cmd);
+}
+
+static int user_tacho_motor_stop(void *context, enum tm_stop_action action)
+{
+	struct user_tacho_motor_command cmd = {
+		.type		= USER_TM_CMD_STOP,
+		.stop_action	= action,
+	};
+
+	return user_tacho_motor_send(context, &cmd);
+}
+
+static int user_tacho_motor_reset(void *context)
+{
+	struct user_tacho_motor_command cmd = {
+		.type		= USER_TM_CMD_RESET,
+	};
+
+	return user_tacho_motor_send(context, &cmd);
+}
+
+static unsigned user_tacho_motor_get_stop_actions(void *context)
+{
+	return BIT(TM_STOP_ACTION_COAST) | BIT(TM_STOP_ACTION_BRAKE)
+		| BIT(TM_STOP_ACTION_HOLD);
+}
+
+static const struct tacho_motor_ops user_tacho_motor_ops = {
+	.get_position		= user_tacho_motor_get_position,
+	.set_position		= user_tacho_motor_set_position,
+	.get_state		= user_tacho_motor_get_state,
+	.get_duty_cycle		= user_tacho_motor_get_duty_cycle,
+	.get_speed		= user_tacho_motor_get_speed,
+	.run_unregulated	= user_tacho_motor_run_unregulated,
+	.run_regulated		= user_tacho_motor_run_regulated,
+	.run_to_pos		= user_tacho_motor_run_to_pos,
+	.stop			= user_tacho_motor_stop,
+	.reset			= user_tacho_motor_reset,
+	.get_stop_actions	= user_tacho_motor_get_stop_actions,
+};
+
+/* character device */
+
+static int user_tacho_motor_open(struct inode *inode, struct file *file)
+{
+	struct user_tacho_motor_chrdev *chrdev;
+	struct user_lego_chrdev *common;
+
+	common = user_lego_chrdev_get(&user_tacho_motor_chrdevs, inode);
+	if (!common)
+		return -ENODEV;
+
+	chrdev = container_of(common, struct user_tacho_motor_chrdev, common);
+	file->private_data = chrdev;
+	atomic_inc(&chrdev->open_count);
+
+	return nonseekable_open(inode, file);
+}
+
+static int user_tacho_motor_release_file(struct inode *inode,
+					 struct file *file)
+{
+	struct user_tacho_motor_chrdev *chrdev = file->private_data;
+
+	atomic_dec(&chrdev->open_count);
+	user_lego_chrdev_put(&chrdev->common);
+
+	return 0;
+}
+
+static bool user_tacho_motor_gone(struct user_tacho_motor_chrdev *chrdev)
+{
+	return !READ_ONCE(chrdev->motor);
+}
+
+static ssize_t user_tacho_motor_read(struct file *file, char __user *buf,
+				     size_t count, loff_t *ppos)
+{
+	struct user_tacho_motor_chrdev *chrdev = file->private_data;
+	unsigned int copied;
+	int err;
+
+	if (count < sizeof(struct user_tacho_motor_command))
+		return -EINVAL;
+
+	if (mutex_lock_interruptible(&chrdev->read_lock))
+		return -ERESTARTSYS;
+
+	while (kfifo_is_empty(&chrdev->commands)) {
+		if (user_tacho_motor_gone(chrdev)) {
+			err = -ENODEV;
+			goto out;
+		}
+		if (file->f_flags & O_NONBLOCK) {
+			err = -EAGAIN;
+			goto out;
+		}
+		mutex_unlock(&chrdev->read_lock);
+		err = wait_event_interruptible(chrdev->wait,
+				!kfifo_is_empty(&chrdev->commands)
+				|| user_tacho_motor_gone(chrdev));
+		if (err)
+			return err;
+		if (mutex_lock_interruptible(&chrdev->read_lock))
+			return -ERESTARTSYS;
+	}
+
+	/* kfifo_to_user() only copies whole records */
+	err = kfifo_to_user(&chrdev->commands, buf, count, &copied);
+
+out:
+	mutex_unlock(&chrdev->read_lock);
+
+	return err ? err : copied;
+}
+
+static void user_tacho_motor_notify_state(struct user_tacho_motor_chrdev *chrdev)
+{
+	mutex_lock(&chrdev->lock);
+	if (chrdev->motor)
+		tacho_motor_notify_state_change(&chrdev->motor->tm);
+	mutex_unlock(&chrdev->lock);
+}
+
+static ssize_t user_tacho_motor_write(struct file *file,
+				      const char __user *buf, size_t count,
+				      loff_t *ppos)
+{
+	struct user_tacho_motor_chrdev *chrdev = file->private_data;
+	struct user_tacho_motor_state state;
+
+	if (count != sizeof(state))
+		return -EINVAL;
+
+	if (copy_from_user(&state, buf, sizeof(state)))
+		return -EFAULT;
+
+	WRITE_ONCE(chrdev->state->position, state.position);
+	WRITE_ONCE(chrdev->state->speed, state.speed);
+	WRITE_ONCE(chrdev->state->duty_cycle, state.duty_cycle);
+	WRITE_ONCE(chrdev->state->state, state.state);
+
+	user_tacho_motor_notify_state(chrdev);
+
+	return count;
+}
+
+static unsigned int user_tacho_motor_poll(struct file *file, poll_table *wait)
+{
+	struct user_tacho_motor_chrdev *chrdev = file->private_data;
+	unsigned int mask = POLLOUT | POLLWRNORM;
+
+	poll_wait(file, &chrdev->wait, wait);
+
+	if (!kfifo_is_empty(&chrdev->commands))
+		mask |= POLLIN | POLLRDNORM;
+	if (user_tacho_motor_gone(chrdev))
+		mask |= POLLHUP;
+
+	return mask;
+}
+
+static long user_tacho_motor_ioctl(struct file *file, unsigned int cmd,
+				   unsigned long arg)
+{
+	struct user_tacho_motor_chrdev *chrdev = file->private_data;
+
+	switch (cmd) {
+	case USER_TACHO_MOTOR_IOC_NOTIFY_STATE:
+		user_tacho_motor_notify_state(chrdev);
+		return 0;
+	case USER_TACHO_MOTOR_IOC_NOTIFY_RAMP_DOWN:
+		mutex_lock(&chrdev->lock);
+		if (chrdev->motor)
+			tacho_motor_notify_position_ramp_down(&chrdev->motor->tm);
+		mutex_unlock(&chrdev->lock);
+		return 0;
+	}
+
+	return -ENOTTY;
+}
+
+static int user_tacho_motor_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct user_tacho_motor_chrdev *chrdev = file->private_data;
+
+	if (vma->vm_pgoff || vma->vm_end - vma->vm_start > PAGE_SIZE)
+		return -EINVAL;
+
+	return remap_vmalloc_range(vma, chrdev->state, 0);
+}
+
+static const struct file_operations user_tacho_motor_fops = {
+	.owner		= THIS_MODULE,
+	.open		= user_tacho_motor_open,
+	.release	= user_tacho_motor_release_file,
+	.read		= user_tacho_motor_read,
+	.write		= user_tacho_motor_write,
+	.poll		= user_tacho_motor_poll,
+	.unlocked_ioctl	= user_tacho_motor_ioctl,
+	.mmap		= user_tacho_motor_mmap,
+	.llseek		= no_llseek,
+};
+
+static int user_tacho_motor_chrdev_create(struct user_tacho_motor_device *motor)
+{
+	struct user_tacho_motor_chrdev *chrdev;
+	int err;
+
+	chrdev = kzalloc(sizeof(*chrdev), GFP_KERNEL);
+	if (!chrdev)
+		return -ENOMEM;
+
+	chrdev->state = vmalloc_user(PAGE_SIZE);
+	if (!chrdev->state) {
+		err = -ENOMEM;
+		goto err_vmalloc_user;
+	}
+
+	INIT_KFIFO(chrdev->commands);
+	spin_lock_init(&chrdev->commands_lock);
+	mutex_init(&chrdev->read_lock);
+	init_waitqueue_head(&chrdev->wait);
+	mutex_init(&chrdev->lock);
+
+	err = user_lego_chrdev_add(&user_tacho_motor_chrdevs, &chrdev->common,
+				   &user_tacho_motor_fops,
+				   user_tacho_motor_chrdev_free);
+	if (err)
+		goto err_user_lego_chrdev_add;
+
+	motor->dev.devt = chrdev->common.cdev->dev;
+	motor->chrdev = chrdev;
+
+	return 0;
+
+err_user_lego_chrdev_add:
+	vfree(chrdev->state);
+err_vmalloc_user:
+	kfree(chrdev);
+
+	return err;
+}
+
+static void user_tacho_motor_chrdev_destroy(struct user_tacho_motor_device *motor)
+{
+	struct user_tacho_motor_chrdev *chrdev = motor->chrdev;
+
+	user_lego_chrdev_del(&user_tacho_motor_chrdevs, &chrdev->common);
+
+	/* wake up blocked readers so that they can return -ENODEV */
+	mutex_lock(&chrdev->lock);
+	WRITE_ONCE(chrdev->motor, NULL);
+	mutex_unlock(&chrdev->lock);
+	wake_up_interruptible(&chrdev->wait);
+
+	motor->chrdev = NULL;
+	user_lego_chrdev_put(&chrdev->common);
+}
+
+/* user-tacho-motor class */
+
+static ssize_t address_show(struct device *dev, struct device_attribute *attr,
+			    char *buf)
+{
+	struct user_tacho_motor_device *motor = to_user_tacho_motor_device(dev);
+
+	return snprintf(buf, LEGO_NAME_SIZE, "%s\n", motor->tm.address);
+}
+
+static DEVICE_ATTR_RO(address);
+
+static struct attribute *user_tacho_motor_class_attrs[] = {
+	&dev_attr_address.attr,
+	NULL
+};
+
+ATTRIBUTE_GROUPS(user_tacho_motor_class);
+
+static void user_tacho_motor_release(struct device *dev)
+{
+}
+
+struct class user_tacho_motor_class;
+static unsigned user_tacho_motor_class_id = 0;
+
+int user_tacho_motor_register(struct user_tacho_motor_device *motor,
+			      struct device *parent)
+{
+	int err;
+
+	if (WARN_ON(!motor))
+		return -EINVAL;
+	if (WARN_ON(!motor->tm.address))
+		return -EINVAL;
+	if (WARN_ON(!parent))
+		return -EINVAL;
+
+	err = user_tacho_motor_chrdev_create(motor);
+	if (err)
+		return err;
+
+	motor->dev.release = user_tacho_motor_release;
+	motor->dev.parent = parent;
+	motor->dev.class = &user_tacho_motor_class;
+	dev_set_name(&motor->dev, "motor%d", user_tacho_motor_class_id++);
+
+	err = device_register(&motor->dev);
+	if (err) {
+		user_tacho_motor_chrdev_destroy(motor);
+		return err;
+	}
+
+	dev_info(&motor->dev, "Registered '%s' on '%s'.\n",
+		 motor->tm.driver_name, motor->tm.address);
+
+	motor->tm.ops = &user_tacho_motor_ops;
+	motor->tm.context = motor;
+
+	err = register_tacho_motor(&motor->tm, &motor->dev);
+	if (err) {
+		dev_err(&motor->dev,
+			"Failed to register tacho-motor class device. %d\n",
+			err);
+		device_unregister(&motor->dev);
+		user_tacho_motor_chrdev_destroy(motor);
+		return err;
+	}
+
+	mutex_lock(&motor->chrdev->lock);
+	WRITE_ONCE(motor->chrdev->motor, motor);
+	mutex_unlock(&motor->chrdev->lock);
+
+	return 0;
+}
+EXPORT_SYMBOL_GPL(user_tacho_motor_register);
+
+void user_tacho_motor_unregister(struct user_tacho_motor_device *motor)
+{
+	/* the controller must not notify the class device after this */
+	mutex_lock(&motor->chrdev->lock);
+	WRITE_ONCE(motor->chrdev->motor, NULL);
+	mutex_unlock(&motor->chrdev->lock);
+
+	unregister_tacho_motor(&motor->tm);
+	user_tacho_motor_chrdev_destroy(motor);
+	dev_info(&motor->dev, "Unregistered '%s' on '%s'.\n",
+		 motor->tm.driver_name, motor->tm.address);
+	device_unregister(&motor->dev);
+}
+EXPORT_SYMBOL_GPL(user_tacho_motor_unregister);
+
+static int user_tacho_motor_dev_uevent(struct device *dev,
+				       struct kobj_uevent_env *env)
+{
+	struct user_tacho_motor_device *motor = to_user_tacho_motor_device(dev);
+	int ret;
+
+	ret = add_uevent_var(env, "LEGO_DRIVER_NAME=%s", motor->tm.driver_name);
+	if (ret) {
+		dev_err(dev, "failed to add uevent LEGO_DRIVER_NAME\n");
+		return ret;
+	}
+
+	ret = add_uevent_var(env, "LEGO_ADDRESS=%s", motor->tm.address);
+	if (ret) {
+		dev_err(dev, "failed to add uevent LEGO_ADDRESS\n");
+		return ret;
+	}
+
+	return 0;
+}
+
+static char *user_tacho_motor_devnode(struct device *dev, umode_t *mode)
+{
+	return kasprintf(GFP_KERNEL, USER_TACHO_MOTOR_NAME "/%s", dev_name(dev));
+}
+
+struct class user_tacho_motor_class = {
+	.name		= USER_TACHO_MOTOR_NAME,
+	.owner		= THIS_MODULE,
+	.dev_groups	= user_tacho_motor_class_groups,
+	.dev_uevent	= user_tacho_motor_dev_uevent,
+	.devnode	= user_tacho_motor_devnode,
+};
+EXPORT_SYMBOL_GPL(user_tacho_motor_class);
+
+static int __init user_tacho_motor_class_init(void)
+{
+	int err;
+
+	err = user_lego_chrdev_region_init(&user_tacho_motor_chrdevs,
+					   USER_TACHO_MOTOR_NAME,
+					   USER_TACHO_MOTOR_MAX_MINORS);
+	if (err) {
+		pr_err("unable to allocate " USER_TACHO_MOTOR_NAME " device numbers\n");
+		return err;
+	}
+
+	err = class_register(&user_tacho_motor_class);
+	if (err) {
+		pr_err("unable to register " USER_TACHO_MOTOR_NAME " device class\n");
+		user_lego_chrdev_region_exit(&user_tacho_motor_chrdevs);
+		return err;
+	}
+
+	return 0;
+}
+module_init(user_tacho_motor_class_init);
+
+static void __exit user_tacho_motor_class_exit(void)
+{
+	class_unregister(&user_tacho_motor_class);
+	user_lego_chrdev_region_exit(&user_tacho_motor_chrdevs);
+}
+module_exit(user_tacho_motor_class_exit);
+
+MODULE_DESCRIPTION("User-defined tacho motor device class");
+MODULE_AUTHOR("David Lechner <david@lechnology.com>");
+MODULE_LICENSE("GPL");
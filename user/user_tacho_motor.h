@@ -0,0 +1,78 @@
+/*
+ * User-defined LEGO devices - Tacho motor driver
+ *
+ * Copyright (C) 2016 David Lechner <david@lechnology.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+
+ * This program is distributed "as is" WITHOUT ANY WARRANTY of any
+ * kind, whether express or implied; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+#include <lego.h>
+#include <tacho_motor_class.h>
+
+enum user_tacho_motor_command_type {
+	USER_TM_CMD_RUN_UNREGULATED,
+	USER_TM_CMD_RUN_REGULATED,
+	USER_TM_CMD_RUN_TO_POS,
+	USER_TM_CMD_STOP,
+	USER_TM_CMD_RESET,
+	USER_TM_CMD_SET_POSITION,
+};
+
+/**
+ * struct user_tacho_motor_command - command read from the character device
+ * @type: One of enum user_tacho_motor_command_type.
+ * @position: Target position for run-to-pos or new position for
+ *            set-position, in tacho counts.
+ * @speed: Speed setpoint in tacho counts per second.
+ * @duty_cycle: Duty cycle in percent for run-unregulated.
+ * @stop_action: One of enum tm_stop_action for run-to-pos and stop.
+ */
+struct user_tacho_motor_command {
+	__u32 type;
+	__s32 position;
+	__s32 speed;
+	__s32 duty_cycle;
+	__u32 stop_action;
+};
+
+/**
+ * struct user_tacho_motor_state - state shared with the controller
+ * @position: Current position in tacho counts.
+ * @speed: Current speed in tacho counts per second.
+ * @duty_cycle: Current duty cycle in percent.
+ * @state: BIT(TM_STATE_*) flags, except TM_STATE_RAMPING which is handled
+ *         by the tacho-motor class.
+ */
+struct user_tacho_motor_state {
+	__s32 position;
+	__s32 speed;
+	__s32 duty_cycle;
+	__u32 state;
+};
+
+/* Tells the tacho-motor class that the state flags in the shared page changed. */
+#define USER_TACHO_MOTOR_IOC_NOTIFY_STATE	_IO('L', 0x10)
+/* Tells the tacho-motor class that a run-to-pos command is ramping down. */
+#define USER_TACHO_MOTOR_IOC_NOTIFY_RAMP_DOWN	_IO('L', 0x11)
+
+struct user_tacho_motor_chrdev;
+
+struct user_tacho_motor_device {
+	struct tacho_motor_device tm;
+	struct device dev;
+	struct user_tacho_motor_chrdev *chrdev;
+};
+
+extern int user_tacho_motor_register(struct user_tacho_motor_device *motor,
+				     struct device *parent);
+extern void user_tacho_motor_unregister(struct user_tacho_motor_device *motor);
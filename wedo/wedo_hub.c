@@ -21,6 +21,8 @@
 #include <linux/slab.h>
 #include <linux/module.h>
 #include <linux/bitops.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
 
 #include <lego.h>
 #include <lego_port_class.h>
@@ -38,6 +40,16 @@
 
 #define WEDO_STATUS_DEBOUNCE	8
 
+/*
+ * The hub sends an 8 byte report every interrupt interval. Several input URBs
+ * are kept queued so that the host controller always has a buffer ready for
+ * the next report while the completion handler for the previous one runs.
+ */
+#define WEDO_NUM_IN_URBS	4
+#define WEDO_REPORT_SIZE	8
+#define WEDO_IN_INTERVAL	32
+#define WEDO_RATE_WINDOW_MS	1000
+
 /* table of devices that work with this driver */
 static const struct usb_device_id wedo_table [] = {
 	{ USB_DEVICE(0x0694, 0x0003) },
@@ -141,9 +153,9 @@ static const struct wedo_hub_sensor_info wedo_hub_sensor_defs[] = {
  * @wedo_hub: The LEGO sensor device that represents the WeDo hub itself
  * @wedo_hub_info: Sensor info used by wedo_hub
  * @wedo_ports: The LEGO port devices for the 2 ports on the WeDo hub
- * @in_dma:
- * @in_buf: The read data buffer
- * @in_urb: the urb to read data with
+ * @in_dma: DMA address of @in_buf
+ * @in_buf: The read data buffers, WEDO_REPORT_SIZE bytes for each input URB
+ * @in_urb: Ring of input URBs that are kept in flight
  * @cr: The USB Control Request
  * @ctl_dma:
  * @ctl_buf: The control data buffer
@@ -151,9 +163,19 @@ static const struct wedo_hub_sensor_info wedo_hub_sensor_defs[] = {
  * @io_lock: lock for I/O operations
  * @status_debounce: Status debounce count after output change
  * @output_bits: Control bits sent to hub during output change
- * @update_output: Output module requested an output change
+ * @update_output: An output change was requested while @ctl_urb was busy
  * @output_pending: Control URB has been submitted
  * @io_halt:  IO to the WeDo hub must stop
+ * @report_time: Time the most recent input report was received
+ * @reports: Number of input reports received
+ * @lost_reports: Number of input reports that were missed or failed
+ * @rate_time: Start of the current report rate measurement window
+ * @rate_reports: Value of @reports at @rate_time
+ * @report_rate: Input reports per second measured over the last window
+ * @ctl_time: Time @ctl_urb was last submitted
+ * @output_urbs: Number of control URBs that completed successfully
+ * @output_coalesced: Number of output changes merged into a later control URB
+ * @output_latency_us: Average round-trip time of the control URB
  * */
 struct usb_wedo {
 	struct usb_device	*usb_device;
@@ -164,7 +186,7 @@ struct usb_wedo {
 	struct wedo_port_data	*wedo_ports[WEDO_PORT_MAX];
 	dma_addr_t		in_dma;
 	unsigned char		*in_buf;
-	struct urb		*in_urb;
+	struct urb		*in_urb[WEDO_NUM_IN_URBS];
 	struct usb_ctrlrequest	cr;
 	dma_addr_t		ctl_dma;
 	unsigned char		*ctl_buf;
@@ -175,16 +197,68 @@ struct usb_wedo {
 	bool			update_output;
 	bool			output_pending;
 	bool			io_halt;
+	ktime_t			report_time;
+	unsigned long		reports;
+	unsigned long		lost_reports;
+	ktime_t			rate_time;
+	unsigned long		rate_reports;
+	unsigned		report_rate;
+	ktime_t			ctl_time;
+	unsigned long		output_urbs;
+	unsigned long		output_coalesced;
+	unsigned		output_latency_us;
 };
 
+/*
+ * Copies the current output state into the control buffer and submits the
+ * control URB. The buffer is filled at submit time rather than when the
+ * change is requested, so all changes that were made while the previous URB
+ * was in flight go out together. Must be called with io_lock held.
+ */
+static void wedo_hub_submit_output(struct usb_wedo *wedo)
+{
+	struct wedo_port_data *wpd1 = wedo->wedo_ports[WEDO_PORT_1];
+	struct wedo_port_data *wpd2 = wedo->wedo_ports[WEDO_PORT_2];
+	int ret;
+
+	wedo->ctl_buf[0] = wedo->output_bits;
+	wedo->ctl_buf[1] = wpd1 ? wpd1->output : 0;
+	wedo->ctl_buf[2] = wpd2 ? wpd2->output : 0;
+	wedo->ctl_buf[3] = 0x00;
+	wedo->ctl_buf[4] = 0x00;
+	wedo->ctl_buf[5] = 0x00;
+	wedo->ctl_buf[6] = 0x00;
+	wedo->ctl_buf[7] = 0x00;
+
+	wedo->update_output = false;
+	wedo->output_pending = true;
+	wedo->ctl_time = ktime_get();
+
+	ret = usb_submit_urb(wedo->ctl_urb, GFP_ATOMIC);
+	if (ret) {
+		dev_dbg(&wedo->usb_device->dev,
+			"%s: failed to submit ctl urb: %d\n", __func__, ret);
+		wedo->output_pending = false;
+	}
+}
+
 void wedo_hub_request_output_update(struct usb_interface *interface)
 {
 	struct usb_wedo *wedo = usb_get_intfdata(interface);
 	unsigned long flags;
 
 	spin_lock_irqsave (&wedo->io_lock, flags);
-	if (!wedo->io_halt)
-		wedo->update_output = true;
+	if (!wedo->io_halt) {
+		if (!wedo->output_pending) {
+			/* idle, so send it now */
+			wedo_hub_submit_output(wedo);
+		} else {
+			/* picked up by wedo_ctrl_callback() */
+			if (wedo->update_output)
+				wedo->output_coalesced++;
+			wedo->update_output = true;
+		}
+	}
 	spin_unlock_irqrestore (&wedo->io_lock, flags);
 }
 
@@ -217,6 +291,37 @@ static int wedo_hub_send_command(void *context, u8 command)
 	return 0;
 }
 
+/*
+ * The hub reports don't have a sequence number, so missed reports are
+ * estimated from the time since the previous report and the interval that the
+ * host controller is actually polling the endpoint at.
+ */
+static void wedo_in_update_stats(struct usb_wedo *wedo, struct urb *urb,
+				 ktime_t now)
+{
+	s64 interval_us = urb->interval * USEC_PER_MSEC;
+	s64 delta_us, window_ms;
+
+	if (wedo->reports && interval_us) {
+		delta_us = ktime_us_delta(now, wedo->report_time);
+		if (delta_us > interval_us + interval_us / 2)
+			wedo->lost_reports += div64_s64(delta_us + interval_us / 2,
+							interval_us) - 1;
+	}
+
+	wedo->report_time = now;
+	wedo->reports++;
+
+	window_ms = ktime_to_ms(ktime_sub(now, wedo->rate_time));
+	if (window_ms >= WEDO_RATE_WINDOW_MS) {
+		WRITE_ONCE(wedo->report_rate,
+			   div64_s64((wedo->reports - wedo->rate_reports)
+				     * MSEC_PER_SEC, window_ms));
+		wedo->rate_time = now;
+		wedo->rate_reports = wedo->reports;
+	}
+}
+
 static void wedo_in_callback(struct urb *urb)
 {
 	struct usb_wedo *wedo = urb->context;
@@ -225,37 +330,54 @@ static void wedo_in_callback(struct urb *urb)
 	struct wedo_port_data *wpd1 = wedo->wedo_ports[WEDO_PORT_1];
 	struct wedo_port_data *wpd2 = wedo->wedo_ports[WEDO_PORT_2];
 	u16 *hub_raw_data = (u16 *)hub->mode_info[hub->mode].raw_data;
+	unsigned char *report = urb->transfer_buffer;
+	ktime_t now = ktime_get();
 	unsigned long flags;
 
-	if (status) {
+	switch (status) {
+	case 0:
+		break;
+	case -ECONNRESET:
+	case -ENOENT:
+	case -ESHUTDOWN:
+		/* URB was killed, don't resubmit */
+		return;
+	default:
 		dev_dbg(&wedo->usb_device->dev, "%s: nonzero status received: %d\n",
 			__func__, status);
+		wedo->lost_reports++;
 		goto err_in_urb;
 	}
 
 	/*
-	 * No need to lock access to the input URB results - the wedo_hub_class
-	 * is the only reader, and each byte of data is atomic.
+	 * Completions for the input endpoint are serialized, so this is the only
+	 * writer. Readers (the lego-sensor and lego-port class attributes) don't
+	 * take a lock, so each decoded value is published with a single store
+	 * and there is never a partially updated value to see.
 	 */
-	if (urb->actual_length == 8) {
-		if (wedo->in_buf[0] & WEDO_HUB_CTL_BIT_ECHO)
+	if (urb->actual_length == WEDO_REPORT_SIZE) {
+		wedo_in_update_stats(wedo, urb, now);
+
+		if (report[0] & WEDO_HUB_CTL_BIT_ECHO)
 			wedo->output_bits &= ~WEDO_HUB_CTL_BIT_ECHO;
 		else
 			wedo->output_bits |= WEDO_HUB_CTL_BIT_ECHO;
 
-		hub_raw_data[0] = wedo->in_buf[0];
+		WRITE_ONCE(hub_raw_data[0], report[0]);
 		/* multiplying by 49 scales the raw value to millivolts */
-		hub_raw_data[1] = wedo->in_buf[1] * 49;
-		wpd1->input	= wedo->in_buf[2];
-		wpd1->id	= wedo->in_buf[3];
+		WRITE_ONCE(hub_raw_data[1], report[1] * 49);
+		WRITE_ONCE(wpd1->input, report[2]);
+		WRITE_ONCE(wpd1->id, report[3]);
 		/* WEDO_HUB_CTL_BIT_ERROR indicates that outputs are turned off */
-		if (!wpd1->output || (wedo->in_buf[0] & WEDO_HUB_CTL_BIT_ERROR))
+		if (!wpd1->output || (report[0] & WEDO_HUB_CTL_BIT_ERROR))
 			wedo_port_update_status(wpd1);
-		wpd2->input	= wedo->in_buf[4];
-		wpd2->id	= wedo->in_buf[5];
+		WRITE_ONCE(wpd2->input, report[4]);
+		WRITE_ONCE(wpd2->id, report[5]);
 		/* WEDO_HUB_CTL_BIT_ERROR indicates that outputs are turned off */
-		if (!wpd2->output || (wedo->in_buf[0] & WEDO_HUB_CTL_BIT_ERROR))
+		if (!wpd2->output || (report[0] & WEDO_HUB_CTL_BIT_ERROR))
 			wedo_port_update_status(wpd2);
+	} else {
+		wedo->lost_reports++;
 	}
 
 	if (wedo->status_debounce < WEDO_STATUS_DEBOUNCE) {
@@ -275,27 +397,6 @@ static void wedo_in_callback(struct urb *urb)
 		spin_unlock_irqrestore (&wedo->io_lock, flags);
 	}
 
-	if (wedo->update_output && !wedo->output_pending) {
-
-		spin_lock_irqsave(&wedo->io_lock, flags);
-
-		wedo->ctl_buf[0] = wedo->output_bits;
-		wedo->ctl_buf[1] = wpd1->output;
-		wedo->ctl_buf[2] = wpd2->output;
-		wedo->ctl_buf[3] = 0x00;
-		wedo->ctl_buf[4] = 0x00;
-		wedo->ctl_buf[5] = 0x00;
-		wedo->ctl_buf[6] = 0x00;
-		wedo->ctl_buf[7] = 0x00;
-
-		wedo->update_output = false;
-		wedo->output_pending = true;
-
-		spin_unlock_irqrestore(&wedo->io_lock, flags);
-
-		usb_submit_urb(wedo->ctl_urb, GFP_ATOMIC);
-	}
-
 err_in_urb:
 	usb_submit_urb(urb, GFP_ATOMIC);
 }
@@ -305,30 +406,123 @@ static void wedo_ctrl_callback(struct urb *urb)
 {
 	struct usb_wedo *wedo = urb->context;
 	int status = urb->status;
+	unsigned long flags;
+	s64 latency_us;
+
+	spin_lock_irqsave(&wedo->io_lock, flags);
 
-	if (status) {
+	wedo->output_pending = false;
+
+	switch (status) {
+	case 0:
+		latency_us = ktime_us_delta(ktime_get(), wedo->ctl_time);
+		if (wedo->output_urbs++)
+			latency_us = (wedo->output_latency_us * 7 + latency_us) / 8;
+		WRITE_ONCE(wedo->output_latency_us, latency_us);
+		wedo->status_debounce = 0;
+		break;
+	case -ECONNRESET:
+	case -ENOENT:
+	case -ESHUTDOWN:
+		/* URB was killed, don't resubmit */
+		wedo->update_output = false;
+		break;
+	default:
 		dev_dbg(&wedo->usb_device->dev,
 			"%s: nonzero ctl status received: %d\n",
 			__func__, status);
-		goto err_ctrl_urb;
+		/* try again with whatever the outputs are now */
+		wedo->update_output = true;
+		break;
 	}
 
-	wedo->status_debounce = 0;
-	wedo->output_pending = false;
+	if (wedo->update_output && !wedo->io_halt)
+		wedo_hub_submit_output(wedo);
 
-	return;
+	spin_unlock_irqrestore(&wedo->io_lock, flags);
+}
 
-err_ctrl_urb:
-	usb_submit_urb(urb, GFP_ATOMIC);
-	return;
+static ssize_t reports_show(struct device *dev, struct device_attribute *attr,
+			    char *buf)
+{
+	struct usb_wedo *wedo = usb_get_intfdata(to_usb_interface(dev));
+
+	return sprintf(buf, "%lu\n", READ_ONCE(wedo->reports));
+}
+
+static ssize_t lost_reports_show(struct device *dev,
+				 struct device_attribute *attr, char *buf)
+{
+	struct usb_wedo *wedo = usb_get_intfdata(to_usb_interface(dev));
+
+	return sprintf(buf, "%lu\n", READ_ONCE(wedo->lost_reports));
+}
+
+static ssize_t report_rate_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct usb_wedo *wedo = usb_get_intfdata(to_usb_interface(dev));
+	unsigned rate = READ_ONCE(wedo->report_rate);
+
+	/* The rate is only updated when reports arrive, so catch a stalled hub */
+	if (ktime_to_ms(ktime_sub(ktime_get(), READ_ONCE(wedo->report_time)))
+	    > 2 * WEDO_RATE_WINDOW_MS)
+		rate = 0;
+
+	return sprintf(buf, "%u\n", rate);
+}
+
+static ssize_t output_urbs_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct usb_wedo *wedo = usb_get_intfdata(to_usb_interface(dev));
+
+	return sprintf(buf, "%lu\n", READ_ONCE(wedo->output_urbs));
 }
 
+static ssize_t output_coalesced_show(struct device *dev,
+				     struct device_attribute *attr, char *buf)
+{
+	struct usb_wedo *wedo = usb_get_intfdata(to_usb_interface(dev));
+
+	return sprintf(buf, "%lu\n", READ_ONCE(wedo->output_coalesced));
+}
+
+static ssize_t output_latency_us_show(struct device *dev,
+				      struct device_attribute *attr, char *buf)
+{
+	struct usb_wedo *wedo = usb_get_intfdata(to_usb_interface(dev));
+
+	return sprintf(buf, "%u\n", READ_ONCE(wedo->output_latency_us));
+}
+
+static DEVICE_ATTR_RO(reports);
+static DEVICE_ATTR_RO(lost_reports);
+static DEVICE_ATTR_RO(report_rate);
+static DEVICE_ATTR_RO(output_urbs);
+static DEVICE_ATTR_RO(output_coalesced);
+static DEVICE_ATTR_RO(output_latency_us);
+
+static struct attribute *wedo_hub_attrs[] = {
+	&dev_attr_reports.attr,
+	&dev_attr_lost_reports.attr,
+	&dev_attr_report_rate.attr,
+	&dev_attr_output_urbs.attr,
+	&dev_attr_output_coalesced.attr,
+	&dev_attr_output_latency_us.attr,
+	NULL
+};
+
+static const struct attribute_group wedo_hub_attr_group = {
+	.attrs = wedo_hub_attrs,
+};
+
 static int wedo_probe(struct usb_interface *interface,
 		      const struct usb_device_id *id)
 {
 	struct usb_wedo *wedo;
 	struct usb_endpoint_descriptor *endpoint;
-	int ret = -ENOMEM;
+	int i, ret = -ENOMEM;
 
 	/* allocate memory for our device state and initialize it */
 	wedo = kzalloc(sizeof(*wedo), GFP_KERNEL);
@@ -377,22 +571,29 @@ static int wedo_probe(struct usb_interface *interface,
 	if (!usb_endpoint_xfer_int(endpoint) && !usb_endpoint_dir_in(endpoint))
 		goto err_no_int_in_endpoint;
 
-	wedo->in_urb = usb_alloc_urb(0, GFP_KERNEL);
-	if (!wedo->in_urb)
-		goto err_alloc_in_urb;
+	for (i = 0; i < WEDO_NUM_IN_URBS; i++) {
+		wedo->in_urb[i] = usb_alloc_urb(0, GFP_KERNEL);
+		if (!wedo->in_urb[i])
+			goto err_alloc_in_urb;
+	}
 
-	wedo->in_buf = usb_alloc_coherent(wedo->usb_device, 8, GFP_KERNEL,
-					  &wedo->in_dma);
+	wedo->in_buf = usb_alloc_coherent(wedo->usb_device,
+					  WEDO_NUM_IN_URBS * WEDO_REPORT_SIZE,
+					  GFP_KERNEL, &wedo->in_dma);
 	if (!wedo->in_buf)
 		goto err_alloc_in_buf;
 
-	usb_fill_int_urb(wedo->in_urb, wedo->usb_device,
-			 usb_rcvintpipe(wedo->usb_device,
-					endpoint->bEndpointAddress),
-			 wedo->in_buf, 8, wedo_in_callback, wedo, 32 );
+	for (i = 0; i < WEDO_NUM_IN_URBS; i++) {
+		usb_fill_int_urb(wedo->in_urb[i], wedo->usb_device,
+				 usb_rcvintpipe(wedo->usb_device,
+						endpoint->bEndpointAddress),
+				 wedo->in_buf + i * WEDO_REPORT_SIZE,
+				 WEDO_REPORT_SIZE, wedo_in_callback, wedo,
+				 WEDO_IN_INTERVAL);
 
-	wedo->in_urb->transfer_dma = wedo->in_dma;
-	wedo->in_urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+		wedo->in_urb[i]->transfer_dma = wedo->in_dma + i * WEDO_REPORT_SIZE;
+		wedo->in_urb[i]->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+	}
 
 	/* save our data pointer in this interface device */
 	usb_set_intfdata(interface, wedo);
@@ -444,19 +645,43 @@ static int wedo_probe(struct usb_interface *interface,
 		goto err_register_wedo_port_2;
 	}
 
-	ret = usb_submit_urb(wedo->in_urb, GFP_ATOMIC);
+	ret = sysfs_create_group(&interface->dev.kobj, &wedo_hub_attr_group);
+	if (ret) {
+		dev_err(&interface->dev,
+			"Failed to create WeDo hub attributes. (%d)\n", ret);
+		goto err_sysfs_create_group;
+	}
+
+	wedo->rate_time = ktime_get();
+	for (i = 0; i < WEDO_NUM_IN_URBS; i++) {
+		ret = usb_submit_urb(wedo->in_urb[i], GFP_KERNEL);
+		if (ret) {
+			dev_err(&interface->dev,
+				"Failed to submit input URB. (%d)\n", ret);
+			goto err_submit_in_urb;
+		}
+	}
 
 	return 0;
 
+err_submit_in_urb:
+	while (i--)
+		usb_kill_urb(wedo->in_urb[i]);
+	sysfs_remove_group(&interface->dev.kobj, &wedo_hub_attr_group);
+err_sysfs_create_group:
+	unregister_wedo_port(wedo->wedo_ports[WEDO_PORT_2]);
 err_register_wedo_port_2:
 	unregister_wedo_port(wedo->wedo_ports[WEDO_PORT_1]);
 err_register_wedo_port_1:
 	unregister_lego_sensor(&wedo->wedo_hub);
 err_register_wedo_hub:
-	usb_free_coherent (wedo->usb_device, 8, wedo->in_buf, wedo->in_dma);
+	usb_set_intfdata(interface, NULL);
+	usb_free_coherent(wedo->usb_device, WEDO_NUM_IN_URBS * WEDO_REPORT_SIZE,
+			  wedo->in_buf, wedo->in_dma);
 err_alloc_in_buf:
-	usb_free_urb (wedo->in_urb);
 err_alloc_in_urb:
+	for (i = 0; i < WEDO_NUM_IN_URBS; i++)
+		usb_free_urb(wedo->in_urb[i]);
 err_no_int_in_endpoint:
 	usb_free_coherent (wedo->usb_device, 8, wedo->ctl_buf, wedo->ctl_dma);
 err_alloc_ctl_buf:
@@ -472,6 +697,7 @@ static void wedo_disconnect(struct usb_interface *interface)
 {
 	struct usb_wedo *wedo;
 	unsigned long flags;
+	int i;
 
 	wedo = usb_get_intfdata(interface);
 
@@ -479,9 +705,11 @@ static void wedo_disconnect(struct usb_interface *interface)
 	wedo->io_halt = true;
 	spin_unlock_irqrestore (&wedo->io_lock, flags);
 
-	do {
-	} while (wedo->update_output || wedo->output_pending);
+	usb_kill_urb(wedo->ctl_urb);
+	for (i = 0; i < WEDO_NUM_IN_URBS; i++)
+		usb_kill_urb(wedo->in_urb[i]);
 
+	sysfs_remove_group(&interface->dev.kobj, &wedo_hub_attr_group);
 	unregister_wedo_port(wedo->wedo_ports[WEDO_PORT_2]);
 	unregister_wedo_port(wedo->wedo_ports[WEDO_PORT_1]);
 	unregister_lego_sensor(&wedo->wedo_hub);
@@ -490,8 +718,10 @@ static void wedo_disconnect(struct usb_interface *interface)
 
 	wedo->usb_interface = NULL;
 
-	usb_free_coherent (wedo->usb_device, 8, wedo->in_buf, wedo->in_dma);
-	usb_free_urb (wedo->in_urb);
+	usb_free_coherent(wedo->usb_device, WEDO_NUM_IN_URBS * WEDO_REPORT_SIZE,
+			  wedo->in_buf, wedo->in_dma);
+	for (i = 0; i < WEDO_NUM_IN_URBS; i++)
+		usb_free_urb(wedo->in_urb[i]);
 	usb_free_coherent (wedo->usb_device, 8, wedo->ctl_buf, wedo->ctl_dma);
 	usb_free_urb (wedo->ctl_urb);
 	usb_put_dev (wedo->usb_device);
@@ -545,7 +545,8 @@ void wedo_port_update_status(struct wedo_port_data *wpd)
 	case WEDO_TYPE_MOTION:
 		wsd = wpd->sensor_data;
 		if (wsd) {
-			wsd->info.mode_info[wsd->sensor.mode].raw_data[0] = wpd->input;
+			WRITE_ONCE(wsd->info.mode_info[wsd->sensor.mode].raw_data[0],
+				   wpd->input);
 		}
 		break;
 	case WEDO_TYPE_SERVO: